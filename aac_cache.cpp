@@ -0,0 +1,158 @@
+#include "aac_cache.h"
+
+#include <math.h>
+#include <string.h>
+
+#include "oscillator.h"
+
+/* frames encoded before the cycle, so its first frame has a full history */
+static const int warmup_frames = 2;
+
+static int gcd(int64_t a, int64_t b) {
+    while (b) {
+        int64_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return (int)a;
+}
+
+AacToneCache::AacToneCache() {
+    memset(&ch_layout, 0, sizeof(ch_layout));
+}
+
+AacToneCache::~AacToneCache() {
+    for (int freq = 0; freq <= max_freq; freq++) {
+        Tone* tone = tones[freq].load(std::memory_order_relaxed);
+        if (!tone)
+            continue;
+        for (size_t i = 0; i < tone->packets.size(); i++)
+            av_packet_free(&tone->packets[i]);
+        delete tone;
+    }
+    av_channel_layout_uninit(&ch_layout);
+}
+
+void AacToneCache::init(const AVCodecContext* c) {
+    std::call_once(initialized, [&] {
+        bit_rate = c->bit_rate;
+        sample_rate = c->sample_rate;
+        frame_size = c->frame_size;
+        sample_fmt = c->sample_fmt;
+        av_channel_layout_copy(&ch_layout, &c->ch_layout);
+        max_freq = sample_rate / 2;
+        tones.reset(new std::atomic<Tone*>[max_freq + 1]);
+        for (int freq = 0; freq <= max_freq; freq++)
+            tones[freq].store(NULL, std::memory_order_relaxed);
+    });
+}
+
+const AVPacket* AacToneCache::get(int freq, double phase) {
+    if (freq <= 0 || freq > max_freq)
+        return NULL;
+
+    std::atomic<Tone*>& slot = tones[freq];
+    Tone* tone = slot.load(std::memory_order_acquire);
+    if (!tone) {
+        /* a loser of the race takes the winner's tone */
+        Tone* created = new Tone;
+        if (slot.compare_exchange_strong(tone, created, std::memory_order_acq_rel))
+            tone = created;
+        else
+            delete created;
+    }
+    /* the first caller encodes; after that this is a check of a flag */
+    std::call_once(tone->filled, [&] {
+        tone->ok = fill(*tone, freq);
+    });
+    if (!tone->ok)
+        return NULL;
+
+    int index = (int)llround(phase * tone->cycle) % tone->cycle;
+    return tone->packets[index];
+}
+
+bool AacToneCache::fill(Tone& tone, int freq) {
+    if (freq <= 0 || sample_fmt != AV_SAMPLE_FMT_FLTP || frame_size <= 0)
+        return false;
+
+    int g = gcd((int64_t)freq * frame_size, sample_rate);
+    tone.cycle = sample_rate / g;
+    tone.packets.assign(tone.cycle, NULL);
+
+    const AVCodec* codec = avcodec_find_encoder(AV_CODEC_ID_AAC);
+    AVCodecContext* c = codec ? avcodec_alloc_context3(codec) : NULL;
+    AVFrame* frame = av_frame_alloc();
+    AVPacket* pkt = av_packet_alloc();
+    bool ok = c && frame && pkt;
+
+    if (ok) {
+        c->bit_rate = bit_rate;
+        c->sample_fmt = sample_fmt;
+        c->sample_rate = sample_rate;
+        av_channel_layout_copy(&c->ch_layout, &ch_layout);
+        c->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+        ok = avcodec_open2(c, codec, NULL) >= 0 && c->frame_size == frame_size;
+    }
+    if (ok) {
+        frame->nb_samples = frame_size;
+        frame->format = sample_fmt;
+        frame->sample_rate = sample_rate;
+        ok = av_channel_layout_copy(&frame->ch_layout, &ch_layout) >= 0 &&
+            av_frame_get_buffer(frame, 0) >= 0;
+    }
+
+    Oscillator osc;
+    oscillator_init(&osc);
+    oscillator_set_frequency(&osc, freq, sample_rate);
+
+    int frames = warmup_frames + tone.cycle + 1;
+    for (int n = 0; ok && n <= frames; n++) {
+        /* the last round flushes the encoder */
+        int ret;
+        if (n < frames) {
+            float* samples = (float*)frame->data[0];
+            oscillator_render(&osc, samples, frame_size);
+            for (int k = 1; k < frame->ch_layout.nb_channels; k++)
+                memcpy(frame->data[k], samples, frame_size * sizeof(float));
+            frame->pts = (int64_t)n * frame_size;
+            ret = avcodec_send_frame(c, frame);
+        }
+        else {
+            ret = avcodec_send_frame(c, NULL);
+        }
+        while (ret >= 0) {
+            ret = avcodec_receive_packet(c, pkt);
+            if (ret < 0)
+                break;
+            /* the packet with a frame's pts decodes to that frame */
+            int64_t m = pkt->pts / frame_size;
+            if (pkt->pts % frame_size == 0 && m >= warmup_frames && m < warmup_frames + tone.cycle) {
+                int index = (int)(m * frame_size * freq % sample_rate / g);
+                if (!tone.packets[index]) {
+                    tone.packets[index] = av_packet_alloc();
+                    if (!tone.packets[index]) {
+                        ok = false;
+                        break;
+                    }
+                    av_packet_move_ref(tone.packets[index], pkt);
+                }
+            }
+            av_packet_unref(pkt);
+        }
+        if (ret < 0 && ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+            ok = false;
+    }
+
+    for (int i = 0; ok && i < tone.cycle; i++)
+        ok = tone.packets[i] != NULL;
+    if (!ok) {
+        for (int i = 0; i < tone.cycle; i++)
+            av_packet_free(&tone.packets[i]);
+    }
+
+    av_packet_free(&pkt);
+    av_frame_free(&frame);
+    avcodec_free_context(&c);
+    return ok;
+}
@@ -0,0 +1,76 @@
+#ifndef WEBDRIVERTORSO_AAC_CACHE_H
+#define WEBDRIVERTORSO_AAC_CACHE_H
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+extern "C" {
+#include "libavcodec/avcodec.h"
+}
+
+/*
+ * Pre-encoded AAC access units of the test tone.
+ *
+ * With an integer frequency f, the phase at a frame start is always a
+ * multiple of 1 / cycle, cycle = sample_rate / gcd(f * frame_size,
+ * sample_rate), so a tone has at most cycle different frames (375 at
+ * 48 kHz). The first time a frequency is asked for, its whole cycle is
+ * encoded once with a private encoder (after a short warmup, so the MDCT
+ * overlap with the previous frame is in place), and every later frame of
+ * that tone is a lookup. Only the frame right after a frequency change
+ * differs from what the live encoder would produce; if the previous tone
+ * left the phase between two of the new tone's frames, it snaps to the
+ * nearest one.
+ *
+ * Filled tones are never modified, so one cache serves every stream in
+ * the process; a tone costs about 300 KB at 320 kbit/s. There is no lock
+ * around the lookup: tones sit in a table of atomic pointers indexed by
+ * frequency, up to Nyquist, and each is encoded under its own once_flag
+ * outside any lock. Only callers asking for a tone that is still being
+ * encoded wait, and only for that tone; a hit is two loads.
+ */
+class AacToneCache {
+public:
+    AacToneCache();
+    ~AacToneCache();
+
+    /* Takes the stream parameters from the opened encoder the packets
+     * stand in for. Every channel calls it, the first call counts. */
+    void init(const AVCodecContext* c);
+
+    /* The packet for the frame of the tone that starts at phase (in
+     * cycles). Encodes the tone's cycle on first use; NULL if that fails. */
+    const AVPacket* get(int freq, double phase);
+
+private:
+    struct Tone {
+        std::once_flag filled;
+        bool ok = false;
+        int cycle = 0;
+        std::vector<AVPacket*> packets;     ///< indexed by phase * cycle
+    };
+
+    bool fill(Tone& tone, int freq);
+
+    std::once_flag initialized;
+    int64_t bit_rate = 0;
+    int sample_rate = 0;
+    int frame_size = 0;
+    AVSampleFormat sample_fmt = AV_SAMPLE_FMT_NONE;
+    AVChannelLayout ch_layout;
+
+    int max_freq = 0;
+    /* indexed by frequency, each set once and then left alone */
+    std::unique_ptr<std::atomic<Tone*>[]> tones;
+};
+
+/* Tone parameters of an audio frame, attached as its opaque_ref. */
+struct ToneFrame {
+    int freq;
+    double phase;
+};
+
+#endif /* WEBDRIVERTORSO_AAC_CACHE_H */
@@ -0,0 +1,74 @@
+#include <algorithm>
+#include "abr.h"
+
+using namespace std;
+
+AbrController::AbrController(const AbrOptions& options, int64_t start_bps)
+    : options(options), bps(min(max(start_bps, options.floor_bps), options.ceiling_bps)) {
+}
+
+int64_t AbrController::update(int64_t now_us, const vector<LinkSample>& links) {
+    if (window_start_us < 0) {
+        window_start_us = now_us;
+        window = links;
+        calm_since_us = now_us;
+        last_change_us = now_us;
+        return 0;
+    }
+    int64_t elapsed_us = now_us - window_start_us;
+    if (elapsed_us < options.interval_us)
+        return 0;
+
+    bool congested = false;
+    bool far_behind = false;
+    bool calm = true;
+    int64_t lowest_bps = INT64_MAX;
+    for (size_t i = 0; i < links.size() && i < window.size(); i++) {
+        const LinkSample& link = links[i];
+        if (!link.alive)
+            continue;
+        /* still connecting: a backlog, but nothing to measure the link by */
+        if (!link.sent_bytes)
+            continue;
+        int64_t throughput_bps = (int64_t)((link.sent_bytes - window[i].sent_bytes) * 8 * 1000000 / elapsed_us);
+        int64_t growth_ms = link.queued_ms - window[i].queued_ms;
+        bool behind = link.queued_ms > 4 * options.congested_ms;
+        if ((link.queued_ms > options.congested_ms && growth_ms >= 0) || behind) {
+            congested = true;
+            far_behind |= behind;
+            lowest_bps = min(lowest_bps, throughput_bps);
+        }
+        if (link.queued_ms > options.congested_ms / 4)
+            calm = false;
+    }
+    window = links;
+    window_start_us = now_us;
+
+    int64_t target = bps;
+    if (congested) {
+        if (far_behind || now_us - last_decrease_us >= options.settle_us)
+            target = min((int64_t)(lowest_bps * options.down_factor) - options.reserved_bps,
+                (int64_t)(bps * options.down_factor));
+        calm_since_us = now_us;
+    }
+    else if (!calm)
+        calm_since_us = now_us;
+    else if (now_us - calm_since_us >= options.up_hold_us && now_us - last_change_us >= options.up_hold_us)
+        target = (int64_t)(bps * (1 + options.up_step));
+    target = min(max(target, options.floor_bps), options.ceiling_bps);
+
+    /* the floor and the ceiling are always reached, however small the step */
+    int64_t change = target > bps ? target - bps : bps - target;
+    bool bound = target == options.floor_bps || target == options.ceiling_bps;
+    if (!change || (change < bps * options.min_change && !bound))
+        return 0;
+    if (target < bps) {
+        nb_decreases++;
+        last_decrease_us = now_us;
+    }
+    else
+        nb_increases++;
+    bps = target;
+    last_change_us = now_us;
+    return bps;
+}
@@ -0,0 +1,80 @@
+#ifndef WEBDRIVERTORSO_ABR_H
+#define WEBDRIVERTORSO_ABR_H
+
+#include <stdint.h>
+#include <vector>
+
+/*
+ * Adaptive video bitrate, from what the destinations manage to send.
+ *
+ * Once per interval the controller looks at every live destination: the
+ * bytes it sent during the interval, its throughput, and how much stream
+ * it has queued now and an interval ago. A destination is congested when
+ * it holds more than congested_ms and the backlog is not shrinking, or
+ * when it holds four times that. Its throughput is then what the link
+ * carries, so the bitrate steps down to down_factor of it less the
+ * audio, and by at least down_factor of the current bitrate. The
+ * encoder's lookahead delays a change by a second or two, during which
+ * the backlog still grows; no second step down is taken for settle_us
+ * unless the backlog is four times congested_ms. It steps up again, by
+ * up_step at a time, only after up_hold_us in which no destination held
+ * more than a quarter of congested_ms and the bitrate did not change.
+ * Steps smaller than min_change are not taken, so measurement noise does
+ * not reconfigure the encoder every interval.
+ *
+ * Time and the counters are passed in, so the controller runs the same
+ * against a simulated link (see abr_sim.cpp) as against sockets.
+ */
+
+struct AbrOptions {
+    int64_t floor_bps = 300000;
+    int64_t ceiling_bps = 2500000;
+    /* bitrate of everything that is not video, taken off the throughput */
+    int64_t reserved_bps = 0;
+    int64_t interval_us = 1000000;
+    int64_t congested_ms = 500;
+    double down_factor = 0.85;
+    int64_t settle_us = 3000000;
+    double up_step = 0.15;
+    int64_t up_hold_us = 5000000;
+    double min_change = 0.05;
+};
+
+/* What one destination has done so far. */
+struct LinkSample {
+    bool alive = true;
+    uint64_t sent_bytes = 0;
+    int64_t queued_ms = 0;
+};
+
+class AbrController {
+public:
+    AbrController(const AbrOptions& options, int64_t start_bps);
+
+    /* Returns the new bitrate if it changes now, 0 otherwise. links must
+     * list the same destinations in the same order every time. */
+    int64_t update(int64_t now_us, const std::vector<LinkSample>& links);
+
+    int64_t bitrate() const {
+        return bps;
+    }
+    uint64_t decreases() const {
+        return nb_decreases;
+    }
+    uint64_t increases() const {
+        return nb_increases;
+    }
+
+private:
+    AbrOptions options;
+    int64_t bps;
+    int64_t window_start_us = -1;
+    std::vector<LinkSample> window;
+    int64_t calm_since_us = 0;
+    int64_t last_change_us = 0;
+    int64_t last_decrease_us = INT64_MIN / 2;
+    uint64_t nb_decreases = 0;
+    uint64_t nb_increases = 0;
+};
+
+#endif /* WEBDRIVERTORSO_ABR_H */
@@ -0,0 +1,129 @@
+/*
+ * Runs the ABR controller (see abr.h) against a rate-limited link in
+ * simulated time and checks that it follows the link.
+ *
+ * The stand-in encoder produces 25 fps video at the controller's bitrate,
+ * with a keyframe of four times the average size every 250 frames, and a
+ * bitrate change takes effect 40 frames late, as it does through the x264
+ * lookahead. Audio is 320 kbit/s AAC, as the channel encodes it. The link
+ * sends one destination queue at a rate that steps through a profile.
+ * Every 5 s the link rate, the video bitrate, the throughput and the
+ * backlog are printed. In the last 15 s of every step, the backlog must
+ * stay under a second and the video must fit the link but not fall below
+ * half of what fits; the exit status is 1 if it does not.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <deque>
+#include <vector>
+#include "abr.h"
+
+using namespace std;
+
+struct LinkStep {
+    int64_t until_ms;
+    int64_t bps;
+};
+
+static const LinkStep profile[] = {
+    { 40000, 5000000 },
+    { 100000, 1500000 },
+    { 160000, 3500000 },
+    { 220000, 1000000 },
+    { 280000, 5000000 },
+};
+
+const int64_t audio_bps = 320000;
+const int64_t lookahead_ms = 40 * 40;
+
+struct QueuedMessage {
+    int64_t timestamp_ms;
+    int64_t bytes;
+};
+
+int main() {
+    AbrOptions options;
+    options.reserved_bps = audio_bps;
+    AbrController abr(options, options.ceiling_bps);
+
+    /* (time it takes effect, bitrate) */
+    std::deque<std::pair<int64_t, int64_t> > pending_bitrates;
+    int64_t encoder_bps = abr.bitrate();
+    std::deque<QueuedMessage> queue;
+    uint64_t sent_bytes = 0;
+    double link_budget = 0;
+    int64_t next_video_ms = 0;
+    double next_audio_ms = 0;
+    int frame = 0;
+
+    int64_t window_bytes = 0;
+    int64_t max_backlog_ms = 0;
+    bool failed = false;
+    size_t step = 0;
+
+    printf("%8s %10s %10s %10s %10s\n", "time s", "link kb/s", "video kb/s", "sent kb/s", "backlog ms");
+    for (int64_t now_ms = 0; step < sizeof(profile) / sizeof(profile[0]); now_ms++) {
+        const LinkStep& link = profile[step];
+
+        while (!pending_bitrates.empty() && pending_bitrates.front().first <= now_ms) {
+            encoder_bps = pending_bitrates.front().second;
+            pending_bitrates.pop_front();
+        }
+        if (now_ms == next_video_ms) {
+            int64_t average = encoder_bps / 8 / 25;
+            int64_t bytes = frame % 250 == 0 ? 4 * average : average * (250 - 4) / 249;
+            queue.push_back({ now_ms, bytes });
+            next_video_ms += 40;
+            frame++;
+        }
+        if (now_ms >= next_audio_ms) {
+            queue.push_back({ now_ms, audio_bps / 8 * 1024 / 48000 });
+            next_audio_ms += 1024 * 1000.0 / 48000;
+        }
+
+        link_budget += link.bps / 8 / 1000.0;
+        while (!queue.empty() && link_budget >= 1) {
+            int64_t n = min(queue.front().bytes, (int64_t)link_budget);
+            queue.front().bytes -= n;
+            link_budget -= n;
+            sent_bytes += n;
+            window_bytes += n;
+            if (!queue.front().bytes)
+                queue.pop_front();
+        }
+        if (queue.empty())
+            link_budget = 0;
+
+        LinkSample sample;
+        sample.sent_bytes = sent_bytes;
+        sample.queued_ms = queue.empty() ? 0 : now_ms - queue.front().timestamp_ms;
+        if (now_ms % 10 == 0) {
+            int64_t bps = abr.update(now_ms * 1000, std::vector<LinkSample>(1, sample));
+            if (bps)
+                pending_bitrates.push_back(std::make_pair(now_ms + lookahead_ms, bps));
+        }
+
+        if (now_ms > link.until_ms - 15000)
+            max_backlog_ms = max(max_backlog_ms, sample.queued_ms);
+        if (now_ms % 5000 == 4999)
+            printf("%8.0f %10lld %10lld %10lld %10lld\n", (now_ms + 1) / 1000.0, (long long)(link.bps / 1000),
+                (long long)(encoder_bps / 1000), (long long)(window_bytes * 8 / 5000), (long long)sample.queued_ms),
+            window_bytes = 0;
+
+        if (now_ms + 1 == link.until_ms) {
+            int64_t fits = min(link.bps - audio_bps, options.ceiling_bps);
+            bool ok = max_backlog_ms < 1000 && encoder_bps + audio_bps <= link.bps && encoder_bps >= fits / 2;
+            printf("step %zu: link %lld kb/s, video %lld kb/s, max backlog %lld ms: %s\n", step,
+                (long long)(link.bps / 1000), (long long)(encoder_bps / 1000), (long long)max_backlog_ms,
+                ok ? "ok" : "FAILED");
+            failed |= !ok;
+            max_backlog_ms = 0;
+            step++;
+        }
+    }
+    printf("%llu decreases, %llu increases\n", (unsigned long long)abr.decreases(),
+        (unsigned long long)abr.increases());
+    return failed ? 1 : 0;
+}
@@ -21,20 +21,39 @@
 
 #include "libavutil/intreadwrite.h"
 #include "h264.h"
+#define CACHED_BITSTREAM_READER 1
 #include "get_bits.h"
 //#include "avformat.h"
 #include "libavformat/avio.h"
 #include "libavutil/error.h"
 #include "avc.h"
 #include "libavcodec/defs.h"
+#include "libavutil/macros.h"
+#include "cpu.h"
 //#include "avio_internal.h"
 
-static const uint8_t *avc_find_startcode_internal(const uint8_t *p, const uint8_t *end)
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#if HAVE_X86
+#include <immintrin.h>
+#endif
+#if HAVE_NEON
+#include <arm_neon.h>
+#endif
+
+/*
+ * The scanners look for 00 00 b: b = 1 is a start code, b = 3 an
+ * emulation_prevention_three_byte. Each is written once, always inlined
+ * with a constant b.
+ */
+static av_always_inline const uint8_t *find_zero_zero_c(const uint8_t *p, const uint8_t *end,
+                                                        const uint8_t b)
 {
     const uint8_t *a = p + 4 - ((intptr_t)p & 3);
 
     for (end -= 3; p < a && p < end; p++) {
-        if (p[0] == 0 && p[1] == 0 && p[2] == 1)
+        if (p[0] == 0 && p[1] == 0 && p[2] == b)
             return p;
     }
 
@@ -44,28 +63,202 @@ static const uint8_t *avc_find_startcode_internal(const uint8_t *p, const uint8_
 //      if ((x - 0x00010001) & (~x) & 0x00800080) // big endian
         if ((x - 0x01010101) & (~x) & 0x80808080) { // generic
             if (p[1] == 0) {
-                if (p[0] == 0 && p[2] == 1)
+                if (p[0] == 0 && p[2] == b)
                     return p;
-                if (p[2] == 0 && p[3] == 1)
+                if (p[2] == 0 && p[3] == b)
                     return p+1;
             }
             if (p[3] == 0) {
-                if (p[2] == 0 && p[4] == 1)
+                if (p[2] == 0 && p[4] == b)
                     return p+2;
-                if (p[4] == 0 && p[5] == 1)
+                if (p[4] == 0 && p[5] == b)
                     return p+3;
             }
         }
     }
 
     for (end += 3; p < end; p++) {
-        if (p[0] == 0 && p[1] == 0 && p[2] == 1)
+        if (p[0] == 0 && p[1] == 0 && p[2] == b)
             return p;
     }
 
     return end + 3;
 }
 
+/* Byte by byte, for what is left after the vector loops. Like the scalar
+ * version, a match in the last three bytes is not reported: a start code
+ * there could only start an empty NAL unit, and an escape there can only
+ * protect the trailing bytes of the NAL. */
+static av_always_inline const uint8_t *find_zero_zero_tail(const uint8_t *p, const uint8_t *end,
+                                                           const uint8_t b)
+{
+    for (end -= 3; p < end; p++) {
+        if (p[0] == 0 && p[1] == 0 && p[2] == b)
+            return p;
+    }
+    return end + 3;
+}
+
+/*
+ * The vector versions compare 16 or 32 positions at once: a match
+ * begins at i if p[i] == 0, p[i + 1] == 0 and p[i + 2] == b, so three
+ * overlapping loads are compared and combined. They never read beyond end.
+ */
+#if HAVE_X86
+#ifdef _MSC_VER
+static inline int ctz32(uint32_t v)
+{
+    unsigned long i;
+    _BitScanForward(&i, v);
+    return i;
+}
+#else
+#define ctz32(v) __builtin_ctz(v)
+#endif
+
+static av_always_inline const uint8_t *find_zero_zero_sse2(const uint8_t *p, const uint8_t *end,
+                                                           const uint8_t b)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i third = _mm_set1_epi8(b);
+
+    for (; end - p >= 19; p += 16) {
+        __m128i v0 = _mm_loadu_si128((const __m128i *)p);
+        __m128i v1 = _mm_loadu_si128((const __m128i *)(p + 1));
+        __m128i v2 = _mm_loadu_si128((const __m128i *)(p + 2));
+        int mask = _mm_movemask_epi8(_mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(v0, zero),
+                                                                 _mm_cmpeq_epi8(v1, zero)),
+                                                   _mm_cmpeq_epi8(v2, third)));
+        if (mask)
+            return p + ctz32(mask);
+    }
+    return find_zero_zero_tail(p, end, b);
+}
+
+static TARGET_AVX2 av_always_inline const uint8_t *find_zero_zero_avx2(const uint8_t *p, const uint8_t *end,
+                                                                       const uint8_t b)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i third = _mm256_set1_epi8(b);
+
+    for (; end - p >= 35; p += 32) {
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)p);
+        __m256i v1 = _mm256_loadu_si256((const __m256i *)(p + 1));
+        __m256i v2 = _mm256_loadu_si256((const __m256i *)(p + 2));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(v0, zero),
+                                                                               _mm256_cmpeq_epi8(v1, zero)),
+                                                              _mm256_cmpeq_epi8(v2, third)));
+        if (mask)
+            return p + ctz32(mask);
+    }
+    return find_zero_zero_sse2(p, end, b);
+}
+#endif
+
+#if HAVE_NEON
+static av_always_inline const uint8_t *find_zero_zero_neon(const uint8_t *p, const uint8_t *end,
+                                                           const uint8_t b)
+{
+    const uint8x16_t zero  = vdupq_n_u8(0);
+    const uint8x16_t third = vdupq_n_u8(b);
+
+    for (; end - p >= 19; p += 16) {
+        uint8x16_t m = vandq_u8(vandq_u8(vceqq_u8(vld1q_u8(p), zero),
+                                         vceqq_u8(vld1q_u8(p + 1), zero)),
+                                vceqq_u8(vld1q_u8(p + 2), third));
+        if (vmaxvq_u8(m))
+            return find_zero_zero_tail(p, p + 19, b);
+    }
+    return find_zero_zero_tail(p, end, b);
+}
+#endif
+
+#define FIND_ZERO_ZERO_FUNCS(suffix, attr)                                              \
+static attr const uint8_t *avc_find_startcode_ ## suffix(const uint8_t *p, const uint8_t *end) \
+{                                                                                       \
+    return find_zero_zero_ ## suffix(p, end, 1);                                        \
+}                                                                                       \
+static attr const uint8_t *avc_find_escape_ ## suffix(const uint8_t *p, const uint8_t *end)    \
+{                                                                                       \
+    return find_zero_zero_ ## suffix(p, end, 3);                                        \
+}
+
+FIND_ZERO_ZERO_FUNCS(c, )
+#if HAVE_X86
+FIND_ZERO_ZERO_FUNCS(sse2, )
+FIND_ZERO_ZERO_FUNCS(avx2, TARGET_AVX2)
+#endif
+#if HAVE_NEON
+FIND_ZERO_ZERO_FUNCS(neon, )
+#endif
+
+static const AVCStartcodeImpl startcode_impls[] = {
+    { "c",    avc_find_startcode_c,    avc_find_escape_c },
+#if HAVE_X86
+    { "sse2", avc_find_startcode_sse2, avc_find_escape_sse2 },
+    { "avx2", avc_find_startcode_avx2, avc_find_escape_avx2 },
+#endif
+#if HAVE_NEON
+    { "neon", avc_find_startcode_neon, avc_find_escape_neon },
+#endif
+    { NULL },
+};
+
+int ff_avc_startcode_impls(const AVCStartcodeImpl **impls)
+{
+    int n = FF_ARRAY_ELEMS(startcode_impls) - 1;
+#if HAVE_X86
+    /* avx2 is last */
+    if (!cpu_has_avx2())
+        n--;
+#endif
+    *impls = startcode_impls;
+    return n;
+}
+
+/*
+ * The scanner is picked on first use, by whichever thread scans first;
+ * threads that race there pick the same one. The pointer is still loaded
+ * and stored atomically so that the race is not a data race. Relaxed is
+ * enough: it points into a constant table, nothing else is published.
+ */
+#ifdef _MSC_VER
+#define load_impl(p)     ((const AVCStartcodeImpl *)_InterlockedCompareExchangePointer((void *volatile *)(p), NULL, NULL))
+#define store_impl(p, v) _InterlockedExchangePointer((void *volatile *)(p), (void *)(v))
+#else
+#define load_impl(p)     __atomic_load_n(p, __ATOMIC_RELAXED)
+#define store_impl(p, v) __atomic_store_n(p, v, __ATOMIC_RELAXED)
+#endif
+
+static const AVCStartcodeImpl *avc_startcode_impl(void)
+{
+    static const AVCStartcodeImpl *impl;
+    const AVCStartcodeImpl *cur = load_impl(&impl);
+    if (!cur) {
+        const AVCStartcodeImpl *impls;
+        int n = ff_avc_startcode_impls(&impls);
+        cur = &impls[n - 1];
+        store_impl(&impl, cur);
+    }
+    return cur;
+}
+
+static const uint8_t *avc_find_startcode_internal(const uint8_t *p, const uint8_t *end)
+{
+    return avc_startcode_impl()->find(p, end);
+}
+
+const uint8_t *ff_avc_find_escape(const uint8_t *p, const uint8_t *end)
+{
+    const uint8_t *out = avc_startcode_impl()->find_escape(p, end);
+    if (out < end)
+        return out + 2;
+    /* the scanners skip a match ending on the last byte */
+    if (end - p >= 3 && !end[-3] && !end[-2] && end[-1] == 3)
+        return end - 1;
+    return end;
+}
+
 const uint8_t *ff_avc_find_startcode(const uint8_t *p, const uint8_t *end){
     const uint8_t *out = avc_find_startcode_internal(p, end);
     if(p<out && out<end && !out[-1]) out--;
@@ -128,6 +321,46 @@ void ff_nal_units_write_list(const NALUList *list, AVIOContext *pb,
     }
 }
 
+void ff_nal_units_write_buf(const NALUList *list, uint8_t *dst,
+                            const uint8_t *buf)
+{
+    for (unsigned i = 0; i < list->nb_nalus; i++) {
+        AV_WB32(dst, list->nalus[i].size);
+        memcpy(dst + 4, buf + list->nalus[i].offset, list->nalus[i].size);
+        dst += 4 + list->nalus[i].size;
+    }
+}
+
+int ff_nal_units_to_iovec(const NALUList *list, const uint8_t *buf,
+                          uint8_t (*prefixes)[4], NALUIOVec *iov)
+{
+    for (unsigned i = 0; i < list->nb_nalus; i++) {
+        AV_WB32(prefixes[i], list->nalus[i].size);
+        iov[2 * i]     = (NALUIOVec){ .base = prefixes[i], .len = 4 };
+        iov[2 * i + 1] = (NALUIOVec){ .base = buf + list->nalus[i].offset,
+                                      .len  = list->nalus[i].size };
+    }
+    return 2 * list->nb_nalus;
+}
+
+int ff_nal_units_convert_inplace(const NALUList *list, uint8_t *buf, int size)
+{
+    int pos = 0;
+
+    /* every NAL unit must follow the previous one after exactly 00 00 00 01 */
+    for (unsigned i = 0; i < list->nb_nalus; i++) {
+        if (list->nalus[i].offset != pos + 4)
+            return AVERROR(EINVAL);
+        pos += 4 + list->nalus[i].size;
+    }
+    if (pos != size)
+        return AVERROR(EINVAL);
+
+    for (unsigned i = 0; i < list->nb_nalus; i++)
+        AV_WB32(buf + list->nalus[i].offset - 4, list->nalus[i].size);
+    return 0;
+}
+
 int ff_avc_parse_nal_units_buf(const uint8_t *buf_in, uint8_t **buf, int *size)
 {
     AVIOContext *pb;
@@ -141,6 +374,18 @@ int ff_avc_parse_nal_units_buf(const uint8_t *buf_in, uint8_t **buf, int *size)
     return 0;
 }
 
+/* ffio_free_dyn_buf() is not exported; this is the same through the public API */
+static void free_dyn_buf(AVIOContext **pb)
+{
+    uint8_t *buf;
+
+    if (!*pb)
+        return;
+    avio_close_dyn_buf(*pb, &buf);
+    av_free(buf);
+    *pb = NULL;
+}
+
 int ff_isom_write_avcc(AVIOContext *pb, const uint8_t *data, int len)
 {
     AVIOContext *sps_pb = NULL, *pps_pb = NULL, *sps_ext_pb = NULL;
@@ -233,7 +478,7 @@ int ff_isom_write_avcc(AVIOContext *pb, const uint8_t *data, int len)
 
     if (sps[3] != 66 && sps[3] != 77 && sps[3] != 88) {
         H264SPS seq;
-        ret = -1;// ff_avc_decode_sps(&seq, sps + 3, sps_size - 3);
+        ret = ff_avc_decode_sps(&seq, sps + 3, sps_size - 3);
         if (ret < 0)
             goto fail;
 
@@ -245,9 +490,10 @@ int ff_isom_write_avcc(AVIOContext *pb, const uint8_t *data, int len)
             avio_write(pb, sps_ext, sps_ext_size);
     }
 
-fail:    
-    //ffio_free_dyn_buf(&pps_pb);
-    //ffio_free_dyn_buf(&sps_ext_pb);
+fail:
+    free_dyn_buf(&sps_pb);
+    free_dyn_buf(&pps_pb);
+    free_dyn_buf(&sps_ext_pb);
     av_free(start);
 
     return ret;
@@ -333,6 +579,33 @@ uint8_t *ff_nal_unit_extract_rbsp(const uint8_t *src, uint32_t src_len,
     return dst;
 }
 
+int ff_nal_unit_insert_epb(uint8_t *dst, const uint8_t *src, uint32_t src_len,
+                           int header_len)
+{
+    uint32_t i, len;
+    int zeros = 0;
+
+    /* NAL unit header */
+    i = len = 0;
+    while (i < header_len && i < src_len)
+        dst[len++] = src[i++];
+
+    for (; i < src_len; i++) {
+        if (zeros == 2 && src[i] <= 3) {
+            dst[len++] = 3; // emulation_prevention_three_byte
+            zeros = 0;
+        }
+        dst[len++] = src[i];
+        zeros = src[i] ? 0 : zeros + 1;
+    }
+
+    /* a trailing zero byte would merge with the next start code */
+    if (zeros)
+        dst[len++] = 3;
+
+    return len;
+}
+
 static const AVRational avc_sample_aspect_ratio[17] = {
     {   0,  1 },
     {   1,  1 },
@@ -354,35 +627,17 @@ static const AVRational avc_sample_aspect_ratio[17] = {
 };
 
 
-static inline int get_ue_golomb(GetBitContext* gb) {
-    int i;
-    for (i = 0; i < 32 && !get_bits1(gb); i++)
-        ;
-    return get_bitsz(gb, i) + (1 << i) - 1;
-}
-
-static inline int get_se_golomb(GetBitContext* gb) {
-    int v = get_ue_golomb(gb) + 1;
-    int sign = -(v & 1);
-    return ((v >> 1) ^ sign) - sign;
-}
-
 int ff_avc_decode_sps(H264SPS* sps, const uint8_t* buf, int buf_size)
 {
-    int i, j, ret, rbsp_size, aspect_ratio_idc, pic_order_cnt_type;
+    int i, j, ret, aspect_ratio_idc, pic_order_cnt_type;
     int num_ref_frames_in_pic_order_cnt_cycle;
     int delta_scale, lastScale = 8, nextScale = 8;
     int sizeOfScalingList;
     GetBitContext gb;
-    uint8_t* rbsp_buf;
 
-    rbsp_buf = ff_nal_unit_extract_rbsp(buf, buf_size, &rbsp_size, 0);
-    if (!rbsp_buf)
-        return AVERROR(ENOMEM);
-
-    ret = init_get_bits8(&gb, rbsp_buf, rbsp_size);
+    ret = init_get_bits8_rbsp(&gb, buf, buf_size, ff_avc_find_escape);
     if (ret < 0)
-        goto end;
+        return ret;
 
     memset(sps, 0, sizeof(*sps));
 
@@ -404,7 +659,7 @@ int ff_avc_decode_sps(H264SPS* sps, const uint8_t* buf, int buf_size)
         sps->profile_idc == 134) {
         sps->chroma_format_idc = get_ue_golomb(&gb); // chroma_format_idc
         if (sps->chroma_format_idc == 3) {
-            skip_bits1(&gb); // separate_colour_plane_flag
+            sps->separate_colour_plane_flag = get_bits1(&gb);
         }
         sps->bit_depth_luma = get_ue_golomb(&gb) + 8;
         sps->bit_depth_chroma = get_ue_golomb(&gb) + 8;
@@ -432,14 +687,15 @@ int ff_avc_decode_sps(H264SPS* sps, const uint8_t* buf, int buf_size)
         sps->bit_depth_chroma = 8;
     }
 
-    get_ue_golomb(&gb); // log2_max_frame_num_minus4
+    sps->log2_max_frame_num = get_ue_golomb(&gb) + 4;
     pic_order_cnt_type = get_ue_golomb(&gb);
+    sps->poc_type = pic_order_cnt_type;
 
     if (pic_order_cnt_type == 0) {
-        get_ue_golomb(&gb); // log2_max_pic_order_cnt_lsb_minus4
+        sps->log2_max_poc_lsb = get_ue_golomb(&gb) + 4;
     }
     else if (pic_order_cnt_type == 1) {
-        skip_bits1(&gb);    // delta_pic_order_always_zero
+        sps->delta_pic_order_always_zero_flag = get_bits1(&gb);
         get_se_golomb(&gb); // offset_for_non_ref_pic
         get_se_golomb(&gb); // offset_for_top_to_bottom_field
         num_ref_frames_in_pic_order_cnt_cycle = get_ue_golomb(&gb);
@@ -447,23 +703,35 @@ int ff_avc_decode_sps(H264SPS* sps, const uint8_t* buf, int buf_size)
             get_se_golomb(&gb); // offset_for_ref_frame
     }
 
-    get_ue_golomb(&gb); // max_num_ref_frames
+    sps->max_num_ref_frames = get_ue_golomb(&gb);
     skip_bits1(&gb); // gaps_in_frame_num_value_allowed_flag
-    get_ue_golomb(&gb); // pic_width_in_mbs_minus1
-    get_ue_golomb(&gb); // pic_height_in_map_units_minus1
+    sps->mb_width = get_ue_golomb(&gb) + 1;
+    sps->mb_height = get_ue_golomb(&gb) + 1; // pic_height_in_map_units_minus1
 
     sps->frame_mbs_only_flag = get_bits1(&gb);
+    sps->mb_height *= 2 - sps->frame_mbs_only_flag;
     if (!sps->frame_mbs_only_flag)
         skip_bits1(&gb); // mb_adaptive_frame_field_flag
 
     skip_bits1(&gb); // direct_8x8_inference_flag
 
     if (get_bits1(&gb)) { // frame_cropping_flag
-        get_ue_golomb(&gb); // frame_crop_left_offset
-        get_ue_golomb(&gb); // frame_crop_right_offset
-        get_ue_golomb(&gb); // frame_crop_top_offset
-        get_ue_golomb(&gb); // frame_crop_bottom_offset
+        /* offsets are in chroma samples, and in field pairs for interlaced
+         * streams; a monochrome or separate-plane stream crops luma directly */
+        int chroma_array_type = sps->separate_colour_plane_flag ? 0 : sps->chroma_format_idc;
+        int crop_unit_x = chroma_array_type == 1 || chroma_array_type == 2 ? 2 : 1;
+        int crop_unit_y = (chroma_array_type == 1 ? 2 : 1) * (2 - sps->frame_mbs_only_flag);
+        sps->crop_left   = get_ue_golomb(&gb) * crop_unit_x; // frame_crop_left_offset
+        sps->crop_right  = get_ue_golomb(&gb) * crop_unit_x; // frame_crop_right_offset
+        sps->crop_top    = get_ue_golomb(&gb) * crop_unit_y; // frame_crop_top_offset
+        sps->crop_bottom = get_ue_golomb(&gb) * crop_unit_y; // frame_crop_bottom_offset
+        if (sps->crop_left + sps->crop_right >= sps->mb_width * 16 ||
+            sps->crop_top + sps->crop_bottom >= sps->mb_height * 16) {
+            return AVERROR_INVALIDDATA;
+        }
     }
+    sps->width  = sps->mb_width * 16 - sps->crop_left - sps->crop_right;
+    sps->height = sps->mb_height * 16 - sps->crop_top - sps->crop_bottom;
 
     if (get_bits1(&gb)) { // vui_parameters_present_flag
         if (get_bits1(&gb)) { // aspect_ratio_info_present_flag
@@ -476,6 +744,30 @@ int ff_avc_decode_sps(H264SPS* sps, const uint8_t* buf, int buf_size)
                 sps->sar = avc_sample_aspect_ratio[aspect_ratio_idc];
             }
         }
+
+        if (get_bits1(&gb)) // overscan_info_present_flag
+            skip_bits1(&gb); // overscan_appropriate_flag
+
+        if (get_bits1(&gb)) { // video_signal_type_present_flag
+            skip_bits(&gb, 3); // video_format
+            skip_bits1(&gb); // video_full_range_flag
+            if (get_bits1(&gb)) // colour_description_present_flag
+                skip_bits(&gb, 24); // colour_primaries, transfer_characteristics, matrix_coefficients
+        }
+
+        if (get_bits1(&gb)) { // chroma_loc_info_present_flag
+            get_ue_golomb(&gb); // chroma_sample_loc_type_top_field
+            get_ue_golomb(&gb); // chroma_sample_loc_type_bottom_field
+        }
+
+        sps->timing_info_present_flag = get_bits1(&gb);
+        if (sps->timing_info_present_flag) {
+            sps->num_units_in_tick = get_bits_long(&gb, 32);
+            sps->time_scale = get_bits_long(&gb, 32);
+            sps->fixed_frame_rate_flag = get_bits1(&gb);
+            if (!sps->num_units_in_tick || !sps->time_scale)
+                sps->timing_info_present_flag = 0;
+        }
     }
 
     if (!sps->sar.den) {
@@ -483,9 +775,39 @@ int ff_avc_decode_sps(H264SPS* sps, const uint8_t* buf, int buf_size)
         sps->sar.den = 1;
     }
 
-    ret = 0;
-end:
-    av_free(rbsp_buf);
-    return ret;
+    return 0;
 }
 
+int ff_avc_decode_pps(H264PPS *pps, const uint8_t *buf, int buf_size)
+{
+    int ret;
+    GetBitContext gb;
+
+    ret = init_get_bits8_rbsp(&gb, buf, buf_size, ff_avc_find_escape);
+    if (ret < 0)
+        return ret;
+
+    memset(pps, 0, sizeof(*pps));
+
+    pps->id = get_ue_golomb(&gb);
+    pps->sps_id = get_ue_golomb(&gb);
+    pps->entropy_coding_mode_flag = get_bits1(&gb);
+    pps->bottom_field_pic_order_in_frame_present_flag = get_bits1(&gb);
+    pps->num_slice_groups = get_ue_golomb(&gb) + 1;
+    if (pps->num_slice_groups > 1) {
+        /* slice group maps are not needed by any caller */
+        return AVERROR_PATCHWELCOME;
+    }
+    pps->num_ref_idx_l0_default_active = get_ue_golomb(&gb) + 1;
+    pps->num_ref_idx_l1_default_active = get_ue_golomb(&gb) + 1;
+    pps->weighted_pred_flag = get_bits1(&gb);
+    pps->weighted_bipred_idc = get_bits(&gb, 2);
+    get_se_golomb(&gb); // pic_init_qp_minus26
+    get_se_golomb(&gb); // pic_init_qs_minus26
+    get_se_golomb(&gb); // chroma_qp_index_offset
+    pps->deblocking_filter_control_present_flag = get_bits1(&gb);
+    pps->constrained_intra_pred_flag = get_bits1(&gb);
+    pps->redundant_pic_cnt_present_flag = get_bits1(&gb);
+
+    return 0;
+}
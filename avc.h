@@ -55,16 +55,65 @@ int ff_nal_units_create_list(NALUList *list, const uint8_t *buf, int size);
 void ff_nal_units_write_list(const NALUList *list, AVIOContext *pb,
                              const uint8_t *buf);
 
+/* Writes a NALUList mp4-style to dst, which must have room for the size
+ * returned by ff_nal_units_create_list(). The list must originate from
+ * ff_nal_units_create_list() with the same buf. */
+void ff_nal_units_write_buf(const NALUList *list, uint8_t *dst,
+                            const uint8_t *buf);
+
+typedef struct NALUIOVec {
+    const uint8_t *base;
+    size_t len;
+} NALUIOVec;
+
+/* Describes the mp4-style packet of a NALUList as a gather list without
+ * copying anything: iov[2 * i] is the length of NAL unit i, written to
+ * prefixes[i], and iov[2 * i + 1] the NAL unit itself in buf. prefixes
+ * and iov must have room for list->nb_nalus and 2 * list->nb_nalus
+ * entries. Returns the number of iov entries. */
+int ff_nal_units_to_iovec(const NALUList *list, const uint8_t *buf,
+                          uint8_t (*prefixes)[4], NALUIOVec *iov);
+
+/* Converts buf to the mp4-style packet in place by overwriting the start
+ * codes with the NAL unit lengths. Only possible if every start code is
+ * 4 bytes long and there is nothing else between the NAL units; returns
+ * AVERROR(EINVAL) without touching buf otherwise. x264 only writes 4-byte
+ * start codes before the first NAL unit of an access unit and parameter
+ * sets, so frames with several slices routinely fall back to a copy. The
+ * list must originate from ff_nal_units_create_list() with the same buf. */
+int ff_nal_units_convert_inplace(const NALUList *list, uint8_t *buf, int size);
+
 int ff_avc_parse_nal_units(AVIOContext *s, const uint8_t *buf, int size);
 int ff_avc_parse_nal_units_buf(const uint8_t *buf_in, uint8_t **buf, int *size);
 int ff_isom_write_avcc(AVIOContext *pb, const uint8_t *data, int len);
 const uint8_t *ff_avc_find_startcode(const uint8_t *p, const uint8_t *end);
+
+typedef const uint8_t *(*AVCFindStartcodeFunc)(const uint8_t *p, const uint8_t *end);
+
+typedef struct AVCStartcodeImpl {
+    const char *name;
+    AVCFindStartcodeFunc find;  ///< first 00 00 01 with another byte before end, else end
+    AVCFindStartcodeFunc find_escape; ///< the same for 00 00 03
+} AVCStartcodeImpl;
+
+/* The start code scanners this CPU can run, the scalar one first and the
+ * one ff_avc_find_startcode() uses last. Returns their number. */
+int ff_avc_startcode_impls(const AVCStartcodeImpl **impls);
+
+/* The next emulation_prevention_three_byte in an escaped NAL payload
+ * starting at p, or end. */
+const uint8_t *ff_avc_find_escape(const uint8_t *p, const uint8_t *end);
 int ff_avc_write_annexb_extradata(const uint8_t *in, uint8_t **buf, int *size);
 const uint8_t *ff_avc_mp4_find_startcode(const uint8_t *start,
                                          const uint8_t *end,
                                          int nal_length_size);
 uint8_t *ff_nal_unit_extract_rbsp(const uint8_t *src, uint32_t src_len,
                                   uint32_t *dst_len, int header_len);
+/* Inverse of ff_nal_unit_extract_rbsp(): copies an RBSP to dst, inserting
+ * emulation_prevention_three_bytes where needed. dst must have room for
+ * src_len * 3 / 2 + 1 bytes. Returns the escaped size. */
+int ff_nal_unit_insert_epb(uint8_t *dst, const uint8_t *src, uint32_t src_len,
+                           int header_len);
 
 typedef struct {
     uint8_t id;
@@ -75,9 +124,45 @@ typedef struct {
     uint8_t bit_depth_luma;
     uint8_t bit_depth_chroma;
     uint8_t frame_mbs_only_flag;
+    uint8_t separate_colour_plane_flag;
+    uint8_t log2_max_frame_num;
+    uint8_t poc_type;
+    uint8_t log2_max_poc_lsb;
+    uint8_t delta_pic_order_always_zero_flag;
+    uint16_t mb_width;
+    uint16_t mb_height;         ///< in frame macroblocks, not map units
+    uint16_t width;             ///< luma width after cropping
+    uint16_t height;            ///< luma height after cropping
+    uint16_t crop_left;         ///< crop offsets in luma samples
+    uint16_t crop_right;
+    uint16_t crop_top;
+    uint16_t crop_bottom;
+    uint8_t max_num_ref_frames;
+    uint8_t timing_info_present_flag;
+    uint8_t fixed_frame_rate_flag;
+    uint32_t num_units_in_tick;
+    uint32_t time_scale;        ///< frame rate is time_scale / (2 * num_units_in_tick)
     AVRational sar;
 } H264SPS;
 
 int ff_avc_decode_sps(H264SPS *sps, const uint8_t *buf, int buf_size);
 
+/* The subset of the PPS that is needed to write slice headers. */
+typedef struct {
+    uint8_t id;
+    uint8_t sps_id;
+    uint8_t entropy_coding_mode_flag;
+    uint8_t bottom_field_pic_order_in_frame_present_flag;
+    uint8_t num_slice_groups;
+    uint8_t num_ref_idx_l0_default_active;
+    uint8_t num_ref_idx_l1_default_active;
+    uint8_t weighted_pred_flag;
+    uint8_t weighted_bipred_idc;
+    uint8_t deblocking_filter_control_present_flag;
+    uint8_t constrained_intra_pred_flag;
+    uint8_t redundant_pic_cnt_present_flag;
+} H264PPS;
+
+int ff_avc_decode_pps(H264PPS *pps, const uint8_t *buf, int buf_size);
+
 #endif /* AVFORMAT_AVC_H */
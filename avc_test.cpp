@@ -0,0 +1,119 @@
+/*
+ * Annex B to AVCC conversion: the in-place rewrite, the copy and the
+ * gather list must agree, and the in-place rewrite must refuse what it
+ * cannot convert. x264 writes a 4-byte start code before the first NAL
+ * unit of an access unit and 3-byte ones before the other slices, so
+ * the refusal is the common case, not an edge case.
+ *
+ * Prints every mismatch and exits with 1 if there was one.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+extern "C" {
+#include "avc.h"
+#include "libavcodec/defs.h"
+#include "libavutil/error.h"
+#include "libavutil/mem.h"
+}
+
+using namespace std;
+
+static int failures = 0;
+
+static void check(bool ok, const char* name, const char* what) {
+    if (!ok) {
+        fprintf(stderr, "%s: %s\n", name, what);
+        failures++;
+    }
+}
+
+/* NAL unit payloads without 00 00 in them */
+static const vector<vector<uint8_t> > nal_units = {
+    { 0x09, 0xf0 },                                 /* AUD */
+    { 0x67, 0x64, 0x00, 0x28, 0xac, 0xd9, 0x40 },   /* SPS */
+    { 0x68, 0xeb, 0xe3, 0xcb, 0x22, 0xc0 },         /* PPS */
+    { 0x65, 0x88, 0x84, 0x21, 0xa0, 0x11, 0x22 },   /* IDR slice 0 */
+    { 0x65, 0x01, 0x9a, 0x02, 0x3c, 0x44 },         /* IDR slice 1 */
+    { 0x65, 0x02, 0x4c, 0x03, 0x7e },               /* IDR slice 2 */
+};
+
+/* start_codes[i] bytes before NAL unit i */
+static vector<uint8_t> annex_b(const vector<int>& start_codes) {
+    vector<uint8_t> buf;
+    for (size_t i = 0; i < nal_units.size(); i++) {
+        buf.insert(buf.end(), start_codes[i] - 1, 0);
+        buf.push_back(1);
+        buf.insert(buf.end(), nal_units[i].begin(), nal_units[i].end());
+    }
+    return buf;
+}
+
+static vector<uint8_t> expected_avcc() {
+    vector<uint8_t> avcc;
+    for (size_t i = 0; i < nal_units.size(); i++) {
+        uint32_t size = (uint32_t)nal_units[i].size();
+        uint8_t prefix[4] = { (uint8_t)(size >> 24), (uint8_t)(size >> 16), (uint8_t)(size >> 8), (uint8_t)size };
+        avcc.insert(avcc.end(), prefix, prefix + 4);
+        avcc.insert(avcc.end(), nal_units[i].begin(), nal_units[i].end());
+    }
+    return avcc;
+}
+
+/* in_place: whether ff_nal_units_convert_inplace must take the buffer */
+static void test(const char* name, const vector<int>& start_codes, bool in_place) {
+    vector<uint8_t> annexb = annex_b(start_codes);
+    int size = (int)annexb.size();
+    /* the scanners read past the end */
+    vector<uint8_t> buf(annexb);
+    buf.resize(size + AV_INPUT_BUFFER_PADDING_SIZE, 0);
+    vector<uint8_t> expected = expected_avcc();
+
+    NALUList list = { NULL, 0, 0 };
+    int avcc_size = ff_nal_units_create_list(&list, buf.data(), size);
+    check(avcc_size == (int)expected.size(), name, "AVCC size");
+    check(list.nb_nalus == nal_units.size(), name, "NAL unit count");
+    if (avcc_size != (int)expected.size() || list.nb_nalus != nal_units.size()) {
+        av_free(list.nalus);
+        return;
+    }
+
+    vector<uint8_t> copied(avcc_size);
+    ff_nal_units_write_buf(&list, copied.data(), buf.data());
+    check(copied == expected, name, "ff_nal_units_write_buf output");
+
+    vector<uint8_t> prefixes(4 * list.nb_nalus);
+    vector<NALUIOVec> iov(2 * list.nb_nalus);
+    int nb_iov = ff_nal_units_to_iovec(&list, buf.data(), (uint8_t(*)[4])prefixes.data(), iov.data());
+    vector<uint8_t> gathered;
+    for (int i = 0; i < nb_iov; i++)
+        gathered.insert(gathered.end(), iov[i].base, iov[i].base + iov[i].len);
+    check(gathered == expected, name, "ff_nal_units_to_iovec output");
+
+    int ret = ff_nal_units_convert_inplace(&list, buf.data(), size);
+    if (in_place) {
+        check(ret == 0, name, "in-place conversion refused");
+        check(!ret && !memcmp(buf.data(), expected.data(), size), name, "in-place output");
+    }
+    else {
+        check(ret == AVERROR(EINVAL), name, "in-place conversion taken");
+        check(!memcmp(buf.data(), annexb.data(), size), name, "refused buffer modified");
+    }
+    av_free(list.nalus);
+}
+
+int main() {
+    test("4-byte start codes", { 4, 4, 4, 4, 4, 4 }, true);
+    /* what x264 writes for a frame with several slices */
+    test("3-byte start codes after the first", { 4, 3, 3, 3, 3, 3 }, false);
+    test("3-byte start code on the last slice", { 4, 4, 4, 4, 4, 3 }, false);
+    test("3-byte start code first", { 3, 4, 4, 4, 4, 4 }, false);
+
+    if (failures)
+        return 1;
+    printf("avc_test: all passed\n");
+    return 0;
+}
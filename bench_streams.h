@@ -0,0 +1,91 @@
+/*
+ * H.264 streams for the benchmarks: baked corpus files or synthetic
+ * access units of a given bitrate.
+ */
+
+#ifndef WEBDRIVERTORSO_BENCH_STREAMS_H
+#define WEBDRIVERTORSO_BENCH_STREAMS_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <string>
+#include <vector>
+#include "corpus.h"
+
+/* Annex B access units with 4-byte start codes, back to back */
+struct Stream {
+    std::string name;
+    std::vector<uint8_t> data;
+    std::vector<size_t> frame_offsets;  ///< start of every access unit in data
+    int frames = 0;
+};
+
+inline void append_nal(std::vector<uint8_t>& out, const uint8_t* nal, int size) {
+    static const uint8_t startcode[4] = { 0, 0, 0, 1 };
+    out.insert(out.end(), startcode, startcode + 4);
+    out.insert(out.end(), nal, nal + size);
+}
+
+/* random payload, escaped like an encoder would */
+inline void append_random_nal(std::vector<uint8_t>& out, int size) {
+    std::vector<uint8_t> nal;
+    int zeros = 0;
+    while ((int)nal.size() < size) {
+        /* entropy coded data has more zero bytes than uniform noise */
+        uint8_t b = rand() % 8 == 0 ? 0 : rand() & 0xff;
+        if (zeros >= 2 && b <= 3) {
+            nal.push_back(3);
+            zeros = 0;
+        }
+        nal.push_back(b);
+        zeros = b ? 0 : zeros + 1;
+    }
+    if (nal.back() == 0)
+        nal.back() = 0x80;
+    append_nal(out, nal.data(), nal.size());
+}
+
+inline Stream synthetic_stream(int bitrate, int seconds) {
+    Stream s;
+    s.name = "synthetic " + std::to_string(bitrate / 1000) + " kbit/s";
+    for (int i = 0; i < 25 * seconds; i++) {
+        s.frame_offsets.push_back(s.data.size());
+        if (i % 25 == 0) {
+            append_random_nal(s.data, 20);  // SPS
+            append_random_nal(s.data, 5);   // PPS
+            append_random_nal(s.data, 600); // x264 SEI
+        }
+        /* keyframes are several times larger than the frames between them */
+        int size = bitrate / 8 / 25 * (i % 25 == 0 ? 5 : 1) * (rand() % 50 + 75) / 100;
+        append_random_nal(s.data, size);
+        s.frames++;
+    }
+    return s;
+}
+
+inline bool corpus_stream(const char* path, Stream& s) {
+    CorpusFile corpus;
+    if (!corpus.open(path))
+        return false;
+    s.name = path + std::string(" (") + std::to_string(corpus.header()->video_bitrate / 1000) + " kbit/s)";
+    for (uint32_t i = 0; i < corpus.header()->packet_count; i++) {
+        const CorpusPacket& pkt = corpus.packets()[i];
+        if (pkt.type != CORPUS_PACKET_VIDEO)
+            continue;
+        s.frame_offsets.push_back(s.data.size());
+        const uint8_t* p = corpus.payload(pkt);
+        const uint8_t* end = p + pkt.size;
+        while (end - p >= 4) {
+            uint32_t size = (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+            if (size > (uint32_t)(end - p - 4))
+                break;
+            append_nal(s.data, p + 4, size);
+            p += 4 + size;
+        }
+        s.frames++;
+    }
+    return true;
+}
+
+#endif /* WEBDRIVERTORSO_BENCH_STREAMS_H */
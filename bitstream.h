@@ -0,0 +1,504 @@
+/*
+ * Copyright (c) 2016 Alexandra Hájková
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * bitstream reader API header.
+ *
+ * The big-endian half of libavcodec/bitstream_template.h, which get_bits.h
+ * includes when CACHED_BITSTREAM_READER is set. Bits are served from a
+ * 64-bit cache that is refilled 32 or 64 bits at a time, so a read is a
+ * shift and a mask rather than an unaligned load per call. The
+ * little-endian reader and bits_read_vlc() are not provided; nothing here
+ * reads LE bitstreams or VLC tables.
+ *
+ * Refills load 8 bytes at a time and may read up to 7 bytes past the end
+ * of the buffer, which must be padded with AV_INPUT_BUFFER_PADDING_SIZE
+ * bytes like every other FFmpeg bitstream buffer.
+ *
+ * bits_init8_rbsp() reads an escaped H.264/HEVC NAL payload in place,
+ * dropping the emulation_prevention_three_bytes while refilling instead of
+ * copying the payload to an RBSP buffer first. The caller's scanner finds
+ * the next escape; refills that do not reach it stay single loads, the one
+ * that does goes byte by byte. This reader never reads past the end of the
+ * buffer, so it needs no padding.
+ */
+
+#ifndef AVCODEC_BITSTREAM_H
+#define AVCODEC_BITSTREAM_H
+
+#include <stdint.h>
+
+#include "libavutil/common.h"
+#include "libavutil/intreadwrite.h"
+#include "libavutil/avassert.h"
+
+#include "libavcodec/defs.h"
+
+#ifndef UNCHECKED_BITSTREAM_READER
+#define UNCHECKED_BITSTREAM_READER !CONFIG_SAFE_BITSTREAM_READER
+#endif
+
+typedef struct BitstreamContextBE {
+    uint64_t bits;       // stores bits read from the buffer
+    const uint8_t *buffer, *buffer_end;
+    const uint8_t *ptr;  // pointer to the position inside a buffer
+    unsigned bits_valid; // number of bits left in bits field
+    unsigned size_in_bits;
+    // RBSP mode only, NULL otherwise: the next emulation prevention byte
+    // or buffer_end; refills that would load it go byte by byte
+    const uint8_t *slow;
+    const uint8_t *(*find_escape)(const uint8_t *p, const uint8_t *end);
+    unsigned escaped_bits; // emulation prevention bits skipped so far
+} BitstreamContextBE;
+
+typedef BitstreamContextBE BitstreamContext;
+
+static av_noinline void bits_priv_refill_rbsp(BitstreamContext *bc)
+{
+    while (bc->bits_valid <= 56 && bc->ptr < bc->buffer_end) {
+        if (bc->ptr == bc->slow) {
+            bc->ptr++;
+            bc->escaped_bits += 8;
+            bc->slow = bc->find_escape(bc->ptr, bc->buffer_end);
+            continue;
+        }
+        bc->bits |= (uint64_t)*bc->ptr++ << (56 - bc->bits_valid);
+        bc->bits_valid += 8;
+    }
+}
+
+static inline void bits_priv_refill_64(BitstreamContext *bc)
+{
+    if (bc->slow && bc->slow - bc->ptr < 8) {
+        bits_priv_refill_rbsp(bc);
+        return;
+    }
+
+#if !UNCHECKED_BITSTREAM_READER
+    if (bc->ptr >= bc->buffer_end)
+        return;
+#endif
+
+    bc->bits       = AV_RB64(bc->ptr);
+    bc->ptr       += 8;
+    bc->bits_valid = 64;
+}
+
+static inline void bits_priv_refill_32(BitstreamContext *bc)
+{
+    if (bc->slow && bc->slow - bc->ptr < 4) {
+        bits_priv_refill_rbsp(bc);
+        return;
+    }
+
+#if !UNCHECKED_BITSTREAM_READER
+    if (bc->ptr >= bc->buffer_end)
+        return;
+#endif
+
+    bc->bits      |= (uint64_t)AV_RB32(bc->ptr) << (32 - bc->bits_valid);
+    bc->ptr        += 4;
+    bc->bits_valid += 32;
+}
+
+/**
+ * Initialize BitstreamContext.
+ * @param buffer bitstream buffer, must be AV_INPUT_BUFFER_PADDING_SIZE bytes
+ *        larger than the actual read bits because some optimized bitstream
+ *        readers read 32 or 64 bits at once and could read over the end
+ * @param bit_size the size of the buffer in bits
+ * @return 0 on success, AVERROR_INVALIDDATA if the buffer_size would overflow.
+ */
+static inline int bits_init(BitstreamContext *bc, const uint8_t *buffer,
+                            unsigned int bit_size)
+{
+    unsigned int buffer_size;
+
+    bc->slow         = NULL;
+    bc->find_escape  = NULL;
+    bc->escaped_bits = 0;
+
+    if (bit_size > INT_MAX - 7 || !buffer) {
+        bc->buffer       = NULL;
+        bc->buffer_end   = NULL;
+        bc->ptr          = NULL;
+        bc->size_in_bits = 0;
+        bc->bits_valid   = 0;
+        bc->bits         = 0;
+        return AVERROR_INVALIDDATA;
+    }
+
+    buffer_size = (bit_size + 7) >> 3;
+
+    bc->buffer       = buffer;
+    bc->buffer_end   = buffer + buffer_size;
+    bc->ptr          = bc->buffer;
+    bc->size_in_bits = bit_size;
+    bc->bits_valid   = 0;
+    bc->bits         = 0;
+
+    bits_priv_refill_64(bc);
+
+    return 0;
+}
+
+/**
+ * Initialize BitstreamContext.
+ * @param buffer bitstream buffer, must be AV_INPUT_BUFFER_PADDING_SIZE bytes
+ *        larger than the actual read bits because some optimized bitstream
+ *        readers read 32 or 64 bits at once and could read over the end
+ * @param byte_size the size of the buffer in bytes
+ * @return 0 on success, AVERROR_INVALIDDATA if the buffer_size would overflow
+ */
+static inline int bits_init8(BitstreamContext *bc, const uint8_t *buffer,
+                             unsigned int byte_size)
+{
+    if (byte_size > INT_MAX / 8)
+        return AVERROR_INVALIDDATA;
+    return bits_init(bc, buffer, byte_size * 8);
+}
+
+/**
+ * Initialize BitstreamContext for reading the RBSP of an escaped NAL unit
+ * payload in place.
+ * @param buffer the NAL unit payload, with its emulation prevention bytes;
+ *        no padding is needed
+ * @param byte_size the size of the buffer in bytes
+ * @param find_escape returns the first emulation_prevention_three_byte in
+ *        [p, end), or end if there is none
+ * @return 0 on success, AVERROR_INVALIDDATA if the buffer_size would overflow
+ */
+static inline int bits_init8_rbsp(BitstreamContext *bc, const uint8_t *buffer,
+                                  unsigned int byte_size,
+                                  const uint8_t *(*find_escape)(const uint8_t *p,
+                                                                const uint8_t *end))
+{
+    if (byte_size > INT_MAX / 8 || !buffer) {
+        bits_init(bc, NULL, 0);
+        return AVERROR_INVALIDDATA;
+    }
+
+    bc->buffer       = buffer;
+    bc->buffer_end   = buffer + byte_size;
+    bc->ptr          = bc->buffer;
+    bc->size_in_bits = byte_size * 8;
+    bc->bits_valid   = 0;
+    bc->bits         = 0;
+    bc->find_escape  = find_escape;
+    bc->escaped_bits = 0;
+    bc->slow         = find_escape(buffer, bc->buffer_end);
+
+    bits_priv_refill_64(bc);
+
+    return 0;
+}
+
+/**
+ * Return number of bits already read. In RBSP mode, emulation prevention
+ * bytes are not counted.
+ */
+static inline int bits_tell(const BitstreamContext *bc)
+{
+    return (bc->ptr - bc->buffer) * 8 - bc->bits_valid - bc->escaped_bits;
+}
+
+/**
+ * Return buffer size in bits.
+ */
+static inline int bits_size(const BitstreamContext *bc)
+{
+    return bc->size_in_bits;
+}
+
+/**
+ * Return the number of the bits left in a buffer. In RBSP mode this is an
+ * upper bound: emulation prevention bytes not reached yet are counted.
+ */
+static inline int bits_left(const BitstreamContext *bc)
+{
+    return (bc->buffer - bc->ptr) * 8 + bc->size_in_bits + bc->bits_valid;
+}
+
+static inline uint64_t bits_priv_val_show(BitstreamContext *bc, unsigned int n)
+{
+    av_assert2(n > 0 && n <= 64);
+
+    return bc->bits >> (64 - n);
+}
+
+static inline void bits_priv_skip_remaining(BitstreamContext *bc, unsigned int n)
+{
+    if (n < 64)
+        bc->bits <<= n;
+    else
+        bc->bits = 0;
+    bc->bits_valid -= n;
+}
+
+static inline uint64_t bits_priv_val_get(BitstreamContext *bc, unsigned int n)
+{
+    uint64_t ret;
+
+    av_assert2(n > 0 && n < 64);
+
+    ret = bits_priv_val_show(bc, n);
+    bits_priv_skip_remaining(bc, n);
+
+    return ret;
+}
+
+/**
+ * Return one bit from the buffer.
+ */
+static inline unsigned int bits_read_bit(BitstreamContext *bc)
+{
+    if (!bc->bits_valid)
+        bits_priv_refill_64(bc);
+
+    return bits_priv_val_get(bc, 1);
+}
+
+/**
+ * Return n bits from the buffer, n has to be in the 1-32 range.
+ * May be faster than bits_read() when n is not a compile-time constant and is
+ * known to be non-zero;
+ */
+static inline uint32_t bits_read_nz(BitstreamContext *bc, unsigned int n)
+{
+    av_assert2(n > 0 && n <= 32);
+
+    if (n > bc->bits_valid)
+        bits_priv_refill_32(bc);
+
+    return bits_priv_val_get(bc, n);
+}
+
+/**
+ * Return n bits from the buffer, n has to be in the 0-32  range.
+ */
+static inline uint32_t bits_read(BitstreamContext *bc, unsigned int n)
+{
+    av_assert2(n <= 32);
+
+    if (!n)
+        return 0;
+
+    return bits_read_nz(bc, n);
+}
+
+/**
+ * Return n bits from the buffer, n has to be in the 0-63 range.
+ */
+static inline uint64_t bits_read_63(BitstreamContext *bc, unsigned int n)
+{
+    uint64_t ret = 0;
+    unsigned left = 0;
+
+    av_assert2(n <= 63);
+
+    if (!n)
+        return 0;
+
+    if (n > bc->bits_valid) {
+        left = bc->bits_valid;
+        n   -= left;
+
+        if (left)
+            ret = bits_priv_val_get(bc, left);
+
+        bits_priv_refill_64(bc);
+    }
+
+    ret = bits_priv_val_get(bc, n) | ret << n;
+
+    return ret;
+}
+
+/**
+ * Return n bits from the buffer, n has to be in the 0-64 range.
+ */
+static inline uint64_t bits_read_64(BitstreamContext *bc, unsigned int n)
+{
+    av_assert2(n <= 64);
+
+    if (n == 64) {
+        uint64_t ret = bits_read_63(bc, 63);
+        return ret << 1 | (uint64_t)bits_read_bit(bc);
+    }
+    return bits_read_63(bc, n);
+}
+
+/**
+ * Return n bits from the buffer as a signed integer, n has to be in the 1-32
+ * range. May be faster than bits_read_signed() when n is not a compile-time
+ * constant and is known to be non-zero;
+ */
+static inline int32_t bits_read_signed_nz(BitstreamContext *bc, unsigned int n)
+{
+    av_assert2(n > 0 && n <= 32);
+    return sign_extend(bits_read_nz(bc, n), n);
+}
+
+/**
+ * Return n bits from the buffer as a signed integer.
+ * n has to be in the 0-32 range.
+ */
+static inline int32_t bits_read_signed(BitstreamContext *bc, unsigned int n)
+{
+    av_assert2(n <= 32);
+
+    if (!n)
+        return 0;
+
+    return bits_read_signed_nz(bc, n);
+}
+
+/**
+ * Return n bits from the buffer but do not change the buffer state.
+ * n has to be in the 1-32 range. May be faster than bits_peek() when n is not a
+ * compile-time constant and is known to be non-zero;
+ */
+static inline uint32_t bits_peek_nz(BitstreamContext *bc, unsigned int n)
+{
+    av_assert2(n > 0 && n <= 32);
+
+    if (n > bc->bits_valid)
+        bits_priv_refill_32(bc);
+
+    return bits_priv_val_show(bc, n);
+}
+
+/**
+ * Return n bits from the buffer but do not change the buffer state.
+ * n has to be in the 0-32 range.
+ */
+static inline uint32_t bits_peek(BitstreamContext *bc, unsigned int n)
+{
+    av_assert2(n <= 32);
+
+    if (!n)
+        return 0;
+
+    return bits_peek_nz(bc, n);
+}
+
+/**
+ * Return n bits from the buffer as a signed integer, do not change the buffer
+ * state. n has to be in the 1-32 range.
+ */
+static inline int bits_peek_signed_nz(BitstreamContext *bc, unsigned int n)
+{
+    av_assert2(n > 0 && n <= 32);
+    return sign_extend(bits_peek_nz(bc, n), n);
+}
+
+/**
+ * Skip n bits in the buffer.
+ */
+static inline void bits_skip(BitstreamContext *bc, unsigned int n)
+{
+    if (n < bc->bits_valid)
+        bits_priv_skip_remaining(bc, n);
+    else {
+        n -= bc->bits_valid;
+        bc->bits       = 0;
+        bc->bits_valid = 0;
+
+        if (bc->slow) {
+            /* the bytes in between may hold escapes, read through them */
+            for (bits_priv_refill_64(bc); n >= bc->bits_valid && bc->bits_valid;
+                 bits_priv_refill_64(bc)) {
+                n -= bc->bits_valid;
+                bc->bits       = 0;
+                bc->bits_valid = 0;
+            }
+        } else {
+            if (n >= 64) {
+                unsigned int skip = n / 8;
+
+                n -= skip * 8;
+                bc->ptr += skip;
+            }
+            bits_priv_refill_64(bc);
+        }
+        if (n)
+            bits_priv_skip_remaining(bc, n);
+    }
+}
+
+/**
+ * Seek to the given bit position.
+ */
+static inline void bits_seek(BitstreamContext *bc, unsigned pos)
+{
+    bc->ptr        = bc->buffer;
+    bc->bits       = 0;
+    bc->bits_valid = 0;
+    if (bc->slow) {
+        bc->slow         = bc->find_escape(bc->buffer, bc->buffer_end);
+        bc->escaped_bits = 0;
+    }
+
+    bits_skip(bc, pos);
+}
+
+/**
+ * Skip bits to a byte boundary. In RBSP mode the returned pointer does not
+ * account for the emulation prevention bytes skipped.
+ */
+static inline const uint8_t *bits_align(BitstreamContext *bc)
+{
+    unsigned int n = -bits_tell(bc) & 7;
+    if (n)
+        bits_skip(bc, n);
+    return bc->buffer + (bits_tell(bc) >> 3);
+}
+
+/**
+ * Read MPEG-1 dc-style VLC (sign bit + mantissa with no MSB).
+ * If MSB not set it is negative.
+ * @param n length in bits
+ */
+static inline int bits_read_xbits(BitstreamContext *bc, unsigned int n)
+{
+    int32_t cache = bits_peek(bc, 32);
+    int sign = ~cache >> 31;
+    bits_priv_skip_remaining(bc, n);
+
+    return ((((uint32_t)(sign ^ cache)) >> (32 - n)) ^ sign) - sign;
+}
+
+/**
+ * Skip unary-coded 8-bit data blocks, each preceded by a 1 and terminated by a 0.
+ */
+static inline int bits_skip_1stop_8data(BitstreamContext *s)
+{
+    int result = bits_read_bit(s);
+
+    while (result) {
+        bits_skip(s, 8);
+        result = bits_read_bit(s);
+    }
+
+    return result;
+}
+
+#endif /* AVCODEC_BITSTREAM_H */
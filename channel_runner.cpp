@@ -0,0 +1,194 @@
+#define WIN32_LEAN_AND_MEAN
+
+#include <windows.h>
+#include <winsock2.h>
+#include <stdio.h>
+
+#include "channel_runner.h"
+
+using namespace std;
+
+ChannelRunner::ChannelRunner(int nb_workers, const PacingOptions& pacing, const SendQueueOptions& send_queue)
+    : nb_workers(nb_workers), pacing(pacing), send_queue(send_queue), worker_stats(new WorkerStats[nb_workers]) {
+}
+
+ChannelRunner::~ChannelRunner() {
+}
+
+void ChannelRunner::add(const ChannelConfig& config, const RtmpUrl& url) {
+    channels.push_back(std::unique_ptr<Channel>(new Channel(config, url, clock, pacing, send_queue, send_loop)));
+    channels.back()->channel.init();
+}
+
+void ChannelRunner::run() {
+    /* the send loop publishes while the workers start, meanwhile the streams queue up */
+    for (size_t i = 0; i < channels.size(); i++)
+        channels[i]->destination.start(channels[i]->channel.stream_info(), channels[i]->channel.headers());
+
+    TimePoint now = chrono::steady_clock::now();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        alive = channels.size();
+        for (size_t i = 0; i < channels.size(); i++)
+            schedule.push(Due(now, i));
+    }
+
+    int metrics_id = metrics.add([this](MetricsWriter& w) { write_metrics(w); });
+    std::vector<std::thread> workers;
+    for (int i = 0; i < nb_workers; i++)
+        workers.push_back(std::thread(&ChannelRunner::worker, this, &worker_stats[i]));
+
+    TimePoint next_stats = now + chrono::seconds(10);
+    std::unique_lock<std::mutex> lock(mutex);
+    while (alive) {
+        if (finished.wait_until(lock, next_stats) == std::cv_status::timeout) {
+            size_t n = alive;
+            lock.unlock();
+            print_stats(n);
+            next_stats += chrono::seconds(10);
+            lock.lock();
+        }
+    }
+    lock.unlock();
+
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+    metrics.remove(metrics_id);
+    for (size_t i = 0; i < channels.size(); i++)
+        channels[i]->destination.stop();
+}
+
+void ChannelRunner::worker(WorkerStats* stats) {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (alive) {
+        if (schedule.empty()) {
+            wakeup.wait(lock);
+            continue;
+        }
+        Due next = schedule.top();
+        TimePoint now = chrono::steady_clock::now();
+        if (next.first > now) {
+            wakeup.wait_until(lock, next.first);
+            continue;
+        }
+        schedule.pop();
+        lock.unlock();
+
+        stats->runs.fetch_add(1, std::memory_order_relaxed);
+        TimePoint due;
+        bool ok = run_channel(*channels[next.second], due, stats);
+
+        lock.lock();
+        if (ok) {
+            schedule.push(Due(due, next.second));
+            wakeup.notify_one();
+        }
+        else if (--alive == 0) {
+            wakeup.notify_all();
+            finished.notify_all();
+        }
+    }
+}
+
+bool ChannelRunner::run_channel(Channel& c, TimePoint& due, WorkerStats* stats) {
+    if (!c.started) {
+        c.pacer.start();
+        c.started = true;
+    }
+
+    for (;;) {
+        if (!c.destination.alive()) {
+            c.destination.stop();
+            return false;
+        }
+        c.channel.produce();
+        int64_t due_ms = c.channel.next_due_ms();
+        if (!c.pacer.due(due_ms)) {
+            /* nothing queued only if the encoder is holding frames back, try again soon */
+            int64_t deadline_us = due_ms == INT64_MAX ? clock.now_us() + 5000 : c.pacer.deadline_us(due_ms);
+            due = TimePoint(chrono::microseconds(deadline_us));
+            return true;
+        }
+
+        Backpressure backpressure = c.destination.backpressure();
+        if (backpressure == BACKPRESSURE_RESYNC && !c.keyframe_requested) {
+            c.channel.request_keyframe();
+            c.keyframe_requested = true;
+            stats->keyframe_requests.fetch_add(1, std::memory_order_relaxed);
+        }
+        if ((backpressure != BACKPRESSURE_NONE || c.channel.dropping_to_keyframe()) &&
+            (c.channel.drop_disposable() || (!c.channel.has_disposable_frames() && c.channel.drop_to_keyframe()))) {
+            stats->shed.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+
+        bool key;
+        SharedMessage msg = c.channel.pop_message(key);
+        c.destination.publish(msg, key);
+        if (key)
+            c.keyframe_requested = false;
+    }
+}
+
+void ChannelRunner::print_stats(size_t alive_channels) {
+    uint64_t runs = 0;
+    uint64_t shed = 0;
+    uint64_t keyframe_requests = 0;
+    for (int i = 0; i < nb_workers; i++) {
+        runs += worker_stats[i].runs.load(std::memory_order_relaxed);
+        shed += worker_stats[i].shed.load(std::memory_order_relaxed);
+        keyframe_requests += worker_stats[i].keyframe_requests.load(std::memory_order_relaxed);
+    }
+    uint64_t jitter[JitterHistogram::nb_buckets] = {};
+    uint64_t skips = 0;
+    uint64_t messages = 0;
+    uint64_t bytes = 0;
+    LatencySnapshot send;
+    for (size_t i = 0; i < channels.size(); i++) {
+        channels[i]->pacer.jitter().merge_into(jitter);
+        skips += channels[i]->pacer.skips();
+        channels[i]->destination.add_totals(messages, bytes, send);
+    }
+    printf("Channels %zu/%zu alive, %d workers, %llu runs, %llu messages sent, %llu schedule restarts\n",
+        alive_channels, channels.size(), nb_workers, (unsigned long long)runs, (unsigned long long)messages,
+        (unsigned long long)skips);
+    printf("Backpressure: %llu frames skipped, %llu keyframes requested\n",
+        (unsigned long long)shed, (unsigned long long)keyframe_requests);
+    JitterHistogram::print("Send", jitter);
+    fflush(stdout);
+}
+
+void ChannelRunner::write_metrics(MetricsWriter& w) {
+    ChannelMetrics channel_metrics;
+    PacingMetrics pacing;
+    for (size_t i = 0; i < channels.size(); i++) {
+        channels[i]->channel.add_metrics(channel_metrics);
+        pacing.add(channels[i]->pacer);
+    }
+    channel_metrics.write(w);
+    pacing.write(w);
+
+    uint64_t messages = 0;
+    uint64_t bytes = 0;
+    LatencySnapshot send;
+    for (size_t i = 0; i < channels.size(); i++)
+        channels[i]->destination.add_totals(messages, bytes, send);
+    uint64_t shed = 0;
+    uint64_t keyframe_requests = 0;
+    for (int i = 0; i < nb_workers; i++) {
+        shed += worker_stats[i].shed.load(std::memory_order_relaxed);
+        keyframe_requests += worker_stats[i].keyframe_requests.load(std::memory_order_relaxed);
+    }
+    size_t alive_channels;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        alive_channels = alive;
+    }
+    w.gauge("webdrivertorso_channels_alive", "Channels still connected.", "", (double)alive_channels);
+    w.counter("webdrivertorso_output_messages_total", "Messages sent or written.", "", messages);
+    w.counter("webdrivertorso_output_bytes_total", "Bytes sent or written.", "", bytes);
+    w.histogram("webdrivertorso_rtmp_send_seconds", "Time to send one message to the destination socket.", "", send);
+    w.counter("webdrivertorso_shed_frames_total", "Frames skipped while an output was congested.", "", shed);
+    w.counter("webdrivertorso_keyframe_requests_total", "IDRs requested for an output that dropped.", "",
+        keyframe_requests);
+}
@@ -0,0 +1,109 @@
+#ifndef WEBDRIVERTORSO_CHANNEL_RUNNER_H
+#define WEBDRIVERTORSO_CHANNEL_RUNNER_H
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+#include "fanout.h"
+#include "metrics.h"
+#include "pacer.h"
+#include "torso_channel.h"
+
+/*
+ * Runs many channels in one process on a fixed pool of workers.
+ *
+ * Every channel is in a schedule ordered by the deadline of its next
+ * packet (see pacer.h, the catch-up policy applies per channel). A worker takes the earliest channel once it is due, renders and
+ * encodes it up to that packet (TorsoChannel::produce()), publishes
+ * everything that is due and puts it back with its next due time. A
+ * channel is only ever run by one worker at a time, so it needs no
+ * locking of its own; the schedule is the only shared state.
+ *
+ * The workers never touch the network: each channel publishes to its own
+ * Destination (see fanout.h) behind a bounded queue, and one send loop
+ * (see send_loop.h) writes all of them, so a slow or dead endpoint
+ * cannot hold a worker and with it every other channel. Backpressure is
+ * acted on per channel as in the live stage. A channel whose destination
+ * fails is dropped; the runner returns when none is left. The encoders
+ * should be single threaded (ChannelOptions::encoder_threads 1): the
+ * pool already keeps every core busy.
+ *
+ * While it runs, the metrics export (see metrics.h) has the stage
+ * latencies, queues and pacing of all channels added up, and the sends
+ * of all destinations.
+ */
+class ChannelRunner {
+public:
+    /* spin_us does not apply, the workers wait on the schedule */
+    ChannelRunner(int nb_workers, const PacingOptions& pacing, const SendQueueOptions& send_queue);
+    ~ChannelRunner();
+
+    /* Opens the channel's encoders. Before run() only. */
+    void add(const ChannelConfig& config, const RtmpUrl& url);
+
+    /* Runs until every channel has failed, printing stats every 10 s. */
+    void run();
+
+    void write_metrics(MetricsWriter& w);
+
+private:
+    typedef std::chrono::steady_clock::time_point TimePoint;
+
+    struct Channel {
+        Channel(const ChannelConfig& config, const RtmpUrl& url, Clock& clock,
+            const PacingOptions& pacing, const SendQueueOptions& send_queue, SendLoop& loop)
+            : channel(config), pacer(clock, pacing), destination(url, send_queue, loop) {
+        }
+
+        TorsoChannel channel;
+
+        /* written for every packet */
+        char pad0[64];
+        Pacer pacer;
+        char pad1[64];
+
+        Destination destination;
+        bool started = false;
+        bool keyframe_requested = false;
+    };
+
+    /* Written by whichever worker ran last, read by the stats printer. */
+    struct WorkerStats {
+        char pad0[64];
+        std::atomic<uint64_t> runs{ 0 };
+        std::atomic<uint64_t> shed{ 0 };
+        std::atomic<uint64_t> keyframe_requests{ 0 };
+        char pad1[64];
+    };
+
+    typedef std::pair<TimePoint, size_t> Due;
+
+    void worker(WorkerStats* stats);
+    /* Returns false if the channel failed. */
+    bool run_channel(Channel& c, TimePoint& due, WorkerStats* stats);
+    void print_stats(size_t alive_channels);
+
+    int nb_workers;
+    PacingOptions pacing;
+    SendQueueOptions send_queue;
+    SteadyClock clock;
+    /* outlives the destinations */
+    SendLoop send_loop;
+    std::vector<std::unique_ptr<Channel> > channels;
+    std::unique_ptr<WorkerStats[]> worker_stats;
+
+    std::mutex mutex;
+    std::condition_variable wakeup;         ///< workers, the schedule changed
+    std::condition_variable finished;       ///< run(), the last channel failed
+    std::priority_queue<Due, std::vector<Due>, std::greater<Due> > schedule;
+    size_t alive = 0;
+};
+
+#endif /* WEBDRIVERTORSO_CHANNEL_RUNNER_H */
@@ -0,0 +1,230 @@
+#include "corpus.h"
+
+#include <string.h>
+#include <algorithm>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+CorpusWriter::~CorpusWriter() {
+    if (f)
+        fclose(f);
+}
+
+bool CorpusWriter::write_aligned(const void* data, size_t size) {
+    static const uint8_t zeros[8] = { 0 };
+    size_t pad = CorpusFile::align8(size) - size;
+    if (fwrite(data, 1, size, f) != size || fwrite(zeros, 1, pad, f) != pad)
+        return false;
+    offset += size + pad;
+    return true;
+}
+
+bool CorpusWriter::open(const char* path, const CorpusHeader& h,
+    const uint8_t* avcc, int avcc_size, const uint8_t* asc, int asc_size) {
+    f = fopen(path, "wb");
+    if (!f)
+        return false;
+
+    header = h;
+    header.magic = CORPUS_MAGIC;
+    header.version = CORPUS_VERSION;
+    header.avcc_size = avcc_size;
+    header.asc_size = asc_size;
+    header.packet_count = 0;
+    header.keyframe_count = 0;
+    header.index_offset = 0;
+    header.keyframe_offset = 0;
+
+    /* the header is rewritten with the real counts by finish() */
+    return write_aligned(&header, sizeof(header)) &&
+        write_aligned(avcc, avcc_size) &&
+        write_aligned(asc, asc_size);
+}
+
+bool CorpusWriter::write_packet(CorpusPacketType type, int64_t dts_ms, int64_t pts_ms, int duration_ms,
+    bool key, const uint8_t* data, int size) {
+    CorpusPacket pkt;
+    memset(&pkt, 0, sizeof(pkt));
+    pkt.offset = offset;
+    pkt.size = size;
+    pkt.dts_ms = (int32_t)dts_ms;
+    pkt.cts_ms = (int32_t)(pts_ms - dts_ms);
+    pkt.duration_ms = (uint16_t)duration_ms;
+    pkt.type = (uint8_t)type;
+    pkt.flags = key ? CORPUS_FLAG_KEY : 0;
+
+    if (fwrite(data, 1, size, f) != (size_t)size)
+        return false;
+    offset += size;
+    packets.push_back(pkt);
+    return true;
+}
+
+/* Whether the next loop, shifted by duration_ms, starts after this one ends in every stream. */
+static bool loops_cleanly(const CorpusPacket* packets, uint32_t count, uint32_t duration_ms) {
+    for (int type = CORPUS_PACKET_AUDIO; type <= CORPUS_PACKET_VIDEO; type++) {
+        const CorpusPacket* first = NULL;
+        int64_t last_dts = INT64_MIN;
+        int64_t min_pts = INT64_MAX;
+        int64_t max_pts = INT64_MIN;
+        for (uint32_t i = 0; i < count; i++) {
+            const CorpusPacket& pkt = packets[i];
+            if (pkt.type != type)
+                continue;
+            if (!first)
+                first = &pkt;
+            int64_t pts = (int64_t)pkt.dts_ms + pkt.cts_ms;
+            last_dts = pkt.dts_ms;
+            min_pts = std::min(min_pts, pts);
+            max_pts = std::max(max_pts, pts);
+        }
+        /* audio pts is not sent */
+        if (first && (last_dts >= (int64_t)first->dts_ms + duration_ms ||
+            (type == CORPUS_PACKET_VIDEO && max_pts >= min_pts + duration_ms)))
+            return false;
+    }
+    return true;
+}
+
+bool CorpusWriter::finish(uint32_t duration_ms) {
+    static const uint8_t zeros[8] = { 0 };
+    size_t pad = CorpusFile::align8(offset) - offset;
+    if (fwrite(zeros, 1, pad, f) != pad)
+        return false;
+    offset += pad;
+
+    std::stable_sort(packets.begin(), packets.end(), [](const CorpusPacket& a, const CorpusPacket& b) {
+        if (a.dts_ms != b.dts_ms)
+            return a.dts_ms < b.dts_ms;
+        return a.type < b.type;
+    });
+
+    header.duration_ms = duration_ms;
+    if (!duration_ms || !loops_cleanly(packets.data(), (uint32_t)packets.size(), duration_ms))
+        return false;
+
+    std::vector<uint32_t> keyframes;
+    for (size_t i = 0; i < packets.size(); i++) {
+        if (packets[i].type == CORPUS_PACKET_VIDEO && (packets[i].flags & CORPUS_FLAG_KEY))
+            keyframes.push_back((uint32_t)i);
+    }
+
+    header.packet_count = (uint32_t)packets.size();
+    header.keyframe_count = (uint32_t)keyframes.size();
+    header.index_offset = offset;
+    if (!packets.empty() && !write_aligned(packets.data(), packets.size() * sizeof(CorpusPacket)))
+        return false;
+    header.keyframe_offset = offset;
+    if (!keyframes.empty() && !write_aligned(keyframes.data(), keyframes.size() * sizeof(uint32_t)))
+        return false;
+
+    if (fseek(f, 0, SEEK_SET) != 0 || fwrite(&header, 1, sizeof(header), f) != sizeof(header))
+        return false;
+    bool ok = fclose(f) == 0;
+    f = NULL;
+    return ok;
+}
+
+CorpusFile::~CorpusFile() {
+    close();
+}
+
+bool CorpusFile::open(const char* path) {
+#ifdef _WIN32
+    file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        file = NULL;
+        return false;
+    }
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+        close();
+        return false;
+    }
+    size = file_size.QuadPart;
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!mapping) {
+        close();
+        return false;
+    }
+    base = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+    fd = ::open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close();
+        return false;
+    }
+    size = st.st_size;
+    void* p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (p != MAP_FAILED) {
+        base = (const uint8_t*)p;
+        /* replay walks the file front to back, over and over */
+        madvise(p, size, MADV_SEQUENTIAL);
+        madvise(p, size, MADV_WILLNEED);
+    }
+#endif
+    if (!base || !validate()) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void CorpusFile::close() {
+#ifdef _WIN32
+    if (base)
+        UnmapViewOfFile(base);
+    if (mapping)
+        CloseHandle(mapping);
+    if (file)
+        CloseHandle(file);
+    mapping = NULL;
+    file = NULL;
+#else
+    if (base)
+        munmap((void*)base, size);
+    if (fd >= 0)
+        ::close(fd);
+    fd = -1;
+#endif
+    base = NULL;
+    size = 0;
+}
+
+bool CorpusFile::validate() const {
+    if (size < sizeof(CorpusHeader))
+        return false;
+    const CorpusHeader* h = header();
+    if (h->magic != CORPUS_MAGIC || h->version != CORPUS_VERSION || !h->duration_ms)
+        return false;
+    if (align8(sizeof(CorpusHeader)) + align8(h->avcc_size) + align8(h->asc_size) > size)
+        return false;
+    if (h->index_offset % 8 || h->index_offset > size ||
+        (size - h->index_offset) / sizeof(CorpusPacket) < h->packet_count)
+        return false;
+    if (h->keyframe_offset % 4 || h->keyframe_offset > size ||
+        (size - h->keyframe_offset) / sizeof(uint32_t) < h->keyframe_count)
+        return false;
+    for (uint32_t i = 0; i < h->packet_count; i++) {
+        const CorpusPacket& pkt = packets()[i];
+        if (pkt.offset > size || size - pkt.offset < pkt.size)
+            return false;
+    }
+    for (uint32_t i = 0; i < h->keyframe_count; i++) {
+        if (keyframes()[i] >= h->packet_count)
+            return false;
+    }
+    return loops_cleanly(packets(), h->packet_count, h->duration_ms);
+}
@@ -0,0 +1,135 @@
+#ifndef WEBDRIVERTORSO_CORPUS_H
+#define WEBDRIVERTORSO_CORPUS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+
+/*
+ * Pre-encoded stream corpus written by "bake" and streamed by "replay".
+ *
+ * Layout (little endian, every section 8 byte aligned):
+ *   CorpusHeader
+ *   avcC sequence header          header.avcc_size bytes
+ *   AAC AudioSpecificConfig       header.asc_size bytes
+ *   packet payloads               AVCC video / raw AAC, in encoder output order
+ *   CorpusPacket[packet_count]    sorted by dts, audio before video on ties
+ *   uint32_t[keyframe_count]      indices of the video keyframes in the packet table
+ *
+ * Timestamps are in milliseconds from the start of the loop; a replay
+ * adds duration_ms for every completed loop. The first video packet is
+ * always a keyframe, so the loop restarts cleanly, and each stream's dts
+ * and video pts stay below duration_ms past the first packet's, so they
+ * keep increasing across the seam. Files that break that are refused.
+ */
+
+#define CORPUS_MAGIC 0x43544457 /* "WDTC" */
+#define CORPUS_VERSION 1
+
+enum CorpusPacketType {
+    CORPUS_PACKET_AUDIO = 0,
+    CORPUS_PACKET_VIDEO = 1,
+};
+
+#define CORPUS_FLAG_KEY 0x01
+
+struct CorpusHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t framerate;
+    uint32_t video_bitrate;
+    uint32_t sample_rate;
+    uint32_t channels;
+    uint32_t audio_bitrate;
+    uint32_t duration_ms;
+    uint32_t avcc_size;
+    uint32_t asc_size;
+    uint32_t packet_count;
+    uint32_t keyframe_count;
+    uint64_t index_offset;
+    uint64_t keyframe_offset;
+};
+
+struct CorpusPacket {
+    uint64_t offset;
+    uint32_t size;
+    int32_t dts_ms;
+    int32_t cts_ms;         ///< pts - dts
+    uint16_t duration_ms;
+    uint8_t type;           ///< CorpusPacketType
+    uint8_t flags;
+};
+
+static_assert(sizeof(CorpusHeader) == 72, "CorpusHeader layout");
+static_assert(sizeof(CorpusPacket) == 24, "CorpusPacket layout");
+
+class CorpusWriter {
+public:
+    ~CorpusWriter();
+
+    /* header carries the stream parameters; counts and offsets are filled in by finish() */
+    bool open(const char* path, const CorpusHeader& header,
+        const uint8_t* avcc, int avcc_size, const uint8_t* asc, int asc_size);
+    bool write_packet(CorpusPacketType type, int64_t dts_ms, int64_t pts_ms, int duration_ms,
+        bool key, const uint8_t* data, int size);
+    /* duration_ms is the loop length, which the baker knows only at the
+     * end. Fails as well when the timestamps would not increase across
+     * the loop seam. */
+    bool finish(uint32_t duration_ms);
+
+private:
+    bool write_aligned(const void* data, size_t size);
+
+    FILE* f = NULL;
+    CorpusHeader header;
+    uint64_t offset = 0;
+    std::vector<CorpusPacket> packets;
+};
+
+/* Read-only memory mapping of a corpus file. */
+class CorpusFile {
+public:
+    ~CorpusFile();
+
+    bool open(const char* path);
+    void close();
+
+    const CorpusHeader* header() const {
+        return (const CorpusHeader*)base;
+    }
+    const uint8_t* avcc() const {
+        return base + align8(sizeof(CorpusHeader));
+    }
+    const uint8_t* asc() const {
+        return avcc() + align8(header()->avcc_size);
+    }
+    const CorpusPacket* packets() const {
+        return (const CorpusPacket*)(base + header()->index_offset);
+    }
+    const uint32_t* keyframes() const {
+        return (const uint32_t*)(base + header()->keyframe_offset);
+    }
+    const uint8_t* payload(const CorpusPacket& pkt) const {
+        return base + pkt.offset;
+    }
+
+    static uint64_t align8(uint64_t v) {
+        return (v + 7) & ~(uint64_t)7;
+    }
+
+private:
+    bool validate() const;
+
+    const uint8_t* base = NULL;
+    uint64_t size = 0;
+#ifdef _WIN32
+    void* file = NULL;
+    void* mapping = NULL;
+#else
+    int fd = -1;
+#endif
+};
+
+#endif /* WEBDRIVERTORSO_CORPUS_H */
@@ -0,0 +1,113 @@
+/*
+ * Runtime CPU feature detection, and the CPU time of the process
+ */
+
+#include <string.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include "cpu.h"
+
+#if HAVE_X86 && !defined(_MSC_VER)
+#include <cpuid.h>
+#endif
+
+#if HAVE_X86 && defined(_MSC_VER)
+#include <intrin.h>
+#include <immintrin.h>
+
+static int have_avx(void)
+{
+    int info[4];
+    __cpuid(info, 1);
+    /* OSXSAVE and AVX, then the OS must save the YMM state */
+    return (info[2] & (1 << 27 | 1 << 28)) == (1 << 27 | 1 << 28) && (_xgetbv(0) & 6) == 6;
+}
+#endif
+
+int cpu_has_avx2(void)
+{
+#if !HAVE_X86
+    return 0;
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7 || !have_avx())
+        return 0;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+int cpu_has_avx2_fma(void)
+{
+#if !HAVE_X86
+    return 0;
+#elif defined(_MSC_VER)
+    int info[4];
+    if (!cpu_has_avx2())
+        return 0;
+    __cpuid(info, 1);
+    return (info[2] & (1 << 12)) != 0;
+#else
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+}
+
+void cpu_name(char *name, int size)
+{
+    char brand[49] = { 0 };
+    const char *p = brand;
+#if HAVE_X86
+    unsigned int regs[12];
+    int i;
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0x80000000);
+    if ((unsigned int)info[0] >= 0x80000004) {
+        for (i = 0; i < 3; i++)
+            __cpuid((int *)regs + 4 * i, 0x80000002 + i);
+        memcpy(brand, regs, 48);
+    }
+#else
+    if (__get_cpuid_max(0x80000000, NULL) >= 0x80000004) {
+        for (i = 0; i < 3; i++)
+            __get_cpuid(0x80000002 + i, &regs[4 * i], &regs[4 * i + 1], &regs[4 * i + 2], &regs[4 * i + 3]);
+        memcpy(brand, regs, 48);
+    }
+#endif
+#endif
+    /* some vendors pad it in front */
+    while (*p == ' ')
+        p++;
+    name[0] = 0;
+    strncat(name, p, size - 1);
+}
+
+int64_t cpu_process_time_us(void)
+{
+#ifdef _WIN32
+    FILETIME creation, exit, kernel, user;
+    ULARGE_INTEGER k, u;
+    if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+        return 0;
+    k.LowPart = kernel.dwLowDateTime;
+    k.HighPart = kernel.dwHighDateTime;
+    u.LowPart = user.dwLowDateTime;
+    u.HighPart = user.dwHighDateTime;
+    /* 100 ns units */
+    return (int64_t)((k.QuadPart + u.QuadPart) / 10);
+#else
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) < 0)
+        return 0;
+    return (int64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+#endif
+}
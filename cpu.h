@@ -0,0 +1,51 @@
+/*
+ * Runtime CPU feature detection, and the CPU time of the process
+ */
+
+#ifndef WEBDRIVERTORSO_CPU_H
+#define WEBDRIVERTORSO_CPU_H
+
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define HAVE_X86 1
+#ifdef _MSC_VER
+#define TARGET_AVX2
+#define TARGET_AVX2_FMA
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX2_FMA __attribute__((target("avx2,fma")))
+#endif
+#else
+#define HAVE_X86 0
+#endif
+
+/* NEON is part of every AArch64 CPU, no runtime check needed */
+#if defined(__aarch64__) || defined(_M_ARM64)
+#define HAVE_NEON 1
+#else
+#define HAVE_NEON 0
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* AVX2 is usable: supported by the CPU and the YMM state saved by the OS. */
+int cpu_has_avx2(void);
+
+/* AVX2 and FMA3 are both usable. */
+int cpu_has_avx2_fma(void);
+
+/* The brand string of the CPU, such as "AMD Ryzen 9 7950X 16-Core
+ * Processor", or "" where there is none. size of at least 49 holds all. */
+void cpu_name(char *name, int size);
+
+/* User and system time of every thread of the process so far. */
+int64_t cpu_process_time_us(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* WEBDRIVERTORSO_CPU_H */
@@ -0,0 +1,163 @@
+#include <float.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <thread>
+#include "cpu.h"
+#include "encoder_tune.h"
+
+using namespace std;
+
+/* fastest first */
+static const char* presets[] = { "ultrafast", "superfast", "veryfast", "faster", "fast", "medium", "slow" };
+
+/* The GOP and B frames stay as configured. */
+static EncoderSettings variant(const EncoderSettings& base, const char* preset, bool slice_threads) {
+    EncoderSettings s = base;
+    s.slices = 0;
+    s.preset = preset;
+    s.tune = slice_threads ? "stillimage,zerolatency" : "stillimage";
+    s.thread_type = slice_threads ? FF_THREAD_SLICE : FF_THREAD_FRAME;
+    return s;
+}
+
+static const char* thread_type_name(int thread_type) {
+    return thread_type == FF_THREAD_SLICE ? "slice" : thread_type == FF_THREAD_FRAME ? "frame" : "default";
+}
+
+/* The messages are thrown away. */
+static void encode_frames(TorsoChannel& channel, uint64_t frames) {
+    while (channel.stage_times().video_frames < frames) {
+        channel.produce();
+        bool key;
+        while (channel.next_due_ms() != INT64_MAX)
+            channel.pop_message(key);
+    }
+}
+
+static double cpu_ms_per_frame(const ChannelOptions& options, const EncoderSettings& settings) {
+    ChannelConfig config;
+    config.options = options;
+    config.options.encoder = settings;
+    config.seed = 1;
+    TorsoChannel channel(config);
+    channel.init();
+
+    encode_frames(channel, TUNE_WARMUP_FRAMES);
+    uint64_t start_frames = channel.stage_times().video_frames;
+    int64_t start_us = cpu_process_time_us();
+    encode_frames(channel, TUNE_WARMUP_FRAMES + TUNE_FRAMES);
+    uint64_t frames = channel.stage_times().video_frames - start_frames;
+    return (cpu_process_time_us() - start_us) / 1000.0 / frames;
+}
+
+/* No tabs, they separate the fields of the cache file. */
+static string cache_key(const ChannelOptions& options, double budget_ms) {
+    char cpu[64];
+    cpu_name(cpu, sizeof(cpu));
+    char key[256];
+    snprintf(key, sizeof(key), "%s, %u cores, libavcodec %u, %dx%d, %d encoder threads, gop %d, %d B frames,%s%s%s %.2f ms",
+        cpu[0] ? cpu : "unknown CPU", std::thread::hardware_concurrency(), avcodec_version(),
+        options.width, options.height, options.encoder_threads, options.encoder.gop_size, options.encoder.max_b_frames,
+        options.skip_static_frames ? " skip-static," : "", options.cache_audio ? " cache-audio," : "",
+        options.abr ? " abr," : "", budget_ms);
+    return key;
+}
+
+/* The last line for the key wins; only what calibration picks is overwritten. */
+static bool read_cache(const string& path, const string& key, EncoderSettings& settings, double& cpu_ms) {
+    FILE* f = fopen(path.c_str(), "r");
+    if (!f)
+        return false;
+    bool found = false;
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        char* tab = strchr(line, '\t');
+        if (line[0] == '#' || !tab)
+            continue;
+        *tab = 0;
+        if (key != line)
+            continue;
+        char preset[32];
+        char tune[64];
+        int thread_type;
+        int slices;
+        double ms;
+        if (sscanf(tab + 1, "%31s %63s %d %d %lf", preset, tune, &thread_type, &slices, &ms) != 5)
+            continue;
+        settings.preset = preset;
+        settings.tune = strcmp(tune, "-") ? tune : "";
+        settings.thread_type = thread_type;
+        settings.slices = slices;
+        cpu_ms = ms;
+        found = true;
+    }
+    fclose(f);
+    return found;
+}
+
+static void write_cache(const string& path, const string& key, const EncoderSettings& settings, double cpu_ms) {
+    FILE* f = fopen(path.c_str(), "a");
+    if (!f) {
+        fprintf(stderr, "Could not write %s, the next start calibrates again\n", path.c_str());
+        return;
+    }
+    fseek(f, 0, SEEK_END);
+    if (ftell(f) == 0)
+        fprintf(f, "# encoder settings per host and budget: key, preset, tune, thread_type, slices, CPU ms per frame\n");
+    fprintf(f, "%s\t%s\t%s\t%d\t%d\t%.2f\n", key.c_str(), settings.preset.c_str(),
+        settings.tune.empty() ? "-" : settings.tune.c_str(), settings.thread_type, settings.slices, cpu_ms);
+    fclose(f);
+}
+
+static void print_settings(const char* prefix, const EncoderSettings& settings, double cpu_ms) {
+    printf("%s%s, tune %s, %s threads: %.1f ms CPU per frame\n", prefix, settings.preset.c_str(),
+        settings.tune.empty() ? "none" : settings.tune.c_str(), thread_type_name(settings.thread_type), cpu_ms);
+    fflush(stdout);
+}
+
+EncoderSettings auto_tune_encoder(const ChannelOptions& options, double budget_ms, const string& cache_path) {
+    string key = cache_key(options, budget_ms);
+    EncoderSettings best = options.encoder;
+    double best_ms = 0;
+    if (read_cache(cache_path, key, best, best_ms)) {
+        print_settings("Encoder from the calibration cache: ", best, best_ms);
+        return best;
+    }
+
+    printf("Calibrating the encoder for %.1f ms CPU per frame on %s\n", budget_ms, key.c_str());
+    bool found = false;
+    EncoderSettings cheapest;
+    double cheapest_ms = DBL_MAX;
+    for (size_t i = 0; i < sizeof(presets) / sizeof(presets[0]); i++) {
+        bool fits = false;
+        /* the worse variant first, a fitting one after it is better */
+        for (int slice_threads = 1; slice_threads >= 0; slice_threads--) {
+            EncoderSettings settings = variant(options.encoder, presets[i], slice_threads != 0);
+            double ms = cpu_ms_per_frame(options, settings);
+            print_settings("  ", settings, ms);
+            if (ms < cheapest_ms) {
+                cheapest = settings;
+                cheapest_ms = ms;
+            }
+            if (ms <= budget_ms) {
+                best = settings;
+                best_ms = ms;
+                found = fits = true;
+            }
+        }
+        /* slower presets cost more still */
+        if (!fits)
+            break;
+    }
+    if (!found) {
+        fprintf(stderr, "Nothing fits in %.1f ms CPU per frame, taking the cheapest\n", budget_ms);
+        best = cheapest;
+        best_ms = cheapest_ms;
+    }
+
+    write_cache(cache_path, key, best, best_ms);
+    print_settings("Encoder: ", best, best_ms);
+    return best;
+}
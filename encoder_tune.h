@@ -0,0 +1,35 @@
+#ifndef WEBDRIVERTORSO_ENCODER_TUNE_H
+#define WEBDRIVERTORSO_ENCODER_TUNE_H
+
+#include <string>
+#include "torso_channel.h"
+
+/* video frames encoded before the CPU time is measured, to fill the lookahead */
+#define TUNE_WARMUP_FRAMES 25
+/* video frames measured, four scenes */
+#define TUNE_FRAMES 100
+
+/*
+ * The x264 settings with the best picture that fit a budget of CPU time
+ * per video frame on this host, for one stream. 40 ms per frame at 25
+ * fps is one core. The GOP and B frames stay as options.encoder has
+ * them; the preset, tune and threading are picked.
+ *
+ * Calibration encodes generated scenes with every preset from ultrafast
+ * up, each in two variants: frame threads with tune stillimage (the
+ * scenes are still between cuts), and slice threads with stillimage and
+ * zerolatency, which costs some compression for a frame less of delay
+ * per thread; x264 cuts as many slices as it has threads. A channel runs
+ * the candidate through produce() on this thread, so the process CPU
+ * time per video frame is what a stream costs: render, audio and the
+ * encoder threads. Better means a slower preset, then frame threads.
+ * Calibration stops at the first preset that fits in neither variant.
+ *
+ * The result is kept in cache_path, one line per host and setup: the
+ * CPU, the core count, the libavcodec version, the channel options that
+ * change the cost and the budget. A later start with the same key reads
+ * it back instead of calibrating again.
+ */
+EncoderSettings auto_tune_encoder(const ChannelOptions& options, double budget_ms, const std::string& cache_path);
+
+#endif /* WEBDRIVERTORSO_ENCODER_TUNE_H */
@@ -0,0 +1,322 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include "fanout.h"
+#include "rtmp_proto.h"
+
+Destination::Destination(const RtmpUrl& url, const SendQueueOptions& options, SendLoop& loop)
+    : url(url), options(options), loop(loop), queue(options.capacity) {
+}
+
+Destination::~Destination() {
+    stop();
+}
+
+static int64_t steady_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Destination::start(const RtmpStreamInfo& info, const std::vector<SharedMessage>& headers) {
+    this->info = info;
+    this->headers = headers;
+    if (!publisher.connect(url, steady_us() / 1000)) {
+        failed = true;
+        return;
+    }
+    started = true;
+    loop.add(this);
+}
+
+void Destination::stop() {
+    stopping = true;
+    if (!started)
+        return;
+    loop.wake();
+    while (!exited.load())
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+}
+
+void Destination::disconnect() {
+    failed = true;
+    stopping = true;
+    loop.wake();
+}
+
+void Destination::update_metadata(const RtmpStreamInfo& info) {
+    if (failed.load(std::memory_order_relaxed))
+        return;
+    pending_metadata = std::make_shared<RtmpStreamInfo>(info);
+    push_metadata();
+}
+
+void Destination::push_metadata() {
+    Outgoing out;
+    out.metadata = pending_metadata;
+    out.timestamp = newest_ms;
+    if (queue.try_push(out)) {
+        pending_metadata.reset();
+        loop.wake();
+    }
+}
+
+void Destination::publish(const SharedMessage& msg, bool key) {
+    if (failed.load(std::memory_order_relaxed))
+        return;
+
+    if (pending_metadata)
+        push_metadata();
+    newest_ms = msg->timestamp;
+    if (first_ms < 0)
+        first_ms = newest_ms;
+    size_t bytes = queued_bytes.load(std::memory_order_relaxed);
+    int64_t ms = queued_ms();
+    if (!congested && (bytes > options.high_bytes || ms > options.high_ms)) {
+        congested = true;
+        congestions++;
+    }
+    else if (congested && bytes <= options.low_bytes && ms <= options.low_ms)
+        congested = false;
+
+    if (dropping) {
+        /* start over on a keyframe, once the backlog is half gone */
+        if (!key || queue.depth() > queue.capacity() / 2) {
+            dropped.store(dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return;
+        }
+        dropping = false;
+    }
+
+    Outgoing out;
+    out.msg = msg;
+    out.timestamp = msg->timestamp;
+    size_t size = message_size(*msg);
+    /* counted before the push, the send loop may take it off right away */
+    queued_bytes.fetch_add(size, std::memory_order_relaxed);
+    if (queue.try_push(out)) {
+        loop.wake();
+        return;
+    }
+    queued_bytes.fetch_sub(size, std::memory_order_relaxed);
+
+    if (options.policy == SLOW_CONSUMER_DISCONNECT) {
+        fprintf(stderr, "%s/%s: send queue full, disconnecting\n", url.host.c_str(), url.app.c_str());
+        disconnect();
+        return;
+    }
+    dropping = true;
+    dropped.store(dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+int64_t Destination::queued_ms() const {
+    if (!queued_bytes.load(std::memory_order_relaxed))
+        return 0;
+    int64_t sending = sending_ms.load(std::memory_order_relaxed);
+    return newest_ms - (sending == INT64_MIN ? first_ms : sending);
+}
+
+Backpressure Destination::backpressure() const {
+    if (!alive())
+        return BACKPRESSURE_NONE;
+    if (dropping)
+        return BACKPRESSURE_RESYNC;
+    return congested ? BACKPRESSURE_SHED : BACKPRESSURE_NONE;
+}
+
+LinkSample Destination::sample() const {
+    LinkSample link;
+    link.alive = alive();
+    link.sent_bytes = sent_bytes.load(std::memory_order_relaxed);
+    link.queued_ms = queued_ms();
+    return link;
+}
+
+int64_t Destination::deadline_ms() const {
+    return std::min(publisher.deadline_ms(), stop_deadline_ms);
+}
+
+bool Destination::turn(bool readable, bool writable, int64_t now_us) {
+    int64_t now_ms = now_us / 1000;
+    /* a failed one has nothing left worth sending */
+    if (stopping.load(std::memory_order_relaxed) && stop_deadline_ms == INT64_MAX)
+        stop_deadline_ms = now_ms + (failed.load() ? 0 : STOP_GRACE_MS);
+
+    bool ok = !failed.load(std::memory_order_relaxed);
+    if (ok && readable)
+        ok = publisher.read();
+    if (ok && writable)
+        ok = publisher.write();
+    if (ok)
+        ok = publisher.check_deadline(now_ms);
+    if (ok && publisher.state() == PUBLISHER_STREAMING)
+        ok = send_queued(now_us);
+    /* the publisher printed why, unless the producer disconnected it */
+    if (!ok) {
+        failed = true;
+        publisher.close();
+        return false;
+    }
+
+    /* the message in flight gets until the deadline, what is still queued is left */
+    if (stopping.load(std::memory_order_relaxed) &&
+        (publisher.state() != PUBLISHER_STREAMING || publisher.idle() || now_ms >= stop_deadline_ms)) {
+        publisher.close();
+        return false;
+    }
+    return true;
+}
+
+bool Destination::send_queued(int64_t now_us) {
+    if (!headers_sent) {
+        publisher.send_metadata(info, 0);
+        for (size_t i = 0; i < headers.size(); i++)
+            publisher.send_media(headers[i]->type, headers[i]->timestamp, headers[i]->body.data(),
+                headers[i]->body.size());
+        headers_sent = true;
+        if (!publisher.write())
+            return false;
+    }
+
+    while (publisher.idle()) {
+        if (sending) {
+            int64_t send_us = now_us - send_start_us;
+            send_latency.record(send_us);
+            if (send_us > SEND_STALL_US)
+                stalls.fetch_add(1, std::memory_order_relaxed);
+            if (send_us > longest_send_us.load(std::memory_order_relaxed))
+                longest_send_us.store(send_us, std::memory_order_relaxed);
+            if (current.msg) {
+                size_t size = message_size(*current.msg);
+                queued_bytes.fetch_sub(size, std::memory_order_relaxed);
+                sent_bytes.fetch_add(size, std::memory_order_relaxed);
+                sent.fetch_add(1, std::memory_order_relaxed);
+            }
+            current = Outgoing();
+            sending = false;
+        }
+        if (stopping.load(std::memory_order_relaxed))
+            return true;
+        if (!queue.try_pop(current)) {
+            if (idle_since_us < 0)
+                idle_since_us = now_us;
+            return true;
+        }
+        if (idle_since_us >= 0) {
+            idle_us.fetch_add(now_us - idle_since_us, std::memory_order_relaxed);
+            idle_since_us = -1;
+        }
+
+        sending = true;
+        send_start_us = now_us;
+        sending_ms.store(current.timestamp, std::memory_order_relaxed);
+        if (current.metadata)
+            publisher.send_metadata(*current.metadata, (uint32_t)current.timestamp);
+        else
+            publisher.send_media(current.msg->type, current.msg->timestamp, current.msg->body.data(),
+                current.msg->body.size());
+        if (!publisher.write())
+            return false;
+    }
+    return true;
+}
+
+void Destination::print_stats() const {
+    printf("  %s/%s: %s, sent %llu, dropped %llu, queue %zu/%zu %zu KB %lld ms, congested %llu times, "
+        "%llu send stalls (longest %lld ms), idle %lld ms\n",
+        url.host.c_str(), url.app.c_str(), alive() ? "up" : "down",
+        (unsigned long long)sent.load(std::memory_order_relaxed),
+        (unsigned long long)dropped.load(std::memory_order_relaxed),
+        queue.depth(), queue.capacity(), queued_bytes.load(std::memory_order_relaxed) / 1024,
+        (long long)queued_ms(), (unsigned long long)congestions,
+        (unsigned long long)stalls.load(std::memory_order_relaxed),
+        (long long)(longest_send_us.load(std::memory_order_relaxed) / 1000),
+        (long long)(idle_us.load(std::memory_order_relaxed) / 1000));
+}
+
+/* Never the key, the label is the host and the app. */
+void Destination::write_metrics(MetricsWriter& w) const {
+    std::string output = metric_label("output", url.host + "/" + url.app);
+    w.gauge("webdrivertorso_output_up", "Whether the output is still up.", output, alive());
+    w.counter("webdrivertorso_output_messages_total", "Messages sent or written.", output,
+        sent.load(std::memory_order_relaxed));
+    w.counter("webdrivertorso_output_bytes_total", "Bytes sent or written.", output,
+        sent_bytes.load(std::memory_order_relaxed));
+    w.counter("webdrivertorso_dropped_messages_total", "Messages a full send queue dropped.", output,
+        dropped.load(std::memory_order_relaxed));
+    w.gauge("webdrivertorso_send_queue_messages", "Messages queued for the output.", output, (double)queue.depth());
+    w.gauge("webdrivertorso_send_queue_bytes", "Bytes queued for a destination.", output,
+        (double)queued_bytes.load(std::memory_order_relaxed));
+    w.counter("webdrivertorso_send_stalls_total", "Sends that took longer than 100 ms.", output,
+        stalls.load(std::memory_order_relaxed));
+    LatencySnapshot s;
+    s.add(send_latency);
+    w.histogram("webdrivertorso_rtmp_send_seconds", "Time to send one message to the destination socket.", output, s);
+}
+
+void Destination::add_totals(uint64_t& messages, uint64_t& bytes, LatencySnapshot& send) const {
+    messages += sent.load(std::memory_order_relaxed);
+    bytes += sent_bytes.load(std::memory_order_relaxed);
+    send.add(send_latency);
+}
+
+void FanOut::add(std::unique_ptr<PacketSink> sink) {
+    sinks.push_back(std::move(sink));
+}
+
+void FanOut::start(const RtmpStreamInfo& info, const std::vector<SharedMessage>& headers) {
+    for (size_t i = 0; i < sinks.size(); i++)
+        sinks[i]->start(info, headers);
+}
+
+void FanOut::stop() {
+    for (size_t i = 0; i < sinks.size(); i++)
+        sinks[i]->stop();
+}
+
+void FanOut::publish(const SharedMessage& msg, bool key) {
+    for (size_t i = 0; i < sinks.size(); i++)
+        sinks[i]->publish(msg, key);
+}
+
+void FanOut::update_metadata(const RtmpStreamInfo& info) {
+    for (size_t i = 0; i < sinks.size(); i++)
+        sinks[i]->update_metadata(info);
+}
+
+bool FanOut::alive() const {
+    for (size_t i = 0; i < sinks.size(); i++) {
+        if (sinks[i]->alive())
+            return true;
+    }
+    return false;
+}
+
+Backpressure FanOut::backpressure() const {
+    Backpressure worst = BACKPRESSURE_NONE;
+    for (size_t i = 0; i < sinks.size(); i++) {
+        Backpressure b = sinks[i]->backpressure();
+        if (b > worst)
+            worst = b;
+    }
+    return worst;
+}
+
+void FanOut::sample_links(std::vector<LinkSample>& links) const {
+    links.resize(sinks.size());
+    for (size_t i = 0; i < sinks.size(); i++)
+        links[i] = sinks[i]->sample();
+}
+
+void FanOut::print_stats() const {
+    for (size_t i = 0; i < sinks.size(); i++)
+        sinks[i]->print_stats();
+}
+
+void FanOut::write_metrics(MetricsWriter& w) const {
+    for (size_t i = 0; i < sinks.size(); i++)
+        sinks[i]->write_metrics(w);
+}
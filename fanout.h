@@ -0,0 +1,184 @@
+#ifndef WEBDRIVERTORSO_FANOUT_H
+#define WEBDRIVERTORSO_FANOUT_H
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include "packet_sink.h"
+#include "rtmp_publisher.h"
+#include "send_loop.h"
+#include "spsc_queue.h"
+
+/*
+ * One encode, many sinks (see packet_sink.h), most of them RTMP
+ * destinations. Every message is built once and queued by reference to
+ * each destination; a destination has its own connection and bounded
+ * queue, and the send loop (see send_loop.h) never waits on one socket,
+ * so a slow or dead endpoint only ever holds up itself.
+ *
+ * Publishing never blocks, so a stalled uplink cannot stop the encoders.
+ * Instead each destination reports backpressure from what it has queued:
+ * above the high watermark (in bytes or in milliseconds of stream) it
+ * asks the encoder side to shed frames nothing references (a stream
+ * without B frames has none and skips video up to an IDR instead), until
+ * it is back below the low watermark; once its queue is full and it
+ * drops, it asks for an IDR to pick the stream up again.
+ */
+
+/* What a destination does when its queue is full. */
+enum SlowConsumerPolicy {
+    SLOW_CONSUMER_DROP,         ///< drop everything up to the next video keyframe
+    SLOW_CONSUMER_DISCONNECT,   ///< close the connection, the others go on
+};
+
+struct SendQueueOptions {
+    /* about four seconds of 25 fps video with 44.1 kHz AAC */
+    size_t capacity = 256;
+    SlowConsumerPolicy policy = SLOW_CONSUMER_DROP;
+    /* shedding starts above either high watermark and ends below both low ones */
+    size_t high_bytes = 1024 * 1024;
+    int64_t high_ms = 1000;
+    size_t low_bytes = 256 * 1024;
+    int64_t low_ms = 250;
+};
+
+/* a message taking longer than this to go out is reported as a stall */
+#define SEND_STALL_US 100000
+/* how long stop() lets a message in flight finish before closing */
+#define STOP_GRACE_MS 1000
+
+/*
+ * The RTMP sink, publishing with RtmpPublisher on the send loop's thread.
+ * A metadata update is queued with the messages and goes out in order
+ * with them as another @setDataFrame onMetaData.
+ */
+class Destination : public PacketSink {
+public:
+    Destination(const RtmpUrl& url, const SendQueueOptions& options, SendLoop& loop);
+    ~Destination();
+
+    Destination(const Destination&) = delete;
+    Destination& operator=(const Destination&) = delete;
+
+    /* Resolves the host and starts connecting; the send loop publishes,
+     * then sends the stream info and the sequence headers ahead of
+     * everything published. */
+    void start(const RtmpStreamInfo& info, const std::vector<SharedMessage>& headers) override;
+    void stop() override;
+
+    /* Never blocks. A destination that dropped picks the stream up again
+     * at a keyframe. */
+    void publish(const SharedMessage& msg, bool key) override;
+    /* Never dropped: with the queue full, it waits for the next publish(). */
+    void update_metadata(const RtmpStreamInfo& info) override;
+
+    bool alive() const override {
+        return !failed.load(std::memory_order_relaxed);
+    }
+
+    Backpressure backpressure() const override;
+    LinkSample sample() const override;
+
+    void print_stats() const override;
+    void write_metrics(MetricsWriter& w) const override;
+    /* for a runner that exports many destinations added up */
+    void add_totals(uint64_t& messages, uint64_t& bytes, LatencySnapshot& send) const;
+
+private:
+    friend class SendLoop;
+
+    /* A message, or a metadata update if msg is null. */
+    struct Outgoing {
+        SharedMessage msg;
+        std::shared_ptr<const RtmpStreamInfo> metadata;
+        int64_t timestamp = 0;
+    };
+
+    /* On the send loop's thread, with what poll() reported for the socket.
+     * Returns false once the destination is done, stopped or failed; the
+     * socket is closed then. */
+    bool turn(bool readable, bool writable, int64_t now_us);
+    /* Takes the next message off the queue whenever the last one is out. */
+    bool send_queued(int64_t now_us);
+    /* when the send loop has to run a turn at the latest */
+    int64_t deadline_ms() const;
+    void push_metadata();
+    /* Marks the destination failed, the send loop closes it. */
+    void disconnect();
+    /* milliseconds of stream between the message being sent and the newest one queued */
+    int64_t queued_ms() const;
+
+    RtmpUrl url;
+    SendQueueOptions options;
+    SendLoop& loop;
+    SPSCQueue<Outgoing> queue;
+    /* added to the send loop */
+    bool started = false;
+    std::atomic<bool> stopping{ false };
+    std::atomic<bool> failed{ false };
+    /* set by the send loop once it has let go of the destination */
+    std::atomic<bool> exited{ false };
+    std::atomic<uint64_t> sent{ 0 };
+    std::atomic<uint64_t> sent_bytes{ 0 };
+
+    /* added by the producer, taken off by the send loop once sent */
+    std::atomic<size_t> queued_bytes{ 0 };
+    /* timestamp of the message being sent, INT64_MIN before the first */
+    std::atomic<int64_t> sending_ms{ INT64_MIN };
+    std::atomic<uint64_t> stalls{ 0 };
+    std::atomic<int64_t> longest_send_us{ 0 };
+    /* with nothing to send */
+    std::atomic<int64_t> idle_us{ 0 };
+    /* one message, from its first byte written until the socket took the last */
+    LatencyHistogram send_latency;
+
+    /* send loop side, set up by start() */
+    RtmpPublisher publisher;
+    RtmpStreamInfo info;
+    std::vector<SharedMessage> headers;
+    bool headers_sent = false;
+    /* the message being written, the publisher sends its body from it */
+    Outgoing current;
+    bool sending = false;
+    int64_t send_start_us = 0;
+    int64_t idle_since_us = -1;
+    int64_t stop_deadline_ms = INT64_MAX;
+
+    /* producer side only */
+    std::shared_ptr<const RtmpStreamInfo> pending_metadata;
+    bool dropping = false;
+    bool congested = false;
+    /* atomic for the metrics export only */
+    std::atomic<uint64_t> dropped{ 0 };
+    uint64_t congestions = 0;
+    int64_t first_ms = -1;
+    int64_t newest_ms = 0;
+};
+
+class FanOut {
+public:
+    void add(std::unique_ptr<PacketSink> sink);
+    void start(const RtmpStreamInfo& info, const std::vector<SharedMessage>& headers);
+    void stop();
+
+    void publish(const SharedMessage& msg, bool key);
+    void update_metadata(const RtmpStreamInfo& info);
+
+    /* false once every sink has failed */
+    bool alive() const;
+
+    /* the worst of the sinks still alive */
+    Backpressure backpressure() const;
+
+    /* One sample per sink, in the order they were added. */
+    void sample_links(std::vector<LinkSample>& links) const;
+
+    void print_stats() const;
+    void write_metrics(MetricsWriter& w) const;
+
+private:
+    std::vector<std::unique_ptr<PacketSink> > sinks;
+};
+
+#endif /* WEBDRIVERTORSO_FANOUT_H */
@@ -0,0 +1,22 @@
+/*
+ * Solid colour fills of 8-bit planes
+ */
+
+#include <string.h>
+#include "fill.h"
+
+void fill_block(uint8_t *dst, ptrdiff_t linesize, int width, int height, uint8_t value)
+{
+    for (int y = 0; y < height; y++, dst += linesize)
+        memset(dst, value, width);
+}
+
+void fill_plane(uint8_t *dst, ptrdiff_t linesize, int width, int height, uint8_t value)
+{
+    if (linesize == width) {
+        /* padding included, so the plane is one span */
+        memset(dst, value, (size_t)width * height);
+    } else {
+        fill_block(dst, linesize, width, height, value);
+    }
+}
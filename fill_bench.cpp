@@ -0,0 +1,126 @@
+/*
+ * Compares fill.c against the memset loops generate_video_frame used
+ * before, on YUV420P planes at 1080p, 4K and 8K. fill.c is memset too
+ * now; rerun this before putting SIMD kernels back.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <vector>
+#include "fill.h"
+
+using namespace std;
+
+struct Plane {
+    std::vector<uint8_t> storage;
+    uint8_t* data;
+    int linesize;
+    int height;
+
+    Plane(int width, int h) {
+        /* same alignment and padding as av_frame_get_buffer */
+        linesize = (width + 63) & ~63;
+        height = h;
+        storage.resize(linesize * height + 64);
+        data = (uint8_t*)(((uintptr_t)storage.data() + 63) & ~(uintptr_t)63);
+    }
+};
+
+struct Frame {
+    Plane y, u, v;
+    Frame(int width, int height) : y(width, height), u(width / 2, height / 2), v(width / 2, height / 2) {
+    }
+};
+
+struct Rect {
+    int x, y, width, height;
+};
+
+void clean_frame_memset(Frame& f) {
+    memset(f.y.data, 255, f.y.linesize * f.y.height);
+    memset(f.u.data, 128, f.u.linesize * f.u.height);
+    memset(f.v.data, 128, f.v.linesize * f.v.height);
+}
+
+void draw_rect_memset(Frame& f, Rect rect, uint8_t Y, uint8_t U, uint8_t V) {
+    for (int y = rect.y; y < rect.y + rect.height; y++, y++) {
+        memset(f.y.data + f.y.linesize * (y)+rect.x, Y, rect.width);
+        memset(f.y.data + f.y.linesize * (y + 1) + rect.x, Y, rect.width);
+        memset(f.u.data + (f.u.linesize * (y / 2)) + rect.x / 2, U, rect.width / 2);
+        memset(f.v.data + f.v.linesize * (y / 2) + rect.x / 2, V, rect.width / 2);
+    }
+}
+
+void clean_frame_fill(Frame& f) {
+    fill_plane(f.y.data, f.y.linesize, f.y.linesize, f.y.height, 255);
+    fill_plane(f.u.data, f.u.linesize, f.u.linesize, f.u.height, 128);
+    fill_plane(f.v.data, f.v.linesize, f.v.linesize, f.v.height, 128);
+}
+
+void draw_rect_fill(Frame& f, Rect rect, uint8_t Y, uint8_t U, uint8_t V) {
+    fill_block(f.y.data + f.y.linesize * rect.y + rect.x, f.y.linesize, rect.width, rect.height, Y);
+    fill_block(f.u.data + f.u.linesize * (rect.y / 2) + rect.x / 2, f.u.linesize, rect.width / 2, rect.height / 2, U);
+    fill_block(f.v.data + f.v.linesize * (rect.y / 2) + rect.x / 2, f.v.linesize, rect.width / 2, rect.height / 2, V);
+}
+
+/* the same distribution as TorsoChannel::generate_rect */
+Rect random_rect(int width, int height) {
+    int minWidth = height / 10;
+    int maxWidth = height / 2;
+    Rect r;
+    r.width = (rand() % (maxWidth - minWidth) + minWidth) & ~1;
+    r.height = (rand() % (maxWidth - minWidth) + minWidth) & ~1;
+    r.x = (rand() % (width - r.width)) & ~1;
+    r.y = (rand() % (height - r.height)) & ~1;
+    return r;
+}
+
+template <typename F>
+double time_us(int iterations, F f) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++)
+        f(i);
+    return chrono::duration<double, micro>(chrono::steady_clock::now() - start).count() / iterations;
+}
+
+void bench(const char* name, int width, int height, int iterations) {
+    Frame a(width, height);
+    Frame b(width, height);
+    std::vector<Rect> rects;
+    for (int i = 0; i < 2 * iterations; i++)
+        rects.push_back(random_rect(width, height));
+
+    double clear_memset = time_us(iterations, [&](int) { clean_frame_memset(a); });
+    double clear_fill = time_us(iterations, [&](int) { clean_frame_fill(b); });
+    double rects_memset = time_us(iterations, [&](int i) {
+        draw_rect_memset(a, rects[2 * i], 41, 240, 110);
+        draw_rect_memset(a, rects[2 * i + 1], 63, 102, 240);
+    });
+    double rects_fill = time_us(iterations, [&](int i) {
+        draw_rect_fill(b, rects[2 * i], 41, 240, 110);
+        draw_rect_fill(b, rects[2 * i + 1], 63, 102, 240);
+    });
+
+    bool same = memcmp(a.y.data, b.y.data, a.y.linesize * a.y.height) == 0 &&
+        memcmp(a.u.data, b.u.data, a.u.linesize * a.u.height) == 0 &&
+        memcmp(a.v.data, b.v.data, a.v.linesize * a.v.height) == 0;
+
+    double frame_bytes = a.y.linesize * a.y.height + 2.0 * a.u.linesize * a.u.height;
+    printf("%-6s %5dx%-5d clear: memset %8.1f us, fill %8.1f us (%5.1f GB/s)  rects: memset %8.1f us, fill %8.1f us  %s\n",
+        name, width, height, clear_memset, clear_fill, frame_bytes / clear_fill / 1000,
+        rects_memset, rects_fill, same ? "ok" : "MISMATCH");
+}
+
+int main(int argc, char* argv[]) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 200;
+    if (iterations <= 0)
+        iterations = 200;
+    srand(1);
+    bench("1080p", 1920, 1080, iterations);
+    bench("4K", 3840, 2160, iterations);
+    bench("8K", 7680, 4320, iterations);
+    return 0;
+}
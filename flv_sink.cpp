@@ -0,0 +1,297 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+/* no writev, the batch is gathered into one buffer instead */
+struct iovec {
+    void* iov_base;
+    size_t iov_len;
+};
+#else
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#endif
+
+#include "flv_sink.h"
+#include "rtmp_proto.h"
+
+using namespace std;
+
+enum {
+    FLV_TAG_AUDIO = 8,
+    FLV_TAG_VIDEO = 9,
+    FLV_TAG_SCRIPT = 18,
+};
+
+static void put_be24(uint8_t* p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 16);
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)v;
+}
+
+static void put_be32(uint8_t* p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    put_be24(p + 1, v);
+}
+
+FlvSink::FlvSink(const string& path) : path(path) {
+    batch.reserve(FLV_BATCH_TAGS);
+    if (path == "-") {
+        /* anything printed so far still goes where it was meant to */
+        fflush(stdout);
+#ifdef _WIN32
+        fd = _dup(_fileno(stdout));
+        if (fd >= 0)
+            _setmode(fd, _O_BINARY);
+        _dup2(_fileno(stderr), _fileno(stdout));
+#else
+        fd = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+#endif
+    }
+    else {
+#ifdef _WIN32
+        fd = _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+        fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+#endif
+    }
+    if (fd < 0) {
+        fprintf(stderr, "Could not open %s: %s\n", name(), strerror(errno));
+        exit(1);
+    }
+#ifndef _WIN32
+    /* a reader that goes away is a write error, not the end of the process */
+    signal(SIGPIPE, SIG_IGN);
+#endif
+}
+
+FlvSink::~FlvSink() {
+    stop();
+#ifdef _WIN32
+    _close(fd);
+#else
+    close(fd);
+#endif
+}
+
+void FlvSink::start(const RtmpStreamInfo& info, const std::vector<SharedMessage>& headers) {
+    /* FLV version 1, audio and video, then PreviousTagSize0 */
+    static const uint8_t header[13] = { 'F', 'L', 'V', 1, 0x05, 0, 0, 0, 9, 0, 0, 0, 0 };
+    if (!write_all(header, sizeof(header)))
+        return;
+
+    update_metadata(info);
+    for (size_t i = 0; i < headers.size(); i++)
+        publish(headers[i], false);
+    thread = std::thread(&FlvSink::write_loop, this);
+}
+
+void FlvSink::stop() {
+    stopping = true;
+    if (thread.joinable())
+        thread.join();
+}
+
+void FlvSink::queue_tag(Tag& tag) {
+    last_timestamp = tag.timestamp;
+    queue.push(tag, stopping);
+}
+
+void FlvSink::publish(const SharedMessage& msg, bool key) {
+    if (failed.load(std::memory_order_relaxed))
+        return;
+    Tag tag;
+    tag.msg = msg;
+    tag.timestamp = msg->timestamp;
+    queue_tag(tag);
+}
+
+void FlvSink::update_metadata(const RtmpStreamInfo& info) {
+    if (failed.load(std::memory_order_relaxed))
+        return;
+    std::shared_ptr<std::vector<uint8_t> > body(new std::vector<uint8_t>);
+    flv_metadata_body(*body, info);
+    Tag tag;
+    tag.script = body;
+    tag.timestamp = last_timestamp;
+    queue_tag(tag);
+}
+
+void FlvSink::add_to_batch(Tag& tag) {
+    batch.push_back(PendingTag());
+    PendingTag& p = batch.back();
+    p.tag = std::move(tag);
+
+    const MediaMessage* msg = p.tag.msg.get();
+    uint8_t* h = p.head;
+    size_t size;
+    if (!msg) {
+        h[0] = FLV_TAG_SCRIPT;
+        size = p.tag.script->size();
+    }
+    else {
+        h[0] = msg->type == RTMP_VIDEO ? FLV_TAG_VIDEO : FLV_TAG_AUDIO;
+        size = message_size(*msg);
+    }
+    put_be24(h + 1, (uint32_t)size);
+    put_be24(h + 4, p.tag.timestamp & 0xffffff);
+    h[7] = (uint8_t)(p.tag.timestamp >> 24);
+    put_be24(h + 8, 0);
+    put_be32(p.tail, (uint32_t)(11 + size));
+    batch_bytes += 11 + size + 4;
+}
+
+/* Also lets a publisher blocked on the full queue go. */
+bool FlvSink::write_failed() {
+    fprintf(stderr, "%s: write error: %s\n", name(), strerror(errno));
+    failed = true;
+    stopping = true;
+    return false;
+}
+
+bool FlvSink::write_all(const uint8_t* data, size_t size) {
+    while (size) {
+#ifdef _WIN32
+        int n = _write(fd, data, (unsigned)min(size, (size_t)INT32_MAX));
+#else
+        ssize_t n = write(fd, data, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+#endif
+        if (n < 0)
+            return write_failed();
+        writes.fetch_add(1, std::memory_order_relaxed);
+        written_bytes.fetch_add(n, std::memory_order_relaxed);
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool FlvSink::write_batch() {
+    if (batch.empty())
+        return true;
+
+    struct iovec iov[3 * FLV_BATCH_TAGS];
+    int count = 0;
+    for (size_t i = 0; i < batch.size(); i++) {
+        PendingTag& p = batch[i];
+        iov[count].iov_base = p.head;
+        iov[count++].iov_len = sizeof(p.head);
+        const MediaMessage* msg = p.tag.msg.get();
+        if (!msg) {
+            iov[count].iov_base = (void*)p.tag.script->data();
+            iov[count++].iov_len = p.tag.script->size();
+        }
+        else {
+            iov[count].iov_base = (void*)msg->body.data();
+            iov[count++].iov_len = message_size(*msg);
+        }
+        iov[count].iov_base = p.tail;
+        iov[count++].iov_len = 4;
+    }
+
+    bool ok = true;
+#ifdef _WIN32
+    std::vector<uint8_t> gathered;
+    gathered.reserve(batch_bytes);
+    for (int i = 0; i < count; i++)
+        gathered.insert(gathered.end(), (uint8_t*)iov[i].iov_base, (uint8_t*)iov[i].iov_base + iov[i].iov_len);
+    ok = write_all(gathered.data(), gathered.size());
+#else
+    struct iovec* next = iov;
+    while (count) {
+        ssize_t n = writev(fd, next, count);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            ok = write_failed();
+            break;
+        }
+        writes.fetch_add(1, std::memory_order_relaxed);
+        written_bytes.fetch_add(n, std::memory_order_relaxed);
+        /* a pipe takes part of it at a time */
+        while (count && (size_t)n >= next->iov_len) {
+            n -= next->iov_len;
+            next++;
+            count--;
+        }
+        if (count) {
+            next->iov_base = (uint8_t*)next->iov_base + n;
+            next->iov_len -= n;
+        }
+    }
+#endif
+    if (ok)
+        written_tags.fetch_add(batch.size(), std::memory_order_relaxed);
+    batch.clear();
+    batch_bytes = 0;
+    return ok;
+}
+
+void FlvSink::write_loop() {
+    Tag tag;
+    bool ok = true;
+    while (ok) {
+        if (!queue.try_pop(tag)) {
+            /* caught up: write what there is, then wait for more */
+            ok = write_batch();
+            if (!ok || !queue.pop(tag, stopping))
+                break;
+        }
+        add_to_batch(tag);
+        if (batch.size() == FLV_BATCH_TAGS || batch_bytes >= FLV_BATCH_BYTES)
+            ok = write_batch();
+    }
+    /* stopped: what was published before stop() is still written */
+    while (ok && queue.try_pop(tag)) {
+        add_to_batch(tag);
+        if (batch.size() == FLV_BATCH_TAGS || batch_bytes >= FLV_BATCH_BYTES)
+            ok = write_batch();
+    }
+    if (ok)
+        write_batch();
+}
+
+void FlvSink::print_stats() const {
+    uint64_t n = writes.load(std::memory_order_relaxed);
+    uint64_t bytes = written_bytes.load(std::memory_order_relaxed);
+    printf("  %s: %s, %llu tags, %.1f MB in %llu writes (%.0f KB each), queue %zu/%zu, publish blocked %lld ms\n",
+        name(), alive() ? "up" : "down",
+        (unsigned long long)written_tags.load(std::memory_order_relaxed), bytes / 1048576.0,
+        (unsigned long long)n, n ? bytes / 1024.0 / n : 0.0, queue.depth(), queue.capacity(),
+        (long long)(queue.producer_stall_us() / 1000));
+}
+
+void FlvSink::write_metrics(MetricsWriter& w) const {
+    std::string output = metric_label("output", name());
+    w.gauge("webdrivertorso_output_up", "Whether the output is still up.", output, alive());
+    w.counter("webdrivertorso_output_messages_total", "Messages sent or written.", output,
+        written_tags.load(std::memory_order_relaxed));
+    w.counter("webdrivertorso_output_bytes_total", "Bytes sent or written.", output,
+        written_bytes.load(std::memory_order_relaxed));
+    w.gauge("webdrivertorso_send_queue_messages", "Messages queued for the output.", output, (double)queue.depth());
+}
+
+void NullSink::publish(const SharedMessage& msg, bool key) {
+    if (msg->type == RTMP_VIDEO) {
+        video++;
+        keyframes += key;
+    }
+    else
+        audio++;
+    bytes += message_size(*msg);
+}
+
+void NullSink::print_stats() const {
+    printf("  null: %llu video (%llu keyframes), %llu audio, %.1f MB\n", (unsigned long long)video,
+        (unsigned long long)keyframes, (unsigned long long)audio, bytes / 1048576.0);
+}
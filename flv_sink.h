@@ -0,0 +1,119 @@
+#ifndef WEBDRIVERTORSO_FLV_SINK_H
+#define WEBDRIVERTORSO_FLV_SINK_H
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "packet_sink.h"
+#include "spsc_queue.h"
+
+/* the writer gathers up to this much stream into one write */
+#define FLV_BATCH_BYTES (1024 * 1024)
+/* three iovecs a tag, well under IOV_MAX */
+#define FLV_BATCH_TAGS 256
+
+/*
+ * The stream as an FLV file, to capture it without a server, or on
+ * stdout to pipe it into ffmpeg or ffplay ("-" as the path).
+ *
+ * The tags are written on a thread of their own. It takes whatever is
+ * queued, up to FLV_BATCH_BYTES, and writes it with one writev: the tag
+ * headers are built next to the batch and the payloads stay in the
+ * shared messages. A file is not a live link, so publish() blocks on a
+ * full queue rather than drop, and stop() writes the rest before it
+ * closes.
+ */
+class FlvSink : public PacketSink {
+public:
+    /* With "-", stdout is taken over for the stream and what the process
+     * prints goes to stderr from here on. Exits if the file cannot be
+     * created. */
+    explicit FlvSink(const std::string& path);
+    ~FlvSink();
+
+    FlvSink(const FlvSink&) = delete;
+    FlvSink& operator=(const FlvSink&) = delete;
+
+    void start(const RtmpStreamInfo& info, const std::vector<SharedMessage>& headers) override;
+    void stop() override;
+    void publish(const SharedMessage& msg, bool key) override;
+    /* A new onMetaData tag, after the messages published so far. */
+    void update_metadata(const RtmpStreamInfo& info) override;
+
+    bool alive() const override {
+        return !failed.load(std::memory_order_relaxed);
+    }
+
+    void print_stats() const override;
+    void write_metrics(MetricsWriter& w) const override;
+
+private:
+    /* An audio or video message, or the body of a script data tag. */
+    struct Tag {
+        SharedMessage msg;
+        std::shared_ptr<const std::vector<uint8_t> > script;
+        uint32_t timestamp = 0;
+    };
+
+    /* A tag in the batch being written, with its header and PreviousTagSize. */
+    struct PendingTag {
+        Tag tag;
+        uint8_t head[11];
+        uint8_t tail[4];
+    };
+
+    void queue_tag(Tag& tag);
+    void write_loop();
+    void add_to_batch(Tag& tag);
+    bool write_batch();
+    bool write_all(const uint8_t* data, size_t size);
+    bool write_failed();
+
+    const char* name() const {
+        return path == "-" ? "stdout" : path.c_str();
+    }
+
+    std::string path;
+    int fd = -1;
+    SPSCQueue<Tag> queue{ 1024 };
+    std::thread thread;
+    std::atomic<bool> stopping{ false };
+    std::atomic<bool> failed{ false };
+    std::atomic<uint64_t> written_tags{ 0 };
+    std::atomic<uint64_t> written_bytes{ 0 };
+    std::atomic<uint64_t> writes{ 0 };
+
+    /* producer side only */
+    uint32_t last_timestamp = 0;
+
+    /* writer thread only */
+    std::vector<PendingTag> batch;
+    size_t batch_bytes = 0;
+};
+
+/* Takes every message and counts it, to measure the encode side alone. */
+class NullSink : public PacketSink {
+public:
+    void start(const RtmpStreamInfo& info, const std::vector<SharedMessage>& headers) override {
+    }
+    void stop() override {
+    }
+    void publish(const SharedMessage& msg, bool key) override;
+
+    bool alive() const override {
+        return true;
+    }
+
+    void print_stats() const override;
+
+private:
+    uint64_t video = 0;
+    uint64_t keyframes = 0;
+    uint64_t audio = 0;
+    uint64_t bytes = 0;
+};
+
+#endif /* WEBDRIVERTORSO_FLV_SINK_H */
@@ -20,7 +20,7 @@
 
 /**
  * @file
- * bitstream reader API header.
+ * bitstream reader API header, plus the Exp-Golomb readers from golomb.h.
  */
 
 #ifndef AVCODEC_GET_BITS_H
@@ -36,6 +36,40 @@
 //#include "mathops.h"
 //#include "vlc.h"*/
 
+/* The generic parts of libavcodec/mathops.h the reader needs; that header is not installed. */
+#ifndef NEG_SSR32
+#   define NEG_SSR32(a,s) ((( int32_t)(a))>>(32-(s)))
+#endif
+
+#ifndef NEG_USR32
+#   define NEG_USR32(a,s) (((uint32_t)(a))>>(32-(s)))
+#endif
+
+#ifndef sign_extend
+static inline av_const int sign_extend(int val, unsigned bits)
+{
+    unsigned shift = 8 * sizeof(int) - bits;
+    union { unsigned u; int s; } v = { (unsigned) val << shift };
+    return v.s >> shift;
+}
+#endif
+
+#ifndef sign_extend64
+static inline av_const int64_t sign_extend64(int64_t val, unsigned bits)
+{
+    unsigned shift = 8 * sizeof(int64_t) - bits;
+    union { uint64_t u; int64_t s; } v = { (uint64_t) val << shift };
+    return v.s >> shift;
+}
+#endif
+
+#ifndef zero_extend
+static inline av_const unsigned zero_extend(unsigned val, unsigned bits)
+{
+    return (val << ((8 * sizeof(int)) - bits)) >> ((8 * sizeof(int)) - bits);
+}
+#endif
+
 /*
  * Safe bitstream reading:
  * optionally, the get_bits API can check to ensure that we
@@ -91,6 +125,7 @@ typedef BitstreamContext GetBitContext;
 #define show_bits_long      bits_peek
 #define init_get_bits       bits_init
 #define init_get_bits8      bits_init8
+#define init_get_bits8_rbsp bits_init8_rbsp
 #define align_get_bits      bits_align
 #define get_vlc2            bits_read_vlc
 
@@ -682,4 +717,47 @@ static inline int skip_1stop_8data_bits(GetBitContext *gb)
 
 #endif // CACHED_BITSTREAM_READER
 
+/**
+ * Read an unsigned Exp-Golomb code in the range 0 to UINT32_MAX-1.
+ * One 32-bit peek covers every code up to 31 bits, i.e. values below
+ * 65535: the leading zeros are counted at once and the code is consumed
+ * with a single skip. Longer codes take a second read; 32 or more zero
+ * bits are invalid and return UINT32_MAX.
+ */
+static inline unsigned get_ue_golomb_long(GetBitContext *gb)
+{
+    unsigned buf, log;
+
+    buf = show_bits_long(gb, 32);
+    if (!buf) {
+        skip_bits_long(gb, 32);
+        return UINT32_MAX;
+    }
+    log = 31 - av_log2(buf);
+    if (log < 16) {
+        skip_bits(gb, 2 * log + 1);
+        return (buf >> (31 - 2 * log)) - 1;
+    }
+    skip_bits_long(gb, log);
+    return get_bits_long(gb, log + 1) - 1;
+}
+
+/**
+ * Read an unsigned Exp-Golomb code.
+ */
+static inline int get_ue_golomb(GetBitContext *gb)
+{
+    return get_ue_golomb_long(gb);
+}
+
+/**
+ * Read a signed Exp-Golomb code.
+ */
+static inline int get_se_golomb(GetBitContext *gb)
+{
+    unsigned v = get_ue_golomb_long(gb) + 1;
+    int sign = -(int)(v & 1);
+    return (int)((v >> 1) ^ sign) - sign;
+}
+
 #endif /* AVCODEC_GET_BITS_H */
@@ -0,0 +1,325 @@
+/*
+ * H.264 intra encoder for flat-colour rectangle scenes
+ */
+
+#include <string.h>
+#include "libavutil/common.h"
+#include "libavutil/intreadwrite.h"
+#include "libavutil/mem.h"
+#include "libavutil/error.h"
+#include "libavcodec/defs.h"
+#include "h264.h"
+#include "put_bits.h"
+#include "h264_flat.h"
+
+#define LOG2_MAX_FRAME_NUM 8
+
+/* Largest macroblock: I_PCM, 9 bit mb_type, alignment and 384 samples. */
+#define MAX_MB_BYTES 386
+
+/* Intra_16x16 and intra chroma prediction modes, 8.3.3 and 8.3.4 */
+enum {
+    PRED16x16_VERT = 0,
+    PRED16x16_HOR  = 1,
+};
+enum {
+    PRED_CHROMA_HOR  = 1,
+    PRED_CHROMA_VERT = 2,
+};
+
+#define MB_TYPE_I_PCM 25
+
+/* Table A-1: level_idc, MaxMBPS, MaxFS */
+static const struct {
+    uint8_t level_idc;
+    int max_mbps;
+    int max_fs;
+} levels[] = {
+    { 10,     1485,     99 },
+    { 11,     3000,    396 },
+    { 12,     6000,    396 },
+    { 13,    11880,    396 },
+    { 21,    19800,    792 },
+    { 22,    20250,   1620 },
+    { 30,    40500,   1620 },
+    { 31,   108000,   3600 },
+    { 32,   216000,   5120 },
+    { 40,   245760,   8192 },
+    { 42,   522240,   8704 },
+    { 50,   589824,  22080 },
+    { 51,   983040,  36864 },
+    { 52,  2073600,  36864 },
+    { 60,  4177920, 139264 },
+    { 61,  8355840, 139264 },
+    { 62, 16711680, 139264 },
+};
+
+static int choose_level(int mb_width, int mb_height, int framerate)
+{
+    int mb_count = mb_width * mb_height;
+    for (int i = 0; i < FF_ARRAY_ELEMS(levels); i++) {
+        if (mb_count <= levels[i].max_fs &&
+            (int64_t)mb_count * framerate <= levels[i].max_mbps &&
+            mb_width * mb_width <= 8 * levels[i].max_fs &&
+            mb_height * mb_height <= 8 * levels[i].max_fs)
+            return levels[i].level_idc;
+    }
+    return levels[FF_ARRAY_ELEMS(levels) - 1].level_idc;
+}
+
+static int write_nal(uint8_t *dst, PutBitContext *pb)
+{
+    put_rbsp_trailing_bits(pb);
+    AV_WB32(dst, 0x00000001);
+    return 4 + ff_nal_unit_insert_epb(dst + 4, pb->buf, put_bytes_output(pb), 1);
+}
+
+static void put_sps(PutBitContext *pb, const H264FlatEncoder *s)
+{
+    int crop_right  = s->mb_width  * 16 - s->width;
+    int crop_bottom = s->mb_height * 16 - s->height;
+
+    put_bits(pb, 8, (3 << 5) | H264_NAL_SPS);
+    put_bits(pb, 8, 66);                        // profile_idc: baseline
+    put_bits(pb, 8, 0xc0);                      // constraint_set0_flag, constraint_set1_flag: constrained baseline
+    put_bits(pb, 8, choose_level(s->mb_width, s->mb_height, s->framerate));
+    set_ue_golomb(pb, 0);                       // seq_parameter_set_id
+    set_ue_golomb(pb, LOG2_MAX_FRAME_NUM - 4);  // log2_max_frame_num_minus4
+    set_ue_golomb(pb, 2);                       // pic_order_cnt_type: output order is decoding order
+    set_ue_golomb(pb, 1);                       // max_num_ref_frames
+    put_bits(pb, 1, 0);                         // gaps_in_frame_num_value_allowed_flag
+    set_ue_golomb(pb, s->mb_width - 1);         // pic_width_in_mbs_minus1
+    set_ue_golomb(pb, s->mb_height - 1);        // pic_height_in_map_units_minus1
+    put_bits(pb, 1, 1);                         // frame_mbs_only_flag
+    put_bits(pb, 1, 1);                         // direct_8x8_inference_flag
+    put_bits(pb, 1, crop_right || crop_bottom); // frame_cropping_flag
+    if (crop_right || crop_bottom) {
+        set_ue_golomb(pb, 0);                   // frame_crop_left_offset
+        set_ue_golomb(pb, crop_right / 2);      // frame_crop_right_offset
+        set_ue_golomb(pb, 0);                   // frame_crop_top_offset
+        set_ue_golomb(pb, crop_bottom / 2);     // frame_crop_bottom_offset
+    }
+    put_bits(pb, 1, 1);                         // vui_parameters_present_flag
+    put_bits(pb, 1, 0);                         // aspect_ratio_info_present_flag
+    put_bits(pb, 1, 0);                         // overscan_info_present_flag
+    put_bits(pb, 1, 0);                         // video_signal_type_present_flag
+    put_bits(pb, 1, 0);                         // chroma_loc_info_present_flag
+    put_bits(pb, 1, 1);                         // timing_info_present_flag
+    put_bits32(pb, 1);                          // num_units_in_tick
+    put_bits32(pb, 2 * s->framerate);           // time_scale
+    put_bits(pb, 1, 1);                         // fixed_frame_rate_flag
+    put_bits(pb, 1, 0);                         // nal_hrd_parameters_present_flag
+    put_bits(pb, 1, 0);                         // vcl_hrd_parameters_present_flag
+    put_bits(pb, 1, 0);                         // pic_struct_present_flag
+    put_bits(pb, 1, 1);                         // bitstream_restriction_flag
+    put_bits(pb, 1, 1);                         // motion_vectors_over_pic_boundaries_flag
+    set_ue_golomb(pb, 0);                       // max_bytes_per_pic_denom
+    set_ue_golomb(pb, 0);                       // max_bits_per_mb_denom
+    set_ue_golomb(pb, 15);                      // log2_max_mv_length_horizontal
+    set_ue_golomb(pb, 15);                      // log2_max_mv_length_vertical
+    set_ue_golomb(pb, 0);                       // max_num_reorder_frames
+    set_ue_golomb(pb, 1);                       // max_dec_frame_buffering
+}
+
+static void put_pps(PutBitContext *pb)
+{
+    put_bits(pb, 8, (3 << 5) | H264_NAL_PPS);
+    set_ue_golomb(pb, 0);                       // pic_parameter_set_id
+    set_ue_golomb(pb, 0);                       // seq_parameter_set_id
+    put_bits(pb, 1, 0);                         // entropy_coding_mode_flag: CAVLC
+    put_bits(pb, 1, 0);                         // bottom_field_pic_order_in_frame_present_flag
+    set_ue_golomb(pb, 0);                       // num_slice_groups_minus1
+    set_ue_golomb(pb, 0);                       // num_ref_idx_l0_default_active_minus1
+    set_ue_golomb(pb, 0);                       // num_ref_idx_l1_default_active_minus1
+    put_bits(pb, 1, 0);                         // weighted_pred_flag
+    put_bits(pb, 2, 0);                         // weighted_bipred_idc
+    set_se_golomb(pb, 0);                       // pic_init_qp_minus26
+    set_se_golomb(pb, 0);                       // pic_init_qs_minus26
+    set_se_golomb(pb, 0);                       // chroma_qp_index_offset
+    put_bits(pb, 1, 1);                         // deblocking_filter_control_present_flag
+    put_bits(pb, 1, 0);                         // constrained_intra_pred_flag
+    put_bits(pb, 1, 0);                         // redundant_pic_cnt_present_flag
+}
+
+int h264_flat_init(H264FlatEncoder *s, int width, int height, int framerate)
+{
+    uint8_t rbsp[64];
+    PutBitContext pb;
+    int ret;
+
+    memset(s, 0, sizeof(*s));
+
+    if (width <= 0 || height <= 0 || (width | height) & 1 || framerate <= 0)
+        return AVERROR(EINVAL);
+
+    s->width     = width;
+    s->height    = height;
+    s->framerate = framerate;
+    s->mb_width  = (width  + 15) / 16;
+    s->mb_height = (height + 15) / 16;
+    if (s->mb_width > H264_MAX_MB_WIDTH || s->mb_height > H264_MAX_MB_HEIGHT ||
+        s->mb_width * s->mb_height > H264_MAX_MB_PIC_SIZE)
+        return AVERROR(EINVAL);
+
+    s->rbsp_size = s->mb_width * s->mb_height * MAX_MB_BYTES + 64;
+    s->rbsp      = av_malloc(s->rbsp_size);
+    s->top_pcm   = av_malloc(s->mb_width);
+    s->extradata = av_mallocz(2 * (4 + sizeof(rbsp) * 3 / 2 + 1) + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (!s->rbsp || !s->top_pcm || !s->extradata) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    init_put_bits(&pb, rbsp, sizeof(rbsp));
+    put_sps(&pb, s);
+    s->extradata_size = write_nal(s->extradata, &pb);
+
+    init_put_bits(&pb, rbsp, sizeof(rbsp));
+    put_pps(&pb);
+    s->extradata_size += write_nal(s->extradata + s->extradata_size, &pb);
+
+    ret = h264_skip_init(&s->skip, s->extradata, s->extradata_size);
+    if (ret < 0)
+        goto fail;
+    return 0;
+
+fail:
+    h264_flat_uninit(s);
+    return ret;
+}
+
+void h264_flat_uninit(H264FlatEncoder *s)
+{
+    av_freep(&s->rbsp);
+    av_freep(&s->top_pcm);
+    av_freep(&s->extradata);
+}
+
+int h264_flat_max_size(const H264FlatEncoder *s)
+{
+    return FFMAX(4 + s->rbsp_size * 3 / 2 + 1, h264_skip_max_size(&s->skip));
+}
+
+static const uint8_t *scene_color_at(const H264FlatScene *scene, int x, int y)
+{
+    for (int i = scene->nb_rects - 1; i >= 0; i--) {
+        if (x >= scene->rects[i].x && x < scene->rects[i].x + scene->rects[i].width &&
+            y >= scene->rects[i].y && y < scene->rects[i].y + scene->rects[i].height)
+            return scene->rects[i].color;
+    }
+    return scene->background;
+}
+
+/* The colour of the whole area, or NULL if it is not known to be uniform.
+ * Walks the rectangles top down: the first one touching the area decides. */
+static const uint8_t *scene_area_color(const H264FlatScene *scene, int x, int y, int w, int h)
+{
+    for (int i = scene->nb_rects - 1; i >= 0; i--) {
+        int x0 = FFMAX(x, scene->rects[i].x);
+        int x1 = FFMIN(x + w, scene->rects[i].x + scene->rects[i].width);
+        int y0 = FFMAX(y, scene->rects[i].y);
+        int y1 = FFMIN(y + h, scene->rects[i].y + scene->rects[i].height);
+        if (x0 >= x1 || y0 >= y1)
+            continue;
+        if (x0 == x && x1 == x + w && y0 == y && y1 == y + h)
+            return scene->rects[i].color;
+        return NULL;
+    }
+    return scene->background;
+}
+
+static int same_color(const uint8_t *a, const uint8_t *b)
+{
+    return a && b && a[0] == b[0] && a[1] == b[1] && a[2] == b[2];
+}
+
+static void put_pcm_mb(PutBitContext *pb, const H264FlatScene *scene, int x0, int y0)
+{
+    set_ue_golomb(pb, MB_TYPE_I_PCM);
+    align_put_bits(pb);                         // pcm_alignment_zero_bit
+    for (int y = 0; y < 16; y++)
+        for (int x = 0; x < 16; x++)
+            put_bits(pb, 8, scene_color_at(scene, x0 + x, y0 + y)[0]);
+    for (int plane = 1; plane < 3; plane++)
+        for (int y = 0; y < 16; y += 2)
+            for (int x = 0; x < 16; x += 2)
+                put_bits(pb, 8, scene_color_at(scene, x0 + x, y0 + y)[plane]);
+}
+
+int h264_flat_write_idr(H264FlatEncoder *s, const H264FlatScene *scene,
+                        uint8_t *buf, int buf_size)
+{
+    PutBitContext pb;
+
+    if (buf_size < h264_flat_max_size(s))
+        return AVERROR(EINVAL);
+
+    init_put_bits(&pb, s->rbsp, s->rbsp_size);
+    put_bits(&pb, 8, (3 << 5) | H264_NAL_IDR_SLICE);
+    set_ue_golomb(&pb, 0);                      // first_mb_in_slice
+    set_ue_golomb(&pb, 7);                      // slice_type: I, all slices
+    set_ue_golomb(&pb, 0);                      // pic_parameter_set_id
+    put_bits(&pb, LOG2_MAX_FRAME_NUM, 0);       // frame_num
+    set_ue_golomb(&pb, s->idr_pic_id);          // idr_pic_id, differs between consecutive IDRs
+    put_bits(&pb, 1, 0);                        // no_output_of_prior_pics_flag
+    put_bits(&pb, 1, 0);                        // long_term_reference_flag
+    set_se_golomb(&pb, 0);                      // slice_qp_delta
+    set_ue_golomb(&pb, 1);                      // disable_deblocking_filter_idc
+    s->idr_pic_id ^= 1;
+
+    for (int mb_y = 0; mb_y < s->mb_height; mb_y++) {
+        int left_pcm = 0;
+        for (int mb_x = 0; mb_x < s->mb_width; mb_x++) {
+            int x = mb_x * 16;
+            int y = mb_y * 16;
+            const uint8_t *color = scene_area_color(scene, x, y, 16, 16);
+            int luma_mode = -1, chroma_mode, nc, na, nb;
+
+            /* The last two luma columns (rows) of the neighbour cover the
+             * last chroma column (row) as well. */
+            if (color && mb_x > 0 && same_color(color, scene_area_color(scene, x - 2, y, 2, 16))) {
+                luma_mode   = PRED16x16_HOR;
+                chroma_mode = PRED_CHROMA_HOR;
+            } else if (color && mb_y > 0 && same_color(color, scene_area_color(scene, x, y - 2, 16, 2))) {
+                luma_mode   = PRED16x16_VERT;
+                chroma_mode = PRED_CHROMA_VERT;
+            }
+
+            if (luma_mode < 0) {
+                put_pcm_mb(&pb, scene, x, y);
+                s->top_pcm[mb_x] = left_pcm = 1;
+                continue;
+            }
+
+            set_ue_golomb(&pb, 1 + luma_mode);  // mb_type: I_16x16_<luma_mode>_0_0
+            set_ue_golomb(&pb, chroma_mode);    // intra_chroma_pred_mode
+            set_se_golomb(&pb, 0);              // mb_qp_delta
+
+            /* Intra16x16DCLevel with TotalCoeff 0; nC counts I_PCM neighbours as 16 (9.2.1) */
+            na = left_pcm ? 16 : 0;
+            nb = mb_y > 0 && s->top_pcm[mb_x] ? 16 : 0;
+            if (mb_x > 0 && mb_y > 0)
+                nc = (na + nb + 1) >> 1;
+            else
+                nc = mb_x > 0 ? na : nb;
+            if (nc < 2)
+                put_bits(&pb, 1, 1);
+            else if (nc < 4)
+                put_bits(&pb, 2, 3);
+            else if (nc < 8)
+                put_bits(&pb, 4, 15);
+            else
+                put_bits(&pb, 6, 3);
+
+            s->top_pcm[mb_x] = left_pcm = 0;
+        }
+    }
+
+    h264_skip_idr(&s->skip);
+    return write_nal(buf, &pb);
+}
+
+int h264_flat_write_skip(H264FlatEncoder *s, uint8_t *buf, int buf_size)
+{
+    return h264_skip_write_frame(&s->skip, buf, buf_size);
+}
@@ -0,0 +1,63 @@
+/*
+ * H.264 intra encoder for flat-colour rectangle scenes
+ */
+
+#ifndef WEBDRIVERTORSO_H264_FLAT_H
+#define WEBDRIVERTORSO_H264_FLAT_H
+
+#include <stdint.h>
+#include "h264_skip.h"
+
+#define H264_FLAT_MAX_RECTS 8
+
+/*
+ * A background colour with solid rectangles painted over it in order.
+ * Rectangles must start at even coordinates and have even sizes, so every
+ * 2x2 luma block, and with it every chroma sample, has a single colour.
+ */
+typedef struct H264FlatScene {
+    uint8_t background[3];      ///< Y, U, V
+    int nb_rects;
+    struct {
+        int x, y, width, height;
+        uint8_t color[3];       ///< Y, U, V
+    } rects[H264_FLAT_MAX_RECTS];
+} H264FlatScene;
+
+/*
+ * Writes a constrained baseline stream straight from an H264FlatScene,
+ * without a framebuffer. A scene change is one IDR slice: a macroblock of
+ * one colour whose left or top neighbour ends in the same colour is an
+ * I_16x16 macroblock predicting horizontally or vertically with no
+ * residual; every other macroblock is I_PCM. Deblocking is disabled, so
+ * the decoded picture is exactly the scene. The frames in between are
+ * P_Skip frames from H264SkipContext.
+ */
+typedef struct H264FlatEncoder {
+    int width, height;
+    int mb_width, mb_height;
+    int framerate;
+    int idr_pic_id;
+    uint8_t *extradata;         ///< Annex B SPS + PPS
+    int extradata_size;
+    uint8_t *rbsp;
+    int rbsp_size;
+    uint8_t *top_pcm;           ///< per column, whether the macroblock above is I_PCM
+    H264SkipContext skip;
+} H264FlatEncoder;
+
+int h264_flat_init(H264FlatEncoder *s, int width, int height, int framerate);
+void h264_flat_uninit(H264FlatEncoder *s);
+
+/* Upper bound of the size of one access unit. */
+int h264_flat_max_size(const H264FlatEncoder *s);
+
+/* Writes the IDR access unit for scene as Annex B. Returns its size or a
+ * negative AVERROR. */
+int h264_flat_write_idr(H264FlatEncoder *s, const H264FlatScene *scene,
+                        uint8_t *buf, int buf_size);
+
+/* Writes the next repeated frame of the current scene as Annex B. */
+int h264_flat_write_skip(H264FlatEncoder *s, uint8_t *buf, int buf_size);
+
+#endif /* WEBDRIVERTORSO_H264_FLAT_H */
@@ -0,0 +1,118 @@
+/*
+ * Synthesized all-P_Skip H.264 frames
+ */
+
+#include <string.h>
+#include "libavutil/intreadwrite.h"
+#include "libavutil/error.h"
+#include "h264.h"
+#include "put_bits.h"
+#include "h264_skip.h"
+
+int h264_skip_init(H264SkipContext *s, const uint8_t *extradata, int size)
+{
+    const uint8_t *end = extradata + size;
+    const uint8_t *nal_start, *nal_end;
+    int has_sps = 0, has_pps = 0, ret;
+
+    memset(s, 0, sizeof(*s));
+
+    nal_start = ff_avc_find_startcode(extradata, end);
+    for (;;) {
+        while (nal_start < end && !*(nal_start++));
+        if (nal_start == end)
+            break;
+
+        nal_end = ff_avc_find_startcode(nal_start, end);
+        if ((nal_start[0] & 0x1f) == H264_NAL_SPS && !has_sps) {
+            ret = ff_avc_decode_sps(&s->sps, nal_start + 1, nal_end - nal_start - 1);
+            if (ret < 0)
+                return ret;
+            has_sps = 1;
+        } else if ((nal_start[0] & 0x1f) == H264_NAL_PPS && !has_pps) {
+            ret = ff_avc_decode_pps(&s->pps, nal_start + 1, nal_end - nal_start - 1);
+            if (ret < 0)
+                return ret;
+            has_pps = 1;
+        }
+        nal_start = nal_end;
+    }
+
+    if (!has_sps || !has_pps)
+        return AVERROR_INVALIDDATA;
+
+    if (s->pps.sps_id != s->sps.id ||
+        s->pps.entropy_coding_mode_flag ||
+        !s->sps.frame_mbs_only_flag ||
+        s->sps.separate_colour_plane_flag ||
+        (s->sps.poc_type == 1 && !s->sps.delta_pic_order_always_zero_flag))
+        return AVERROR_PATCHWELCOME;
+
+    return 0;
+}
+
+void h264_skip_idr(H264SkipContext *s)
+{
+    s->frames_since_idr = 0;
+}
+
+int h264_skip_max_size(const H264SkipContext *s)
+{
+    /* start code, NAL header, at most ~20 bytes of slice header and a
+     * 35 bit mb_skip_run, with room for emulation prevention */
+    return 4 + 64 * 3 / 2 + 1;
+}
+
+static void put_p_slice_header(PutBitContext *pb, const H264SPS *sps,
+                               const H264PPS *pps, int frame_num, int poc)
+{
+    int chroma_array_type = sps->separate_colour_plane_flag ? 0 : sps->chroma_format_idc;
+
+    set_ue_golomb(pb, 0);                       // first_mb_in_slice
+    set_ue_golomb(pb, 5);                       // slice_type: P, all slices
+    set_ue_golomb(pb, pps->id);                 // pic_parameter_set_id
+    put_bits(pb, sps->log2_max_frame_num, frame_num & ((1 << sps->log2_max_frame_num) - 1));
+    // frame_mbs_only_flag: no field_pic_flag
+    if (sps->poc_type == 0) {
+        put_bits(pb, sps->log2_max_poc_lsb, poc & ((1 << sps->log2_max_poc_lsb) - 1));
+        if (pps->bottom_field_pic_order_in_frame_present_flag)
+            set_se_golomb(pb, 0);               // delta_pic_order_cnt_bottom
+    }
+    if (pps->redundant_pic_cnt_present_flag)
+        set_ue_golomb(pb, 0);                   // redundant_pic_cnt
+    put_bits(pb, 1, 1);                         // num_ref_idx_active_override_flag
+    set_ue_golomb(pb, 0);                       // num_ref_idx_l0_active_minus1
+    put_bits(pb, 1, 0);                         // ref_pic_list_modification_flag_l0
+    if (pps->weighted_pred_flag) {
+        set_ue_golomb(pb, 0);                   // luma_log2_weight_denom
+        if (chroma_array_type)
+            set_ue_golomb(pb, 0);               // chroma_log2_weight_denom
+        put_bits(pb, 1, 0);                     // luma_weight_l0_flag
+        if (chroma_array_type)
+            put_bits(pb, 1, 0);                 // chroma_weight_l0_flag
+    }
+    put_bits(pb, 1, 0);                         // adaptive_ref_pic_marking_mode_flag
+    set_se_golomb(pb, 0);                       // slice_qp_delta
+    if (pps->deblocking_filter_control_present_flag)
+        set_ue_golomb(pb, 1);                   // disable_deblocking_filter_idc
+}
+
+int h264_skip_write_frame(H264SkipContext *s, uint8_t *buf, int buf_size)
+{
+    uint8_t rbsp[64];
+    PutBitContext pb;
+
+    if (buf_size < h264_skip_max_size(s))
+        return AVERROR(EINVAL);
+
+    s->frames_since_idr++;
+
+    init_put_bits(&pb, rbsp, sizeof(rbsp));
+    put_bits(&pb, 8, (2 << 5) | H264_NAL_SLICE); // forbidden_zero_bit, nal_ref_idc, nal_unit_type
+    put_p_slice_header(&pb, &s->sps, &s->pps, s->frames_since_idr, 2 * s->frames_since_idr);
+    set_ue_golomb(&pb, s->sps.mb_width * s->sps.mb_height); // mb_skip_run
+    put_rbsp_trailing_bits(&pb);
+
+    AV_WB32(buf, 0x00000001);
+    return 4 + ff_nal_unit_insert_epb(buf + 4, rbsp, put_bytes_output(&pb), 1);
+}
@@ -0,0 +1,41 @@
+/*
+ * Synthesized all-P_Skip H.264 frames
+ */
+
+#ifndef WEBDRIVERTORSO_H264_SKIP_H
+#define WEBDRIVERTORSO_H264_SKIP_H
+
+#include <stdint.h>
+#include "avc.h"
+
+/*
+ * A P slice made only of P_Skip macroblocks with zero motion reproduces
+ * its reference picture exactly, so a static scene needs one real
+ * encode per scene change and a handful of bytes per repeated frame.
+ *
+ * The skip frames are reference pictures (sliding window marking), so
+ * frame_num and POC keep counting up from the last IDR; this keeps POC
+ * type 2 streams valid, which forbid consecutive non-reference frames.
+ * Only CAVLC progressive streams without slice groups are supported.
+ */
+typedef struct H264SkipContext {
+    H264SPS sps;
+    H264PPS pps;
+    int frames_since_idr;
+} H264SkipContext;
+
+/* Parses the SPS/PPS from Annex B extradata. Returns AVERROR_PATCHWELCOME
+ * if the stream uses a feature skip slices cannot be written for. */
+int h264_skip_init(H264SkipContext *s, const uint8_t *extradata, int size);
+
+/* Restarts frame_num/POC numbering after an IDR from the real encoder. */
+void h264_skip_idr(H264SkipContext *s);
+
+/* Upper bound of the size of one skip access unit. */
+int h264_skip_max_size(const H264SkipContext *s);
+
+/* Writes the next skip access unit as Annex B (4-byte start code + one
+ * slice NAL) to buf. Returns its size or a negative AVERROR. */
+int h264_skip_write_frame(H264SkipContext *s, uint8_t *buf, int buf_size);
+
+#endif /* WEBDRIVERTORSO_H264_SKIP_H */
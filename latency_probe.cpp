@@ -0,0 +1,178 @@
+/*
+ * Reads the latency probes (see latency_sei.h) back from a received
+ * stream and reports latency percentiles and sequence gaps per stream id.
+ *
+ * latency_probe <FLV file | rtmp:// URL | - for stdin>
+ *
+ * Anything libavformat opens works; the probes are found in AVCC and in
+ * Annex B video. A live input (a URL or a pipe) is timed on arrival, so
+ * run it on the host that sends the stream. A file was received earlier:
+ * only the gaps and the intervals between the send times are reported.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+extern "C" {
+#include "libavcodec/avcodec.h"
+#include <libavformat/avformat.h>
+#include <libavutil/intreadwrite.h>
+#include "avc.h"
+#include "latency_sei.h"
+}
+
+using namespace std;
+
+struct StreamStats {
+    uint64_t probes = 0;
+    uint64_t missing = 0;
+    uint64_t out_of_order = 0;
+    bool has_last = false;
+    uint32_t last_sequence = 0;
+    uint64_t last_send_time_us = 0;
+    std::vector<int64_t> latencies_us;
+    std::vector<int64_t> send_intervals_us;
+
+    void add(const LatencyProbe& probe, uint64_t receive_time_us, bool live) {
+        probes++;
+        if (has_last) {
+            int32_t step = (int32_t)(probe.sequence - last_sequence);
+            if (step <= 0) {
+                out_of_order++;
+                return;
+            }
+            missing += step - 1;
+            send_intervals_us.push_back((int64_t)(probe.send_time_us - last_send_time_us));
+        }
+        has_last = true;
+        last_sequence = probe.sequence;
+        last_send_time_us = probe.send_time_us;
+        if (live)
+            latencies_us.push_back((int64_t)(receive_time_us - probe.send_time_us));
+    }
+};
+
+std::map<uint32_t, StreamStats> streams;
+uint64_t access_units = 0;
+uint64_t access_units_without_probe = 0;
+
+void print_percentiles(const char* name, std::vector<int64_t> v) {
+    if (v.empty())
+        return;
+    sort(v.begin(), v.end());
+    size_t n = v.size();
+    printf("  %s ms: p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n", name,
+        v[n * 50 / 100] / 1000.0, v[n * 90 / 100] / 1000.0, v[n * 99 / 100] / 1000.0,
+        v[n * 999 / 1000] / 1000.0, v[n - 1] / 1000.0);
+}
+
+void print_report() {
+    printf("%llu video access units, %llu without a probe\n",
+        (unsigned long long)access_units, (unsigned long long)access_units_without_probe);
+    for (std::map<uint32_t, StreamStats>::const_iterator it = streams.begin(); it != streams.end(); ++it) {
+        const StreamStats& s = it->second;
+        printf("stream %u: %llu probes, %llu missing, %llu out of order\n", it->first,
+            (unsigned long long)s.probes, (unsigned long long)s.missing, (unsigned long long)s.out_of_order);
+        print_percentiles("latency", s.latencies_us);
+        print_percentiles("send interval", s.send_intervals_us);
+    }
+    fflush(stdout);
+}
+
+/* The SEI of one access unit; nal_length_size 0 is Annex B. */
+void scan_access_unit(const uint8_t* data, int size, int nal_length_size, bool live) {
+    uint64_t receive_time_us = latency_clock_us();
+    const uint8_t* end = data + size;
+    bool found = false;
+    LatencyProbe probe;
+
+    access_units++;
+    if (nal_length_size) {
+        const uint8_t* p = data;
+        while (end - p > nal_length_size) {
+            uint32_t nal_size = 0;
+            for (int i = 0; i < nal_length_size; i++)
+                nal_size = (nal_size << 8) | p[i];
+            p += nal_length_size;
+            if (nal_size > (uint32_t)(end - p))
+                break;
+            if (latency_sei_parse(p, nal_size, &probe)) {
+                streams[probe.stream_id].add(probe, receive_time_us, live);
+                found = true;
+            }
+            p += nal_size;
+        }
+    }
+    else {
+        const uint8_t* nal_start = ff_avc_find_startcode(data, end);
+        for (;;) {
+            while (nal_start < end && !*(nal_start++));
+            if (nal_start == end)
+                break;
+            const uint8_t* nal_end = ff_avc_find_startcode(nal_start, end);
+            if (latency_sei_parse(nal_start, nal_end - nal_start, &probe)) {
+                streams[probe.stream_id].add(probe, receive_time_us, live);
+                found = true;
+            }
+            nal_start = nal_end;
+        }
+    }
+    if (!found)
+        access_units_without_probe++;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <FLV file | rtmp:// URL | - for stdin>\n", argv[0]);
+        return 1;
+    }
+    const char* url = strcmp(argv[1], "-") ? argv[1] : "pipe:0";
+    struct stat st;
+    bool live = stat(url, &st) != 0 || (st.st_mode & S_IFMT) != S_IFREG;
+
+    avformat_network_init();
+    AVFormatContext* ic = NULL;
+    if (avformat_open_input(&ic, url, NULL, NULL) < 0) {
+        fprintf(stderr, "Could not open %s\n", argv[1]);
+        return 1;
+    }
+    if (avformat_find_stream_info(ic, NULL) < 0) {
+        fprintf(stderr, "Could not read stream info from %s\n", argv[1]);
+        return 1;
+    }
+    int video = av_find_best_stream(ic, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (video < 0 || ic->streams[video]->codecpar->codec_id != AV_CODEC_ID_H264) {
+        fprintf(stderr, "No H.264 video in %s\n", argv[1]);
+        return 1;
+    }
+    const AVCodecParameters* par = ic->streams[video]->codecpar;
+    /* avcC extradata starts with configurationVersion 1, Annex B with a start code */
+    int nal_length_size = par->extradata_size >= 7 && par->extradata[0] == 1 ? (par->extradata[4] & 3) + 1 : 0;
+
+    printf("%s: %s, %s\n", argv[1], live ? "live, latency measured on arrival" : "file, gaps only",
+        nal_length_size ? "AVCC" : "Annex B");
+
+    AVPacket* pkt = av_packet_alloc();
+    uint64_t next_report_us = latency_clock_us() + 10000000;
+    while (av_read_frame(ic, pkt) >= 0) {
+        if (pkt->stream_index == video)
+            scan_access_unit(pkt->data, pkt->size, nal_length_size, live);
+        av_packet_unref(pkt);
+
+        if (live && latency_clock_us() >= next_report_us) {
+            print_report();
+            next_report_us += 10000000;
+        }
+    }
+    print_report();
+
+    av_packet_free(&pkt);
+    avformat_close_input(&ic);
+    return 0;
+}
@@ -0,0 +1,112 @@
+/*
+ * Latency probe carried in user_data_unregistered SEI messages
+ */
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#define _POSIX_C_SOURCE 200809L
+#include <time.h>
+#endif
+#include <string.h>
+#include "libavutil/error.h"
+#include "h264.h"
+#include "put_bits.h"
+#define CACHED_BITSTREAM_READER 1
+#include "get_bits.h"
+#include "avc.h"
+#include "latency_sei.h"
+
+#define SEI_TYPE_USER_DATA_UNREGISTERED 5
+#define PROBE_PAYLOAD_SIZE (16 + 16)
+
+/* uuid_iso_iec_11578 of the probe */
+static const uint8_t probe_uuid[16] = {
+    0x77, 0x64, 0x74, 0x6f, 0x72, 0x73, 0x6f, 0x2d,
+    0x8c, 0x5e, 0x4a, 0x1b, 0x9d, 0x27, 0xe3, 0x40,
+};
+
+uint64_t latency_clock_us(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000 +
+           (uint64_t)(count.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+int latency_sei_write(uint8_t *buf, int buf_size, const LatencyProbe *probe)
+{
+    uint8_t rbsp[64];
+    PutBitContext pb;
+    int i;
+
+    if (buf_size < LATENCY_SEI_MAX_SIZE)
+        return AVERROR(EINVAL);
+
+    init_put_bits(&pb, rbsp, sizeof(rbsp));
+    put_bits(&pb, 8, H264_NAL_SEI);             // forbidden_zero_bit, nal_ref_idc, nal_unit_type
+    put_bits(&pb, 8, SEI_TYPE_USER_DATA_UNREGISTERED); // last_payload_type_byte
+    put_bits(&pb, 8, PROBE_PAYLOAD_SIZE);       // last_payload_size_byte
+    for (i = 0; i < 16; i++)
+        put_bits(&pb, 8, probe_uuid[i]);        // uuid_iso_iec_11578
+    put_bits32(&pb, probe->send_time_us >> 32); // user_data_payload_byte...
+    put_bits32(&pb, (uint32_t)probe->send_time_us);
+    put_bits32(&pb, probe->sequence);
+    put_bits32(&pb, probe->stream_id);
+    put_rbsp_trailing_bits(&pb);
+
+    return ff_nal_unit_insert_epb(buf, rbsp, put_bytes_output(&pb), 1);
+}
+
+int latency_sei_parse(const uint8_t *nal, int size, LatencyProbe *probe)
+{
+    GetBitContext gb;
+    uint8_t uuid[16];
+    int i;
+
+    if (size < 2 || (nal[0] & 0x1f) != H264_NAL_SEI)
+        return 0;
+    if (init_get_bits8_rbsp(&gb, nal + 1, size - 1, ff_avc_find_escape) < 0)
+        return 0;
+
+    /* every sei_message() is at least two bytes; what is left after the
+     * last one is rbsp_trailing_bits() */
+    while (get_bits_left(&gb) > 16) {
+        int type = 0, payload_size = 0, byte;
+
+        do {
+            byte = get_bits(&gb, 8);
+            type += byte;
+        } while (byte == 0xff);
+        do {
+            byte = get_bits(&gb, 8);
+            payload_size += byte;
+        } while (byte == 0xff);
+
+        if (payload_size > get_bits_left(&gb) / 8)
+            return 0;
+
+        if (type == SEI_TYPE_USER_DATA_UNREGISTERED && payload_size >= PROBE_PAYLOAD_SIZE) {
+            for (i = 0; i < 16; i++)
+                uuid[i] = get_bits(&gb, 8);
+            if (!memcmp(uuid, probe_uuid, sizeof(uuid))) {
+                probe->send_time_us = (uint64_t)get_bits_long(&gb, 32) << 32;
+                probe->send_time_us |= get_bits_long(&gb, 32);
+                probe->sequence = get_bits_long(&gb, 32);
+                probe->stream_id = get_bits_long(&gb, 32);
+                return 1;
+            }
+            payload_size -= 16;
+        }
+        skip_bits_long(&gb, payload_size * 8);
+    }
+    return 0;
+}
@@ -0,0 +1,42 @@
+/*
+ * Latency probe carried in user_data_unregistered SEI messages
+ */
+
+#ifndef WEBDRIVERTORSO_LATENCY_SEI_H
+#define WEBDRIVERTORSO_LATENCY_SEI_H
+
+#include <stdint.h>
+
+/*
+ * The sender puts one probe into every video access unit, in front of the
+ * first slice. A decoder ignores user_data_unregistered SEI it does not
+ * know, and ingests and transcoders usually pass SEI through, so the probe
+ * arrives wherever the picture does. The receiver compares send_time_us
+ * with its own clock and checks the sequence numbers for gaps.
+ *
+ * send_time_us is latency_clock_us(): a monotonic clock shared by every
+ * process on a host, so latencies are only meaningful when the sender and
+ * the receiver run on the same machine.
+ */
+typedef struct LatencyProbe {
+    uint64_t send_time_us;
+    uint32_t sequence;          ///< per stream, counts up from 0
+    uint32_t stream_id;
+} LatencyProbe;
+
+/* NAL header, payload type and size, uuid, probe, trailing bits, and room
+ * for emulation prevention */
+#define LATENCY_SEI_MAX_SIZE ((1 + 2 + 16 + 16 + 1) * 3 / 2 + 1)
+
+/* Microseconds on the host's monotonic clock. */
+uint64_t latency_clock_us(void);
+
+/* Writes the SEI NAL unit for probe, NAL header included but without a
+ * start code or length prefix. Returns its size or a negative AVERROR. */
+int latency_sei_write(uint8_t *buf, int buf_size, const LatencyProbe *probe);
+
+/* Looks for a probe in an escaped SEI NAL unit, NAL header included.
+ * Returns 1 if one was found, 0 if the NAL carries none. */
+int latency_sei_parse(const uint8_t *nal, int size, LatencyProbe *probe);
+
+#endif /* WEBDRIVERTORSO_LATENCY_SEI_H */
@@ -0,0 +1,213 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include "log.h"
+
+using namespace std;
+
+Logger logger;
+
+static int64_t now_us() {
+    return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+Logger::Logger() : ring(new LogRecord[LOG_RING_SIZE]) {
+    for (size_t i = 0; i < LOG_RING_SIZE; i++)
+        ring[i].sequence.store(i, std::memory_order_relaxed);
+}
+
+Logger::~Logger() {
+    std::lock_guard<std::mutex> lock(start_mutex);
+    if (!flusher.joinable())
+        return;
+    stopping = true;
+    flusher.join();
+}
+
+void Logger::start() {
+    std::lock_guard<std::mutex> lock(start_mutex);
+    if (started.load(std::memory_order_relaxed))
+        return;
+    flusher = std::thread(&Logger::flush_loop, this);
+    started.store(true, std::memory_order_release);
+}
+
+/*
+ * A slot is free for the writer at position p while its sequence is p,
+ * and holds a line for the flusher once it is p + 1. The flusher hands
+ * it back for the next round with p + LOG_RING_SIZE.
+ */
+LogRecord* Logger::claim() {
+    if (!started.load(std::memory_order_acquire))
+        start();
+    size_t position = write_position.load(std::memory_order_relaxed);
+    for (;;) {
+        LogRecord* r = &ring[position & (LOG_RING_SIZE - 1)];
+        intptr_t diff = (intptr_t)r->sequence.load(std::memory_order_acquire) - (intptr_t)position;
+        if (diff == 0) {
+            if (write_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                return r;
+        }
+        else if (diff < 0) {
+            nb_dropped.fetch_add(1, std::memory_order_relaxed);
+            return NULL;
+        }
+        else {
+            position = write_position.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+void Logger::commit(LogRecord* r) {
+    r->sequence.store(r->sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+void Logger::add_arg(LogRecord& r, const char* s) {
+    if (r.nb_args == LOG_MAX_ARGS)
+        return;
+    LogRecord::Arg& a = r.args[r.nb_args++];
+    a.type = 's';
+    int room = LOG_TEXT_BYTES - r.text_size;
+    if (room <= 0) {
+        a.i = -1;
+        return;
+    }
+    if (!s)
+        s = "(null)";
+    size_t n = min(strlen(s), (size_t)room - 1);
+    memcpy(r.text + r.text_size, s, n);
+    r.text[r.text_size + n] = 0;
+    a.i = r.text_size;
+    r.text_size += (int)n + 1;
+}
+
+/* printf with the length modifiers replaced by what the argument was captured as */
+static void format_record(const LogRecord& r, string& s) {
+    const char* p = r.format;
+    int arg = 0;
+    char spec[32];
+    char buf[256];
+    while (*p) {
+        if (*p != '%') {
+            s += *p++;
+            continue;
+        }
+        if (p[1] == '%') {
+            s += '%';
+            p += 2;
+            continue;
+        }
+        int n = 0;
+        spec[n++] = *p++;
+        while (*p && strchr("-+ #0123456789.", *p) && n < 24)
+            spec[n++] = *p++;
+        while (*p && strchr("hljztLq", *p))
+            p++;
+        char conversion = *p;
+        if (!conversion)
+            break;
+        p++;
+        if (arg == r.nb_args) {
+            s += "<?>";
+            continue;
+        }
+        const LogRecord::Arg& a = r.args[arg++];
+        if (conversion == 'c' || conversion == 'd' || conversion == 'i') {
+            int64_t v = a.type == 'i' ? a.i : a.type == 'f' ? (int64_t)a.f : 0;
+            if (conversion != 'c')
+                spec[n++] = 'l', spec[n++] = 'l';
+            spec[n++] = conversion;
+            spec[n] = 0;
+            if (conversion == 'c')
+                snprintf(buf, sizeof(buf), spec, (int)v);
+            else
+                snprintf(buf, sizeof(buf), spec, (long long)v);
+        }
+        else if (strchr("ouxX", conversion)) {
+            uint64_t v = a.type == 'i' ? (uint64_t)a.i : a.type == 'f' ? (uint64_t)a.f : 0;
+            spec[n++] = 'l';
+            spec[n++] = 'l';
+            spec[n++] = conversion;
+            spec[n] = 0;
+            snprintf(buf, sizeof(buf), spec, (unsigned long long)v);
+        }
+        else if (strchr("eEfFgGaA", conversion)) {
+            double v = a.type == 'f' ? a.f : a.type == 'i' ? (double)a.i : 0;
+            spec[n++] = conversion;
+            spec[n] = 0;
+            snprintf(buf, sizeof(buf), spec, v);
+        }
+        else if (conversion == 's') {
+            spec[n++] = 's';
+            spec[n] = 0;
+            snprintf(buf, sizeof(buf), spec, a.type == 's' && a.i >= 0 ? r.text + a.i : "");
+        }
+        else {
+            s += "<?>";
+            continue;
+        }
+        s += buf;
+    }
+    if (r.suppressed) {
+        snprintf(buf, sizeof(buf), " (%llu more not shown)", (unsigned long long)r.suppressed);
+        s += buf;
+    }
+    s += '\n';
+}
+
+bool Logger::drain(string& out, string& err) {
+    bool any = false;
+    for (;;) {
+        LogRecord* r = &ring[read_position & (LOG_RING_SIZE - 1)];
+        if (r->sequence.load(std::memory_order_acquire) != read_position + 1)
+            return any;
+        format_record(*r, r->level <= LOG_LEVEL_WARNING ? err : out);
+        r->sequence.store(read_position + LOG_RING_SIZE, std::memory_order_release);
+        read_position++;
+        any = true;
+    }
+}
+
+/* Once stopping is seen, one more round writes what was queued before. */
+void Logger::flush_loop() {
+    string out;
+    string err;
+    for (;;) {
+        bool stop = stopping.load(std::memory_order_acquire);
+        bool any = drain(out, err);
+        uint64_t n = dropped();
+        if (n != reported_dropped) {
+            char line[64];
+            snprintf(line, sizeof(line), "%llu log lines dropped\n", (unsigned long long)(n - reported_dropped));
+            err += line;
+            reported_dropped = n;
+        }
+        if (!err.empty()) {
+            fwrite(err.data(), 1, err.size(), stderr);
+            fflush(stderr);
+            err.clear();
+        }
+        if (!out.empty()) {
+            fwrite(out.data(), 1, out.size(), stdout);
+            fflush(stdout);
+            out.clear();
+        }
+        if (stop)
+            break;
+        if (!any)
+            this_thread::sleep_for(chrono::milliseconds(10));
+    }
+}
+
+bool LogRateLimit::allow(uint64_t& suppressed) {
+    int64_t now = now_us();
+    int64_t next = next_us.load(std::memory_order_relaxed);
+    if (now < next || !next_us.compare_exchange_strong(next, now + interval_us, std::memory_order_relaxed)) {
+        skipped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    suppressed = skipped.exchange(0, std::memory_order_relaxed);
+    return true;
+}
@@ -0,0 +1,203 @@
+#ifndef WEBDRIVERTORSO_LOG_H
+#define WEBDRIVERTORSO_LOG_H
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+
+/*
+ * Logging from the stage threads and pool workers without a syscall or a
+ * lock on their side.
+ *
+ * LOG_INFO("%s connected", name) only copies the format pointer and the
+ * arguments (numbers as they are, strings up to LOG_TEXT_BYTES) into a
+ * slot of a bounded lock-free ring; a background thread formats what is
+ * queued and writes it in one go every few milliseconds, errors and
+ * warnings to stderr, the rest to stdout, a line each. The format is
+ * printf's, except that the length modifiers are ignored: every integer
+ * is printed from 64 bits, so %d takes an int64_t and %u a size_t alike.
+ * A full ring drops the line and counts it rather than wait.
+ *
+ * Levels above LOG_COMPILED_LEVEL are compiled out, arguments and all;
+ * by default that is debug in release (NDEBUG) builds. Up to it, the
+ * level set at run time applies, and the arguments are only evaluated
+ * for lines that are logged.
+ *
+ * LOG_DEBUG_EVERY logs a line at most once per interval per call site,
+ * for per-packet events; the calls in between are counted and the count
+ * printed with the next line.
+ */
+
+enum LogLevel {
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARNING,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG,
+};
+
+#ifndef LOG_COMPILED_LEVEL
+#ifdef NDEBUG
+#define LOG_COMPILED_LEVEL LOG_LEVEL_INFO
+#else
+#define LOG_COMPILED_LEVEL LOG_LEVEL_DEBUG
+#endif
+#endif
+
+#define LOG_MAX_ARGS 8
+/* for all string arguments of a line together */
+#define LOG_TEXT_BYTES 96
+/* lines queued at most */
+#define LOG_RING_SIZE 4096
+
+/* One line as queued: the format and its arguments, not the text. */
+struct LogRecord {
+    struct Arg {
+        char type;                  ///< 'i' integer, 'f' floating point, 's' offset into text
+        union {
+            int64_t i;
+            double f;
+        };
+    };
+
+    std::atomic<size_t> sequence;
+    LogLevel level;
+    const char* format;
+    uint64_t suppressed;
+    int nb_args;
+    int text_size;
+    Arg args[LOG_MAX_ARGS];
+    char text[LOG_TEXT_BYTES];
+};
+
+class Logger {
+public:
+    Logger();
+    /* Writes what is queued. */
+    ~Logger();
+
+    Logger(const Logger&) = delete;
+    Logger& operator=(const Logger&) = delete;
+
+    void set_level(LogLevel level) {
+        max_level.store(level, std::memory_order_relaxed);
+    }
+    bool enabled(LogLevel level) const {
+        return level <= max_level.load(std::memory_order_relaxed);
+    }
+
+    /* format must outlive the process, a string literal. */
+    template <typename... Args>
+    void write(LogLevel level, uint64_t suppressed, const char* format, Args... args) {
+        LogRecord* r = claim();
+        if (!r)
+            return;
+        r->level = level;
+        r->format = format;
+        r->suppressed = suppressed;
+        r->nb_args = 0;
+        r->text_size = 0;
+        capture(*r, args...);
+        commit(r);
+    }
+
+    /* lines the full ring dropped */
+    uint64_t dropped() const {
+        return nb_dropped.load(std::memory_order_relaxed);
+    }
+
+private:
+    LogRecord* claim();
+    void commit(LogRecord* r);
+    void start();
+    void flush_loop();
+    /* Formats every committed line into the buffers; returns whether there was one. */
+    bool drain(std::string& out, std::string& err);
+
+    static void capture(LogRecord& r) {
+    }
+    template <typename T, typename... Rest>
+    static void capture(LogRecord& r, T v, Rest... rest) {
+        add_arg(r, v);
+        capture(r, rest...);
+    }
+
+    template <typename T>
+    static typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type
+    add_arg(LogRecord& r, T v) {
+        if (r.nb_args < LOG_MAX_ARGS) {
+            r.args[r.nb_args].type = 'i';
+            r.args[r.nb_args++].i = (int64_t)v;
+        }
+    }
+    template <typename T>
+    static typename std::enable_if<std::is_floating_point<T>::value>::type add_arg(LogRecord& r, T v) {
+        if (r.nb_args < LOG_MAX_ARGS) {
+            r.args[r.nb_args].type = 'f';
+            r.args[r.nb_args++].f = v;
+        }
+    }
+    static void add_arg(LogRecord& r, const char* s);
+    static void add_arg(LogRecord& r, const std::string& s) {
+        add_arg(r, s.c_str());
+    }
+
+    /* never freed, a thread still logging at exit writes into it */
+    LogRecord* ring;
+    std::atomic<int> max_level{ LOG_LEVEL_INFO };
+    /* written by every line */
+    char pad0[64];
+    std::atomic<size_t> write_position{ 0 };
+    std::atomic<uint64_t> nb_dropped{ 0 };
+    char pad1[64];
+
+    /* the flusher starts with the first line */
+    std::atomic<bool> started{ false };
+    std::mutex start_mutex;
+    std::atomic<bool> stopping{ false };
+    std::thread flusher;
+    /* flusher only */
+    size_t read_position = 0;
+    uint64_t reported_dropped = 0;
+};
+
+extern Logger logger;
+
+/* At most one line per interval_ms from one call site. */
+class LogRateLimit {
+public:
+    explicit LogRateLimit(int64_t interval_ms) : interval_us(interval_ms * 1000) {
+    }
+
+    /* Whether to log now; if so, suppressed is the calls not logged since. */
+    bool allow(uint64_t& suppressed);
+
+private:
+    int64_t interval_us;
+    std::atomic<int64_t> next_us{ INT64_MIN };
+    std::atomic<uint64_t> skipped{ 0 };
+};
+
+#define LOG(level, ...) do { \
+        if ((level) <= LOG_COMPILED_LEVEL && logger.enabled(level)) \
+            logger.write(level, 0, __VA_ARGS__); \
+    } while (0)
+
+#define LOG_ERROR(...) LOG(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARNING(...) LOG(LOG_LEVEL_WARNING, __VA_ARGS__)
+#define LOG_INFO(...) LOG(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+#define LOG_DEBUG_EVERY(interval_ms, ...) do { \
+        if (LOG_LEVEL_DEBUG <= LOG_COMPILED_LEVEL && logger.enabled(LOG_LEVEL_DEBUG)) { \
+            static LogRateLimit log_limit(interval_ms); \
+            uint64_t log_suppressed; \
+            if (log_limit.allow(log_suppressed)) \
+                logger.write(LOG_LEVEL_DEBUG, log_suppressed, __VA_ARGS__); \
+        } \
+    } while (0)
+
+#endif /* WEBDRIVERTORSO_LOG_H */
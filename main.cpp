@@ -5,482 +5,608 @@
 #include <ws2tcpip.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 
+#include <atomic>
 #include <iostream>
+#include <vector>
 #include <chrono>
+#include <memory>
+#include <string>
 #include <thread>
-#include "easyrtmp/data_layers/tcp_network.h"
-#include "easyrtmp/rtmp_client_session.h"
-#include "easyrtmp/utils.h"
-#include "easyrtmp/rtmp_exception.h"
-#include <cassert>
+#include "abr.h"
+#include "corpus.h"
+#include "encoder_tune.h"
+#include "fanout.h"
+#include "flv_sink.h"
+#include "log.h"
+#include "metrics.h"
+#include "pacer.h"
+#include "torso_channel.h"
+#include "channel_runner.h"
 
 extern "C" {
-#include "libavcodec/avcodec.h"
-#include <libavutil/opt.h>
-#include <libavutil/mem.h>
-#include <libavformat/avio.h>
-#include <libavformat/avformat.h>
-
-    int av_isom_write_avcc(AVIOContext* pb, const uint8_t* data, int len);
-    int av_avc_parse_nal_units_buf(const uint8_t* buf_in, uint8_t** buf, int* size);
+#include <libavutil/mathematics.h>
 }
 
 using namespace std;
 
-AVCodecContext* c_video = NULL;
-AVCodecContext* c_audio = NULL;
-AVPacket* pkt_video = NULL;
-AVPacket* pkt_audio = NULL;
-AVFrame* frame_video = NULL;
-AVFrame* frame_audio = NULL;
-AVFormatContext* oc = NULL;
-
-
-
-static int write_packet(void* opaque, uint8_t* buf, int buf_size)
-{
-    return buf_size;
+/* what every channel of the process does, set from the command line */
+ChannelOptions channel_options;
+uint32_t latency_probe_stream_id = 0;
+PacingOptions pacing_options;
+/* with channel_options.abr */
+AbrOptions abr_options;
+
+void print_pacing_stats(const Pacer& pacer) {
+    uint64_t counts[JitterHistogram::nb_buckets] = {};
+    pacer.jitter().merge_into(counts);
+    JitterHistogram::print("Send", counts);
+    if (pacer.skips())
+        printf("Send schedule restarted %llu times\n", (unsigned long long)pacer.skips());
 }
 
-int init_video_codec(AVCodecContext* c, const AVCodec* codec) {
-    /* put sample parameters */
-    c->bit_rate = 2500000;
-    /* resolution must be a multiple of two */
-    c->width = 1920;
-    c->height = 1080;
-    /* frames per second */
-    c->time_base = { 1, 25 };
-    c->framerate = { 25, 1 };
-
-    //c->gop_size = 10;
-    //c->max_b_frames = 1;
-    c->pix_fmt = AV_PIX_FMT_YUV420P;
-    c->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
-
-    //if (codec->id == AV_CODEC_ID_H264)
-        //av_opt_set(c->priv_data, "preset", "veryfast", 0);
-
-    int ret = avcodec_open2(c, codec, NULL);
-    if (ret < 0) {
-        char errbuf[100]{ 0 };
-        av_make_error_string(errbuf, 100, ret);
-        fprintf(stderr, "Could not open codec: %s\n", errbuf);
-        exit(1);
+/*
+ * Paces the channel's packets against the wall clock, see pacer.h. The
+ * wait is cut into slices of at most 5 ms, so a packet of the other
+ * stream that the encoders put in front meanwhile is not held back.
+ * Publishing never blocks on a destination (an FLV file waits for its
+ * writer); the stage ends when every output has failed.
+ *
+ * Backpressure from the destinations (see fanout.h) is acted on here:
+ * while one is congested, the non-reference frames are skipped, and
+ * while one drops, an IDR is requested so it can resume. One request is
+ * outstanding at a time, the next only after a keyframe went out. A
+ * stream without non-reference frames (no B frames: zerolatency,
+ * --skip-static, --flat-encoder) skips video up to a requested IDR
+ * instead, so the picture freezes for a moment.
+ *
+ * With --abr the video bitrate follows what the destinations manage to
+ * send, see abr.h; the slowest congested destination sets it for all.
+ *
+ * The channel, the outputs and the pacer are in the metrics export (see
+ * metrics.h) while the stage runs.
+ */
+void send_stage(TorsoChannel& channel, FanOut& out) {
+    SteadyClock clock(pacing_options.spin_us);
+    PacingOptions pacer_options = pacing_options;
+    AVRational framerate = channel.video_codec()->framerate;
+    pacer_options.frame_period_us = 1000000LL * framerate.den / framerate.num;
+    Pacer pacer(clock, pacer_options);
+    pacer.start();
+    int64_t next_stats_us = pacer.deadline_us(10000);
+    std::atomic<uint64_t> shed{ 0 };
+    std::atomic<uint64_t> keyframe_requests{ 0 };
+    bool keyframe_requested = false;
+
+    int metrics_id = metrics.add([&](MetricsWriter& w) {
+        ChannelMetrics channel_metrics;
+        channel.add_metrics(channel_metrics);
+        channel_metrics.write(w);
+        PacingMetrics pacing;
+        pacing.add(pacer);
+        pacing.write(w);
+        out.write_metrics(w);
+        w.counter("webdrivertorso_shed_frames_total", "Frames skipped while an output was congested.", "",
+            shed.load(std::memory_order_relaxed));
+        w.counter("webdrivertorso_keyframe_requests_total", "IDRs requested for an output that dropped.", "",
+            keyframe_requests.load(std::memory_order_relaxed));
+    });
+
+    std::unique_ptr<AbrController> abr;
+    std::vector<LinkSample> links;
+    if (channel_options.abr) {
+        AbrOptions options = abr_options;
+        options.reserved_bps = channel.audio_codec()->bit_rate;
+        abr.reset(new AbrController(options, channel.video_codec()->bit_rate));
+        if (abr->bitrate() != channel.video_codec()->bit_rate)
+            channel.set_video_bitrate(abr->bitrate());
     }
 
-    return 0;
-}
+    while (out.alive()) {
+        if (clock.now_us() >= next_stats_us) {
+            channel.print_pipeline_stats();
+            out.print_stats();
+            print_pacing_stats(pacer);
+            printf("Backpressure: %llu frames skipped, %llu keyframes requested\n",
+                (unsigned long long)shed.load(std::memory_order_relaxed),
+                (unsigned long long)keyframe_requests.load(std::memory_order_relaxed));
+            if (abr)
+                printf("ABR: video %lld kbit/s, %llu decreases, %llu increases\n",
+                    (long long)(abr->bitrate() / 1000), (unsigned long long)abr->decreases(),
+                    (unsigned long long)abr->increases());
+            next_stats_us += 10000000;
+        }
 
-int init_audio_codec(AVCodecContext* c, const AVCodec* codec) {
-    /* put sample parameters */
-    c->bit_rate = 320000;
-    /* check that the encoder supports s16 pcm input */
-    c->sample_fmt = AV_SAMPLE_FMT_FLTP;
-    c->sample_rate = 48000;
-    av_channel_layout_default(&c->ch_layout, 2);
-    c->channels = 2;
-    c->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
-    /* open it */
-    if (avcodec_open2(c, codec, NULL) < 0) {
-        fprintf(stderr, "Could not open codec\n");
-        exit(1);
-    }
-    return 0;
-}
+        if (abr) {
+            out.sample_links(links);
+            int64_t bps = abr->update(clock.now_us(), links);
+            if (bps) {
+                channel.set_video_bitrate(bps);
+                out.update_metadata(channel.stream_info());
+                printf("ABR: video %lld kbit/s\n", (long long)(bps / 1000));
+            }
+        }
 
-int init_codecs() {
-    const AVCodec* codec_video = avcodec_find_encoder(AV_CODEC_ID_H264);
-    if (!codec_video) {
-        fprintf(stderr, "Codec '%s' not found\n", "aac");
-        exit(1);
-    }
-    const AVCodec* codec_audio = avcodec_find_encoder(AV_CODEC_ID_AAC);
-    if (!codec_audio) {
-        fprintf(stderr, "Codec '%s' not found\n", "aac");
-        exit(1);
-    }
+        if (!pacer.wait(channel.next_due_ms(), 5000))
+            continue;
 
-    c_video = avcodec_alloc_context3(codec_video);
-    if (!c_video) {
-        fprintf(stderr, "Could not allocate video codec context\n");
-        exit(1);
-    }
+        Backpressure backpressure = out.backpressure();
+        if (backpressure == BACKPRESSURE_RESYNC && !keyframe_requested) {
+            channel.request_keyframe();
+            keyframe_requested = true;
+            keyframe_requests++;
+        }
+        if ((backpressure != BACKPRESSURE_NONE || channel.dropping_to_keyframe()) &&
+            (channel.drop_disposable() || (!channel.has_disposable_frames() && channel.drop_to_keyframe()))) {
+            shed++;
+            continue;
+        }
 
-    c_audio = avcodec_alloc_context3(codec_audio);
-    if (!c_audio) {
-        fprintf(stderr, "Could not allocate audio codec context\n");
-        exit(1);
+        bool key;
+        SharedMessage msg = channel.pop_message(key);
+        out.publish(msg, key);
+        if (key)
+            keyframe_requested = false;
     }
-
-    init_video_codec(c_video, codec_video);
-    init_audio_codec(c_audio, codec_audio);
-    return 0;
+    metrics.remove(metrics_id);
 }
 
-uint64_t t = 0;
+WSADATA wsaData;
 
-int generate_audio_frame(AVFrame* frame, float freq) {
-    int ret = av_frame_make_writable(frame);
-    if (ret < 0)
+void init_network() {
+    int iResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
+    if (iResult != 0) {
+        printf("WSAStartup failed with error: %d\n", iResult);
         exit(1);
-    float tincr = 2 * M_PI * freq / frame->sample_rate;
-
-    for (int j = 0; j < frame->nb_samples; j++) {
-        float v = (sin(t * tincr));
-
-        for (int k = 0; k < frame->ch_layout.nb_channels; k++) {
-            float* samples = (float*)frame->data[k];
-            samples[j] = v;
-        }
-        t++;
     }
-    return 0;
-}
-
-struct Rect {
-    int x = 0;
-    int y = 0;
-    int width = 0;
-    int height = 0;
-};
-
-Rect blueRect;
-Rect redRect;
-
-Rect generate_rect(int width, int height) {
-    assert(width >= height);
-    int minWidth = height / 10;
-    int maxWidth = height / 2;
-
-    int w = rand() % (maxWidth - minWidth) + minWidth;
-    int h = rand() % (maxWidth - minWidth) + minWidth;
-    w -= w % 2;
-    h -= h % 2;
-
-    int x = rand() % (width - w);
-    int y = rand() % (height - h);
-    x -= x % 2;
-    y -= y % 2;
-
-    Rect res;
-    res.width = w;
-    res.height = h;
-    res.x = x;
-    res.y = y;
-    return res;
 }
 
-int change_rects(int width, int height) {
-    blueRect = generate_rect(width, height);
-    redRect = generate_rect(width, height);
-    return 0;
+ChannelConfig channel_config(uint32_t seed, uint32_t stream_id) {
+    ChannelConfig config;
+    config.options = channel_options;
+    config.seed = seed;
+    config.stream_id = stream_id;
+    return config;
 }
 
-struct YUVColor {
-    int Y = 0;
-    int U = 0;
-    int V = 0;
-};
-
-YUVColor get_yuv_from_rgb(int R, int G, int B) {
-    int Y = 0.183f * R + 0.614f * G + 0.062f * B + 16;
-    int U = -0.101f * R - 0.338f * G + 0.439f * B + 128;
-    int V = 0.439f * R - 0.399f * G - 0.040f * B + 128;
-    YUVColor c;
-    c.Y = Y;
-    c.U = U;
-    c.V = V;
-    return c;
-}
+int run_live(FanOut& out) {
+    TorsoChannel channel(channel_config((uint32_t)time(NULL), latency_probe_stream_id));
+    channel.init();
 
+    out.start(channel.stream_info(), channel.headers());
+    channel.start_threads();
+    send_stage(channel, out);
+    channel.stop_threads();
+    out.stop();
 
-void clean_frame(AVFrame* frame) {
-    memset(frame->data[0], 255, frame->linesize[0] * frame->height);
-    memset(frame->data[1], 128, frame->linesize[1] * frame->height / 2);
-    memset(frame->data[2], 128, frame->linesize[2] * frame->height / 2);
+    std::cout << "All outputs failed" << endl;
+    return 1;
 }
 
-void draw_rect_on_frame(AVFrame* frame, Rect rect, YUVColor color) {
-    for (int y = rect.y; y < rect.y + rect.height; y++, y++) {
-        memset(frame->data[0] + frame->linesize[0] * (y)+rect.x, color.Y, rect.width);
-        memset(frame->data[0] + frame->linesize[0] * (y + 1) + rect.x, color.Y, rect.width);
-        memset(frame->data[1] + (frame->linesize[1] * (y / 2)) + rect.x / 2, color.U, rect.width / 2);
-        memset(frame->data[2] + frame->linesize[2] * (y / 2) + rect.x / 2, color.V, rect.width / 2);
+int run_bake(const char* path, int scenes) {
+    TorsoChannel channel(channel_config((uint32_t)time(NULL), 0));
+    channel.init();
+    const AVCodecContext* c_video = channel.video_codec();
+    const AVCodecContext* c_audio = channel.audio_codec();
+
+    CorpusHeader header;
+    memset(&header, 0, sizeof(header));
+    header.width = c_video->width;
+    header.height = c_video->height;
+    header.framerate = c_video->framerate.num / c_video->framerate.den;
+    header.video_bitrate = c_video->bit_rate;
+    header.sample_rate = c_audio->sample_rate;
+    header.channels = c_audio->ch_layout.nb_channels;
+    header.audio_bitrate = c_audio->bit_rate;
+    /* at least; bake() ends the loop at the next IDR */
+    int64_t duration_ms = av_rescale_q(scenes * TorsoChannel::change_interval, c_video->time_base, { 1, 1000 });
+
+    std::vector<uint8_t> avcc = make_avcc(c_video->extradata, c_video->extradata_size);
+    CorpusWriter writer;
+    if (!writer.open(path, header, avcc.data(), avcc.size(), c_audio->extradata, c_audio->extradata_size)) {
+        fprintf(stderr, "Could not create %s\n", path);
+        return 1;
     }
-}
-
-int generate_video_frame(AVFrame* frame, Rect blueRect) {
-    int ret = av_frame_make_writable(frame);
-    if (ret < 0)
-        exit(1);
-    clean_frame(frame);
-    draw_rect_on_frame(frame, blueRect, get_yuv_from_rgb(0, 0, 255));
-    draw_rect_on_frame(frame, redRect, get_yuv_from_rgb(255, 0, 0));
-    return 0;
-}
-
-int64_t video_pts_ms = 0;
-int64_t audio_pts_ms = 0;
-
-int output_video(AVPacket* pkt, librtmp::RTMPClientSession& rtmp) {
-    av_packet_rescale_ts(pkt, { c_video->time_base.num, c_video->time_base.den }, { 1,1000 });
-    if (pkt->dts < 0)
-        pkt->dts = 0;
-
-    uint8_t* data = NULL;
-    int size = pkt->size;
-    int ret = av_avc_parse_nal_units_buf(pkt->data, &data, &size);
-
-    librtmp::RTMPMediaMessage mediaMsg;
-    mediaMsg.message_type = librtmp::RTMPMessageType::VIDEO;
-    mediaMsg.message_stream_id = 1;
-    mediaMsg.timestamp = pkt->dts;
-    mediaMsg.video.d.avc_packet_type = 1;
-    mediaMsg.video.d.composition_time = pkt->pts - pkt->dts;
-    mediaMsg.video.d.codec_id = (uint8_t)(librtmp::RTMPVideoCodec::AVC);
-    mediaMsg.video.d.frame_type = (pkt->flags & AV_PKT_FLAG_KEY) ? 1 : 2;
-    mediaMsg.video.video_data_send.resize(size);
-    memcpy(mediaMsg.video.video_data_send.data(), data, size);
-    rtmp.SendRTMPMessage(mediaMsg);
-    std::cout << "Out Video " << pkt->dts << endl;    
-    video_pts_ms = pkt->dts;
-    av_free(data);
-    return 0;
-}
-
-int output_audio(AVPacket* pkt, librtmp::RTMPClientSession& rtmp) {
-    av_packet_rescale_ts(pkt, { c_audio->time_base.num, c_audio->time_base.den }, { 1,1000 });
-    if (pkt->dts < 0)
-        pkt->dts = 0;
-
-    librtmp::RTMPMediaMessage mediaMsg;
-    mediaMsg.message_type = librtmp::RTMPMessageType::AUDIO;
-    mediaMsg.message_stream_id = 1;
-    mediaMsg.timestamp = pkt->dts;
-    mediaMsg.audio.aac_packet_type = 1;
-    mediaMsg.audio.d.channels = 1;
-    mediaMsg.audio.d.format = (int)librtmp::RTMPAudioCodec::AAC;
-    mediaMsg.audio.d.sample_rate = 3;
-    mediaMsg.audio.d.sample_size = 1;
-    mediaMsg.audio.audio_data_send.resize(pkt->size);
-    memcpy(mediaMsg.audio.audio_data_send.data(), pkt->data, pkt->size);
-    rtmp.SendRTMPMessage(mediaMsg);
-    std::cout << "Out Audio " << pkt->dts << endl;        
-    audio_pts_ms = pkt->dts;
 
+    channel.start_threads();
+    bool ok = channel.bake(writer, duration_ms);
+    channel.stop_threads();
+    if (!ok || !writer.finish((uint32_t)duration_ms)) {
+        fprintf(stderr, "Could not write %s\n", path);
+        return 1;
+    }
+    std::cout << "Baked " << scenes << " scenes, " << duration_ms << " ms to " << path << endl;
     return 0;
 }
 
-int encode(AVFrame* frame, AVCodecContext* c, AVPacket* pkt, librtmp::RTMPClientSession& rtmp, int (*output_video)(AVPacket*, librtmp::RTMPClientSession&)) {
-    int ret = avcodec_send_frame(c, frame);
-    if (ret < 0) {
-        fprintf(stderr, "Error sending a frame for encoding\n");
-        exit(1);
+/*
+ * Streams a baked corpus in an endless loop. The only per-packet work is
+ * shifting the timestamps by the loop count and the socket write.
+ */
+int run_replay(FanOut& out, const char* path) {
+    CorpusFile corpus;
+    if (!corpus.open(path)) {
+        fprintf(stderr, "Could not open corpus %s\n", path);
+        return 1;
     }
-
-    while (ret >= 0) {
-        ret = avcodec_receive_packet(c, pkt);
-        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-            break;
-        else if (ret < 0) {
-            fprintf(stderr, "Error during encoding\n");
-            exit(1);
+    const CorpusHeader* header = corpus.header();
+
+    RtmpStreamInfo info;
+    info.width = header->width;
+    info.height = header->height;
+    info.framerate = header->framerate;
+    info.video_bitrate = header->video_bitrate;
+    info.audio_bitrate = header->audio_bitrate;
+    info.sample_rate = header->sample_rate;
+    info.channels = header->channels;
+
+    std::vector<SharedMessage> headers;
+    headers.push_back(video_message(0, 0, 0, true, corpus.avcc(), header->avcc_size));
+    headers.push_back(audio_message(0, 0, corpus.asc(), header->asc_size));
+    out.start(info, headers);
+
+    SteadyClock clock(pacing_options.spin_us);
+    PacingOptions pacer_options = pacing_options;
+    pacer_options.frame_period_us = 1000000 / header->framerate;
+    Pacer pacer(clock, pacer_options);
+    int metrics_id = metrics.add([&](MetricsWriter& w) {
+        PacingMetrics pacing;
+        pacing.add(pacer);
+        pacing.write(w);
+        out.write_metrics(w);
+    });
+    pacer.start();
+    int64_t next_stats_ms = 10000;
+    uint32_t probe_sequence = 0;
+    for (int64_t loop_start_ms = 0; out.alive(); loop_start_ms += header->duration_ms) {
+        for (uint32_t i = 0; i < header->packet_count && out.alive(); i++) {
+            const CorpusPacket& pkt = corpus.packets()[i];
+            int64_t timestamp = loop_start_ms + pkt.dts_ms;
+            pacer.wait(timestamp);
+
+            bool key = pkt.flags & CORPUS_FLAG_KEY;
+            if (pkt.type == CORPUS_PACKET_VIDEO && channel_options.latency_probe)
+                out.publish(probed_video_message(timestamp, pkt.cts_ms, key,
+                    corpus.payload(pkt), pkt.size, latency_probe_stream_id, probe_sequence++), key);
+            else if (pkt.type == CORPUS_PACKET_VIDEO)
+                out.publish(video_message(1, timestamp, pkt.cts_ms, key, corpus.payload(pkt), pkt.size), key);
+            else
+                out.publish(audio_message(1, timestamp, corpus.payload(pkt), pkt.size), false);
+
+            if (timestamp >= next_stats_ms) {
+                out.print_stats();
+                print_pacing_stats(pacer);
+                next_stats_ms += 10000;
+            }
         }
-        output_video(pkt, rtmp);
-        av_packet_unref(pkt);
     }
-    return 0;
-}
+    metrics.remove(metrics_id);
+    out.stop();
 
-WSADATA wsaData;
-
-void init_network() {
-    int iResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
-    if (iResult != 0) {
-        printf("WSAStartup failed with error: %d\n", iResult);
-        exit(1);
-    }
+    std::cout << "All outputs failed" << endl;
+    return 1;
 }
-int main() {
-    srand(time(NULL));
-    init_network();
-
-    init_codecs();
-
-    pkt_video = av_packet_alloc();
-    pkt_audio = av_packet_alloc();
-    if (!pkt_video)
-        exit(1);
-    if (!pkt_audio)
-        exit(1);
 
-    frame_video = av_frame_alloc();
-    frame_audio = av_frame_alloc();
-    if (!frame_video) {
-        fprintf(stderr, "Could not allocate video frame\n");
-        exit(1);
-    }
-    if (!frame_audio) {
-        fprintf(stderr, "Could not allocate audio frame\n");
-        exit(1);
+/*
+ * Runs every channel of a channels file in this process. One line per
+ * channel: rtmp://host[:port]/app/key, optionally followed by the seed of
+ * its scene sequence; blank lines and lines starting with # are skipped.
+ * With --latency-probe, the channels get consecutive stream ids.
+ */
+int run_channels(const char* path, int workers, const SendQueueOptions& send_queue) {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return 1;
     }
 
-    frame_video->format = c_video->pix_fmt;
-    frame_video->width = c_video->width;
-    frame_video->height = c_video->height;
-    int ret = av_frame_get_buffer(frame_video, 0);
-    if (ret < 0) {
-        fprintf(stderr, "Could not allocate the video frame data\n");
-        exit(1);
+    /* the pool keeps the cores busy, a thread per encoder would only add switches */
+    ChannelConfig config;
+    config.options = channel_options;
+    config.options.encoder_threads = 1;
+    config.stream_id = latency_probe_stream_id;
+    ChannelRunner runner(workers, pacing_options, send_queue);
+    char line[1024];
+    int n = 0;
+    for (int line_number = 1; fgets(line, sizeof(line), f); line_number++) {
+        char url[1024];
+        unsigned seed;
+        int fields = sscanf(line, "%1023s %u", url, &seed);
+        if (fields < 1 || url[0] == '#')
+            continue;
+        RtmpUrl parsed_url;
+        if (!parse_rtmp_url(url, parsed_url)) {
+            fprintf(stderr, "%s:%d: invalid destination, expected rtmp://host[:port]/app/key\n", path, line_number);
+            fclose(f);
+            return 1;
+        }
+        config.seed = fields < 2 ? (uint32_t)time(NULL) + n : seed;
+        runner.add(config, parsed_url);
+        config.stream_id++;
+        n++;
     }
-
-
-    frame_audio->nb_samples = c_audio->frame_size;
-    frame_audio->format = c_audio->sample_fmt;
-    frame_audio->sample_rate = c_audio->sample_rate;
-    ret = av_channel_layout_copy(&frame_audio->ch_layout, &c_audio->ch_layout);
-    if (ret < 0)
-        exit(1);
-
-    /* allocate the data buffers */
-    ret = av_frame_get_buffer(frame_audio, 0);
-    if (ret < 0) {
-        fprintf(stderr, "Could not allocate audio data buffers\n");
-        exit(1);
+    fclose(f);
+    if (!n) {
+        fprintf(stderr, "No channels in %s\n", path);
+        return 1;
     }
 
+    std::cout << "Running " << n << " channels on " << workers << " workers" << endl;
+    runner.run();
+    std::cout << "All channels failed" << endl;
+    return 1;
+}
 
+void usage(const char* name) {
+    fprintf(stderr,
+        "Usage: %s [--skip-static | --flat-encoder] [--cache-audio] [--latency-probe <stream id>]\n"
+        "          [--size <width>x<height>] [--abr <floor kbit/s>,<ceiling kbit/s>] [encoder] [pacing] [outputs]\n"
+        "       %s bake <corpus file> <scenes> [--skip-static | --flat-encoder] [--cache-audio] [encoder]\n"
+        "       %s replay <corpus file> [--latency-probe <stream id>] [pacing] [outputs]\n"
+        "       %s channels <channels file> [--workers <n>] [--skip-static | --flat-encoder] [--cache-audio]\n"
+        "                [--latency-probe <first stream id>] [--catch-up burst | skip] [--max-late <ms>] [encoder]\n"
+        "                [--slow-consumer drop | disconnect] [--send-queue <messages>]\n"
+        "                [--high-watermark <KB>,<ms>] [--low-watermark <KB>,<ms>] (per channel)\n"
+        "encoder: [--preset <x264 preset>] [--tune <x264 tunes>] [--thread-type frame | slice] [--slices <n>]\n"
+        "         [--gop <frames>] [--bframes <n>]\n"
+        "         [--auto-tune <CPU ms per frame> [--tune-cache <file>]] (live and channels, picks the\n"
+        "         preset, tune and threading, see encoder_tune.h)\n"
+        "pacing: [--catch-up burst | skip] [--max-late <ms>] [--spin <us>] [--unpaced]\n"
+        "outputs: [--to rtmp://host[:port]/app/key]... [--flv <file> | --flv -] [--null]\n"
+        "         [--slow-consumer drop | disconnect]\n"
+        "         [--send-queue <messages>] [--high-watermark <KB>,<ms>] [--low-watermark <KB>,<ms>]\n"
+        "live, replay and channels export metrics with [--metrics-port <port>] [--metrics-file <file>]\n"
+        "--log-level error | warning | info | debug (debug adds an Out Video and an Out Audio line a second)\n",
+        name, name, name, name);
+}
 
-    librtmp::ParsedUrl parsed_url;
-    parsed_url.type = librtmp::ProtoType::RTMP;
-    parsed_url.port = 1935;
-
-    parsed_url.app = "live2";
-    parsed_url.key = "key";
-    parsed_url.url = "127.0.0.1";
-
-    parsed_url.app = "live2";
-    parsed_url.key = "j0c0-v7xv-4kmb-gtu7-5r5p";
-    parsed_url.url = "a.rtmp.youtube.com";
-    parsed_url.app = "app";
-    parsed_url.key = "live_702512547_mCogJenh8dxfbsrIKa8KVA6axmoFii";
-    parsed_url.url = "vie02.contribute.live-video.net";
-
-
-    TCPClient tcp_client;
-    std::shared_ptr<TCPNetwork> tcp_network;
-
-    try {
-        tcp_network = tcp_client.ConnectToHost(parsed_url.url.c_str(), parsed_url.port);
-        librtmp::RTMPEndpoint rtmp_endpoint(tcp_network.get());
-        librtmp::RTMPClientSession rtmp_client(&rtmp_endpoint);
-
-        librtmp::ClientParameters client_parameters;
-        client_parameters.app = parsed_url.app;
-        client_parameters.url = parsed_url.url;
-        client_parameters.key = parsed_url.key;
-        client_parameters.has_video = true;
-        client_parameters.width = c_video->width;
-        client_parameters.height = c_video->height;
-        client_parameters.video_datarate = c_video->bit_rate / 1024;
-        client_parameters.framerate = c_video->framerate.num / c_video->framerate.den;
-        client_parameters.video_codec = librtmp::RTMPVideoCodec::AVC;
-        client_parameters.has_audio = true;
-        client_parameters.audio_codec = librtmp::RTMPAudioCodec::AAC;
-        client_parameters.audio_datarate = c_audio->bit_rate / 1024;
-        client_parameters.channels = c_audio->ch_layout.nb_channels;
-        client_parameters.samplesize = 16;
-        client_parameters.samplerate = c_audio->sample_rate;
-        rtmp_client.SendClientParameters(&client_parameters);
-
-        {
-            AVIOContext* avio_ctx = NULL;
-            uint8_t* buffer = NULL, * avio_ctx_buffer = NULL;
-            size_t buffer_size, avio_ctx_buffer_size = 4096;
-            avio_ctx_buffer = (uint8_t*)av_malloc(avio_ctx_buffer_size);
-            avio_ctx = avio_alloc_context(avio_ctx_buffer, avio_ctx_buffer_size,
-                1, NULL, NULL, &write_packet, NULL);
-            ret = av_isom_write_avcc(avio_ctx, c_video->extradata, c_video->extradata_size);
-
-            int s = avio_ctx->buf_ptr - avio_ctx->buffer;
-
-            librtmp::RTMPMediaMessage mediaMsg;
-            mediaMsg.message_type = librtmp::RTMPMessageType::VIDEO;
-            mediaMsg.message_stream_id = 1;
-            mediaMsg.timestamp = 0;
-            mediaMsg.video.d.avc_packet_type = 0;
-            mediaMsg.video.d.codec_id = (int)(librtmp::RTMPVideoCodec::AVC);
-            mediaMsg.video.d.frame_type = 1;
-            mediaMsg.video.video_data_send.resize(s);
-            memcpy(mediaMsg.video.video_data_send.data(), avio_ctx->buffer,
-                s);
-            rtmp_client.SendRTMPMessage(mediaMsg);
-
-            //av_free(data);
+int main(int argc, char* argv[]) {
+    const char* command = NULL;
+    std::vector<const char*> args;
+    std::vector<RtmpUrl> destinations;
+    std::vector<const char*> flv_paths;
+    bool null_sink = false;
+    SendQueueOptions send_queue;
+    int workers = max(1u, std::thread::hardware_concurrency());
+    int metrics_port = 0;
+    std::string metrics_file;
+    double auto_tune_ms = 0;
+    std::string tune_cache = "webdrivertorso.tune";
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--skip-static"))
+            channel_options.skip_static_frames = true;
+        else if (!strcmp(argv[i], "--flat-encoder"))
+            channel_options.flat_encoder = true;
+        else if (!strcmp(argv[i], "--cache-audio"))
+            channel_options.cache_audio = true;
+        else if (!strcmp(argv[i], "--latency-probe") && i + 1 < argc) {
+            channel_options.latency_probe = true;
+            latency_probe_stream_id = strtoul(argv[++i], NULL, 10);
         }
-
-        {
-            librtmp::RTMPMediaMessage mediaMsg;
-            mediaMsg.message_type = librtmp::RTMPMessageType::AUDIO;
-            mediaMsg.message_stream_id = 1;
-            mediaMsg.timestamp = 0;
-            mediaMsg.audio.aac_packet_type = 0;
-            mediaMsg.audio.d.channels = 1; //0 - mono, 1 - stereo
-            mediaMsg.audio.d.format = (int)librtmp::RTMPAudioCodec::AAC;
-            mediaMsg.audio.d.sample_rate
-                = 3; //0 - 5.5 Khz, 1 - 11 Khz, 2 - 22 Khz, 3 - 44 KHz
-            mediaMsg.audio.d.sample_size = 1; //0 - 8 bit, 1 - 16 bit
-            mediaMsg.audio.audio_data_send.resize(c_audio->extradata_size);
-            memcpy(mediaMsg.audio.audio_data_send.data(),
-                c_audio->extradata, c_audio->extradata_size);
-            rtmp_client.SendRTMPMessage(mediaMsg);
+        else if (!strcmp(argv[i], "--size") && i + 1 < argc) {
+            int width, height;
+            /* even, and landscape for the rects */
+            if (sscanf(argv[++i], "%dx%d", &width, &height) != 2 || height < 64 || width < height ||
+                width % 2 || height % 2) {
+                usage(argv[0]);
+                return 1;
+            }
+            channel_options.width = width;
+            channel_options.height = height;
         }
-
-        chrono::high_resolution_clock::time_point start_time = chrono::high_resolution_clock::now();
-        int64_t video_pts = 0;
-        int64_t audio_pts = 0;
-
-        change_rects(c_video->width, c_video->height);
-        float freq = 440;
-
-        int change_interval = 25;
-        bool changed_frame = false;
-        for (;;) {
-            if (video_pts % change_interval == 0 && !changed_frame) {
-                change_rects(c_video->width, c_video->height);
-                generate_video_frame(frame_video, blueRect);
-                freq = rand() % 400 + 200;
-                changed_frame = true;
+        else if (!strcmp(argv[i], "--preset") && i + 1 < argc)
+            channel_options.encoder.preset = argv[++i];
+        else if (!strcmp(argv[i], "--tune") && i + 1 < argc)
+            channel_options.encoder.tune = argv[++i];
+        else if (!strcmp(argv[i], "--thread-type") && i + 1 < argc) {
+            i++;
+            if (!strcmp(argv[i], "frame"))
+                channel_options.encoder.thread_type = FF_THREAD_FRAME;
+            else if (!strcmp(argv[i], "slice"))
+                channel_options.encoder.thread_type = FF_THREAD_SLICE;
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+        else if ((!strcmp(argv[i], "--slices") || !strcmp(argv[i], "--gop") || !strcmp(argv[i], "--bframes")) &&
+            i + 1 < argc) {
+            const char* name = argv[i];
+            int n = atoi(argv[++i]);
+            if (n < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            if (!strcmp(name, "--slices"))
+                channel_options.encoder.slices = n;
+            else if (!strcmp(name, "--gop"))
+                channel_options.encoder.gop_size = n;
+            else
+                channel_options.encoder.max_b_frames = n;
+        }
+        else if (!strcmp(argv[i], "--auto-tune") && i + 1 < argc) {
+            auto_tune_ms = atof(argv[++i]);
+            if (auto_tune_ms <= 0) {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "--tune-cache") && i + 1 < argc)
+            tune_cache = argv[++i];
+        else if (!strcmp(argv[i], "--abr") && i + 1 < argc) {
+            unsigned floor_kbps, ceiling_kbps;
+            if (sscanf(argv[++i], "%u,%u", &floor_kbps, &ceiling_kbps) != 2 || !floor_kbps ||
+                ceiling_kbps < floor_kbps) {
+                usage(argv[0]);
+                return 1;
+            }
+            channel_options.abr = true;
+            abr_options.floor_bps = floor_kbps * (int64_t)1000;
+            abr_options.ceiling_bps = ceiling_kbps * (int64_t)1000;
+        }
+        else if (!strcmp(argv[i], "--to") && i + 1 < argc) {
+            RtmpUrl parsed_url;
+            if (!parse_rtmp_url(argv[++i], parsed_url)) {
+                fprintf(stderr, "Invalid destination, expected rtmp://host[:port]/app/key\n");
+                return 1;
+            }
+            destinations.push_back(parsed_url);
+        }
+        else if (!strcmp(argv[i], "--flv") && i + 1 < argc)
+            flv_paths.push_back(argv[++i]);
+        else if (!strcmp(argv[i], "--null"))
+            null_sink = true;
+        else if (!strcmp(argv[i], "--slow-consumer") && i + 1 < argc) {
+            i++;
+            if (!strcmp(argv[i], "drop"))
+                send_queue.policy = SLOW_CONSUMER_DROP;
+            else if (!strcmp(argv[i], "disconnect"))
+                send_queue.policy = SLOW_CONSUMER_DISCONNECT;
+            else {
+                usage(argv[0]);
+                return 1;
             }
-            if (video_pts_ms < audio_pts_ms) {
-                frame_video->pts = video_pts;
-                video_pts++;
-                changed_frame = false;
-                encode(frame_video, c_video, pkt_video, rtmp_client, &output_video);                                
+        }
+        else if (!strcmp(argv[i], "--send-queue") && i + 1 < argc) {
+            int n = atoi(argv[++i]);
+            if (n <= 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            send_queue.capacity = n;
+        }
+        else if ((!strcmp(argv[i], "--high-watermark") || !strcmp(argv[i], "--low-watermark")) && i + 1 < argc) {
+            bool high = !strcmp(argv[i], "--high-watermark");
+            unsigned kb;
+            int ms;
+            if (sscanf(argv[++i], "%u,%d", &kb, &ms) != 2 || ms < 0) {
+                usage(argv[0]);
+                return 1;
             }
+            (high ? send_queue.high_bytes : send_queue.low_bytes) = (size_t)kb * 1024;
+            (high ? send_queue.high_ms : send_queue.low_ms) = ms;
+        }
+        else if (!strcmp(argv[i], "--catch-up") && i + 1 < argc) {
+            i++;
+            if (!strcmp(argv[i], "burst"))
+                pacing_options.catch_up = CATCH_UP_BURST;
+            else if (!strcmp(argv[i], "skip"))
+                pacing_options.catch_up = CATCH_UP_SKIP;
             else {
-                generate_audio_frame(frame_audio, freq);
-                frame_audio->pts = audio_pts;
-                audio_pts += c_audio->frame_size;
-                encode(frame_audio, c_audio, pkt_audio, rtmp_client, &output_audio);                
+                usage(argv[0]);
+                return 1;
             }
-
-            int64_t elapsed_ms = chrono::duration_cast<chrono::milliseconds>(chrono::high_resolution_clock::now() - start_time).count();
-            if (video_pts_ms > elapsed_ms) {
-                this_thread::sleep_for(chrono::milliseconds(video_pts_ms - elapsed_ms));
+        }
+        else if (!strcmp(argv[i], "--max-late") && i + 1 < argc)
+            pacing_options.max_late_us = atoi(argv[++i]) * (int64_t)1000;
+        else if (!strcmp(argv[i], "--spin") && i + 1 < argc)
+            pacing_options.spin_us = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--unpaced"))
+            pacing_options.unpaced = true;
+        else if (!strcmp(argv[i], "--metrics-port") && i + 1 < argc) {
+            metrics_port = atoi(argv[++i]);
+            if (metrics_port <= 0 || metrics_port > 65535) {
+                usage(argv[0]);
+                return 1;
             }
         }
-
+        else if (!strcmp(argv[i], "--metrics-file") && i + 1 < argc)
+            metrics_file = argv[++i];
+        else if (!strcmp(argv[i], "--log-level") && i + 1 < argc) {
+            static const char* levels[] = { "error", "warning", "info", "debug" };
+            i++;
+            int level = 0;
+            while (level < 4 && strcmp(argv[i], levels[level]))
+                level++;
+            if (level == 4) {
+                usage(argv[0]);
+                return 1;
+            }
+            logger.set_level((LogLevel)level);
+        }
+        else if (!strcmp(argv[i], "--workers") && i + 1 < argc) {
+            workers = atoi(argv[++i]);
+            if (workers <= 0) {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+        else if (!command && (!strcmp(argv[i], "bake") || !strcmp(argv[i], "replay") ||
+            !strcmp(argv[i], "channels")))
+            command = argv[i];
+        else if (command)
+            args.push_back(argv[i]);
+        else {
+            usage(argv[0]);
+            return 1;
+        }
     }
-    catch (TCPNetworkException& e) {
-        std::cout << "Connection error: " << e.what() << endl;
+
+    if (auto_tune_ms > 0 && channel_options.flat_encoder) {
+        fprintf(stderr, "--auto-tune tunes x264, the flat encoder has nothing to tune\n");
         return 1;
     }
-    catch (std::exception& e) {
-        std::cout << "Unexpected error: " << e.what() << endl;
-        return 1;
+    if (auto_tune_ms > 0 && (!command || !strcmp(command, "channels"))) {
+        ChannelOptions tune_options = channel_options;
+        /* as run_channels() runs them */
+        if (command)
+            tune_options.encoder_threads = 1;
+        channel_options.encoder = auto_tune_encoder(tune_options, auto_tune_ms, tune_cache);
     }
 
-    return 0;
+    if (command && !strcmp(command, "bake")) {
+        int scenes = args.size() == 2 ? atoi(args[1]) : 0;
+        if (scenes <= 0) {
+            usage(argv[0]);
+            return 1;
+        }
+        return run_bake(args[0], scenes);
+    }
+
+    if (command && !strcmp(command, "channels")) {
+        if (args.size() != 1) {
+            usage(argv[0]);
+            return 1;
+        }
+        init_network();
+        MetricsExporter exporter;
+        if (metrics_port || !metrics_file.empty())
+            exporter.start(metrics_port, metrics_file);
+        return run_channels(args[0], workers, send_queue);
+    }
+
+    if (destinations.empty() && flv_paths.empty() && !null_sink) {
+        RtmpUrl parsed_url;
+        parsed_url.app = "app";
+        parsed_url.key = "live_702512547_mCogJenh8dxfbsrIKa8KVA6axmoFii";
+        parsed_url.host = "vie02.contribute.live-video.net";
+        destinations.push_back(parsed_url);
+    }
+    /* outlives the destinations */
+    SendLoop send_loop;
+    FanOut out;
+    for (size_t i = 0; i < destinations.size(); i++)
+        out.add(std::unique_ptr<PacketSink>(new Destination(destinations[i], send_queue, send_loop)));
+    for (size_t i = 0; i < flv_paths.size(); i++)
+        out.add(std::unique_ptr<PacketSink>(new FlvSink(flv_paths[i])));
+    if (null_sink)
+        out.add(std::unique_ptr<PacketSink>(new NullSink));
+
+    init_network();
+    /* the last file is written once the outputs have failed */
+    MetricsExporter exporter;
+    if (metrics_port || !metrics_file.empty())
+        exporter.start(metrics_port, metrics_file);
+
+    if (command && !strcmp(command, "replay")) {
+        if (args.size() != 1) {
+            usage(argv[0]);
+            return 1;
+        }
+        return run_replay(out, args[0]);
+    }
+
+    return run_live(out);
 }
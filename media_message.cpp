@@ -0,0 +1,132 @@
+#include <string.h>
+
+#include "media_message.h"
+
+extern "C" {
+#include <libavutil/mem.h>
+#include <libavutil/intreadwrite.h>
+#include <libavformat/avio.h>
+#include "h264.h"
+#include "latency_sei.h"
+
+    int av_isom_write_avcc(AVIOContext* pb, const uint8_t* data, int len);
+}
+
+static int write_packet(void* opaque, uint8_t* buf, int buf_size)
+{
+    return buf_size;
+}
+
+MediaMessage make_video_message(int avc_packet_type, int64_t timestamp,
+    int composition_time, bool key, int size) {
+    MediaMessage mediaMsg;
+    mediaMsg.type = RTMP_VIDEO;
+    mediaMsg.timestamp = (uint32_t)timestamp;
+    mediaMsg.body.resize(VIDEO_TAG_HEADER_SIZE + size);
+    uint8_t* h = mediaMsg.body.data();
+    h[0] = (key ? 1 : 2) << 4 | 7;  // keyframe or inter frame, AVC
+    h[1] = (uint8_t)avc_packet_type;
+    AV_WB24(h + 2, (uint32_t)composition_time);
+    return mediaMsg;
+}
+
+SharedMessage share_message(MediaMessage& mediaMsg) {
+    return std::make_shared<MediaMessage>(std::move(mediaMsg));
+}
+
+SharedMessage video_message(int avc_packet_type, int64_t timestamp,
+    int composition_time, bool key, const uint8_t* data, int size) {
+    MediaMessage mediaMsg = make_video_message(avc_packet_type, timestamp, composition_time, key, size);
+    memcpy(mediaMsg.body.data() + VIDEO_TAG_HEADER_SIZE, data, size);
+    return share_message(mediaMsg);
+}
+
+bool is_vcl_nal(uint8_t nal_header) {
+    int type = nal_header & 0x1f;
+    return type >= H264_NAL_SLICE && type <= H264_NAL_IDR_SLICE;
+}
+
+int write_probe_nal(uint8_t* dst, uint32_t stream_id, uint32_t sequence) {
+    LatencyProbe probe;
+    probe.send_time_us = latency_clock_us();
+    probe.sequence = sequence;
+    probe.stream_id = stream_id;
+    int size = latency_sei_write(dst + 4, LATENCY_SEI_MAX_SIZE, &probe);
+    AV_WB32(dst, size);
+    return 4 + size;
+}
+
+SharedMessage probed_video_message(int64_t timestamp, int composition_time, bool key,
+    const uint8_t* data, int size, uint32_t stream_id, uint32_t sequence) {
+    int offset = 0;
+    while (size - offset > 4 && !is_vcl_nal(data[offset + 4])) {
+        uint32_t nal_size = AV_RB32(data + offset);
+        if (nal_size > (uint32_t)(size - offset - 4))
+            break;
+        offset += 4 + nal_size;
+    }
+
+    uint8_t probe_nal[4 + LATENCY_SEI_MAX_SIZE];
+    int probe_size = write_probe_nal(probe_nal, stream_id, sequence);
+    MediaMessage mediaMsg = make_video_message(1, timestamp, composition_time, key, size + probe_size);
+    uint8_t* dst = mediaMsg.body.data() + VIDEO_TAG_HEADER_SIZE;
+    memcpy(dst, data, offset);
+    memcpy(dst + offset, probe_nal, probe_size);
+    memcpy(dst + offset + probe_size, data + offset, size - offset);
+    return share_message(mediaMsg);
+}
+
+SharedMessage audio_message(int aac_packet_type, int64_t timestamp,
+    const uint8_t* data, int size) {
+    MediaMessage mediaMsg;
+    mediaMsg.type = RTMP_AUDIO;
+    mediaMsg.timestamp = (uint32_t)timestamp;
+    mediaMsg.body.resize(AUDIO_TAG_HEADER_SIZE + size);
+    mediaMsg.body[0] = 10 << 4 | 3 << 2 | 1 << 1 | 1;  // AAC, 44 kHz, 16 bit, stereo as FLV requires for AAC
+    mediaMsg.body[1] = (uint8_t)aac_packet_type;
+    memcpy(mediaMsg.body.data() + AUDIO_TAG_HEADER_SIZE, data, size);
+    return share_message(mediaMsg);
+}
+
+std::vector<uint8_t> make_avcc(const uint8_t* extradata, int extradata_size) {
+    AVIOContext* avio_ctx = NULL;
+    uint8_t* avio_ctx_buffer = NULL;
+    size_t avio_ctx_buffer_size = 4096;
+    avio_ctx_buffer = (uint8_t*)av_malloc(avio_ctx_buffer_size);
+    avio_ctx = avio_alloc_context(avio_ctx_buffer, avio_ctx_buffer_size,
+        1, NULL, NULL, &write_packet, NULL);
+    av_isom_write_avcc(avio_ctx, extradata, extradata_size);
+
+    int s = avio_ctx->buf_ptr - avio_ctx->buffer;
+    std::vector<uint8_t> avcc(avio_ctx->buffer, avio_ctx->buffer + s);
+    av_free(avio_ctx->buffer);
+    avio_context_free(&avio_ctx);
+    return avcc;
+}
+
+bool VideoGather::build(const uint8_t* data, int data_size) {
+    size = ff_nal_units_create_list(&nal_list, data, data_size);
+    if (size < 0)
+        return false;
+    prefixes.resize(4 * nal_list.nb_nalus);
+    iov.resize(2 * nal_list.nb_nalus);
+    ff_nal_units_to_iovec(&nal_list, data, (uint8_t(*)[4])prefixes.data(), iov.data());
+    return true;
+}
+
+/* SEI must come before the first slice of the access unit */
+void VideoGather::insert_probe(const uint8_t* data, uint32_t stream_id) {
+    unsigned i = 0;
+    while (i < nal_list.nb_nalus && !is_vcl_nal(data[nal_list.nalus[i].offset]))
+        i++;
+    NALUIOVec probe = { probe_nal, (size_t)write_probe_nal(probe_nal, stream_id, probe_sequence++) };
+    iov.insert(iov.begin() + 2 * i, probe);
+    size += probe.len;
+}
+
+void VideoGather::gather(uint8_t* dst) const {
+    for (size_t i = 0; i < iov.size(); i++) {
+        memcpy(dst, iov[i].base, iov[i].len);
+        dst += iov[i].len;
+    }
+}
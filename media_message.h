@@ -0,0 +1,95 @@
+#ifndef WEBDRIVERTORSO_MEDIA_MESSAGE_H
+#define WEBDRIVERTORSO_MEDIA_MESSAGE_H
+
+#include <stdint.h>
+#include <memory>
+#include <vector>
+#include "rtmp_proto.h"
+
+extern "C" {
+#include "libavutil/mem.h"
+#include "avc.h"
+#include "latency_sei.h"
+}
+
+/* FLV tag header in front of the payload: frame type and codec, AVC packet type, composition time */
+#define VIDEO_TAG_HEADER_SIZE 5
+/* sound format, rate, size and channels, then the AAC packet type */
+#define AUDIO_TAG_HEADER_SIZE 2
+
+/*
+ * An audio or video message. The body is what RTMP sends and what an FLV
+ * tag holds: the tag header, then the payload.
+ */
+struct MediaMessage {
+    int type = RTMP_VIDEO;          ///< RTMP_VIDEO or RTMP_AUDIO
+    uint32_t timestamp = 0;         ///< milliseconds
+    std::vector<uint8_t> body;
+};
+
+/* A finished message, shared by every destination queue it is in. */
+typedef std::shared_ptr<const MediaMessage> SharedMessage;
+
+/* avc_packet_type 0 is the avcC sequence header, 1 a NALU packet; the size
+ * bytes after the tag header are left for the caller to fill */
+MediaMessage make_video_message(int avc_packet_type, int64_t timestamp,
+    int composition_time, bool key, int size);
+
+/* Messages are built once and shared by every destination, see fanout.h. */
+SharedMessage share_message(MediaMessage& mediaMsg);
+
+SharedMessage video_message(int avc_packet_type, int64_t timestamp,
+    int composition_time, bool key, const uint8_t* data, int size);
+
+/* video_message() for an AVCC access unit, with a probe SEI in front of its first slice */
+SharedMessage probed_video_message(int64_t timestamp, int composition_time, bool key,
+    const uint8_t* data, int size, uint32_t stream_id, uint32_t sequence);
+
+/* aac_packet_type 0 is the AudioSpecificConfig, 1 a raw AAC frame */
+SharedMessage audio_message(int aac_packet_type, int64_t timestamp, const uint8_t* data, int size);
+
+/* body bytes of a message, what it costs in a send queue */
+inline size_t message_size(const MediaMessage& msg) {
+    return msg.body.size();
+}
+
+bool is_vcl_nal(uint8_t nal_header);
+
+/* Writes the length-prefixed probe SEI for the next access unit of a stream. Returns its size. */
+int write_probe_nal(uint8_t* dst, uint32_t stream_id, uint32_t sequence);
+
+/*
+ * AVCC gather list of an Annex B access unit: the length prefixes are
+ * built here and the NAL units stay in the encoder's packet. A message
+ * is shared by every sink and holds a contiguous payload, so the list is
+ * gathered into it once, the same bytes ff_nal_units_write_buf copies (see
+ * packetize_bench). The list lets the probe SEI go in as one more entry
+ * instead of moving the payload. Reused from frame to frame, it keeps
+ * its buffers.
+ */
+struct VideoGather {
+    NALUList nal_list = { NULL, 0, 0 };
+    std::vector<uint8_t> prefixes;
+    std::vector<NALUIOVec> iov;
+    int size = 0;
+    uint8_t probe_nal[4 + LATENCY_SEI_MAX_SIZE];
+    uint32_t probe_sequence = 0;
+
+    VideoGather() = default;
+    VideoGather(const VideoGather&) = delete;
+    VideoGather& operator=(const VideoGather&) = delete;
+
+    ~VideoGather() {
+        av_freep(&nal_list.nalus);
+    }
+
+    /* data stays referenced until gather() */
+    bool build(const uint8_t* data, int data_size);
+    void insert_probe(const uint8_t* data, uint32_t stream_id);
+    void gather(uint8_t* dst) const;
+};
+
+/* Builds the avcC sequence header from the encoder's Annex B extradata. */
+std::vector<uint8_t> make_avcc(const uint8_t* extradata, int extradata_size);
+
+#endif /* WEBDRIVERTORSO_MEDIA_MESSAGE_H */
@@ -0,0 +1,351 @@
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <intrin.h>
+typedef SOCKET socket_t;
+#define close_socket closesocket
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+typedef int socket_t;
+#define INVALID_SOCKET -1
+#define close_socket close
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include "metrics.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+using namespace std;
+
+MetricsRegistry metrics;
+
+static int highest_bit(uint64_t v) {
+#ifdef _MSC_VER
+    unsigned long i;
+    _BitScanReverse64(&i, v);
+    return (int)i;
+#else
+    return 63 - __builtin_clzll(v);
+#endif
+}
+
+int LatencyHistogram::bucket(int64_t us) {
+    if (us < sub_buckets)
+        return us < 0 ? 0 : (int)us;
+    int shift = highest_bit((uint64_t)us) - sub_bits;
+    /* the top sub_bits + 1 bits of us, less the leading one, pick the sub-bucket */
+    int i = (shift + 1) * sub_buckets + (int)((us >> shift) - sub_buckets);
+    return i < nb_buckets ? i : nb_buckets - 1;
+}
+
+int64_t LatencyHistogram::lower_us(int i) {
+    if (i < sub_buckets)
+        return i;
+    int shift = i / sub_buckets - 1;
+    return (int64_t)(sub_buckets + i % sub_buckets) << shift;
+}
+
+void LatencyHistogram::record(int64_t us) {
+    std::atomic<uint64_t>& b = buckets[bucket(us)];
+    b.store(b.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    sum.store(sum.load(std::memory_order_relaxed) + us, std::memory_order_relaxed);
+}
+
+void LatencySnapshot::add(const LatencyHistogram& h) {
+    for (int i = 0; i < LatencyHistogram::nb_buckets; i++) {
+        uint64_t n = h.count(i);
+        counts[i] += n;
+        total += n;
+    }
+    sum_us += h.sum_us();
+}
+
+int64_t LatencySnapshot::quantile_us(double q) const {
+    if (!total)
+        return 0;
+    uint64_t rank = (uint64_t)(q * total);
+    uint64_t below = 0;
+    for (int i = 0; i < LatencyHistogram::nb_buckets - 1; i++) {
+        below += counts[i];
+        if (below > rank || below == total)
+            return LatencyHistogram::lower_us(i + 1) - 1;
+    }
+    return LatencyHistogram::lower_us(LatencyHistogram::nb_buckets - 1);
+}
+
+uint64_t LatencySnapshot::below(int log2_us) const {
+    int end = LatencyHistogram::bucket((int64_t)1 << log2_us);
+    if (LatencyHistogram::lower_us(end) != (int64_t)1 << log2_us)
+        return total;
+    uint64_t n = 0;
+    for (int i = 0; i < end; i++)
+        n += counts[i];
+    return n;
+}
+
+string metric_label(const char* name, const string& value) {
+    string s = name;
+    s += "=\"";
+    for (size_t i = 0; i < value.size(); i++) {
+        if (value[i] == '\\' || value[i] == '"')
+            s += '\\';
+        if (value[i] == '\n')
+            s += "\\n";
+        else
+            s += value[i];
+    }
+    s += '"';
+    return s;
+}
+
+string join_labels(const string& a, const string& b) {
+    if (a.empty() || b.empty())
+        return a + b;
+    return a + "," + b;
+}
+
+MetricsWriter::Family& MetricsWriter::family(const char* name, const char* type, const char* help) {
+    for (size_t i = 0; i < families.size(); i++) {
+        if (families[i].name == name)
+            return families[i];
+    }
+    families.push_back(Family());
+    Family& f = families.back();
+    f.name = name;
+    f.header = string("# HELP ") + name + " " + help + "\n# TYPE " + name + " " + type + "\n";
+    return f;
+}
+
+void MetricsWriter::sample(Family& f, const char* suffix, const string& labels, const char* value) {
+    f.samples += f.name;
+    f.samples += suffix;
+    if (!labels.empty())
+        f.samples += "{" + labels + "}";
+    f.samples += " ";
+    f.samples += value;
+    f.samples += "\n";
+}
+
+void MetricsWriter::counter(const char* name, const char* help, const string& labels, uint64_t value) {
+    char v[32];
+    snprintf(v, sizeof(v), "%llu", (unsigned long long)value);
+    sample(family(name, "counter", help), "", labels, v);
+}
+
+void MetricsWriter::gauge(const char* name, const char* help, const string& labels, double value) {
+    char v[32];
+    snprintf(v, sizeof(v), "%.9g", value);
+    sample(family(name, "gauge", help), "", labels, v);
+}
+
+void MetricsWriter::histogram(const char* name, const char* help, const string& labels, const LatencySnapshot& s) {
+    char v[32];
+    char le[48];
+    Family& f = family(name, "histogram", help);
+    /* 1 us to 2^33 us, a bit over two hours */
+    for (int k = 0; k < 34; k++) {
+        snprintf(le, sizeof(le), "le=\"%.6f\"", ((int64_t)1 << k) / 1e6);
+        snprintf(v, sizeof(v), "%llu", (unsigned long long)s.below(k));
+        sample(f, "_bucket", join_labels(labels, le), v);
+    }
+    snprintf(v, sizeof(v), "%llu", (unsigned long long)s.total);
+    sample(f, "_bucket", join_labels(labels, "le=\"+Inf\""), v);
+    snprintf(v, sizeof(v), "%.6f", s.sum_us / 1e6);
+    sample(f, "_sum", labels, v);
+    snprintf(v, sizeof(v), "%llu", (unsigned long long)s.total);
+    sample(f, "_count", labels, v);
+
+    static const char* quantiles[] = { "0.5", "0.9", "0.99", "0.999", "1" };
+    string quantile_name = string(name) + "_quantile";
+    Family& q = family(quantile_name.c_str(), "gauge", "Quantiles of the histogram of the same name, to within 12.5%.");
+    for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+        snprintf(v, sizeof(v), "%.6f", s.quantile_us(atof(quantiles[i])) / 1e6);
+        sample(q, "", join_labels(labels, metric_label("quantile", quantiles[i])), v);
+    }
+}
+
+string MetricsWriter::text() const {
+    string s;
+    for (size_t i = 0; i < families.size(); i++)
+        s += families[i].header + families[i].samples;
+    return s;
+}
+
+int MetricsRegistry::add(Source source) {
+    std::lock_guard<std::mutex> lock(mutex);
+    sources.push_back(std::make_pair(next_id, source));
+    return next_id++;
+}
+
+void MetricsRegistry::remove(int id) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (size_t i = 0; i < sources.size(); i++) {
+        if (sources[i].first == id) {
+            sources.erase(sources.begin() + i);
+            return;
+        }
+    }
+}
+
+string MetricsRegistry::text() {
+    MetricsWriter w;
+    std::lock_guard<std::mutex> lock(mutex);
+    for (size_t i = 0; i < sources.size(); i++)
+        sources[i].second(w);
+    return w.text();
+}
+
+#ifndef _WIN32
+static volatile sig_atomic_t dump_requested = 0;
+
+static void request_dump(int) {
+    dump_requested = 1;
+}
+#endif
+
+MetricsExporter::~MetricsExporter() {
+    stop();
+}
+
+void MetricsExporter::start(int port, const string& path) {
+    dump_path = path;
+    if (port) {
+        socket_t s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16_t)port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+#ifndef _WIN32
+        int one = 1;
+        if (s != INVALID_SOCKET)
+            setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+#endif
+        if (s == INVALID_SOCKET || ::bind(s, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(s, 8) != 0) {
+            fprintf(stderr, "Could not listen for metrics on 127.0.0.1:%d\n", port);
+            exit(1);
+        }
+        listener = (intptr_t)s;
+    }
+#ifndef _WIN32
+    if (!dump_path.empty()) {
+        /* the other threads' blocking calls restart rather than fail */
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = request_dump;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGUSR1, &sa, NULL);
+    }
+#endif
+    thread = std::thread(&MetricsExporter::run, this);
+}
+
+void MetricsExporter::stop() {
+    if (!thread.joinable())
+        return;
+    stopping = true;
+    thread.join();
+    if (listener != -1)
+        close_socket((socket_t)listener);
+    listener = -1;
+    if (!dump_path.empty())
+        dump();
+}
+
+/* The signal handler only sets a flag, the file is written from here. */
+void MetricsExporter::run() {
+    while (!stopping.load(std::memory_order_relaxed)) {
+#ifndef _WIN32
+        if (dump_requested) {
+            dump_requested = 0;
+            dump();
+        }
+#endif
+        if (listener == -1) {
+            this_thread::sleep_for(chrono::milliseconds(200));
+            continue;
+        }
+        socket_t s = (socket_t)listener;
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(s, &fds);
+        struct timeval tv = { 0, 200000 };
+        if (select((int)s + 1, &fds, NULL, NULL, &tv) <= 0)
+            continue;
+        socket_t client = accept(s, NULL, NULL);
+        if (client == INVALID_SOCKET)
+            continue;
+        serve((intptr_t)client);
+        close_socket(client);
+    }
+}
+
+/* Reads the request up to the blank line, whatever it asks for. */
+void MetricsExporter::serve(intptr_t client) {
+    socket_t s = (socket_t)client;
+    char request[4096];
+    size_t size = 0;
+    while (size < sizeof(request) - 1) {
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(s, &fds);
+        struct timeval tv = { 1, 0 };
+        if (select((int)s + 1, &fds, NULL, NULL, &tv) <= 0)
+            return;
+        int n = recv(s, request + size, (int)(sizeof(request) - 1 - size), 0);
+        if (n <= 0)
+            return;
+        size += n;
+        request[size] = 0;
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n"))
+            break;
+    }
+
+    string body = metrics.text();
+    char head[128];
+    snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: %zu\r\nConnection: close\r\n\r\n", body.size());
+    string response = head + body;
+    const char* p = response.data();
+    size_t left = response.size();
+    while (left) {
+        int n = send(s, p, (int)left, MSG_NOSIGNAL);
+        if (n <= 0)
+            return;
+        p += n;
+        left -= n;
+    }
+}
+
+/* Through a temporary file, so a reader never sees half of it. */
+void MetricsExporter::dump() {
+    string text = metrics.text();
+    string tmp = dump_path + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "wb");
+    if (!f) {
+        fprintf(stderr, "Could not write %s\n", tmp.c_str());
+        return;
+    }
+    bool ok = fwrite(text.data(), 1, text.size(), f) == text.size();
+    ok = fclose(f) == 0 && ok;
+#ifdef _WIN32
+    /* rename does not replace on Windows */
+    remove(dump_path.c_str());
+#endif
+    if (!ok || rename(tmp.c_str(), dump_path.c_str()) != 0)
+        fprintf(stderr, "Could not write %s\n", dump_path.c_str());
+}
@@ -0,0 +1,154 @@
+#ifndef WEBDRIVERTORSO_METRICS_H
+#define WEBDRIVERTORSO_METRICS_H
+
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/*
+ * Latency of one kind of call, in microseconds, with the layout of an
+ * HDR histogram: every power of two is cut into sub_buckets linear
+ * buckets, so any value is known to within 1/sub_buckets (12.5%) from a
+ * microsecond up to four hours, in a fixed 2 KB. Recording is a few
+ * shifts and two stores, cheap enough for every frame and every send.
+ *
+ * Written by one thread, readable from any: every stage or send thread
+ * owns the histograms it records into. They are padded to cache lines of
+ * their own, so a reader or the next histogram never shares one with
+ * the thread writing it.
+ */
+class LatencyHistogram {
+public:
+    static const int sub_bits = 3;
+    static const int sub_buckets = 1 << sub_bits;
+    static const int nb_buckets = 32 * sub_buckets;
+
+    void record(int64_t us);
+
+    static int bucket(int64_t us);
+    /* smallest value of bucket i */
+    static int64_t lower_us(int i);
+
+    uint64_t count(int i) const {
+        return buckets[i].load(std::memory_order_relaxed);
+    }
+    int64_t sum_us() const {
+        return sum.load(std::memory_order_relaxed);
+    }
+
+private:
+    char pad0[64];
+    std::atomic<uint64_t> buckets[nb_buckets] = {};
+    std::atomic<int64_t> sum{ 0 };
+    char pad1[64];
+};
+
+/* One or more histograms added up at one point in time. */
+struct LatencySnapshot {
+    uint64_t counts[LatencyHistogram::nb_buckets] = {};
+    uint64_t total = 0;
+    int64_t sum_us = 0;
+
+    void add(const LatencyHistogram& h);
+    /* The upper end of the bucket quantile q falls into, 0 if empty. */
+    int64_t quantile_us(double q) const;
+    /* how many values were below 2^log2_us microseconds */
+    uint64_t below(int log2_us) const;
+};
+
+/*
+ * Prometheus text exposition format. Samples of the same metric are
+ * kept together under one HELP and TYPE whichever source adds them, in
+ * the order the metrics first appear. labels is the inside of the
+ * braces, as made by metric_label(), and may be empty.
+ */
+class MetricsWriter {
+public:
+    void counter(const char* name, const char* help, const std::string& labels, uint64_t value);
+    void gauge(const char* name, const char* help, const std::string& labels, double value);
+    /* A histogram in seconds with a bucket at every power of two
+     * microseconds, and its quantiles as the gauge <name>_quantile. */
+    void histogram(const char* name, const char* help, const std::string& labels, const LatencySnapshot& s);
+
+    std::string text() const;
+
+private:
+    struct Family {
+        std::string name;
+        std::string header;
+        std::string samples;
+    };
+
+    Family& family(const char* name, const char* type, const char* help);
+    void sample(Family& f, const char* suffix, const std::string& labels, const char* value);
+
+    std::vector<Family> families;
+};
+
+/* name="value", escaped */
+std::string metric_label(const char* name, const std::string& value);
+/* a, b joined with a comma where both are there */
+std::string join_labels(const std::string& a, const std::string& b);
+
+/*
+ * What is exported. A source adds its current values to a writer; it is
+ * called on the exporter's thread, so it only reads atomics. Sources
+ * are called under the registry's lock, and remove() takes it, so once
+ * remove() returns a source is never called again and what it reads
+ * can go away.
+ */
+class MetricsRegistry {
+public:
+    typedef std::function<void(MetricsWriter&)> Source;
+
+    /* Returns the id to remove it with. */
+    int add(Source source);
+    void remove(int id);
+
+    std::string text();
+
+private:
+    std::mutex mutex;
+    std::vector<std::pair<int, Source> > sources;
+    int next_id = 0;
+};
+
+extern MetricsRegistry metrics;
+
+/*
+ * Serves metrics.text() over HTTP on 127.0.0.1:port for Prometheus to
+ * scrape, whatever the path, and writes it to dump_path on SIGUSR1 and
+ * once more on stop(). Windows has no SIGUSR1, there the file is only
+ * written on stop(). One thread does both, one request at a time; a
+ * client that sends nothing for a second is dropped.
+ */
+class MetricsExporter {
+public:
+    MetricsExporter() {}
+    ~MetricsExporter();
+
+    MetricsExporter(const MetricsExporter&) = delete;
+    MetricsExporter& operator=(const MetricsExporter&) = delete;
+
+    /* port 0 serves nothing, an empty dump_path writes nothing. Exits
+     * if the port cannot be bound. Sockets must be initialized. */
+    void start(int port, const std::string& dump_path);
+    void stop();
+
+private:
+    void run();
+    void serve(intptr_t client);
+    void dump();
+
+    std::string dump_path;
+    intptr_t listener = -1;
+    std::thread thread;
+    std::atomic<bool> stopping{ false };
+};
+
+#endif /* WEBDRIVERTORSO_METRICS_H */
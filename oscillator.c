@@ -0,0 +1,131 @@
+/*
+ * Sine oscillator for the test tone
+ */
+
+#include <math.h>
+#include "cpu.h"
+#include "oscillator.h"
+
+#if HAVE_X86
+#include <immintrin.h>
+#endif
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define MAX_LANES 8
+
+/* Initial phasors of the lanes, lane i starting i samples after the block start. */
+static void init_lanes(const Oscillator *osc, int lanes, float *re, float *im,
+                       float *rot_re, float *rot_im)
+{
+    for (int i = 0; i < lanes; i++) {
+        double angle = 2 * M_PI * (osc->phase + i * osc->step);
+        re[i] = (float)cos(angle);
+        im[i] = (float)sin(angle);
+    }
+    *rot_re = (float)cos(2 * M_PI * lanes * osc->step);
+    *rot_im = (float)sin(2 * M_PI * lanes * osc->step);
+}
+
+#if !HAVE_X86
+static void render_c(float *dst, int nb_samples, const float *re0, const float *im0,
+                     float rot_re, float rot_im)
+{
+    float re[4], im[4];
+    for (int i = 0; i < 4; i++) {
+        re[i] = re0[i];
+        im[i] = im0[i];
+    }
+    for (int n = 0; n < nb_samples; n += 4) {
+        for (int i = 0; i < 4 && n + i < nb_samples; i++) {
+            float r = re[i];
+            dst[n + i] = im[i];
+            re[i] = r * rot_re - im[i] * rot_im;
+            im[i] = r * rot_im + im[i] * rot_re;
+        }
+    }
+}
+#else
+static void render_sse(float *dst, int nb_samples, const float *re0, const float *im0,
+                       float rot_re, float rot_im)
+{
+    __m128 re = _mm_loadu_ps(re0);
+    __m128 im = _mm_loadu_ps(im0);
+    __m128 cr = _mm_set1_ps(rot_re);
+    __m128 ci = _mm_set1_ps(rot_im);
+    int n = 0;
+
+    for (; n + 4 <= nb_samples; n += 4) {
+        __m128 r = re;
+        _mm_storeu_ps(dst + n, im);
+        re = _mm_sub_ps(_mm_mul_ps(r, cr), _mm_mul_ps(im, ci));
+        im = _mm_add_ps(_mm_mul_ps(r, ci), _mm_mul_ps(im, cr));
+    }
+    if (n < nb_samples) {
+        float tail[4];
+        _mm_storeu_ps(tail, im);
+        for (int i = 0; n < nb_samples; i++, n++)
+            dst[n] = tail[i];
+    }
+}
+
+static TARGET_AVX2_FMA void render_avx2(float *dst, int nb_samples, const float *re0, const float *im0,
+                                        float rot_re, float rot_im)
+{
+    __m256 re = _mm256_loadu_ps(re0);
+    __m256 im = _mm256_loadu_ps(im0);
+    __m256 cr = _mm256_set1_ps(rot_re);
+    __m256 ci = _mm256_set1_ps(rot_im);
+    int n = 0;
+
+    for (; n + 8 <= nb_samples; n += 8) {
+        __m256 r = re;
+        _mm256_storeu_ps(dst + n, im);
+        re = _mm256_fmsub_ps(r, cr, _mm256_mul_ps(im, ci));
+        im = _mm256_fmadd_ps(r, ci, _mm256_mul_ps(im, cr));
+    }
+    if (n < nb_samples) {
+        float tail[8];
+        _mm256_storeu_ps(tail, im);
+        for (int i = 0; n < nb_samples; i++, n++)
+            dst[n] = tail[i];
+    }
+}
+#endif
+
+void oscillator_init(Oscillator *osc)
+{
+    osc->phase = 0;
+    osc->step  = 0;
+#if HAVE_X86
+    if (cpu_has_avx2_fma()) {
+        osc->render = render_avx2;
+        osc->lanes  = 8;
+    } else {
+        osc->render = render_sse;
+        osc->lanes  = 4;
+    }
+#else
+    osc->render = render_c;
+    osc->lanes  = 4;
+#endif
+}
+
+void oscillator_set_frequency(Oscillator *osc, double freq, int sample_rate)
+{
+    osc->step = freq / sample_rate;
+}
+
+void oscillator_render(Oscillator *osc, float *dst, int nb_samples)
+{
+    float re[MAX_LANES], im[MAX_LANES], rot_re, rot_im;
+
+    /* the rotation drifts slowly in float, so every block starts from an exact phase */
+    init_lanes(osc, osc->lanes, re, im, &rot_re, &rot_im);
+    osc->render(dst, nb_samples, re, im, rot_re, rot_im);
+
+    osc->phase += nb_samples * osc->step;
+    osc->phase -= floor(osc->phase);
+}
@@ -0,0 +1,41 @@
+/*
+ * Sine oscillator for the test tone
+ */
+
+#ifndef WEBDRIVERTORSO_OSCILLATOR_H
+#define WEBDRIVERTORSO_OSCILLATOR_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The phase is accumulated in cycles and wrapped to [0, 1) after every
+ * block, so it stays exact however long the stream runs, and changing the
+ * frequency only changes the step: the waveform continues without a jump.
+ *
+ * Within a block, 4 (SSE) or 8 (AVX2) consecutive samples are computed at
+ * once by rotating a vector of phasors, which costs a few multiplies per
+ * sample instead of a sin() call; only the block start uses libm. The
+ * kernel is picked by oscillator_init(), so every stream reads its own
+ * pointer and no state is shared between threads.
+ */
+typedef struct Oscillator {
+    double phase;               ///< cycles, [0, 1)
+    double step;                ///< cycles per sample
+    void (*render)(float *dst, int nb_samples, const float *re, const float *im,
+                   float rot_re, float rot_im);
+    int lanes;                  ///< samples per step of render
+} Oscillator;
+
+void oscillator_init(Oscillator *osc);
+void oscillator_set_frequency(Oscillator *osc, double freq, int sample_rate);
+
+/* Writes nb_samples samples in [-1, 1] to dst and advances the phase. */
+void oscillator_render(Oscillator *osc, float *dst, int nb_samples);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* WEBDRIVERTORSO_OSCILLATOR_H */
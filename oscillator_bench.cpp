@@ -0,0 +1,83 @@
+/*
+ * Compares the oscillator against the per-sample sin() loop
+ * generate_audio_frame used before, for 48 kHz stereo and 7.1.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <vector>
+#include "oscillator.h"
+
+using namespace std;
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+const int sample_rate = 48000;
+const int frame_size = 1024;
+
+uint64_t t = 0;
+
+void generate_sin(std::vector<std::vector<float> >& planes, float freq) {
+    float tincr = 2 * M_PI * freq / sample_rate;
+
+    for (int j = 0; j < frame_size; j++) {
+        float v = (sin(t * tincr));
+
+        for (size_t k = 0; k < planes.size(); k++) {
+            float* samples = planes[k].data();
+            samples[j] = v;
+        }
+        t++;
+    }
+}
+
+Oscillator tone;
+
+void generate_oscillator(std::vector<std::vector<float> >& planes, float freq) {
+    oscillator_set_frequency(&tone, freq, sample_rate);
+    float* samples = planes[0].data();
+    oscillator_render(&tone, samples, frame_size);
+    for (size_t k = 1; k < planes.size(); k++)
+        memcpy(planes[k].data(), samples, frame_size * sizeof(float));
+}
+
+template <typename F>
+double time_ns_per_sample(int frames, F f) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int i = 0; i < frames; i++)
+        f(i);
+    return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / frames / frame_size;
+}
+
+void bench(const char* name, int channels, int frames) {
+    std::vector<std::vector<float> > planes(channels, std::vector<float>(frame_size));
+    /* a new tone every second, like a scene change */
+    int frames_per_tone = sample_rate / frame_size;
+
+    t = 0;
+    double sin_ns = time_ns_per_sample(frames, [&](int i) {
+        generate_sin(planes, 200 + (i / frames_per_tone) % 400);
+    });
+    oscillator_init(&tone);
+    double osc_ns = time_ns_per_sample(frames, [&](int i) {
+        generate_oscillator(planes, 200 + (i / frames_per_tone) % 400);
+    });
+
+    printf("%-7s %d ch: sin %6.2f ns/sample, oscillator %6.2f ns/sample, %5.1fx, %.0fx realtime\n",
+        name, channels, sin_ns, osc_ns, sin_ns / osc_ns, 1e9 / sample_rate / osc_ns);
+}
+
+int main(int argc, char* argv[]) {
+    int frames = argc > 1 ? atoi(argv[1]) : 20000;
+    if (frames <= 0)
+        frames = 20000;
+    bench("stereo", 2, frames);
+    bench("7.1", 8, frames);
+    return 0;
+}
@@ -0,0 +1,146 @@
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdio.h>
+#include <time.h>
+#include <errno.h>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include "pacer.h"
+
+using namespace std;
+
+int64_t SteadyClock::now_us() {
+    return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void SteadyClock::sleep_until_us(int64_t t) {
+    int64_t wake_us = t - spin_us;
+    if (wake_us > now_us()) {
+#ifdef __linux__
+        /* steady_clock is CLOCK_MONOTONIC in libstdc++ and libc++ */
+        struct timespec ts;
+        ts.tv_sec = wake_us / 1000000;
+        ts.tv_nsec = wake_us % 1000000 * 1000;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+#else
+        this_thread::sleep_until(chrono::steady_clock::time_point(chrono::microseconds(wake_us)));
+#endif
+    }
+    while (spin_us && now_us() < t)
+        this_thread::yield();
+}
+
+static const int64_t histogram_bounds_us[JitterHistogram::nb_buckets] = {
+    50, 100, 250, 500, 1000, 2000, 5000, 10000, 20000, 50000, 100000, INT64_MAX,
+};
+
+void JitterHistogram::add(int64_t late_us) {
+    int i = 0;
+    while (late_us > histogram_bounds_us[i])
+        i++;
+    buckets[i].store(buckets[i].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+int64_t JitterHistogram::bound_us(int i) {
+    return histogram_bounds_us[i];
+}
+
+void JitterHistogram::merge_into(uint64_t* counts) const {
+    for (int i = 0; i < nb_buckets; i++)
+        counts[i] += count(i);
+}
+
+void JitterHistogram::print(const char* name, const uint64_t* counts) {
+    uint64_t total = 0;
+    for (int i = 0; i < nb_buckets; i++)
+        total += counts[i];
+
+    printf("%s late us:", name);
+    uint64_t below = 0;
+    int p99 = nb_buckets - 1;
+    for (int i = 0; i < nb_buckets; i++) {
+        if (i < nb_buckets - 1)
+            printf(" <=%lld %llu", (long long)histogram_bounds_us[i], (unsigned long long)counts[i]);
+        else
+            printf(" >%lld %llu", (long long)histogram_bounds_us[i - 1], (unsigned long long)counts[i]);
+        below += counts[i];
+        if (p99 == nb_buckets - 1 && below * 100 >= total * 99)
+            p99 = i;
+    }
+    if (total && p99 < nb_buckets - 1)
+        printf(", p99 <=%lld\n", (long long)histogram_bounds_us[p99]);
+    else if (total)
+        printf(", p99 >%lld\n", (long long)histogram_bounds_us[nb_buckets - 2]);
+    else
+        printf("\n");
+}
+
+Pacer::Pacer(Clock& clock, const PacingOptions& options)
+    : clock(clock), options(options) {
+}
+
+void Pacer::start() {
+    origin_us = clock.now_us();
+    skipped_periods = 0;
+}
+
+void Pacer::observe(int64_t timestamp_ms, int64_t now_us) {
+    if (timestamp_ms == INT64_MAX || timestamp_ms == observed_ms)
+        return;
+    observed_ms = timestamp_ms;
+    slack_histogram.record(max(deadline_us(timestamp_ms) - now_us, (int64_t)0));
+}
+
+bool Pacer::due(int64_t timestamp_ms) {
+    if (timestamp_ms == INT64_MAX)
+        return false;
+    if (options.unpaced)
+        return true;
+    int64_t now_us = clock.now_us();
+    observe(timestamp_ms, now_us);
+    int64_t late_us = now_us - deadline_us(timestamp_ms);
+    if (late_us < 0)
+        return false;
+
+    histogram.add(late_us);
+    late_histogram.record(late_us);
+    if (options.catch_up == CATCH_UP_SKIP && late_us > options.max_late_us && late_us >= options.frame_period_us) {
+        /* whole periods: this packet stays less than one late, the ones
+         * after it are due on the grid they were on before the stall */
+        skipped_periods += late_us / options.frame_period_us;
+        nb_skips.fetch_add(1, std::memory_order_relaxed);
+    }
+    return true;
+}
+
+bool Pacer::wait(int64_t timestamp_ms, int64_t max_wait_us) {
+    int64_t now_us = clock.now_us();
+    if (options.unpaced) {
+        /* nothing there yet: a short nap, the producer is busy */
+        if (timestamp_ms == INT64_MAX)
+            clock.sleep_until_us(now_us + min(max_wait_us, (int64_t)100));
+        return due(timestamp_ms);
+    }
+    observe(timestamp_ms, now_us);
+    int64_t until_us = timestamp_ms == INT64_MAX ? INT64_MAX : deadline_us(timestamp_ms);
+    if (max_wait_us < until_us - now_us)
+        until_us = now_us + max_wait_us;
+    clock.sleep_until_us(until_us);
+    return due(timestamp_ms);
+}
+
+void PacingMetrics::add(const Pacer& pacer) {
+    slack.add(pacer.slack());
+    late.add(pacer.lateness());
+    skips += pacer.skips();
+}
+
+void PacingMetrics::write(MetricsWriter& w) const {
+    w.histogram("webdrivertorso_pacing_slack_seconds", "How long before its deadline a packet was ready.", "", slack);
+    w.histogram("webdrivertorso_pacing_late_seconds", "How late packets were sent.", "", late);
+    w.counter("webdrivertorso_pacing_restarts_total", "Times the skip policy restarted the schedule.", "", skips);
+}
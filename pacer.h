@@ -0,0 +1,183 @@
+#ifndef WEBDRIVERTORSO_PACER_H
+#define WEBDRIVERTORSO_PACER_H
+
+#include <stdint.h>
+#include <atomic>
+#include "metrics.h"
+
+/*
+ * Wall-clock pacing of a stream against its timestamps.
+ *
+ * Every packet has an absolute deadline, origin + timestamp, on a
+ * monotonic clock, so an oversleep delays that one packet and is never
+ * carried into the next one the way a relative sleep_for(next - elapsed)
+ * is. What happens after a stall is the catch-up policy: burst sends the
+ * late packets back to back until the stream is on time again, skip
+ * gives up the frame periods the stall took, so the stream continues
+ * from now on the same frame grid, later than wall time by those periods.
+ *
+ * The clock is an interface so a virtual clock can drive the pacer
+ * without sleeping, deterministically.
+ */
+
+class Clock {
+public:
+    virtual ~Clock() {}
+    /* microseconds, monotonic, arbitrary origin */
+    virtual int64_t now_us() = 0;
+    /* Returns at t or later. */
+    virtual void sleep_until_us(int64_t t) = 0;
+};
+
+/*
+ * std::chrono::steady_clock. On Linux the sleep is clock_nanosleep with an
+ * absolute deadline; elsewhere std::this_thread::sleep_until. With
+ * spin_us, the last spin_us before a deadline are spent polling the clock
+ * instead of asleep, which costs a core but is exact to a few
+ * microseconds where a sleep is only as good as the scheduler tick (up to
+ * 15.6 ms on Windows).
+ */
+class SteadyClock : public Clock {
+public:
+    explicit SteadyClock(int64_t spin_us = 0) : spin_us(spin_us) {
+    }
+
+    int64_t now_us() override;
+    void sleep_until_us(int64_t t) override;
+
+private:
+    int64_t spin_us;
+};
+
+/* Time only moves when it is slept on or advanced. */
+class VirtualClock : public Clock {
+public:
+    int64_t now_us() override {
+        return now.load(std::memory_order_relaxed);
+    }
+
+    void sleep_until_us(int64_t t) override {
+        if (t > now.load(std::memory_order_relaxed))
+            now.store(t, std::memory_order_relaxed);
+    }
+
+    /* A stall of us microseconds. */
+    void advance(int64_t us) {
+        now.fetch_add(us, std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<int64_t> now{ 0 };
+};
+
+/*
+ * How late packets were sent, in buckets of exponentially growing width.
+ * Written by one thread, readable from any.
+ */
+class JitterHistogram {
+public:
+    static const int nb_buckets = 12;
+
+    void add(int64_t late_us);
+
+    /* upper bound of bucket i in microseconds, INT64_MAX for the last */
+    static int64_t bound_us(int i);
+
+    uint64_t count(int i) const {
+        return buckets[i].load(std::memory_order_relaxed);
+    }
+
+    void merge_into(uint64_t* counts) const;
+
+    /* One line: name, count per bucket and the bucket p99 falls into. */
+    static void print(const char* name, const uint64_t* counts);
+
+private:
+    std::atomic<uint64_t> buckets[nb_buckets] = {};
+};
+
+enum CatchUpPolicy {
+    CATCH_UP_BURST,             ///< send what is late back to back
+    CATCH_UP_SKIP,              ///< skip the frame periods that were missed
+};
+
+struct PacingOptions {
+    CatchUpPolicy catch_up = CATCH_UP_BURST;
+    /* skip only restarts the schedule for packets later than this */
+    int64_t max_late_us = 200000;
+    /* the video frame period, what skip moves the schedule by */
+    int64_t frame_period_us = 40000;
+    /* see SteadyClock */
+    int64_t spin_us = 0;
+    /* every packet is due as soon as it is there, to measure how fast
+     * the pipeline runs; nothing is recorded as late */
+    bool unpaced = false;
+};
+
+class Pacer {
+public:
+    Pacer(Clock& clock, const PacingOptions& options);
+
+    /* Timestamp 0 is due now. */
+    void start();
+
+    /* The clock time a packet with timestamp_ms is due at. */
+    int64_t deadline_us(int64_t timestamp_ms) const {
+        return origin_us + timestamp_ms * 1000 + skipped_periods * options.frame_period_us;
+    }
+
+    /* Whether a packet with timestamp_ms is due, without waiting. If it
+     * is, its lateness is recorded and the catch-up policy applied. */
+    bool due(int64_t timestamp_ms);
+
+    /* Sleeps until the packet with timestamp_ms is due, but at most
+     * max_wait_us, then returns due(timestamp_ms). INT64_MAX waits
+     * max_wait_us and returns false. */
+    bool wait(int64_t timestamp_ms, int64_t max_wait_us = INT64_MAX);
+
+    const JitterHistogram& jitter() const {
+        return histogram;
+    }
+
+    /* How long before its deadline a packet was first asked about, 0 if
+     * it was already late; how late packets were, the same as jitter()
+     * but finer. Packets with the timestamp of the one before count once. */
+    const LatencyHistogram& slack() const {
+        return slack_histogram;
+    }
+    const LatencyHistogram& lateness() const {
+        return late_histogram;
+    }
+
+    /* times the skip policy restarted the schedule */
+    uint64_t skips() const {
+        return nb_skips.load(std::memory_order_relaxed);
+    }
+
+private:
+    void observe(int64_t timestamp_ms, int64_t now_us);
+
+    Clock& clock;
+    PacingOptions options;
+    int64_t origin_us = 0;
+    /* frame periods the skip policy gave up, the origin stays */
+    int64_t skipped_periods = 0;
+    JitterHistogram histogram;
+    LatencyHistogram slack_histogram;
+    LatencyHistogram late_histogram;
+    /* the last timestamp slack was recorded for */
+    int64_t observed_ms = INT64_MIN;
+    std::atomic<uint64_t> nb_skips{ 0 };
+};
+
+/* What the metrics export shows of one or more pacers, added up. */
+struct PacingMetrics {
+    LatencySnapshot slack;
+    LatencySnapshot late;
+    uint64_t skips = 0;
+
+    void add(const Pacer& pacer);
+    void write(MetricsWriter& w) const;
+};
+
+#endif /* WEBDRIVERTORSO_PACER_H */
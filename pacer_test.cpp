@@ -0,0 +1,134 @@
+/*
+ * The pacer on a virtual clock: packets of a 25 fps stream, one stall,
+ * and when each packet goes out under either catch-up policy. Nothing
+ * sleeps, so the times are exact.
+ *
+ * Prints every mismatch and exits with 1 if there was one.
+ */
+
+#include <stdio.h>
+
+#include <vector>
+#include "pacer.h"
+
+using namespace std;
+
+static int failures = 0;
+
+static void check(bool ok, const char* name, const char* what) {
+    if (!ok) {
+        fprintf(stderr, "%s: %s\n", name, what);
+        failures++;
+    }
+}
+
+static const int64_t period_ms = 40;
+/* the clock does not start at 0 */
+static const int64_t start_us = 1234567;
+
+/*
+ * Sends packets 0 to count - 1 as the live stage does, with a stall of
+ * stall_us after the packet before stall_at went out. Returns when each
+ * went out, relative to the start.
+ */
+static vector<int64_t> run(Pacer& pacer, VirtualClock& clock, int count, int stall_at, int64_t stall_us) {
+    vector<int64_t> sent;
+    pacer.start();
+    for (int i = 0; i < count; i++) {
+        if (i == stall_at)
+            clock.advance(stall_us);
+        while (!pacer.wait(i * period_ms));
+        sent.push_back(clock.now_us() - start_us);
+    }
+    return sent;
+}
+
+static void test_on_time() {
+    const char* name = "on time";
+    VirtualClock clock;
+    clock.advance(start_us);
+    Pacer pacer(clock, PacingOptions());
+    vector<int64_t> sent = run(pacer, clock, 50, -1, 0);
+    bool exact = true;
+    for (size_t i = 0; i < sent.size(); i++)
+        exact = exact && sent[i] == (int64_t)i * period_ms * 1000;
+    check(exact, name, "a packet not sent at its deadline");
+    check(pacer.jitter().count(0) == sent.size(), name, "lateness recorded");
+    check(pacer.skips() == 0, name, "schedule restarted");
+}
+
+static void test_burst() {
+    const char* name = "burst";
+    VirtualClock clock;
+    clock.advance(start_us);
+    Pacer pacer(clock, PacingOptions());
+    /* packet 9 goes out at 360 ms, packet 10 is due at 400 ms and goes out at 900 ms */
+    vector<int64_t> sent = run(pacer, clock, 50, 10, 540000);
+    for (int i = 10; i <= 22; i++)
+        check(sent[i] == 900000, name, "late packet not sent right away");
+    bool on_time = true;
+    for (int i = 23; i < 50; i++)
+        on_time = on_time && sent[i] == i * period_ms * 1000;
+    check(on_time, name, "not back on the schedule after the stall");
+    check(pacer.skips() == 0, name, "schedule restarted");
+}
+
+static void test_skip() {
+    const char* name = "skip";
+    VirtualClock clock;
+    clock.advance(start_us);
+    PacingOptions options;
+    options.catch_up = CATCH_UP_SKIP;
+    options.frame_period_us = period_ms * 1000;
+    Pacer pacer(clock, options);
+    /* 12 periods and 20 ms late: 12 periods are given up */
+    vector<int64_t> sent = run(pacer, clock, 50, 10, 540000);
+    check(sent[10] == 900000, name, "late packet not sent right away");
+    bool on_grid = true;
+    for (int i = 11; i < 50; i++)
+        on_grid = on_grid && sent[i] == (i + 12) * period_ms * 1000;
+    check(on_grid, name, "not on the frame grid after the stall");
+    check(pacer.skips() == 1, name, "not one restart");
+    check(pacer.deadline_us(0) == start_us + 12 * period_ms * 1000, name, "not 12 periods skipped");
+}
+
+/* below max_late the skip policy bursts too */
+static void test_skip_short_stall() {
+    const char* name = "skip, short stall";
+    VirtualClock clock;
+    clock.advance(start_us);
+    PacingOptions options;
+    options.catch_up = CATCH_UP_SKIP;
+    options.frame_period_us = period_ms * 1000;
+    Pacer pacer(clock, options);
+    vector<int64_t> sent = run(pacer, clock, 50, 10, 140000);
+    check(sent[10] == 500000 && sent[12] == 500000, name, "late packet not sent right away");
+    check(sent[13] == 13 * period_ms * 1000, name, "not back on the schedule after the stall");
+    check(pacer.skips() == 0, name, "schedule restarted");
+}
+
+static void test_unpaced() {
+    const char* name = "unpaced";
+    VirtualClock clock;
+    clock.advance(start_us);
+    PacingOptions options;
+    options.unpaced = true;
+    Pacer pacer(clock, options);
+    pacer.start();
+    check(pacer.due(1000000), name, "packet held back");
+    check(!pacer.due(INT64_MAX), name, "nothing queued is due");
+    check(pacer.lateness().count(0) + pacer.jitter().count(0) == 0, name, "lateness recorded");
+}
+
+int main() {
+    test_on_time();
+    test_burst();
+    test_skip();
+    test_skip_short_stall();
+    test_unpaced();
+
+    if (failures)
+        return 1;
+    printf("pacer_test: all passed\n");
+    return 0;
+}
@@ -0,0 +1,65 @@
+#ifndef WEBDRIVERTORSO_PACKET_SINK_H
+#define WEBDRIVERTORSO_PACKET_SINK_H
+
+#include <stdint.h>
+#include <vector>
+#include "abr.h"
+#include "media_message.h"
+#include "metrics.h"
+
+/* What publishing asks of the encoder side; the worst sink wins. */
+enum Backpressure {
+    BACKPRESSURE_NONE,
+    BACKPRESSURE_SHED,          ///< skip frames no other frame references
+    BACKPRESSURE_RESYNC,        ///< a destination drops up to the next keyframe, make one soon
+};
+
+/*
+ * Where the finished messages of a stream go: an RTMP destination (see
+ * fanout.h), an FLV file or stdout, or nowhere (see flv_sink.h). Every
+ * sink gets the same stream: the stream info and the sequence
+ * headers (avcC and AudioSpecificConfig) in start(), then the messages
+ * in dts order. Messages are shared, a sink keeps a reference to what it
+ * has not written yet and never changes them.
+ */
+class PacketSink {
+public:
+    virtual ~PacketSink() {}
+
+    virtual void start(const RtmpStreamInfo& info, const std::vector<SharedMessage>& headers) = 0;
+    /* Writes or drops what is still queued and returns once the sink is idle. */
+    virtual void stop() = 0;
+
+    /* key marks a video keyframe. Called by one thread. */
+    virtual void publish(const SharedMessage& msg, bool key) = 0;
+
+    /* The stream changed mid-way, such as the video bitrate after an ABR
+     * step; a sink that can carries a new onMetaData in order with the
+     * messages. */
+    virtual void update_metadata(const RtmpStreamInfo& info) {
+    }
+
+    virtual bool alive() const = 0;
+
+    /* Producer side, as of the last publish(). */
+    virtual Backpressure backpressure() const {
+        return BACKPRESSURE_NONE;
+    }
+
+    /* Producer side, what the ABR controller measures the link by; a sink
+     * that is not a network link is not measured. */
+    virtual LinkSample sample() const {
+        LinkSample link;
+        link.alive = false;
+        return link;
+    }
+
+    virtual void print_stats() const = 0;
+
+    /* From the exporter's thread, see metrics.h: what the sink has done,
+     * labelled with which output it is. */
+    virtual void write_metrics(MetricsWriter& w) const {
+    }
+};
+
+#endif /* WEBDRIVERTORSO_PACKET_SINK_H */
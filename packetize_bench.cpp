@@ -0,0 +1,252 @@
+/*
+ * Bytes copied per video frame on the way from the encoder's Annex B
+ * packet to the RTMP message payload, by each way output_video has built
+ * the payload.
+ *
+ * packetize_bench [corpus file...]
+ *
+ * "avio" is the original path: avc_parse_nal_units writes every NAL unit
+ * through an AVIO dyn buffer, i.e. into the 1 KB io buffer and from there
+ * into a buffer that grows by half its size on demand
+ * (libavformat/aviobuf.c), whose result is copied into the message. It is
+ * reimplemented here with every copy counted; reallocations are counted
+ * as copies, which is the upper bound. "write_buf" writes the AVCC
+ * straight into the message with ff_nal_units_write_buf. "gather" is the
+ * VideoGather list output_video uses now, copied into the message by
+ * VideoGather::gather(). The bytes are counted as the copies run, and
+ * every path's payload is checked against write_buf's.
+ *
+ * write_buf and gather copy the same bytes: a message holds a contiguous
+ * payload, so the gather list ends in one copy as well. What it
+ * buys is inserting the latency probe without moving the payload.
+ *
+ * Then the message is chunked for the socket. "chunk copy" copies the
+ * body into one buffer between the chunk headers, as RtmpPublisher did;
+ * "chunk iovecs" writes only the headers and sends the body from the
+ * message, as it does now. The live path is gather followed by one of
+ * them; the iovecs are checked against the copied chunks.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include "bench_streams.h"
+#include "rtmp_proto.h"
+
+extern "C" {
+#include "libavutil/mem.h"
+#include "avc.h"
+}
+
+using namespace std;
+
+struct DynBuf {
+    uint8_t io[1024];
+    size_t io_fill = 0;
+    uint8_t* data = NULL;
+    size_t size = 0;
+    size_t allocated = 0;
+    uint64_t copied = 0;
+
+    ~DynBuf() {
+        free(data);
+    }
+
+    void flush() {
+        size_t new_size = size + io_fill;
+        if (new_size > allocated) {
+            while (new_size > allocated)
+                allocated += allocated / 2 + 1;
+            data = (uint8_t*)realloc(data, allocated);
+            copied += size;
+        }
+        memcpy(data + size, io, io_fill);
+        copied += io_fill;
+        size = new_size;
+        io_fill = 0;
+    }
+
+    void write(const uint8_t* p, size_t n) {
+        while (n) {
+            size_t k = min(n, sizeof(io) - io_fill);
+            memcpy(io + io_fill, p, k);
+            copied += k;
+            io_fill += k;
+            p += k;
+            n -= k;
+            if (io_fill == sizeof(io))
+                flush();
+        }
+    }
+};
+
+uint64_t packetize_avio(const NALUList& list, const uint8_t* au, std::vector<char>& msg) {
+    DynBuf dyn;
+    for (unsigned i = 0; i < list.nb_nalus; i++) {
+        uint8_t prefix[4] = { (uint8_t)(list.nalus[i].size >> 24), (uint8_t)(list.nalus[i].size >> 16),
+            (uint8_t)(list.nalus[i].size >> 8), (uint8_t)list.nalus[i].size };
+        dyn.write(prefix, 4);
+        dyn.write(au + list.nalus[i].offset, list.nalus[i].size);
+    }
+    dyn.flush();
+    msg.resize(dyn.size);
+    memcpy(msg.data(), dyn.data, dyn.size);
+    return dyn.copied + dyn.size;
+}
+
+/* what ff_nal_units_write_buf copies: every prefix and NAL unit once */
+uint64_t packetize_write_buf(const NALUList& list, const uint8_t* au, int size, std::vector<char>& msg) {
+    msg.resize(size);
+    ff_nal_units_write_buf(&list, (uint8_t*)msg.data(), au);
+    uint64_t copied = 0;
+    for (unsigned i = 0; i < list.nb_nalus; i++)
+        copied += 4 + list.nalus[i].size;
+    return copied;
+}
+
+uint64_t packetize_gather(const NALUList& list, const uint8_t* au, int size, std::vector<char>& msg,
+    std::vector<uint8_t>& prefixes, std::vector<NALUIOVec>& iov) {
+    prefixes.resize(4 * list.nb_nalus);
+    iov.resize(2 * list.nb_nalus);
+    ff_nal_units_to_iovec(&list, au, (uint8_t(*)[4])prefixes.data(), iov.data());
+    msg.resize(size);
+    uint8_t* dst = (uint8_t*)msg.data();
+    uint64_t copied = 0;
+    for (size_t i = 0; i < iov.size(); i++) {
+        memcpy(dst, iov[i].base, iov[i].len);
+        dst += iov[i].len;
+        copied += iov[i].len;
+    }
+    return copied;
+}
+
+/* The body chunked into one buffer. Returns the bytes copied, headers included. */
+uint64_t chunk_copy(const std::vector<char>& body, std::vector<uint8_t>& out) {
+    size_t chunks = (body.size() + RTMP_MAX_CHUNK_SIZE - 1) / RTMP_MAX_CHUNK_SIZE;
+    out.resize(RTMP_MAX_HEADER_SIZE * chunks + body.size());
+    uint8_t* p = out.data();
+    for (size_t pos = 0; pos < body.size();) {
+        p += pos ? rtmp_write_continuation_header(p, RTMP_CSID_VIDEO, 0) :
+            rtmp_write_message_header(p, RTMP_CSID_VIDEO, 0, (uint32_t)body.size(), RTMP_VIDEO, 1);
+        size_t len = min(body.size() - pos, (size_t)RTMP_MAX_CHUNK_SIZE);
+        memcpy(p, body.data() + pos, len);
+        p += len;
+        pos += len;
+    }
+    out.resize(p - out.data());
+    return out.size();
+}
+
+/* Only the chunk headers are written, the iovecs point into the body. Returns the bytes written. */
+uint64_t chunk_iovecs(const std::vector<char>& body, std::vector<uint8_t>& heads, std::vector<NALUIOVec>& iov) {
+    size_t chunks = (body.size() + RTMP_MAX_CHUNK_SIZE - 1) / RTMP_MAX_CHUNK_SIZE;
+    heads.resize(RTMP_MAX_HEADER_SIZE * chunks);
+    iov.clear();
+    uint8_t* p = heads.data();
+    for (size_t pos = 0; pos < body.size();) {
+        int head_size = pos ? rtmp_write_continuation_header(p, RTMP_CSID_VIDEO, 0) :
+            rtmp_write_message_header(p, RTMP_CSID_VIDEO, 0, (uint32_t)body.size(), RTMP_VIDEO, 1);
+        size_t len = min(body.size() - pos, (size_t)RTMP_MAX_CHUNK_SIZE);
+        NALUIOVec head = { p, (size_t)head_size };
+        NALUIOVec slice = { (const uint8_t*)body.data() + pos, len };
+        iov.push_back(head);
+        iov.push_back(slice);
+        p += head_size;
+        pos += len;
+    }
+    return p - heads.data();
+}
+
+bool same_bytes(const std::vector<NALUIOVec>& iov, const std::vector<uint8_t>& chunked) {
+    size_t pos = 0;
+    for (size_t i = 0; i < iov.size(); i++) {
+        if (pos + iov[i].len > chunked.size() || memcmp(chunked.data() + pos, iov[i].base, iov[i].len))
+            return false;
+        pos += iov[i].len;
+    }
+    return pos == chunked.size();
+}
+
+void report(const char* name, uint64_t copied, uint64_t payload, int frames, double us) {
+    printf("  %-29s %9.0f bytes copied per frame (%.2fx payload)  %7.1f us/frame\n", name,
+        (double)copied / frames, (double)copied / payload, us / frames);
+}
+
+void bench(const Stream& s) {
+    std::vector<uint8_t> buf(s.data);
+    size_t total = buf.size();
+    buf.resize(total + 64);
+
+    NALUList list = { NULL, 0, 0 };
+    std::vector<char> reference, avio_msg, gather_msg;
+    std::vector<uint8_t> prefixes, chunked, heads;
+    std::vector<NALUIOVec> iov, chunk_iov;
+    uint64_t avio_copied = 0, write_buf_copied = 0, gather_copied = 0, payload = 0;
+    uint64_t chunk_copy_copied = 0, chunk_iovecs_copied = 0;
+    double avio_us = 0, write_buf_us = 0, gather_us = 0, chunk_copy_us = 0, chunk_iovecs_us = 0;
+    int mismatches = 0;
+
+    for (size_t f = 0; f < s.frame_offsets.size(); f++) {
+        size_t start = s.frame_offsets[f];
+        size_t end = f + 1 < s.frame_offsets.size() ? s.frame_offsets[f + 1] : total;
+        const uint8_t* au = buf.data() + start;
+        int size = ff_nal_units_create_list(&list, au, end - start);
+        payload += size;
+
+        chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+        write_buf_copied += packetize_write_buf(list, au, size, reference);
+        chrono::steady_clock::time_point t1 = chrono::steady_clock::now();
+        avio_copied += packetize_avio(list, au, avio_msg);
+        chrono::steady_clock::time_point t2 = chrono::steady_clock::now();
+        gather_copied += packetize_gather(list, au, size, gather_msg, prefixes, iov);
+        chrono::steady_clock::time_point t3 = chrono::steady_clock::now();
+        chunk_copy_copied += chunk_copy(gather_msg, chunked);
+        chrono::steady_clock::time_point t4 = chrono::steady_clock::now();
+        chunk_iovecs_copied += chunk_iovecs(gather_msg, heads, chunk_iov);
+        chrono::steady_clock::time_point t5 = chrono::steady_clock::now();
+        mismatches += avio_msg != reference || gather_msg != reference || !same_bytes(chunk_iov, chunked);
+        write_buf_us += chrono::duration<double, micro>(t1 - t0).count();
+        avio_us += chrono::duration<double, micro>(t2 - t1).count();
+        gather_us += chrono::duration<double, micro>(t3 - t2).count();
+        chunk_copy_us += chrono::duration<double, micro>(t4 - t3).count();
+        chunk_iovecs_us += chrono::duration<double, micro>(t5 - t4).count();
+    }
+    av_freep(&list.nalus);
+
+    int frames = s.frame_offsets.size();
+    printf("%s: %d frames, %.0f bytes per frame%s\n", s.name.c_str(), frames, (double)payload / frames,
+        mismatches ? ", PAYLOAD MISMATCH" : "");
+    report("avio", avio_copied, payload, frames, avio_us);
+    report("write_buf", write_buf_copied, payload, frames, write_buf_us);
+    report("gather", gather_copied, payload, frames, gather_us);
+    report("chunk copy", chunk_copy_copied, payload, frames, chunk_copy_us);
+    report("chunk iovecs", chunk_iovecs_copied, payload, frames, chunk_iovecs_us);
+    report("gather + chunk copy", gather_copied + chunk_copy_copied, payload, frames,
+        gather_us + chunk_copy_us);
+    report("gather + chunk iovecs (live)", gather_copied + chunk_iovecs_copied, payload, frames,
+        gather_us + chunk_iovecs_us);
+}
+
+int main(int argc, char* argv[]) {
+    std::vector<Stream> streams;
+    for (int i = 1; i < argc; i++) {
+        Stream s;
+        if (!corpus_stream(argv[i], s)) {
+            fprintf(stderr, "Could not open corpus %s\n", argv[i]);
+            return 1;
+        }
+        streams.push_back(s);
+    }
+    srand(1);
+    if (streams.empty()) {
+        streams.push_back(synthetic_stream(2500000, 60));
+        streams.push_back(synthetic_stream(20000000, 10));
+    }
+    for (size_t i = 0; i < streams.size(); i++)
+        bench(streams[i]);
+    return 0;
+}
@@ -0,0 +1,210 @@
+/*
+ * copyright (c) 2004 Michael Niedermayer <michaelni@gmx.at>
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * bitstream writer API, big-endian only, plus the Exp-Golomb writers
+ * from put_golomb.h.
+ */
+
+#ifndef AVCODEC_PUT_BITS_H
+#define AVCODEC_PUT_BITS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "libavutil/common.h"
+#include "libavutil/intreadwrite.h"
+#include "libavutil/avassert.h"
+
+typedef uint32_t BitBuf;
+#define AV_WBBUF AV_WB32
+
+static const int BUF_BITS = 8 * sizeof(BitBuf);
+
+typedef struct PutBitContext {
+    BitBuf bit_buf;
+    int bit_left;
+    uint8_t *buf, *buf_ptr, *buf_end;
+} PutBitContext;
+
+/**
+ * Initialize the PutBitContext s.
+ *
+ * @param buffer the buffer where to put bits
+ * @param buffer_size the size in bytes of buffer
+ */
+static inline void init_put_bits(PutBitContext *s, uint8_t *buffer,
+                                 int buffer_size)
+{
+    if (buffer_size < 0) {
+        buffer_size = 0;
+        buffer      = NULL;
+    }
+
+    s->buf          = buffer;
+    s->buf_end      = s->buf + buffer_size;
+    s->buf_ptr      = s->buf;
+    s->bit_left     = BUF_BITS;
+    s->bit_buf      = 0;
+}
+
+/**
+ * @return the total number of bits written to the bitstream.
+ */
+static inline int put_bits_count(PutBitContext *s)
+{
+    return (s->buf_ptr - s->buf) * 8 + BUF_BITS - s->bit_left;
+}
+
+/**
+ * @return the number of bytes output so far; may only be called
+ *         when the PutBitContext is freshly initialized or flushed.
+ */
+static inline int put_bytes_output(const PutBitContext *s)
+{
+    av_assert2(s->bit_left == BUF_BITS);
+    return s->buf_ptr - s->buf;
+}
+
+/**
+ * @return Number of bits left in the buffer.
+ */
+static inline int put_bits_left(PutBitContext* s)
+{
+    return (s->buf_end - s->buf_ptr) * 8 - BUF_BITS + s->bit_left;
+}
+
+/**
+ * Pad the end of the output stream with zeros.
+ */
+static inline void flush_put_bits(PutBitContext *s)
+{
+    if (s->bit_left < BUF_BITS)
+        s->bit_buf <<= s->bit_left;
+    while (s->bit_left < BUF_BITS) {
+        av_assert0(s->buf_ptr < s->buf_end);
+        *s->buf_ptr++ = s->bit_buf >> (BUF_BITS - 8);
+        s->bit_buf  <<= 8;
+        s->bit_left  += 8;
+    }
+    s->bit_left = BUF_BITS;
+    s->bit_buf  = 0;
+}
+
+/**
+ * Write up to 31 bits into a bitstream.
+ * Use put_bits32 to write 32 bits.
+ */
+static inline void put_bits(PutBitContext *s, int n, BitBuf value)
+{
+    BitBuf bit_buf;
+    int bit_left;
+
+    av_assert2(n <= 31 && value < (1UL << n));
+
+    bit_buf  = s->bit_buf;
+    bit_left = s->bit_left;
+
+    if (n < bit_left) {
+        bit_buf     = (bit_buf << n) | value;
+        bit_left   -= n;
+    } else {
+        bit_buf   <<= bit_left;
+        bit_buf    |= value >> (n - bit_left);
+        av_assert0(s->buf_end - s->buf_ptr >= (ptrdiff_t)sizeof(BitBuf));
+        AV_WBBUF(s->buf_ptr, bit_buf);
+        s->buf_ptr += sizeof(BitBuf);
+        bit_left   += BUF_BITS - n;
+        bit_buf     = value;
+    }
+
+    s->bit_buf  = bit_buf;
+    s->bit_left = bit_left;
+}
+
+/**
+ * Write exactly 32 bits into a bitstream.
+ */
+static inline void put_bits32(PutBitContext *s, uint32_t value)
+{
+    put_bits(s, 16, value >> 16);
+    put_bits(s, 16, value & 0xffff);
+}
+
+/**
+ * Write up to 32 bits into a bitstream.
+ */
+static inline void put_bits_long(PutBitContext *s, int n, uint32_t value)
+{
+    if (n < 32)
+        put_bits(s, n, value);
+    else
+        put_bits32(s, value);
+}
+
+/**
+ * Pad the bitstream with zeros up to the next byte boundary.
+ */
+static inline void align_put_bits(PutBitContext *s)
+{
+    put_bits(s, s->bit_left & 7, 0);
+}
+
+/**
+ * Write an unsigned Exp-Golomb code. Valid for 0 <= i < 2^31 - 1.
+ */
+static inline void set_ue_golomb(PutBitContext *pb, unsigned i)
+{
+    unsigned x = i + 1;
+    int e = av_log2(x);
+
+    av_assert2(i < UINT32_MAX);
+
+    if (e < 16) {
+        put_bits(pb, 2 * e + 1, x);
+    } else {
+        put_bits(pb, e, 0);
+        put_bits_long(pb, e + 1, x);
+    }
+}
+
+/**
+ * Write a signed Exp-Golomb code.
+ */
+static inline void set_se_golomb(PutBitContext *pb, int i)
+{
+    i = 2 * i - 1;
+    if (i < 0)
+        i ^= -1;    //FIXME check if gcc does the right thing
+    set_ue_golomb(pb, i);
+}
+
+/**
+ * Write rbsp_trailing_bits(): the stop bit and zero bits up to the next
+ * byte boundary, then flush.
+ */
+static inline void put_rbsp_trailing_bits(PutBitContext *pb)
+{
+    put_bits(pb, 1, 1);
+    flush_put_bits(pb);
+}
+
+#endif /* AVCODEC_PUT_BITS_H */
@@ -0,0 +1,48 @@
+#include <string.h>
+
+#include "fill.h"
+#include "render.h"
+
+YUVColor get_yuv_from_rgb(int R, int G, int B) {
+    int Y = 0.183f * R + 0.614f * G + 0.062f * B + 16;
+    int U = -0.101f * R - 0.338f * G + 0.439f * B + 128;
+    int V = 0.439f * R - 0.399f * G - 0.040f * B + 128;
+    YUVColor c;
+    c.Y = Y;
+    c.U = U;
+    c.V = V;
+    return c;
+}
+
+YUVColor get_background_color() {
+    YUVColor c;
+    c.Y = 255;
+    c.U = 128;
+    c.V = 128;
+    return c;
+}
+
+void clean_frame(AVFrame* frame) {
+    fill_plane(frame->data[0], frame->linesize[0], frame->linesize[0], frame->height, 255);
+    fill_plane(frame->data[1], frame->linesize[1], frame->linesize[1], frame->height / 2, 128);
+    fill_plane(frame->data[2], frame->linesize[2], frame->linesize[2], frame->height / 2, 128);
+}
+
+void draw_rect_on_frame(AVFrame* frame, Rect rect, YUVColor color) {
+    fill_block(frame->data[0] + frame->linesize[0] * rect.y + rect.x, frame->linesize[0],
+        rect.width, rect.height, color.Y);
+    fill_block(frame->data[1] + frame->linesize[1] * (rect.y / 2) + rect.x / 2, frame->linesize[1],
+        rect.width / 2, rect.height / 2, color.U);
+    fill_block(frame->data[2] + frame->linesize[2] * (rect.y / 2) + rect.x / 2, frame->linesize[2],
+        rect.width / 2, rect.height / 2, color.V);
+}
+
+void render_tone(AVFrame* frame, Oscillator* tone, float freq) {
+    oscillator_set_frequency(tone, freq, frame->sample_rate);
+
+    /* every audio channel plays the same tone */
+    float* samples = (float*)frame->data[0];
+    oscillator_render(tone, samples, frame->nb_samples);
+    for (int k = 1; k < frame->ch_layout.nb_channels; k++)
+        memcpy(frame->data[k], samples, frame->nb_samples * sizeof(float));
+}
@@ -0,0 +1,42 @@
+#ifndef WEBDRIVERTORSO_RENDER_H
+#define WEBDRIVERTORSO_RENDER_H
+
+#include "oscillator.h"
+
+extern "C" {
+#include "libavutil/frame.h"
+}
+
+/*
+ * What a channel draws and plays: the rects on a white YUV420P picture
+ * and the tone, written into the encoders' frames. The picture is painted
+ * with fill_plane and fill_block, memset per row or per plane (fill.h).
+ */
+
+struct Rect {
+    int x = 0;
+    int y = 0;
+    int width = 0;
+    int height = 0;
+};
+
+struct YUVColor {
+    int Y = 0;
+    int U = 0;
+    int V = 0;
+};
+
+/* BT.709, limited range */
+YUVColor get_yuv_from_rgb(int R, int G, int B);
+YUVColor get_background_color();
+
+/* The whole picture back to the background. */
+void clean_frame(AVFrame* frame);
+/* rect has even coordinates and size, the chroma planes are subsampled */
+void draw_rect_on_frame(AVFrame* frame, Rect rect, YUVColor color);
+
+/* The next frame->nb_samples of the tone at freq, the same on every
+ * channel of the planar float frame. The frame must be writable. */
+void render_tone(AVFrame* frame, Oscillator* tone, float freq);
+
+#endif /* WEBDRIVERTORSO_RENDER_H */
@@ -0,0 +1,741 @@
+/*
+ * Publishes one baked corpus (see corpus.h) on many RTMP connections at
+ * once, to load test an ingest.
+ *
+ * rtmp_loadgen [options] <corpus> rtmp://host[:port]/app/key
+ *
+ *   --connections N     sessions to open (100)
+ *   --ramp N            sessions started per second (50)
+ *   --duration S        stop after S seconds, 0 runs until interrupted (0)
+ *   --max-pending KB    unsent bytes of a session before it skips to the next keyframe (2048)
+ *
+ * Session i publishes to key<i>. Everything runs on one thread around
+ * epoll: the ramp spreads the connects, handshakes and publish commands
+ * over time, and a session streams once the ingest has answered publish.
+ * The corpus is mapped once and every session sends the same payload
+ * bytes straight from the mapping; only the chunk headers are its own.
+ * Session i starts at keyframe i (modulo the keyframe count) so the
+ * keyframes of the sessions do not all line up, and its timestamps start
+ * at 0. The messages that are due on a session are queued as iovecs and
+ * written with one writev.
+ *
+ * A session that falls behind (its socket does not drain) drops
+ * everything up to a keyframe, the same as the drop policy of fanout.h.
+ * Every 10 s the sessions per state, the send rate, the drops and the
+ * send lateness are printed.
+ *
+ * Linux only. The open files limit is raised to its hard limit; it has
+ * to be above the connection count.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <queue>
+#include <string>
+#include <vector>
+#include "corpus.h"
+#include "pacer.h"
+#include "rtmp_proto.h"
+
+using namespace std;
+
+/* iovecs per writev */
+#define BATCH_IOVECS 64
+/* the AVC and AAC tag header in front of every payload */
+#define MAX_TAG_HEADER 5
+
+enum SessionState {
+    SESSION_CONNECTING,
+    SESSION_HANDSHAKE,
+    SESSION_CONNECT,            ///< waiting for the connect _result
+    SESSION_CREATE_STREAM,      ///< waiting for the createStream _result
+    SESSION_PUBLISH,            ///< waiting for NetStream.Publish.Start
+    SESSION_STREAMING,
+    SESSION_FAILED,
+    SESSION_NB_STATES,
+};
+
+static const char* state_names[SESSION_NB_STATES] = {
+    "connecting", "handshake", "connect", "createStream", "publish", "streaming", "failed",
+};
+
+/* A piece of a queued media message: shared payload, or bytes of its own (chunk headers). */
+struct Segment {
+    const uint8_t* data;        ///< NULL if the bytes are in own
+    uint32_t size;
+    uint8_t own[RTMP_MAX_HEADER_SIZE + MAX_TAG_HEADER];
+};
+
+struct Session {
+    Session(Clock& clock, const PacingOptions& pacing) : pacer(clock, pacing) {
+    }
+
+    int fd = -1;
+    int index = 0;
+    SessionState state = SESSION_CONNECTING;
+    uint32_t stream_id = 0;
+
+    /* S0 S1 S2, then the chunk stream */
+    std::vector<uint8_t> handshake;
+    RtmpChunkReader reader;
+
+    /* handshake, commands and headers; media only once this is sent */
+    std::vector<uint8_t> control;
+    size_t control_sent = 0;
+    std::deque<Segment> media;
+    size_t media_sent = 0;      ///< of media.front()
+    size_t pending = 0;         ///< bytes queued and not sent yet
+    bool want_write = false;    ///< registered for EPOLLOUT
+
+    Pacer pacer;
+    uint32_t next_packet = 0;
+    int64_t base_ms = 0;        ///< added to the corpus timestamps
+    bool waiting_key = false;   ///< fell behind, dropping up to a keyframe
+};
+
+class LoadGenerator {
+public:
+    LoadGenerator(const CorpusFile& corpus, const std::string& host, int port, const std::string& app,
+        const std::string& key, size_t max_pending);
+
+    bool resolve();
+    /* Returns after duration_s, or once interrupted if it is 0. */
+    void run(int connections, int ramp, int duration_s, const volatile sig_atomic_t* interrupted);
+
+private:
+    typedef std::pair<int64_t, size_t> Due;
+
+    void open_session();
+    void fail(Session& s, const char* reason);
+    void queue_control(Session& s, int csid, int type, uint32_t stream_id, const std::vector<uint8_t>& body);
+    void on_writable(Session& s);
+    void on_readable(Session& s);
+    void on_handshake(Session& s);
+    void on_message(Session& s, const RtmpMessage& msg);
+    void start_streaming(Session& s);
+    int64_t next_timestamp(const Session& s) const;
+    void queue_due(Session& s);
+    void queue_packet(Session& s, const CorpusPacket& pkt, uint32_t timestamp);
+    /* Writes what the socket takes. Returns false if the connection failed. */
+    bool flush(Session& s);
+    void print_stats(int connections, int64_t interval_us);
+
+    const CorpusFile& corpus;
+    std::string host;
+    int port;
+    std::string app;
+    std::string key;
+    std::string tc_url;
+    size_t max_pending;
+
+    struct sockaddr_storage addr;
+    socklen_t addr_len = 0;
+
+    SteadyClock clock;
+    PacingOptions pacing;
+    int epoll_fd = -1;
+    std::vector<std::unique_ptr<Session> > sessions;
+    std::priority_queue<Due, std::vector<Due>, std::greater<Due> > schedule;
+
+    /* the same for every session */
+    std::vector<uint8_t> c1;
+    std::vector<uint8_t> metadata;
+    std::vector<uint8_t> video_header;
+    std::vector<uint8_t> audio_header;
+
+    uint64_t bytes_sent = 0;
+    uint64_t messages_sent = 0;
+    uint64_t messages_dropped = 0;
+    uint64_t fall_behinds = 0;
+    uint64_t last_bytes_sent = 0;
+    uint64_t last_messages_sent = 0;
+};
+
+LoadGenerator::LoadGenerator(const CorpusFile& corpus, const std::string& host, int port,
+    const std::string& app, const std::string& key, size_t max_pending)
+    : corpus(corpus), host(host), port(port), app(app), key(key), max_pending(max_pending) {
+    tc_url = "rtmp://" + host + ":" + to_string(port) + "/" + app;
+
+    /* time and zero, then anything: the plain handshake does not check it */
+    c1.resize(RTMP_HANDSHAKE_SIZE);
+    uint32_t x = 0x9e3779b9;
+    for (size_t i = 8; i < c1.size(); i++) {
+        x = x * 1664525 + 1013904223;
+        c1[i] = x >> 24;
+    }
+
+    const CorpusHeader* h = corpus.header();
+    pacing.frame_period_us = 1000000 / h->framerate;
+    RtmpStreamInfo info;
+    info.width = h->width;
+    info.height = h->height;
+    info.framerate = h->framerate;
+    info.video_bitrate = h->video_bitrate;
+    info.audio_bitrate = h->audio_bitrate;
+    info.sample_rate = h->sample_rate;
+    info.channels = h->channels;
+    rtmp_metadata_body(metadata, info);
+
+    static const uint8_t avc_sequence_header[] = { 0x17, 0x00, 0x00, 0x00, 0x00 };
+    video_header.assign(avc_sequence_header, avc_sequence_header + sizeof(avc_sequence_header));
+    video_header.insert(video_header.end(), corpus.avcc(), corpus.avcc() + h->avcc_size);
+    static const uint8_t aac_sequence_header[] = { 0xaf, 0x00 };
+    audio_header.assign(aac_sequence_header, aac_sequence_header + sizeof(aac_sequence_header));
+    audio_header.insert(audio_header.end(), corpus.asc(), corpus.asc() + h->asc_size);
+}
+
+bool LoadGenerator::resolve() {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* res = NULL;
+    int err = getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &res);
+    if (err) {
+        fprintf(stderr, "Could not resolve %s: %s\n", host.c_str(), gai_strerror(err));
+        return false;
+    }
+    memcpy(&addr, res->ai_addr, res->ai_addrlen);
+    addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return true;
+}
+
+void LoadGenerator::queue_control(Session& s, int csid, int type, uint32_t stream_id,
+    const std::vector<uint8_t>& body) {
+    size_t before = s.control.size();
+    rtmp_append_message(s.control, csid, type, stream_id, 0, body.data(), body.size(), RTMP_MAX_CHUNK_SIZE);
+    s.pending += s.control.size() - before;
+}
+
+void LoadGenerator::open_session() {
+    std::unique_ptr<Session> session(new Session(clock, pacing));
+    Session& s = *session;
+    s.index = sessions.size();
+    sessions.push_back(std::move(session));
+
+    s.fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (s.fd < 0) {
+        fail(s, strerror(errno));
+        return;
+    }
+    int one = 1;
+    setsockopt(s.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(s.fd, (struct sockaddr*)&addr, addr_len) < 0 && errno != EINPROGRESS) {
+        fail(s, strerror(errno));
+        return;
+    }
+
+    /* connected once writable */
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.u64 = s.index;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s.fd, &ev);
+    s.want_write = true;
+}
+
+void LoadGenerator::fail(Session& s, const char* reason) {
+    if (s.state == SESSION_FAILED)
+        return;
+    fprintf(stderr, "Session %d: %s in state %s\n", s.index, reason, state_names[s.state]);
+    if (s.fd >= 0)
+        close(s.fd);
+    s.fd = -1;
+    s.state = SESSION_FAILED;
+    std::vector<uint8_t>().swap(s.control);
+    std::deque<Segment>().swap(s.media);
+    s.pending = 0;
+}
+
+void LoadGenerator::on_writable(Session& s) {
+    if (s.state == SESSION_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(s.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err) {
+            fail(s, strerror(err));
+            return;
+        }
+        /* C0 C1 */
+        s.control.push_back(3);
+        s.control.insert(s.control.end(), c1.begin(), c1.end());
+        s.pending += 1 + c1.size();
+        s.state = SESSION_HANDSHAKE;
+    }
+    if (!flush(s))
+        fail(s, "write error");
+}
+
+void LoadGenerator::on_readable(Session& s) {
+    uint8_t buf[65536];
+    while (s.state != SESSION_FAILED) {
+        ssize_t n = recv(s.fd, buf, sizeof(buf), 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n <= 0) {
+            fail(s, n ? strerror(errno) : "connection closed");
+            return;
+        }
+
+        const uint8_t* p = buf;
+        size_t size = n;
+        if (s.state == SESSION_HANDSHAKE) {
+            size_t need = 1 + 2 * RTMP_HANDSHAKE_SIZE - s.handshake.size();
+            size_t take = size < need ? size : need;
+            s.handshake.insert(s.handshake.end(), p, p + take);
+            p += take;
+            size -= take;
+            if (take < need)
+                continue;
+            on_handshake(s);
+            if (s.state == SESSION_FAILED)
+                return;
+        }
+
+        std::vector<RtmpMessage> messages;
+        if (!s.reader.feed(p, size, messages)) {
+            fail(s, "malformed chunk stream");
+            return;
+        }
+        for (size_t i = 0; i < messages.size() && s.state != SESSION_FAILED; i++)
+            on_message(s, messages[i]);
+        if (s.state != SESSION_FAILED && !flush(s))
+            fail(s, "write error");
+    }
+}
+
+void LoadGenerator::on_handshake(Session& s) {
+    if (s.handshake[0] != 3) {
+        fail(s, "not an RTMP server");
+        return;
+    }
+    /* C2 echoes S1 */
+    s.control.insert(s.control.end(), s.handshake.begin() + 1, s.handshake.begin() + 1 + RTMP_HANDSHAKE_SIZE);
+    s.pending += RTMP_HANDSHAKE_SIZE;
+    std::vector<uint8_t>().swap(s.handshake);
+    s.state = SESSION_CONNECT;
+
+    size_t before = s.control.size();
+    rtmp_append_set_chunk_size(s.control, RTMP_MAX_CHUNK_SIZE, RTMP_DEFAULT_CHUNK_SIZE);
+    s.pending += s.control.size() - before;
+
+    std::vector<uint8_t> body;
+    rtmp_connect_body(body, app, tc_url);
+    queue_control(s, RTMP_CSID_COMMAND, RTMP_COMMAND_AMF0, 0, body);
+}
+
+void LoadGenerator::on_message(Session& s, const RtmpMessage& msg) {
+    if (msg.type != RTMP_COMMAND_AMF0)
+        return;
+    AmfReader r(msg.body.data(), msg.body.size());
+    std::string name;
+    double transaction = 0;
+    if (!r.read_string(name) || !r.read_number(transaction))
+        return;
+    std::string stream_key = key + to_string(s.index);
+
+    if (name == "_result" && s.state == SESSION_CONNECT && transaction == RTMP_TRANSACTION_CONNECT) {
+        std::vector<uint8_t> body;
+        rtmp_command_start(body, "releaseStream", RTMP_TRANSACTION_RELEASE_STREAM);
+        amf_write_string(body, stream_key);
+        queue_control(s, RTMP_CSID_COMMAND, RTMP_COMMAND_AMF0, 0, body);
+        body.clear();
+        rtmp_command_start(body, "FCPublish", RTMP_TRANSACTION_FC_PUBLISH);
+        amf_write_string(body, stream_key);
+        queue_control(s, RTMP_CSID_COMMAND, RTMP_COMMAND_AMF0, 0, body);
+        body.clear();
+        rtmp_command_start(body, "createStream", RTMP_TRANSACTION_CREATE_STREAM);
+        queue_control(s, RTMP_CSID_COMMAND, RTMP_COMMAND_AMF0, 0, body);
+        s.state = SESSION_CREATE_STREAM;
+    }
+    else if (name == "_result" && s.state == SESSION_CREATE_STREAM && transaction == RTMP_TRANSACTION_CREATE_STREAM) {
+        double id = 0;
+        if (!r.skip() || !r.read_number(id)) {
+            fail(s, "createStream returned no stream id");
+            return;
+        }
+        s.stream_id = (uint32_t)id;
+        std::vector<uint8_t> body;
+        rtmp_command_start(body, "publish", RTMP_TRANSACTION_PUBLISH);
+        amf_write_string(body, stream_key);
+        amf_write_string(body, "live");
+        queue_control(s, RTMP_CSID_STREAM, RTMP_COMMAND_AMF0, s.stream_id, body);
+        s.state = SESSION_PUBLISH;
+    }
+    else if (name == "_error" &&
+        (transaction == RTMP_TRANSACTION_CONNECT || transaction == RTMP_TRANSACTION_CREATE_STREAM)) {
+        fail(s, "command refused");
+    }
+    else if (name == "onStatus") {
+        std::map<std::string, std::string> info;
+        if (!r.skip() || !r.read_object(info))
+            return;
+        if (info["level"] == "error") {
+            fprintf(stderr, "Session %d: %s\n", s.index, info["code"].c_str());
+            fail(s, "publish refused");
+        }
+        else if (s.state == SESSION_PUBLISH && info["code"] == "NetStream.Publish.Start")
+            start_streaming(s);
+    }
+}
+
+void LoadGenerator::start_streaming(Session& s) {
+    queue_control(s, RTMP_CSID_STREAM, RTMP_DATA_AMF0, s.stream_id, metadata);
+    queue_control(s, RTMP_CSID_VIDEO, RTMP_VIDEO, s.stream_id, video_header);
+    queue_control(s, RTMP_CSID_AUDIO, RTMP_AUDIO, s.stream_id, audio_header);
+
+    const CorpusHeader* h = corpus.header();
+    s.next_packet = corpus.keyframes()[s.index % h->keyframe_count];
+    s.base_ms = -(int64_t)corpus.packets()[s.next_packet].dts_ms;
+    s.state = SESSION_STREAMING;
+    s.pacer.start();
+    schedule.push(Due(s.pacer.deadline_us(next_timestamp(s)), s.index));
+}
+
+int64_t LoadGenerator::next_timestamp(const Session& s) const {
+    return s.base_ms + corpus.packets()[s.next_packet].dts_ms;
+}
+
+void LoadGenerator::queue_due(Session& s) {
+    const CorpusPacket* packets = corpus.packets();
+    const CorpusHeader* h = corpus.header();
+    for (;;) {
+        int64_t timestamp = next_timestamp(s);
+        if (!s.pacer.due(timestamp))
+            break;
+
+        const CorpusPacket& pkt = packets[s.next_packet];
+        bool key = pkt.type == CORPUS_PACKET_VIDEO && (pkt.flags & CORPUS_FLAG_KEY);
+        if (!s.waiting_key && s.pending > max_pending) {
+            s.waiting_key = true;
+            fall_behinds++;
+        }
+        if (s.waiting_key && key && s.pending <= max_pending / 2)
+            s.waiting_key = false;
+        if (s.waiting_key)
+            messages_dropped++;
+        else {
+            queue_packet(s, pkt, (uint32_t)timestamp);
+            messages_sent++;
+        }
+
+        if (++s.next_packet == h->packet_count) {
+            s.next_packet = 0;
+            s.base_ms += h->duration_ms;
+        }
+    }
+}
+
+void LoadGenerator::queue_packet(Session& s, const CorpusPacket& pkt, uint32_t timestamp) {
+    uint8_t tag[MAX_TAG_HEADER];
+    int tag_size;
+    int csid;
+    int type;
+    if (pkt.type == CORPUS_PACKET_VIDEO) {
+        tag[0] = pkt.flags & CORPUS_FLAG_KEY ? 0x17 : 0x27;
+        tag[1] = 0x01;
+        tag[2] = pkt.cts_ms >> 16;
+        tag[3] = pkt.cts_ms >> 8;
+        tag[4] = pkt.cts_ms;
+        tag_size = 5;
+        csid = RTMP_CSID_VIDEO;
+        type = RTMP_VIDEO;
+    }
+    else {
+        tag[0] = 0xaf;
+        tag[1] = 0x01;
+        tag_size = 2;
+        csid = RTMP_CSID_AUDIO;
+        type = RTMP_AUDIO;
+    }
+
+    Segment seg;
+    seg.data = NULL;
+    seg.size = rtmp_write_message_header(seg.own, csid, timestamp, tag_size + pkt.size, type, s.stream_id);
+    memcpy(seg.own + seg.size, tag, tag_size);
+    seg.size += tag_size;
+    s.media.push_back(seg);
+    s.pending += seg.size;
+
+    const uint8_t* payload = corpus.payload(pkt);
+    size_t room = RTMP_MAX_CHUNK_SIZE - tag_size;
+    for (size_t pos = 0; pos < pkt.size;) {
+        if (pos) {
+            seg.data = NULL;
+            seg.size = rtmp_write_continuation_header(seg.own, csid, timestamp);
+            s.media.push_back(seg);
+            s.pending += seg.size;
+            room = RTMP_MAX_CHUNK_SIZE;
+        }
+        size_t len = pkt.size - pos < room ? pkt.size - pos : room;
+        seg.data = payload + pos;
+        seg.size = len;
+        s.media.push_back(seg);
+        s.pending += len;
+        pos += len;
+    }
+}
+
+bool LoadGenerator::flush(Session& s) {
+    if (s.state == SESSION_CONNECTING)
+        return true;
+
+    bool blocked = false;
+    while (s.pending) {
+        struct iovec iov[BATCH_IOVECS];
+        int n = 0;
+        size_t total = 0;
+        if (s.control_sent < s.control.size()) {
+            iov[n].iov_base = s.control.data() + s.control_sent;
+            iov[n].iov_len = s.control.size() - s.control_sent;
+            total += iov[n++].iov_len;
+        }
+        size_t offset = s.media_sent;
+        for (std::deque<Segment>::iterator it = s.media.begin(); it != s.media.end() && n < BATCH_IOVECS; ++it) {
+            const uint8_t* base = it->data ? it->data : it->own;
+            iov[n].iov_base = (void*)(base + offset);
+            iov[n].iov_len = it->size - offset;
+            total += iov[n++].iov_len;
+            offset = 0;
+        }
+
+        ssize_t written = writev(s.fd, iov, n);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            blocked = true;
+            break;
+        }
+        if (written < 0)
+            return false;
+
+        bytes_sent += written;
+        s.pending -= written;
+        size_t left = written;
+        if (s.control_sent < s.control.size()) {
+            size_t c = s.control.size() - s.control_sent < left ? s.control.size() - s.control_sent : left;
+            s.control_sent += c;
+            left -= c;
+            if (s.control_sent == s.control.size()) {
+                s.control.clear();
+                s.control_sent = 0;
+            }
+        }
+        while (left) {
+            size_t rest = s.media.front().size - s.media_sent;
+            if (left < rest) {
+                s.media_sent += left;
+                break;
+            }
+            left -= rest;
+            s.media.pop_front();
+            s.media_sent = 0;
+        }
+        if ((size_t)written < total) {
+            blocked = true;
+            break;
+        }
+    }
+
+    if (blocked != s.want_write) {
+        struct epoll_event ev;
+        ev.events = blocked ? EPOLLIN | EPOLLOUT : EPOLLIN;
+        ev.data.u64 = s.index;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, s.fd, &ev);
+        s.want_write = blocked;
+    }
+    return true;
+}
+
+void LoadGenerator::print_stats(int connections, int64_t interval_us) {
+    int states[SESSION_NB_STATES] = {};
+    uint64_t jitter[JitterHistogram::nb_buckets] = {};
+    size_t max_session_pending = 0;
+    for (size_t i = 0; i < sessions.size(); i++) {
+        const Session& s = *sessions[i];
+        states[s.state]++;
+        if (s.state == SESSION_STREAMING) {
+            s.pacer.jitter().merge_into(jitter);
+            if (s.pending > max_session_pending)
+                max_session_pending = s.pending;
+        }
+    }
+    int setting_up = 0;
+    for (int i = SESSION_CONNECTING; i < SESSION_STREAMING; i++)
+        setting_up += states[i];
+
+    double seconds = interval_us / 1e6;
+    printf("Sessions %d/%d streaming, %d setting up, %d failed: %.1f Mbit/s, %.0f messages/s, "
+        "%llu messages dropped in %llu fall-behinds, max %zu KB pending\n",
+        states[SESSION_STREAMING], connections, setting_up, states[SESSION_FAILED],
+        (bytes_sent - last_bytes_sent) * 8 / seconds / 1e6, (messages_sent - last_messages_sent) / seconds,
+        (unsigned long long)messages_dropped, (unsigned long long)fall_behinds, max_session_pending / 1024);
+    JitterHistogram::print("Send", jitter);
+    fflush(stdout);
+    last_bytes_sent = bytes_sent;
+    last_messages_sent = messages_sent;
+}
+
+void LoadGenerator::run(int connections, int ramp, int duration_s, const volatile sig_atomic_t* interrupted) {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        fprintf(stderr, "epoll_create1: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    const int64_t stats_interval_us = 10000000;
+    int64_t start_us = clock.now_us();
+    int64_t end_us = duration_s ? start_us + duration_s * (int64_t)1000000 : INT64_MAX;
+    int64_t ramp_interval_us = 1000000 / ramp;
+    int64_t next_open_us = start_us;
+    int64_t next_stats_us = start_us + stats_interval_us;
+    int64_t last_stats_us = start_us;
+
+    struct epoll_event events[256];
+    while (!*interrupted) {
+        int64_t now_us = clock.now_us();
+        if (now_us >= end_us)
+            break;
+
+        while ((int)sessions.size() < connections && now_us >= next_open_us) {
+            open_session();
+            next_open_us += ramp_interval_us;
+        }
+
+        while (!schedule.empty() && schedule.top().first <= now_us) {
+            size_t i = schedule.top().second;
+            schedule.pop();
+            Session& s = *sessions[i];
+            if (s.state != SESSION_STREAMING)
+                continue;
+            queue_due(s);
+            if (!flush(s)) {
+                fail(s, "write error");
+                continue;
+            }
+            schedule.push(Due(s.pacer.deadline_us(next_timestamp(s)), i));
+        }
+
+        if (now_us >= next_stats_us) {
+            print_stats(connections, now_us - last_stats_us);
+            last_stats_us = now_us;
+            next_stats_us += stats_interval_us;
+        }
+
+        int64_t wake_us = next_stats_us < end_us ? next_stats_us : end_us;
+        if (!schedule.empty() && schedule.top().first < wake_us)
+            wake_us = schedule.top().first;
+        if ((int)sessions.size() < connections && next_open_us < wake_us)
+            wake_us = next_open_us;
+        now_us = clock.now_us();
+        int timeout_ms = wake_us <= now_us ? 0 : (int)((wake_us - now_us + 999) / 1000);
+
+        int n = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(events[0]), timeout_ms);
+        for (int i = 0; i < n; i++) {
+            Session& s = *sessions[events[i].data.u64];
+            if (s.state == SESSION_FAILED)
+                continue;
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                on_readable(s);
+            if (s.state != SESSION_FAILED && (events[i].events & EPOLLOUT))
+                on_writable(s);
+        }
+    }
+
+    print_stats(connections, clock.now_us() - last_stats_us);
+    for (size_t i = 0; i < sessions.size(); i++)
+        if (sessions[i]->fd >= 0)
+            close(sessions[i]->fd);
+    close(epoll_fd);
+}
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void on_interrupt(int) {
+    interrupted = 1;
+}
+
+void usage(const char* name) {
+    fprintf(stderr, "Usage: %s [options] <corpus> rtmp://host[:port]/app/key\n", name);
+    fprintf(stderr, "  --connections N     sessions to open, session i publishes to key<i> (100)\n");
+    fprintf(stderr, "  --ramp N            sessions started per second (50)\n");
+    fprintf(stderr, "  --duration S        stop after S seconds, 0 runs until interrupted (0)\n");
+    fprintf(stderr, "  --max-pending KB    unsent bytes of a session before it skips to the next keyframe (2048)\n");
+    exit(1);
+}
+
+int main(int argc, char* argv[]) {
+    int connections = 100;
+    int ramp = 50;
+    int duration_s = 0;
+    size_t max_pending = 2048 * 1024;
+    std::vector<const char*> args;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--connections") && i + 1 < argc)
+            connections = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--ramp") && i + 1 < argc)
+            ramp = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--duration") && i + 1 < argc)
+            duration_s = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--max-pending") && i + 1 < argc)
+            max_pending = (size_t)atoi(argv[++i]) * 1024;
+        else if (argv[i][0] != '-')
+            args.push_back(argv[i]);
+        else
+            usage(argv[0]);
+    }
+    if (args.size() != 2 || connections < 1 || ramp < 1 || duration_s < 0 || !max_pending)
+        usage(argv[0]);
+
+    RtmpUrl url;
+    if (!parse_rtmp_url(args[1], url)) {
+        fprintf(stderr, "Invalid destination, expected rtmp://host[:port]/app/key\n");
+        return 1;
+    }
+
+    CorpusFile corpus;
+    if (!corpus.open(args[0]))
+        return 1;
+    if (!corpus.header()->keyframe_count) {
+        fprintf(stderr, "%s has no keyframes\n", args[0]);
+        return 1;
+    }
+
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t)connections + 16)
+        fprintf(stderr, "Open files limit %llu is too low for %d connections\n",
+            (unsigned long long)limit.rlim_cur, connections);
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, on_interrupt);
+    signal(SIGTERM, on_interrupt);
+
+    LoadGenerator generator(corpus, url.host, url.port, url.app, url.key, max_pending);
+    if (!generator.resolve())
+        return 1;
+    generator.run(connections, ramp, duration_s, &interrupted);
+    return 0;
+}
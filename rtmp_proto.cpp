@@ -0,0 +1,478 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "rtmp_proto.h"
+
+using namespace std;
+
+bool parse_rtmp_url(const char* url, RtmpUrl& parsed) {
+    static const string scheme = "rtmp://";
+    string s(url);
+    if (s.compare(0, scheme.size(), scheme) != 0)
+        return false;
+    size_t host_end = s.find('/', scheme.size());
+    if (host_end == string::npos)
+        return false;
+    size_t app_end = s.find('/', host_end + 1);
+    if (app_end == string::npos)
+        return false;
+
+    parsed.host = s.substr(scheme.size(), host_end - scheme.size());
+    parsed.port = 1935;
+    size_t colon = parsed.host.find(':');
+    if (colon != string::npos) {
+        parsed.port = atoi(parsed.host.c_str() + colon + 1);
+        parsed.host.resize(colon);
+    }
+    parsed.app = s.substr(host_end + 1, app_end - host_end - 1);
+    parsed.key = s.substr(app_end + 1);
+    return !parsed.host.empty() && !parsed.app.empty() && !parsed.key.empty() && parsed.port > 0;
+}
+
+static void put_be24(uint8_t* p, uint32_t v) {
+    p[0] = v >> 16;
+    p[1] = v >> 8;
+    p[2] = v;
+}
+
+static void put_be32(uint8_t* p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32_t get_be24(const uint8_t* p) {
+    return (uint32_t)p[0] << 16 | p[1] << 8 | p[2];
+}
+
+static uint32_t get_be32(const uint8_t* p) {
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static int write_basic_header(uint8_t* dst, int fmt, int csid) {
+    if (csid < 64) {
+        dst[0] = fmt << 6 | csid;
+        return 1;
+    }
+    if (csid < 64 + 256) {
+        dst[0] = fmt << 6;
+        dst[1] = csid - 64;
+        return 2;
+    }
+    dst[0] = fmt << 6 | 1;
+    dst[1] = (csid - 64) & 0xff;
+    dst[2] = (csid - 64) >> 8;
+    return 3;
+}
+
+int rtmp_write_message_header(uint8_t* dst, int csid, uint32_t timestamp, uint32_t length,
+    int type, uint32_t stream_id) {
+    int n = write_basic_header(dst, 0, csid);
+    uint8_t* p = dst + n;
+    put_be24(p, timestamp < 0xffffff ? timestamp : 0xffffff);
+    put_be24(p + 3, length);
+    p[6] = type;
+    /* the one little endian field */
+    p[7] = stream_id;
+    p[8] = stream_id >> 8;
+    p[9] = stream_id >> 16;
+    p[10] = stream_id >> 24;
+    n += 11;
+    if (timestamp >= 0xffffff) {
+        put_be32(dst + n, timestamp);
+        n += 4;
+    }
+    return n;
+}
+
+int rtmp_write_continuation_header(uint8_t* dst, int csid, uint32_t timestamp) {
+    int n = write_basic_header(dst, 3, csid);
+    /* repeated on every chunk, as FFmpeg and librtmp expect */
+    if (timestamp >= 0xffffff) {
+        put_be32(dst + n, timestamp);
+        n += 4;
+    }
+    return n;
+}
+
+void rtmp_append_message(vector<uint8_t>& out, int csid, int type, uint32_t stream_id,
+    uint32_t timestamp, const uint8_t* body, size_t size, uint32_t chunk_size) {
+    uint8_t header[RTMP_MAX_HEADER_SIZE];
+    int n = rtmp_write_message_header(header, csid, timestamp, size, type, stream_id);
+    out.insert(out.end(), header, header + n);
+    size_t pos = 0;
+    for (;;) {
+        size_t len = size - pos < chunk_size ? size - pos : chunk_size;
+        out.insert(out.end(), body + pos, body + pos + len);
+        pos += len;
+        if (pos == size)
+            break;
+        n = rtmp_write_continuation_header(header, csid, timestamp);
+        out.insert(out.end(), header, header + n);
+    }
+}
+
+void rtmp_append_set_chunk_size(vector<uint8_t>& out, uint32_t size, uint32_t chunk_size) {
+    uint8_t body[4];
+    put_be32(body, size);
+    rtmp_append_message(out, RTMP_CSID_CONTROL, RTMP_SET_CHUNK_SIZE, 0, 0, body, sizeof(body), chunk_size);
+}
+
+void rtmp_append_acknowledgement(vector<uint8_t>& out, uint32_t received, uint32_t chunk_size) {
+    uint8_t body[4];
+    put_be32(body, received);
+    rtmp_append_message(out, RTMP_CSID_CONTROL, RTMP_ACKNOWLEDGEMENT, 0, 0, body, sizeof(body), chunk_size);
+}
+
+void rtmp_append_ping_response(vector<uint8_t>& out, uint32_t timestamp, uint32_t chunk_size) {
+    uint8_t body[6];
+    body[0] = 0;
+    body[1] = RTMP_PING_RESPONSE;
+    put_be32(body + 2, timestamp);
+    rtmp_append_message(out, RTMP_CSID_CONTROL, RTMP_USER_CONTROL, 0, 0, body, sizeof(body), chunk_size);
+}
+
+enum {
+    AMF0_NUMBER = 0x00,
+    AMF0_BOOLEAN = 0x01,
+    AMF0_STRING = 0x02,
+    AMF0_OBJECT = 0x03,
+    AMF0_NULL = 0x05,
+    AMF0_UNDEFINED = 0x06,
+    AMF0_ECMA_ARRAY = 0x08,
+    AMF0_OBJECT_END = 0x09,
+    AMF0_STRICT_ARRAY = 0x0a,
+    AMF0_LONG_STRING = 0x0c,
+};
+
+void amf_write_number(vector<uint8_t>& out, double v) {
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    out.push_back(AMF0_NUMBER);
+    for (int i = 7; i >= 0; i--)
+        out.push_back(bits >> (i * 8));
+}
+
+void amf_write_bool(vector<uint8_t>& out, bool v) {
+    out.push_back(AMF0_BOOLEAN);
+    out.push_back(v);
+}
+
+void amf_write_key(vector<uint8_t>& out, const string& key) {
+    out.push_back(key.size() >> 8);
+    out.push_back(key.size());
+    out.insert(out.end(), key.begin(), key.end());
+}
+
+void amf_write_string(vector<uint8_t>& out, const string& v) {
+    out.push_back(AMF0_STRING);
+    amf_write_key(out, v);
+}
+
+void amf_write_null(vector<uint8_t>& out) {
+    out.push_back(AMF0_NULL);
+}
+
+void amf_write_object_start(vector<uint8_t>& out) {
+    out.push_back(AMF0_OBJECT);
+}
+
+void amf_write_ecma_array_start(vector<uint8_t>& out, uint32_t count) {
+    out.push_back(AMF0_ECMA_ARRAY);
+    uint8_t n[4];
+    put_be32(n, count);
+    out.insert(out.end(), n, n + 4);
+}
+
+void amf_write_object_end(vector<uint8_t>& out) {
+    out.push_back(0);
+    out.push_back(0);
+    out.push_back(AMF0_OBJECT_END);
+}
+
+void rtmp_connect_body(vector<uint8_t>& out, const string& app, const string& tc_url) {
+    amf_write_string(out, "connect");
+    amf_write_number(out, RTMP_TRANSACTION_CONNECT);
+    amf_write_object_start(out);
+    amf_write_key(out, "app");
+    amf_write_string(out, app);
+    amf_write_key(out, "type");
+    amf_write_string(out, "nonprivate");
+    amf_write_key(out, "flashVer");
+    amf_write_string(out, "FMLE/3.0 (compatible; webdrivertorso)");
+    amf_write_key(out, "tcUrl");
+    amf_write_string(out, tc_url);
+    amf_write_object_end(out);
+}
+
+void rtmp_command_start(vector<uint8_t>& out, const char* name, int transaction) {
+    amf_write_string(out, name);
+    amf_write_number(out, transaction);
+    amf_write_null(out);
+}
+
+void rtmp_metadata_body(vector<uint8_t>& out, const RtmpStreamInfo& info) {
+    amf_write_string(out, "@setDataFrame");
+    flv_metadata_body(out, info);
+}
+
+void flv_metadata_body(vector<uint8_t>& out, const RtmpStreamInfo& info) {
+    amf_write_string(out, "onMetaData");
+    amf_write_ecma_array_start(out, 10);
+    amf_write_key(out, "width");
+    amf_write_number(out, info.width);
+    amf_write_key(out, "height");
+    amf_write_number(out, info.height);
+    amf_write_key(out, "framerate");
+    amf_write_number(out, info.framerate);
+    /* kbit/s, as FFmpeg's flvenc writes them */
+    amf_write_key(out, "videodatarate");
+    amf_write_number(out, info.video_bitrate / 1000.0);
+    amf_write_key(out, "videocodecid");
+    amf_write_number(out, 7);
+    amf_write_key(out, "audiodatarate");
+    amf_write_number(out, info.audio_bitrate / 1000.0);
+    amf_write_key(out, "audiosamplerate");
+    amf_write_number(out, info.sample_rate);
+    amf_write_key(out, "audiosamplesize");
+    amf_write_number(out, 16);
+    amf_write_key(out, "stereo");
+    amf_write_bool(out, info.channels > 1);
+    amf_write_key(out, "audiocodecid");
+    amf_write_number(out, 10);
+    amf_write_object_end(out);
+}
+
+bool AmfReader::read_number(double& v) {
+    if (end - p < 9 || p[0] != AMF0_NUMBER)
+        return false;
+    uint64_t bits = (uint64_t)get_be32(p + 1) << 32 | get_be32(p + 5);
+    memcpy(&v, &bits, sizeof(v));
+    p += 9;
+    return true;
+}
+
+bool AmfReader::read_string(string& v) {
+    if (end - p < 3 || p[0] != AMF0_STRING)
+        return false;
+    size_t len = p[1] << 8 | p[2];
+    if ((size_t)(end - p - 3) < len)
+        return false;
+    v.assign((const char*)p + 3, len);
+    p += 3 + len;
+    return true;
+}
+
+bool AmfReader::skip_properties(map<string, string>* strings, map<string, double>* numbers) {
+    for (;;) {
+        if (end - p < 3)
+            return false;
+        size_t len = p[0] << 8 | p[1];
+        if (len == 0 && p[2] == AMF0_OBJECT_END) {
+            p += 3;
+            return true;
+        }
+        if ((size_t)(end - p - 2) < len)
+            return false;
+        string name((const char*)p + 2, len);
+        p += 2 + len;
+        string value;
+        double number;
+        if (strings && p < end && *p == AMF0_STRING) {
+            if (!read_string(value))
+                return false;
+            (*strings)[name] = value;
+        }
+        else if (numbers && p < end && *p == AMF0_NUMBER) {
+            if (!read_number(number))
+                return false;
+            (*numbers)[name] = number;
+        }
+        else if (!skip())
+            return false;
+    }
+}
+
+bool AmfReader::read_object(map<string, string>& strings, map<string, double>* numbers) {
+    if (p >= end)
+        return false;
+    if (*p == AMF0_OBJECT) {
+        p++;
+        return skip_properties(&strings, numbers);
+    }
+    if (*p == AMF0_ECMA_ARRAY && end - p >= 5) {
+        p += 5;
+        return skip_properties(&strings, numbers);
+    }
+    return false;
+}
+
+bool AmfReader::skip() {
+    if (p >= end)
+        return false;
+    size_t left = end - p - 1;
+    switch (*p++) {
+    case AMF0_NUMBER:
+        if (left < 8)
+            return false;
+        p += 8;
+        return true;
+    case AMF0_BOOLEAN:
+        if (left < 1)
+            return false;
+        p += 1;
+        return true;
+    case AMF0_STRING: {
+        if (left < 2)
+            return false;
+        size_t len = p[0] << 8 | p[1];
+        if (left - 2 < len)
+            return false;
+        p += 2 + len;
+        return true;
+    }
+    case AMF0_LONG_STRING: {
+        if (left < 4)
+            return false;
+        size_t len = get_be32(p);
+        if (left - 4 < len)
+            return false;
+        p += 4 + len;
+        return true;
+    }
+    case AMF0_NULL:
+    case AMF0_UNDEFINED:
+        return true;
+    case AMF0_OBJECT:
+        return skip_properties(NULL, NULL);
+    case AMF0_ECMA_ARRAY:
+        /* the count is only a hint, the end marker is authoritative */
+        if (left < 4)
+            return false;
+        p += 4;
+        return skip_properties(NULL, NULL);
+    case AMF0_STRICT_ARRAY: {
+        if (left < 4)
+            return false;
+        uint32_t count = get_be32(p);
+        p += 4;
+        for (uint32_t i = 0; i < count; i++)
+            if (!skip())
+                return false;
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+int RtmpChunkReader::parse_chunk(const uint8_t* p, size_t size, vector<RtmpMessage>& messages) {
+    if (size < 1)
+        return 0;
+    int fmt = p[0] >> 6;
+    int csid = p[0] & 0x3f;
+    size_t n = 1;
+    if (csid == 0) {
+        if (size < 2)
+            return 0;
+        csid = 64 + p[1];
+        n = 2;
+    }
+    else if (csid == 1) {
+        if (size < 3)
+            return 0;
+        csid = 64 + p[1] + (p[2] << 8);
+        n = 3;
+    }
+
+    static const size_t header_sizes[4] = { 11, 7, 3, 0 };
+    if (size < n + header_sizes[fmt])
+        return 0;
+    ChunkStream& s = streams[csid];
+    const uint8_t* h = p + n;
+    /* a type 3 chunk continues the message in progress or starts one like the last */
+    bool first = fmt != 3 || s.body.empty();
+    uint32_t ts_field = 0;
+    if (fmt <= 2) {
+        ts_field = get_be24(h);
+        s.extended = ts_field == 0xffffff;
+    }
+    if (fmt <= 1) {
+        s.length = get_be24(h + 3);
+        s.type = h[6];
+    }
+    if (fmt == 0)
+        s.stream_id = h[7] | h[8] << 8 | h[9] << 16 | (uint32_t)h[10] << 24;
+    n += header_sizes[fmt];
+
+    if (s.extended) {
+        if (size < n + 4)
+            return 0;
+        if (fmt <= 2)
+            ts_field = get_be32(p + n);
+        n += 4;
+    }
+
+    size_t have = s.body.size();
+    size_t len = s.length - have < in_chunk_size ? s.length - have : in_chunk_size;
+    if (size < n + len)
+        return 0;
+
+    if (first) {
+        if (fmt == 0)
+            s.timestamp = ts_field;
+        else {
+            if (fmt <= 2)
+                s.delta = ts_field;
+            s.timestamp += s.delta;
+        }
+        s.body.reserve(s.length);
+    }
+    s.body.insert(s.body.end(), p + n, p + n + len);
+    n += len;
+
+    if (s.body.size() == s.length) {
+        RtmpMessage msg;
+        msg.csid = csid;
+        msg.type = s.type;
+        msg.timestamp = s.timestamp;
+        msg.stream_id = s.stream_id;
+        msg.body.swap(s.body);
+        if (msg.type == RTMP_SET_CHUNK_SIZE) {
+            if (msg.body.size() < 4)
+                return -1;
+            in_chunk_size = get_be32(msg.body.data()) & 0x7fffffff;
+            if (in_chunk_size == 0)
+                return -1;
+        }
+        messages.push_back(std::move(msg));
+    }
+    return (int)n;
+}
+
+bool RtmpChunkReader::feed(const uint8_t* data, size_t size, vector<RtmpMessage>& messages) {
+    /* parse straight from data when nothing is left over, the common case */
+    const uint8_t* p = data;
+    if (!pending.empty()) {
+        pending.insert(pending.end(), data, data + size);
+        p = pending.data();
+        size = pending.size();
+    }
+
+    size_t pos = 0;
+    for (;;) {
+        int n = parse_chunk(p + pos, size - pos, messages);
+        if (n < 0)
+            return false;
+        if (n == 0)
+            break;
+        pos += n;
+    }
+
+    if (p == data)
+        pending.assign(data + pos, data + size);
+    else
+        pending.erase(pending.begin(), pending.begin() + pos);
+    return true;
+}
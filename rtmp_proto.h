@@ -0,0 +1,185 @@
+#ifndef WEBDRIVERTORSO_RTMP_PROTO_H
+#define WEBDRIVERTORSO_RTMP_PROTO_H
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+/*
+ * Just enough of RTMP to publish a stream and to accept one: the plain
+ * (digest-less) handshake, chunk framing, and AMF0 for the NetConnection
+ * and NetStream commands. The streamer's destinations publish with it
+ * (see rtmp_publisher.h), as do the load generator and the ingest
+ * stand-in.
+ */
+
+#define RTMP_HANDSHAKE_SIZE 1536
+#define RTMP_DEFAULT_CHUNK_SIZE 128
+/* the largest chunk size SRS accepts; a 2.5 Mbit/s P frame fits one chunk */
+#define RTMP_MAX_CHUNK_SIZE 65536
+/* basic header + type 0 message header + extended timestamp */
+#define RTMP_MAX_HEADER_SIZE (3 + 11 + 4)
+
+enum RtmpMessageType {
+    RTMP_SET_CHUNK_SIZE = 1,
+    RTMP_ACKNOWLEDGEMENT = 3,
+    RTMP_USER_CONTROL = 4,
+    RTMP_WINDOW_ACK_SIZE = 5,
+    RTMP_SET_PEER_BANDWIDTH = 6,
+    RTMP_AUDIO = 8,
+    RTMP_VIDEO = 9,
+    RTMP_DATA_AMF0 = 18,
+    RTMP_COMMAND_AMF0 = 20,
+};
+
+/* user control events, the first two bytes of the message */
+enum {
+    RTMP_PING_REQUEST = 6,
+    RTMP_PING_RESPONSE = 7,
+};
+
+/* chunk stream ids, the ones FFmpeg and OBS use */
+enum {
+    RTMP_CSID_CONTROL = 2,
+    RTMP_CSID_COMMAND = 3,
+    RTMP_CSID_AUDIO = 4,
+    RTMP_CSID_VIDEO = 6,
+    RTMP_CSID_STREAM = 8,           ///< publish and metadata
+};
+
+struct RtmpUrl {
+    std::string host;
+    int port = 1935;
+    std::string app;
+    std::string key;            ///< the stream key, a secret: never logged
+};
+
+/* rtmp://host[:port]/app/key, port 1935 if none is given */
+bool parse_rtmp_url(const char* url, RtmpUrl& parsed);
+
+/* Header of the first chunk of a message (type 0). Returns its size. */
+int rtmp_write_message_header(uint8_t* dst, int csid, uint32_t timestamp, uint32_t length,
+    int type, uint32_t stream_id);
+
+/* Header of every further chunk of the message (type 3). Returns its size. */
+int rtmp_write_continuation_header(uint8_t* dst, int csid, uint32_t timestamp);
+
+/* Appends a whole message, chunked, to out. For the small control and
+ * command messages; media is sent from its message, only the chunk
+ * headers are written (see RtmpPublisher::send_media()). */
+void rtmp_append_message(std::vector<uint8_t>& out, int csid, int type, uint32_t stream_id,
+    uint32_t timestamp, const uint8_t* body, size_t size, uint32_t chunk_size);
+
+void rtmp_append_set_chunk_size(std::vector<uint8_t>& out, uint32_t size, uint32_t chunk_size);
+/* Acknowledgement of the bytes received so far, once the server's Window
+ * Acknowledgement Size of them has come in. */
+void rtmp_append_acknowledgement(std::vector<uint8_t>& out, uint32_t received, uint32_t chunk_size);
+/* The answer to the server's ping request, with its timestamp. */
+void rtmp_append_ping_response(std::vector<uint8_t>& out, uint32_t timestamp, uint32_t chunk_size);
+
+/* AMF0 values, appended to a message body */
+void amf_write_number(std::vector<uint8_t>& out, double v);
+void amf_write_bool(std::vector<uint8_t>& out, bool v);
+void amf_write_string(std::vector<uint8_t>& out, const std::string& v);
+void amf_write_null(std::vector<uint8_t>& out);
+void amf_write_object_start(std::vector<uint8_t>& out);
+void amf_write_ecma_array_start(std::vector<uint8_t>& out, uint32_t count);
+/* property name inside an object or ECMA array, the value follows */
+void amf_write_key(std::vector<uint8_t>& out, const std::string& key);
+void amf_write_object_end(std::vector<uint8_t>& out);
+
+/* what a publisher numbers its commands, as FFmpeg does */
+enum {
+    RTMP_TRANSACTION_CONNECT = 1,
+    RTMP_TRANSACTION_RELEASE_STREAM = 2,
+    RTMP_TRANSACTION_FC_PUBLISH = 3,
+    RTMP_TRANSACTION_CREATE_STREAM = 4,
+    RTMP_TRANSACTION_PUBLISH = 5,
+};
+
+void rtmp_connect_body(std::vector<uint8_t>& out, const std::string& app, const std::string& tc_url);
+/* The name, the transaction id and a null command object; the arguments follow. */
+void rtmp_command_start(std::vector<uint8_t>& out, const char* name, int transaction);
+
+struct RtmpStreamInfo {
+    int width = 0;
+    int height = 0;
+    double framerate = 0;
+    int video_bitrate = 0;      ///< bits per second
+    int audio_bitrate = 0;
+    int sample_rate = 0;
+    int channels = 0;
+};
+
+/* @setDataFrame onMetaData for H.264 and AAC. Sent again mid-stream, it
+ * announces a change, such as the video bitrate after an ABR step. */
+void rtmp_metadata_body(std::vector<uint8_t>& out, const RtmpStreamInfo& info);
+/* The same without @setDataFrame, as an FLV script tag holds it. */
+void flv_metadata_body(std::vector<uint8_t>& out, const RtmpStreamInfo& info);
+
+class AmfReader {
+public:
+    AmfReader(const uint8_t* data, size_t size) : p(data), end(data + size) {
+    }
+
+    bool read_number(double& v);
+    bool read_string(std::string& v);
+    /* An object or ECMA array; only its string and number properties are kept. */
+    bool read_object(std::map<std::string, std::string>& strings,
+        std::map<std::string, double>* numbers = NULL);
+    /* Skips one value of any type. */
+    bool skip();
+
+    bool at_end() const {
+        return p >= end;
+    }
+
+private:
+    bool skip_properties(std::map<std::string, std::string>* strings, std::map<std::string, double>* numbers);
+
+    const uint8_t* p;
+    const uint8_t* end;
+};
+
+struct RtmpMessage {
+    int csid = 0;
+    int type = 0;
+    uint32_t timestamp = 0;
+    uint32_t stream_id = 0;
+    std::vector<uint8_t> body;
+};
+
+/*
+ * Reassembles messages from the received byte stream. Set Chunk Size is
+ * applied here; every complete message, that one included, is returned.
+ */
+class RtmpChunkReader {
+public:
+    /* Returns false on a malformed stream. */
+    bool feed(const uint8_t* data, size_t size, std::vector<RtmpMessage>& messages);
+
+    uint32_t chunk_size() const {
+        return in_chunk_size;
+    }
+
+private:
+    struct ChunkStream {
+        uint32_t timestamp = 0;
+        uint32_t delta = 0;
+        uint32_t length = 0;
+        int type = 0;
+        uint32_t stream_id = 0;
+        bool extended = false;
+        std::vector<uint8_t> body;
+    };
+
+    /* Parses one chunk at p. Returns its size, 0 if it is incomplete, -1 on error. */
+    int parse_chunk(const uint8_t* p, size_t size, std::vector<RtmpMessage>& messages);
+
+    std::vector<uint8_t> pending;
+    std::map<int, ChunkStream> streams;
+    uint32_t in_chunk_size = RTMP_DEFAULT_CHUNK_SIZE;
+};
+
+#endif /* WEBDRIVERTORSO_RTMP_PROTO_H */
@@ -0,0 +1,413 @@
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+typedef SOCKET socket_t;
+typedef WSABUF send_buf;
+#define close_socket closesocket
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+typedef int socket_t;
+typedef struct iovec send_buf;
+#define INVALID_SOCKET -1
+#define close_socket ::close
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <map>
+#include "rtmp_publisher.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* slices of the output per send */
+#define SEND_BATCH_BUFS 64
+/* what the kernel may hold that is not on the wire yet; the rest waits in
+ * the send queue, where backpressure and the ABR see it */
+#define SEND_UNSENT_LOWAT (128 * 1024)
+
+using namespace std;
+
+static string socket_error() {
+#ifdef _WIN32
+    return "error " + to_string(WSAGetLastError());
+#else
+    return strerror(errno);
+#endif
+}
+
+static bool would_block() {
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+static void set_buf(send_buf& b, const uint8_t* data, size_t size) {
+#ifdef _WIN32
+    b.buf = (char*)data;
+    b.len = (ULONG)size;
+#else
+    b.iov_base = (void*)data;
+    b.iov_len = size;
+#endif
+}
+
+/* Returns the bytes sent, 0 if the socket is full, -1 on error. */
+static long send_bufs(socket_t s, send_buf* bufs, int count) {
+    for (;;) {
+#ifdef _WIN32
+        DWORD sent = 0;
+        if (WSASend(s, bufs, count, &sent, 0, NULL, NULL) == 0)
+            return (long)sent;
+#else
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = bufs;
+        msg.msg_iovlen = count;
+        ssize_t n = sendmsg(s, &msg, MSG_NOSIGNAL);
+        if (n >= 0)
+            return (long)n;
+        if (errno == EINTR)
+            continue;
+#endif
+        return would_block() ? 0 : -1;
+    }
+}
+
+static void set_nonblocking(socket_t s) {
+#ifdef _WIN32
+    u_long nonblocking = 1;
+    ioctlsocket(s, FIONBIO, &nonblocking);
+#else
+    fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+#endif
+}
+
+RtmpPublisher::~RtmpPublisher() {
+    close();
+}
+
+void RtmpPublisher::close() {
+    if (fd != -1)
+        close_socket((socket_t)fd);
+    fd = -1;
+    current = PUBLISHER_FAILED;
+    segments.clear();
+    own.clear();
+}
+
+bool RtmpPublisher::failed(const char* what) {
+    fprintf(stderr, "%s/%s: %s\n", host.c_str(), app.c_str(), what);
+    close();
+    return false;
+}
+
+bool RtmpPublisher::connect(const RtmpUrl& url, int64_t now_ms) {
+    host = url.host;
+    port = url.port;
+    app = url.app;
+    key = url.key;
+    connect_deadline_ms = now_ms + RTMP_CONNECT_TIMEOUT_MS;
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* res = NULL;
+    if (getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &res) != 0 || !res)
+        return failed("could not resolve the host");
+
+    socket_t s = ::socket(res->ai_family, SOCK_STREAM, IPPROTO_TCP);
+    if (s == INVALID_SOCKET) {
+        freeaddrinfo(res);
+        return failed(("socket: " + socket_error()).c_str());
+    }
+    fd = (intptr_t)s;
+    set_nonblocking(s);
+    int one = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&one, sizeof(one));
+#ifdef TCP_NOTSENT_LOWAT
+    int lowat = SEND_UNSENT_LOWAT;
+    setsockopt(s, IPPROTO_TCP, TCP_NOTSENT_LOWAT, (const char*)&lowat, sizeof(lowat));
+#endif
+    int ret = ::connect(s, res->ai_addr, (int)res->ai_addrlen);
+    freeaddrinfo(res);
+    current = PUBLISHER_CONNECTING;
+    if (ret == 0)
+        return connected();
+#ifdef _WIN32
+    bool pending = WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    bool pending = errno == EINPROGRESS;
+#endif
+    if (!pending)
+        return failed(("connect: " + socket_error()).c_str());
+    return true;
+}
+
+/* C0 C1: time and zero, then anything, the plain handshake does not check it */
+bool RtmpPublisher::connected() {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt((socket_t)fd, SOL_SOCKET, SO_ERROR, (char*)&err, &len);
+    if (err)
+        return failed(("connect: " + string(strerror(err))).c_str());
+
+    uint8_t c0c1[1 + RTMP_HANDSHAKE_SIZE];
+    memset(c0c1, 0, sizeof(c0c1));
+    c0c1[0] = 3;
+    uint32_t x = (uint32_t)time(NULL);
+    for (size_t i = 9; i < sizeof(c0c1); i++) {
+        x = x * 1664525 + 1013904223;
+        c0c1[i] = x >> 24;
+    }
+    queue_bytes(c0c1, sizeof(c0c1));
+    current = PUBLISHER_HANDSHAKE;
+    return true;
+}
+
+void RtmpPublisher::queue_bytes(const uint8_t* data, size_t size) {
+    if (!segments.empty() && !segments.back().data && segments.back().offset + segments.back().size == own.size())
+        segments.back().size += size;
+    else {
+        Segment seg = { NULL, own.size(), size };
+        segments.push_back(seg);
+    }
+    own.insert(own.end(), data, data + size);
+}
+
+void RtmpPublisher::queue_command(int csid, uint32_t stream_id, const vector<uint8_t>& body) {
+    vector<uint8_t> chunks;
+    rtmp_append_message(chunks, csid, RTMP_COMMAND_AMF0, stream_id, 0, body.data(), body.size(), RTMP_MAX_CHUNK_SIZE);
+    queue_bytes(chunks.data(), chunks.size());
+}
+
+bool RtmpPublisher::check_deadline(int64_t now_ms) {
+    if (current == PUBLISHER_FAILED)
+        return false;
+    if (now_ms < deadline_ms())
+        return true;
+    return failed(current == PUBLISHER_CONNECTING ? "connect timed out" : "no answer from the server");
+}
+
+bool RtmpPublisher::write() {
+    if (current == PUBLISHER_FAILED)
+        return false;
+    if (current == PUBLISHER_CONNECTING && !connected())
+        return false;
+
+    while (!segments.empty()) {
+        send_buf bufs[SEND_BATCH_BUFS];
+        int count = 0;
+        size_t skip = segment_sent;
+        for (size_t i = 0; i < segments.size() && count < SEND_BATCH_BUFS; i++) {
+            const Segment& seg = segments[i];
+            const uint8_t* base = seg.data ? seg.data : own.data() + seg.offset;
+            set_buf(bufs[count++], base + skip, seg.size - skip);
+            skip = 0;
+        }
+        long n = send_bufs((socket_t)fd, bufs, count);
+        if (n < 0)
+            return failed(("send: " + socket_error()).c_str());
+        if (n == 0)
+            return true;
+
+        size_t left = n;
+        while (left) {
+            size_t rest = segments.front().size - segment_sent;
+            if (left < rest) {
+                segment_sent += left;
+                break;
+            }
+            left -= rest;
+            segments.pop_front();
+            segment_sent = 0;
+        }
+    }
+    own.clear();
+    return true;
+}
+
+bool RtmpPublisher::read() {
+    if (current == PUBLISHER_FAILED)
+        return false;
+    for (;;) {
+        uint8_t buf[16384];
+        int n = recv((socket_t)fd, (char*)buf, sizeof(buf), 0);
+#ifndef _WIN32
+        if (n < 0 && errno == EINTR)
+            continue;
+#endif
+        if (n < 0 && would_block())
+            return true;
+        if (n < 0)
+            return failed(("recv: " + socket_error()).c_str());
+        if (n == 0)
+            return failed("connection closed by the server");
+        received += n;
+
+        if (current == PUBLISHER_HANDSHAKE) {
+            if (!handshake(buf, n))
+                return false;
+            continue;
+        }
+        messages.clear();
+        if (!reader.feed(buf, n, messages))
+            return failed("malformed chunk stream");
+        for (size_t i = 0; i < messages.size(); i++) {
+            if (!handle(messages[i]))
+                return false;
+        }
+        /* at half the window, as librtmp does, so a slow write cannot run past it */
+        if (ack_window && received - acknowledged >= ack_window / 2) {
+            vector<uint8_t> out;
+            rtmp_append_acknowledgement(out, (uint32_t)received, RTMP_MAX_CHUNK_SIZE);
+            queue_bytes(out.data(), out.size());
+            acknowledged = received;
+        }
+    }
+}
+
+/* S0 S1 S2, then C2 echoing S1 and the connect command */
+bool RtmpPublisher::handshake(const uint8_t* data, size_t size) {
+    size_t need = 1 + 2 * RTMP_HANDSHAKE_SIZE - server_handshake.size();
+    size_t take = min(size, need);
+    server_handshake.insert(server_handshake.end(), data, data + take);
+    if (server_handshake.size() < 1 + 2 * RTMP_HANDSHAKE_SIZE)
+        return true;
+    if (server_handshake[0] != 3)
+        return failed("not an RTMP server");
+
+    queue_bytes(server_handshake.data() + 1, RTMP_HANDSHAKE_SIZE);
+    server_handshake.clear();
+    vector<uint8_t> out;
+    rtmp_append_set_chunk_size(out, RTMP_MAX_CHUNK_SIZE, RTMP_DEFAULT_CHUNK_SIZE);
+    queue_bytes(out.data(), out.size());
+
+    string tc_url = "rtmp://" + host + ":" + to_string(port) + "/" + app;
+    vector<uint8_t> body;
+    rtmp_connect_body(body, app, tc_url);
+    queue_command(RTMP_CSID_COMMAND, 0, body);
+    current = PUBLISHER_CONNECT;
+
+    /* the server waits for C2, nothing should follow S2 */
+    if (size > take) {
+        messages.clear();
+        if (!reader.feed(data + take, size - take, messages))
+            return failed("malformed chunk stream");
+        for (size_t i = 0; i < messages.size(); i++) {
+            if (!handle(messages[i]))
+                return false;
+        }
+    }
+    return true;
+}
+
+static uint32_t read_be32(const uint8_t* p) {
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+bool RtmpPublisher::handle(const RtmpMessage& msg) {
+    if (msg.type == RTMP_WINDOW_ACK_SIZE && msg.body.size() >= 4) {
+        ack_window = read_be32(msg.body.data());
+        return true;
+    }
+    if (msg.type == RTMP_USER_CONTROL && msg.body.size() >= 6 && msg.body[0] == 0 &&
+        msg.body[1] == RTMP_PING_REQUEST) {
+        vector<uint8_t> out;
+        rtmp_append_ping_response(out, read_be32(msg.body.data() + 2), RTMP_MAX_CHUNK_SIZE);
+        queue_bytes(out.data(), out.size());
+        return true;
+    }
+    if (msg.type != RTMP_COMMAND_AMF0)
+        return true;
+    AmfReader r(msg.body.data(), msg.body.size());
+    string name;
+    double transaction;
+    if (!r.read_string(name) || !r.read_number(transaction))
+        return true;
+
+    vector<uint8_t> body;
+    if (current == PUBLISHER_CONNECT && transaction == RTMP_TRANSACTION_CONNECT) {
+        if (name != "_result")
+            return failed("connect refused");
+        rtmp_command_start(body, "releaseStream", RTMP_TRANSACTION_RELEASE_STREAM);
+        amf_write_string(body, key);
+        queue_command(RTMP_CSID_COMMAND, 0, body);
+        body.clear();
+        rtmp_command_start(body, "FCPublish", RTMP_TRANSACTION_FC_PUBLISH);
+        amf_write_string(body, key);
+        queue_command(RTMP_CSID_COMMAND, 0, body);
+        body.clear();
+        rtmp_command_start(body, "createStream", RTMP_TRANSACTION_CREATE_STREAM);
+        queue_command(RTMP_CSID_COMMAND, 0, body);
+        current = PUBLISHER_CREATE_STREAM;
+    }
+    else if (current == PUBLISHER_CREATE_STREAM && transaction == RTMP_TRANSACTION_CREATE_STREAM) {
+        double id = 0;
+        if (name != "_result" || !r.skip() || !r.read_number(id))
+            return failed("createStream returned no stream id");
+        stream_id = (uint32_t)id;
+        rtmp_command_start(body, "publish", RTMP_TRANSACTION_PUBLISH);
+        amf_write_string(body, key);
+        amf_write_string(body, "live");
+        queue_command(RTMP_CSID_STREAM, stream_id, body);
+        current = PUBLISHER_PUBLISH;
+    }
+    else if ((current == PUBLISHER_PUBLISH || current == PUBLISHER_STREAMING) && name == "onStatus") {
+        map<string, string> info;
+        if (!r.skip() || !r.read_object(info))
+            return true;
+        if (info["level"] == "error") {
+            if (current == PUBLISHER_STREAMING)
+                return failed(("publish stopped by the server: " + info["code"]).c_str());
+            return failed(("publish refused: " + info["code"]).c_str());
+        }
+        if (info["code"] == "NetStream.Publish.Start")
+            current = PUBLISHER_STREAMING;
+    }
+    return true;
+}
+
+void RtmpPublisher::send_metadata(const RtmpStreamInfo& info, uint32_t timestamp) {
+    vector<uint8_t> body;
+    rtmp_metadata_body(body, info);
+    vector<uint8_t> chunks;
+    rtmp_append_message(chunks, RTMP_CSID_STREAM, RTMP_DATA_AMF0, stream_id, timestamp, body.data(), body.size(),
+        RTMP_MAX_CHUNK_SIZE);
+    queue_bytes(chunks.data(), chunks.size());
+}
+
+/*
+ * The body is sent from the message, which every destination shares: only
+ * the chunk headers are written here, and each send gathers them with the
+ * slices of the body between them.
+ */
+void RtmpPublisher::send_media(int type, uint32_t timestamp, const uint8_t* body, size_t size) {
+    int csid = type == RTMP_VIDEO ? RTMP_CSID_VIDEO : RTMP_CSID_AUDIO;
+    /* never empty, there is always the tag header */
+    for (size_t pos = 0; pos < size;) {
+        uint8_t head[RTMP_MAX_HEADER_SIZE];
+        int head_size = pos ? rtmp_write_continuation_header(head, csid, timestamp) :
+            rtmp_write_message_header(head, csid, timestamp, (uint32_t)size, type, stream_id);
+        queue_bytes(head, head_size);
+        size_t len = min(size - pos, (size_t)RTMP_MAX_CHUNK_SIZE);
+        Segment seg = { body + pos, 0, len };
+        segments.push_back(seg);
+        pos += len;
+    }
+}
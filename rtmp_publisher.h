@@ -0,0 +1,129 @@
+#ifndef WEBDRIVERTORSO_RTMP_PUBLISHER_H
+#define WEBDRIVERTORSO_RTMP_PUBLISHER_H
+
+#include <stdint.h>
+#include <deque>
+#include <string>
+#include <vector>
+#include "rtmp_proto.h"
+
+/* how long connecting, the handshake and the commands up to publishing may take */
+#define RTMP_CONNECT_TIMEOUT_MS 10000
+
+enum PublisherState {
+    PUBLISHER_CONNECTING,
+    PUBLISHER_HANDSHAKE,        ///< C0 C1 sent, waiting for S0 S1 S2
+    PUBLISHER_CONNECT,          ///< connect sent
+    PUBLISHER_CREATE_STREAM,    ///< releaseStream, FCPublish and createStream sent
+    PUBLISHER_PUBLISH,          ///< publish sent, waiting for NetStream.Publish.Start
+    PUBLISHER_STREAMING,
+    PUBLISHER_FAILED,
+};
+
+/*
+ * Publishes one stream on a non-blocking socket, driven by the send loop
+ * (see send_loop.h), with the same commands as rtmp_loadgen. A metadata
+ * change mid-stream goes out as another @setDataFrame onMetaData.
+ *
+ * Nothing blocks: what is sent waits in the output until the socket takes
+ * it, and write() goes on with it once poll() reports the socket
+ * writable. A media body is not copied, only its chunk headers are
+ * written; it has to stay valid until the output is empty.
+ *
+ * Once publishing, read() keeps up with the server: it answers pings,
+ * acknowledges what came in when the server asked for it, and fails the
+ * publish when an onStatus reports an error, as when the ingest drops the
+ * stream.
+ *
+ * Errors are printed with the host and app, never the key.
+ */
+class RtmpPublisher {
+public:
+    RtmpPublisher() = default;
+    ~RtmpPublisher();
+
+    RtmpPublisher(const RtmpPublisher&) = delete;
+    RtmpPublisher& operator=(const RtmpPublisher&) = delete;
+
+    /* Resolves the host and starts connecting, on the caller's thread.
+     * The rest of the publish happens in read() and write(). Returns
+     * false if it failed already. */
+    bool connect(const RtmpUrl& url, int64_t now_ms);
+
+    /* -1 once closed */
+    intptr_t socket() const {
+        return fd;
+    }
+    PublisherState state() const {
+        return current;
+    }
+    /* Whether poll() should wait for the socket to take more. */
+    bool want_write() const {
+        return current == PUBLISHER_CONNECTING || !segments.empty();
+    }
+    /* nothing left to write */
+    bool idle() const {
+        return segments.empty();
+    }
+    /* by when it has to have published, INT64_MAX once it has */
+    int64_t deadline_ms() const {
+        return current < PUBLISHER_STREAMING ? connect_deadline_ms : INT64_MAX;
+    }
+
+    /* When the socket is readable or writable. Return false once the publisher has failed. */
+    bool read();
+    bool write();
+    /* Fails the publish if it is past its deadline. */
+    bool check_deadline(int64_t now_ms);
+
+    /* Queued behind everything before. The stream has to be published. */
+    void send_metadata(const RtmpStreamInfo& info, uint32_t timestamp);
+    /* An audio or video message, body as in MediaMessage: the tag header, then the payload. */
+    void send_media(int type, uint32_t timestamp, const uint8_t* body, size_t size);
+
+    /* Closes the socket without a word; what is still queued is dropped. */
+    void close();
+
+private:
+    /* Bytes of the output: a slice of a media body, or bytes of own. */
+    struct Segment {
+        const uint8_t* data;    ///< NULL for bytes of own
+        size_t offset;          ///< into own
+        size_t size;
+    };
+
+    bool connected();
+    bool handshake(const uint8_t* data, size_t size);
+    bool handle(const RtmpMessage& msg);
+    void queue_bytes(const uint8_t* data, size_t size);
+    void queue_command(int csid, uint32_t stream_id, const std::vector<uint8_t>& body);
+    bool failed(const char* what);
+
+    std::string host;
+    int port = 0;
+    std::string app;
+    std::string key;
+    uint32_t stream_id = 0;
+    intptr_t fd = -1;
+    PublisherState current = PUBLISHER_FAILED;
+    int64_t connect_deadline_ms = 0;
+
+    /* S0 S1 S2 as they come in */
+    std::vector<uint8_t> server_handshake;
+    RtmpChunkReader reader;
+    std::vector<RtmpMessage> messages;
+    /* bytes from the server, and how many of them were acknowledged */
+    uint64_t received = 0;
+    uint64_t acknowledged = 0;
+    /* the server's Window Acknowledgement Size, 0 until it sends one */
+    uint32_t ack_window = 0;
+
+    std::deque<Segment> segments;
+    /* of the first segment */
+    size_t segment_sent = 0;
+    /* the chunks of commands and metadata and the media chunk headers in
+     * the output, emptied with it */
+    std::vector<uint8_t> own;
+};
+
+#endif /* WEBDRIVERTORSO_RTMP_PUBLISHER_H */
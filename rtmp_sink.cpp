@@ -0,0 +1,461 @@
+/*
+ * Stand-in for an RTMP ingest, to point rtmp_loadgen (or the streamer)
+ * at without loading a real one.
+ *
+ * rtmp_sink [--rate-limit kbit/s] [port]
+ *
+ * Accepts publishers on one thread around epoll, answers connect,
+ * createStream and publish, and throws the media away after checking
+ * it: video has to be AVC and audio AAC, and the timestamps of a stream
+ * must not go backwards. Every 10 s it prints the publishers, the
+ * received rate and the messages that failed a check. Every message is
+ * reassembled, so for rates near the NIC's run it on a host of its own.
+ *
+ * --rate-limit reads every connection at no more than the given rate, so
+ * the socket buffers fill and the publisher sees a slow link, as with an
+ * uplink that cannot carry the stream (see --abr of the streamer). The
+ * stream metadata is printed whenever a publisher sends it.
+ *
+ * Linux only.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "rtmp_proto.h"
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+struct Client {
+    int fd = -1;
+    bool handshake_done = false;
+    /* C0 C1, then C2 */
+    std::vector<uint8_t> handshake;
+    RtmpChunkReader reader;
+
+    std::vector<uint8_t> out;
+    size_t out_sent = 0;
+    bool want_write = false;
+
+    /* bytes that may be read before the next refill, with --rate-limit */
+    double allowance = 0;
+    Clock::time_point refilled;
+    /* not reading until resume */
+    bool throttled = false;
+    Clock::time_point resume;
+
+    bool publishing = false;
+    bool has_video = false;
+    bool has_audio = false;
+    uint32_t last_video_ts = 0;
+    uint32_t last_audio_ts = 0;
+};
+
+struct SinkStats {
+    uint64_t bytes = 0;
+    uint64_t video = 0;
+    uint64_t keyframes = 0;
+    uint64_t audio = 0;
+    uint64_t bad_tags = 0;
+    uint64_t regressions = 0;
+    uint64_t accepted = 0;
+    uint64_t closed = 0;
+};
+
+static int epoll_fd = -1;
+static std::map<int, std::unique_ptr<Client> > clients;
+static SinkStats stats;
+static SinkStats last_stats;
+static uint8_t s1[RTMP_HANDSHAKE_SIZE];
+/* bytes per second and connection, 0 without --rate-limit */
+static double rate_limit = 0;
+static size_t nb_throttled = 0;
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void on_interrupt(int) {
+    interrupted = 1;
+}
+
+static void close_client(Client& c) {
+    nb_throttled -= c.throttled;
+    close(c.fd);
+    stats.closed++;
+    clients.erase(c.fd);
+}
+
+static void update_events(Client& c) {
+    struct epoll_event ev;
+    ev.events = (c.throttled ? 0 : EPOLLIN) | (c.want_write ? EPOLLOUT : 0);
+    ev.data.fd = c.fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c.fd, &ev);
+}
+
+/* Returns false if the connection failed. */
+static bool flush(Client& c) {
+    while (c.out_sent < c.out.size()) {
+        ssize_t n = send(c.fd, c.out.data() + c.out_sent, c.out.size() - c.out_sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n < 0)
+            return false;
+        c.out_sent += n;
+    }
+    if (c.out_sent == c.out.size()) {
+        c.out.clear();
+        c.out_sent = 0;
+    }
+
+    bool blocked = !c.out.empty();
+    if (blocked != c.want_write) {
+        c.want_write = blocked;
+        update_events(c);
+    }
+    return true;
+}
+
+/* Stops reading from c until its allowance is back to a full read. */
+static void throttle(Client& c, Clock::time_point now) {
+    c.throttled = true;
+    c.resume = now + chrono::microseconds((int64_t)((1 - c.allowance) * 1e6 / rate_limit) + 1);
+    nb_throttled++;
+    update_events(c);
+}
+
+/* How much c may read now, 0 to wait for the next refill. */
+static size_t read_budget(Client& c, size_t size) {
+    if (!rate_limit)
+        return size;
+    Clock::time_point now = Clock::now();
+    /* up to 50 ms of the rate at once, a few socket reads */
+    double burst = max(rate_limit / 20, 4096.0);
+    c.allowance = min(c.allowance + chrono::duration<double>(now - c.refilled).count() * rate_limit, burst);
+    c.refilled = now;
+    if (c.allowance < 1) {
+        throttle(c, now);
+        return 0;
+    }
+    return min(size, (size_t)c.allowance);
+}
+
+static void send_command(Client& c, int csid, uint32_t stream_id, const std::vector<uint8_t>& body) {
+    rtmp_append_message(c.out, csid, RTMP_COMMAND_AMF0, stream_id, 0, body.data(), body.size(),
+        RTMP_DEFAULT_CHUNK_SIZE);
+}
+
+static void on_command(Client& c, const RtmpMessage& msg) {
+    AmfReader r(msg.body.data(), msg.body.size());
+    std::string name;
+    double transaction = 0;
+    if (!r.read_string(name) || !r.read_number(transaction))
+        return;
+
+    std::vector<uint8_t> body;
+    if (name == "connect") {
+        amf_write_string(body, "_result");
+        amf_write_number(body, transaction);
+        amf_write_object_start(body);
+        amf_write_key(body, "fmsVer");
+        amf_write_string(body, "FMS/3,0,1,123");
+        amf_write_key(body, "capabilities");
+        amf_write_number(body, 31);
+        amf_write_object_end(body);
+        amf_write_object_start(body);
+        amf_write_key(body, "level");
+        amf_write_string(body, "status");
+        amf_write_key(body, "code");
+        amf_write_string(body, "NetConnection.Connect.Success");
+        amf_write_key(body, "objectEncoding");
+        amf_write_number(body, 0);
+        amf_write_object_end(body);
+        send_command(c, RTMP_CSID_COMMAND, 0, body);
+    }
+    else if (name == "createStream") {
+        amf_write_string(body, "_result");
+        amf_write_number(body, transaction);
+        amf_write_null(body);
+        amf_write_number(body, 1);
+        send_command(c, RTMP_CSID_COMMAND, 0, body);
+    }
+    else if (name == "publish") {
+        amf_write_string(body, "onStatus");
+        amf_write_number(body, 0);
+        amf_write_null(body);
+        amf_write_object_start(body);
+        amf_write_key(body, "level");
+        amf_write_string(body, "status");
+        amf_write_key(body, "code");
+        amf_write_string(body, "NetStream.Publish.Start");
+        amf_write_object_end(body);
+        send_command(c, RTMP_CSID_STREAM, msg.stream_id, body);
+        c.publishing = true;
+    }
+    /* releaseStream, FCPublish and the rest need no answer */
+}
+
+/* @setDataFrame onMetaData, at the start and after every bitrate change */
+static void on_data(Client& c, const RtmpMessage& msg) {
+    AmfReader r(msg.body.data(), msg.body.size());
+    std::string name;
+    if (!r.read_string(name))
+        return;
+    if (name == "@setDataFrame" && !r.read_string(name))
+        return;
+    std::map<std::string, std::string> strings;
+    std::map<std::string, double> numbers;
+    if (name != "onMetaData" || !r.read_object(strings, &numbers))
+        return;
+    printf("Client %d metadata at %u ms: %.0fx%.0f %.2f fps, video %.0f kbit/s, audio %.0f kbit/s\n", c.fd,
+        msg.timestamp, numbers["width"], numbers["height"], numbers["framerate"], numbers["videodatarate"],
+        numbers["audiodatarate"]);
+    fflush(stdout);
+}
+
+static void on_message(Client& c, const RtmpMessage& msg) {
+    const std::vector<uint8_t>& b = msg.body;
+    if (msg.type == RTMP_COMMAND_AMF0)
+        on_command(c, msg);
+    else if (msg.type == RTMP_DATA_AMF0)
+        on_data(c, msg);
+    else if (msg.type == RTMP_VIDEO) {
+        if (b.size() < 5 || (b[0] != 0x17 && b[0] != 0x27) || b[1] > 2) {
+            stats.bad_tags++;
+            return;
+        }
+        if (b[1] != 1)
+            return;
+        stats.video++;
+        if (b[0] == 0x17)
+            stats.keyframes++;
+        if (c.has_video && msg.timestamp < c.last_video_ts)
+            stats.regressions++;
+        c.has_video = true;
+        c.last_video_ts = msg.timestamp;
+    }
+    else if (msg.type == RTMP_AUDIO) {
+        if (b.size() < 2 || b[0] >> 4 != 10 || b[1] > 1) {
+            stats.bad_tags++;
+            return;
+        }
+        if (b[1] != 1)
+            return;
+        stats.audio++;
+        if (c.has_audio && msg.timestamp < c.last_audio_ts)
+            stats.regressions++;
+        c.has_audio = true;
+        c.last_audio_ts = msg.timestamp;
+    }
+}
+
+/* Returns false if the connection failed. */
+static bool on_readable(Client& c) {
+    uint8_t buf[65536];
+    std::vector<RtmpMessage> messages;
+    for (;;) {
+        size_t budget = read_budget(c, sizeof(buf));
+        if (!budget)
+            return flush(c);
+        ssize_t n = recv(c.fd, buf, budget, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return flush(c);
+        if (n <= 0)
+            return false;
+        stats.bytes += n;
+        c.allowance -= n;
+
+        const uint8_t* p = buf;
+        size_t size = n;
+        while (!c.handshake_done && size) {
+            size_t stage_end = c.handshake.size() < 1 + RTMP_HANDSHAKE_SIZE ?
+                1 + RTMP_HANDSHAKE_SIZE : 1 + 2 * RTMP_HANDSHAKE_SIZE;
+            size_t need = stage_end - c.handshake.size();
+            size_t take = size < need ? size : need;
+            c.handshake.insert(c.handshake.end(), p, p + take);
+            p += take;
+            size -= take;
+            if (take < need)
+                break;
+            if (c.handshake.size() == 1 + RTMP_HANDSHAKE_SIZE) {
+                if (c.handshake[0] != 3)
+                    return false;
+                /* S0 S1 S2, S2 echoes C1 */
+                c.out.push_back(3);
+                c.out.insert(c.out.end(), s1, s1 + RTMP_HANDSHAKE_SIZE);
+                c.out.insert(c.out.end(), c.handshake.begin() + 1, c.handshake.end());
+            }
+            else {
+                /* C2 is not checked */
+                c.handshake_done = true;
+                std::vector<uint8_t>().swap(c.handshake);
+            }
+        }
+        if (!c.handshake_done)
+            continue;
+
+        messages.clear();
+        if (!c.reader.feed(p, size, messages))
+            return false;
+        for (size_t i = 0; i < messages.size(); i++)
+            on_message(c, messages[i]);
+    }
+}
+
+static void print_stats(double seconds) {
+    size_t publishing = 0;
+    for (std::map<int, std::unique_ptr<Client> >::const_iterator it = clients.begin(); it != clients.end(); ++it)
+        publishing += it->second->publishing;
+    printf("Clients %zu, %zu publishing, %llu accepted, %llu closed: %.1f Mbit/s, %.0f video/s "
+        "(%llu keyframes), %.0f audio/s, %llu bad tags, %llu timestamp regressions\n",
+        clients.size(), publishing, (unsigned long long)stats.accepted, (unsigned long long)stats.closed,
+        (stats.bytes - last_stats.bytes) * 8 / seconds / 1e6, (stats.video - last_stats.video) / seconds,
+        (unsigned long long)stats.keyframes, (stats.audio - last_stats.audio) / seconds,
+        (unsigned long long)stats.bad_tags, (unsigned long long)stats.regressions);
+    fflush(stdout);
+    last_stats = stats;
+}
+
+/* Reads every throttled client whose allowance has refilled. */
+static void resume_throttled(Clock::time_point now) {
+    std::vector<Client*> ready;
+    for (std::map<int, std::unique_ptr<Client> >::iterator it = clients.begin(); it != clients.end(); ++it)
+        if (it->second->throttled && it->second->resume <= now)
+            ready.push_back(it->second.get());
+    for (size_t i = 0; i < ready.size(); i++) {
+        Client& c = *ready[i];
+        c.throttled = false;
+        nb_throttled--;
+        update_events(c);
+        if (!on_readable(c))
+            close_client(c);
+    }
+}
+
+static Clock::time_point next_resume(Clock::time_point until) {
+    for (std::map<int, std::unique_ptr<Client> >::const_iterator it = clients.begin(); it != clients.end(); ++it)
+        if (it->second->throttled && it->second->resume < until)
+            until = it->second->resume;
+    return until;
+}
+
+int main(int argc, char* argv[]) {
+    int arg = 1;
+    if (argc > 2 && !strcmp(argv[1], "--rate-limit")) {
+        rate_limit = atof(argv[2]) * 1000 / 8;
+        arg = 3;
+    }
+    int port = argc > arg ? atoi(argv[arg]) : 1935;
+    if (argc > arg + 1 || port <= 0 || port > 65535 || rate_limit < 0) {
+        fprintf(stderr, "Usage: %s [--rate-limit kbit/s] [port]\n", argv[0]);
+        return 1;
+    }
+
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    signal(SIGINT, on_interrupt);
+    signal(SIGTERM, on_interrupt);
+
+    /* time and zero, then anything */
+    for (size_t i = 8; i < sizeof(s1); i++)
+        s1[i] = (uint8_t)(i * 131 + 7);
+
+    int listen_fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int one = 1;
+    int zero = 0;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    /* IPv4 too */
+    setsockopt(listen_fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+    struct sockaddr_in6 addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_any;
+    addr.sin6_port = htons(port);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd, 4096) < 0) {
+        fprintf(stderr, "Could not listen on port %d: %s\n", port, strerror(errno));
+        return 1;
+    }
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = listen_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+    if (rate_limit)
+        printf("Listening on port %d, reading %.0f kbit/s per connection\n", port, rate_limit * 8 / 1000);
+    else
+        printf("Listening on port %d\n", port);
+    fflush(stdout);
+
+    Clock::time_point last = Clock::now();
+    Clock::time_point next_stats = last + chrono::seconds(10);
+    struct epoll_event events[256];
+    while (!interrupted) {
+        Clock::time_point wake = nb_throttled ? next_resume(next_stats) : next_stats;
+        /* rounded up, so a throttled client is not polled for again and again before it may read */
+        int timeout_ms = (int)chrono::duration_cast<chrono::milliseconds>(wake - Clock::now() +
+            chrono::microseconds(999)).count();
+        int n = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(events[0]), timeout_ms > 0 ? timeout_ms : 0);
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == listen_fd) {
+                int client_fd;
+                while ((client_fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                    std::unique_ptr<Client> c(new Client);
+                    c->fd = client_fd;
+                    c->refilled = Clock::now();
+                    ev.events = EPOLLIN;
+                    ev.data.fd = client_fd;
+                    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &ev);
+                    clients[client_fd] = std::move(c);
+                    stats.accepted++;
+                }
+                continue;
+            }
+
+            std::map<int, std::unique_ptr<Client> >::iterator it = clients.find(fd);
+            if (it == clients.end())
+                continue;
+            Client& c = *it->second;
+            bool ok = true;
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                ok = on_readable(c);
+            if (ok && (events[i].events & EPOLLOUT))
+                ok = flush(c);
+            if (!ok)
+                close_client(c);
+        }
+
+        Clock::time_point now = Clock::now();
+        if (nb_throttled)
+            resume_throttled(now);
+        if (now >= next_stats) {
+            print_stats(chrono::duration<double>(now - last).count());
+            last = now;
+            next_stats += chrono::seconds(10);
+        }
+    }
+    print_stats(chrono::duration<double>(Clock::now() - last).count());
+    return 0;
+}
@@ -0,0 +1,156 @@
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+typedef SOCKET socket_t;
+#define close_socket closesocket
+#define poll WSAPoll
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+typedef int socket_t;
+#define INVALID_SOCKET -1
+#define close_socket close
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include "fanout.h"
+#include "send_loop.h"
+
+using namespace std;
+
+static int64_t steady_us() {
+    return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+SendLoop::~SendLoop() {
+    quit = true;
+    if (thread.joinable()) {
+        wake_pending = false;
+        wake();
+        thread.join();
+    }
+    if (wake_fd != -1)
+        close_socket((socket_t)wake_fd);
+}
+
+/* A UDP socket on the loopback, connected to itself. */
+bool SendLoop::open_wake_socket() {
+    socket_t s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (s == INVALID_SOCKET)
+        return false;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (bind(s, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        getsockname(s, (struct sockaddr*)&addr, &len) != 0 ||
+        connect(s, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close_socket(s);
+        return false;
+    }
+#ifdef _WIN32
+    u_long nonblocking = 1;
+    ioctlsocket(s, FIONBIO, &nonblocking);
+#else
+    fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+#endif
+    wake_fd = (intptr_t)s;
+    return true;
+}
+
+void SendLoop::add(Destination* destination) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!thread.joinable()) {
+            if (!open_wake_socket()) {
+                fprintf(stderr, "Could not open the send loop's wake-up socket\n");
+                exit(1);
+            }
+            thread = std::thread(&SendLoop::run, this);
+        }
+        added.push_back(destination);
+    }
+    wake();
+}
+
+void SendLoop::wake() {
+    if (wake_pending.exchange(true))
+        return;
+    char b = 0;
+    send((socket_t)wake_fd, &b, 1, 0);
+}
+
+void SendLoop::run() {
+    std::vector<struct pollfd> fds;
+    /* what poll() reported, by destination */
+    std::vector<short> events;
+    std::vector<size_t> polled;
+    for (;;) {
+        int64_t turn_start_us = steady_us();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            destinations.insert(destinations.end(), added.begin(), added.end());
+            added.clear();
+        }
+        events.resize(destinations.size());
+        char drain[64];
+        while (recv((socket_t)wake_fd, drain, sizeof(drain), 0) > 0) {
+        }
+        /* From here on a publish wakes the next turn. Taking the flag makes
+         * whatever was queued before it was raised visible to this one. */
+        wake_pending.exchange(false);
+
+        size_t kept = 0;
+        int64_t deadline_ms = INT64_MAX;
+        for (size_t i = 0; i < destinations.size(); i++) {
+            Destination* d = destinations[i];
+            bool readable = events[i] & (POLLIN | POLLERR | POLLHUP);
+            bool writable = events[i] & (POLLOUT | POLLERR | POLLHUP);
+            if (!d->turn(readable, writable, steady_us())) {
+                d->exited = true;
+                continue;
+            }
+            deadline_ms = min(deadline_ms, d->deadline_ms());
+            destinations[kept++] = d;
+        }
+        destinations.resize(kept);
+        if (quit && destinations.empty())
+            break;
+
+        fds.clear();
+        polled.clear();
+        struct pollfd wake_pfd = { (socket_t)wake_fd, POLLIN, 0 };
+        fds.push_back(wake_pfd);
+        for (size_t i = 0; i < destinations.size(); i++) {
+            intptr_t s = destinations[i]->publisher.socket();
+            if (s == -1)
+                continue;
+            struct pollfd pfd = { (socket_t)s, (short)(POLLIN | (destinations[i]->publisher.want_write() ? POLLOUT : 0)), 0 };
+            fds.push_back(pfd);
+            polled.push_back(i);
+        }
+        int64_t timeout_ms = SEND_LOOP_IDLE_MS;
+        if (deadline_ms != INT64_MAX)
+            timeout_ms = max<int64_t>(0, min<int64_t>(timeout_ms, deadline_ms - steady_us() / 1000 + 1));
+        int ret = poll(fds.data(), (unsigned long)fds.size(), (int)timeout_ms);
+
+        events.assign(destinations.size(), 0);
+        for (size_t i = 0; ret > 0 && i < polled.size(); i++)
+            events[polled[i]] = fds[i + 1].revents;
+
+        int64_t turn_us = steady_us() - turn_start_us;
+        if (turn_us < SEND_LOOP_TURN_US)
+            this_thread::sleep_for(chrono::microseconds(SEND_LOOP_TURN_US - turn_us));
+    }
+}
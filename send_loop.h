@@ -0,0 +1,62 @@
+#ifndef WEBDRIVERTORSO_SEND_LOOP_H
+#define WEBDRIVERTORSO_SEND_LOOP_H
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class Destination;
+
+/* the shortest turn of the loop; what is published meanwhile goes out together */
+#define SEND_LOOP_TURN_US 1000
+/* the longest poll() without a deadline to wake up for */
+#define SEND_LOOP_IDLE_MS 1000
+
+/*
+ * Sends for every RTMP destination (see fanout.h) on one thread, with
+ * non-blocking sockets and poll(), as rtmp_loadgen does with epoll: a
+ * process with hundreds of channels has one send thread, not one per
+ * channel.
+ *
+ * Each turn the loop waits for the sockets with output waiting, the
+ * replies and a wake-up, then lets every destination read what came in,
+ * take what its producer queued and write until its socket is full. A
+ * publish wakes the loop through a loopback socket, once per turn at
+ * most. A turn lasts at least SEND_LOOP_TURN_US, so many channels cost
+ * one pass over them a millisecond rather than one per message.
+ *
+ * Destinations add themselves in start() and are dropped by the loop once
+ * they have stopped or failed; the loop has to outlive them.
+ */
+class SendLoop {
+public:
+    SendLoop() = default;
+    ~SendLoop();
+
+    SendLoop(const SendLoop&) = delete;
+    SendLoop& operator=(const SendLoop&) = delete;
+
+    /* From any thread. Starts the loop the first time. */
+    void add(Destination* destination);
+    /* From any thread: something was queued, or a destination is stopping. */
+    void wake();
+
+private:
+    bool open_wake_socket();
+    void run();
+
+    std::mutex mutex;
+    /* added since the last turn, under the mutex */
+    std::vector<Destination*> added;
+    std::thread thread;
+    std::atomic<bool> quit{ false };
+    std::atomic<bool> wake_pending{ false };
+    intptr_t wake_fd = -1;
+
+    /* loop thread only */
+    std::vector<Destination*> destinations;
+};
+
+#endif /* WEBDRIVERTORSO_SEND_LOOP_H */
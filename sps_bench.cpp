@@ -0,0 +1,267 @@
+/*
+ * Exp-Golomb and SPS parsing: checks the clz reader against the
+ * bit-at-a-time loop ff_avc_decode_sps used before, and measures both,
+ * then times whole SPS parses for the flat encoder's and an x264 SPS.
+ *
+ * The in-place RBSP reader is checked against the plain reader on
+ * ff_nal_unit_extract_rbsp() output, and a slice header sized read from
+ * a large NAL is timed both ways.
+ *
+ * sps_bench [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <algorithm>
+#include <random>
+#include <vector>
+
+extern "C" {
+#define CACHED_BITSTREAM_READER 1
+#include "get_bits.h"
+#include "put_bits.h"
+#include "avc.h"
+}
+
+using namespace std;
+
+/* the reader may load 8 bytes past the end */
+const int padding = 64;
+
+static inline int get_ue_golomb_loop(GetBitContext* gb) {
+    int i;
+    for (i = 0; i < 32 && !get_bits1(gb); i++)
+        ;
+    return get_bitsz(gb, i) + (1 << i) - 1;
+}
+
+static inline int get_se_golomb_loop(GetBitContext* gb) {
+    int v = get_ue_golomb_loop(gb) + 1;
+    int sign = -(v & 1);
+    return ((v >> 1) ^ sign) - sign;
+}
+
+/* 1920x1080 constrained baseline, 25 fps, from h264_flat_init() */
+const uint8_t flat_sps[] = {
+    0x42, 0xc0, 0x28, 0x95, 0xa0, 0x1e, 0x00, 0x89, 0xf9, 0x61, 0x00, 0x00,
+    0x03, 0x00, 0x01, 0x00, 0x00, 0x03, 0x00, 0x32, 0x8f, 0x08, 0x04, 0x2a,
+};
+
+/* 1280x720 high profile from x264 */
+const uint8_t x264_sps[] = {
+    0x64, 0x00, 0x1f, 0xac, 0xd9, 0x40, 0x50, 0x05, 0xbb, 0x01, 0x10, 0x00,
+    0x00, 0x03, 0x00, 0x10, 0x00, 0x00, 0x03, 0x03, 0xc0, 0xf1, 0x83, 0x19,
+    0x60,
+};
+
+/*
+ * Codes as parameter sets and slice headers carry them: mostly small,
+ * with every 16th value spread over the whole valid range so the long
+ * path gets exercised too.
+ */
+std::vector<int> make_values(int count) {
+    std::mt19937 rng(1234);
+    std::vector<int> values(count);
+    for (int i = 0; i < count; i++) {
+        if (i % 16 == 15)
+            values[i] = (int)(rng() >> (rng() % 32 + 2)) * (i % 32 == 15 ? 1 : -1);
+        else
+            values[i] = (int)(rng() % 64) - 32;
+    }
+    return values;
+}
+
+/* Alternating ue(v) |value| and se(v) value. */
+std::vector<uint8_t> write_values(const std::vector<int>& values) {
+    std::vector<uint8_t> buf(values.size() * 8 + padding);
+    PutBitContext pb;
+    init_put_bits(&pb, buf.data(), (int)buf.size());
+    for (size_t i = 0; i < values.size(); i++) {
+        int v = values[i];
+        set_ue_golomb(&pb, v < 0 ? -(unsigned)v : v);
+        set_se_golomb(&pb, v);
+    }
+    flush_put_bits(&pb);
+    buf.resize(put_bytes_output(&pb));
+    buf.resize(buf.size() + padding);
+    return buf;
+}
+
+template <typename UE, typename SE>
+bool read_values(const std::vector<uint8_t>& buf, const std::vector<int>& values, UE ue, SE se) {
+    GetBitContext gb;
+    init_get_bits8(&gb, buf.data(), (int)(buf.size() - padding));
+    bool ok = true;
+    for (size_t i = 0; i < values.size(); i++) {
+        int v = values[i];
+        ok &= ue(&gb) == (v < 0 ? -v : v);
+        ok &= se(&gb) == v;
+    }
+    return ok;
+}
+
+template <typename F>
+double time_ns(int iterations, int per_iteration, F f) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++)
+        f();
+    return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() /
+        iterations / per_iteration;
+}
+
+/*
+ * Random NAL payloads, half zero bytes so escapes are frequent, escaped
+ * into buffers without padding. The same reads and skips go to an RBSP
+ * reader on the escaped payload and a plain reader on the extracted RBSP.
+ */
+bool check_rbsp_reader(int iterations) {
+    std::mt19937 rng(5678);
+    for (int iter = 0; iter < iterations; iter++) {
+        std::vector<uint8_t> rbsp(rng() % 300 + 1);
+        for (size_t i = 0; i < rbsp.size(); i++)
+            rbsp[i] = rng() % 2 ? 0 : rng() % 5;
+
+        std::vector<uint8_t> tmp(rbsp.size() * 3 / 2 + 1);
+        tmp.resize(ff_nal_unit_insert_epb(tmp.data(), rbsp.data(), (uint32_t)rbsp.size(), 0));
+        /* exact size, so an overread shows up under ASan */
+        std::vector<uint8_t> escaped(tmp);
+
+        uint32_t extracted_size;
+        uint8_t* extracted = ff_nal_unit_extract_rbsp(escaped.data(), (uint32_t)escaped.size(),
+            &extracted_size, 0);
+        GetBitContext ref, gb;
+        init_get_bits8(&ref, extracted, extracted_size);
+        init_get_bits8_rbsp(&gb, escaped.data(), (unsigned)escaped.size(), ff_avc_find_escape);
+
+        bool ok = true;
+        while (ok && get_bits_left(&ref) > 32) {
+            switch (rng() % 4) {
+            case 0: {
+                int n = rng() % 32 + 1;
+                ok = get_bits(&ref, n) == get_bits(&gb, n);
+                break;
+            }
+            case 1:
+                ok = get_ue_golomb(&ref) == get_ue_golomb(&gb);
+                break;
+            case 2: {
+                int n = rng() % 32 + 1;
+                ok = show_bits(&ref, n) == show_bits(&gb, n);
+                break;
+            }
+            default: {
+                int n = std::min<int>(rng() % 200, get_bits_left(&ref) - 32);
+                skip_bits(&ref, n);
+                skip_bits(&gb, n);
+                break;
+            }
+            }
+            ok = ok && get_bits_count(&ref) == get_bits_count(&gb);
+        }
+        av_free(extracted);
+        if (!ok) {
+            fprintf(stderr, "RBSP reader mismatch on payload %d\n", iter);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* A 60 kB escaped slice of which only the first 64 bits, about a slice
+ * header, are read. */
+void bench_slice_header(int iterations) {
+    std::mt19937 rng(42);
+    std::vector<uint8_t> rbsp(60000);
+    for (size_t i = 0; i < rbsp.size(); i++)
+        rbsp[i] = rng() % 4 ? rng() : 0;
+    std::vector<uint8_t> escaped(rbsp.size() * 3 / 2 + 1);
+    escaped.resize(ff_nal_unit_insert_epb(escaped.data(), rbsp.data(), (uint32_t)rbsp.size(), 0));
+
+    volatile int sink = 0;
+    double copy_ns = time_ns(iterations, 1, [&]() {
+        uint32_t size;
+        uint8_t* buf = ff_nal_unit_extract_rbsp(escaped.data(), (uint32_t)escaped.size(), &size, 0);
+        GetBitContext gb;
+        init_get_bits8(&gb, buf, size);
+        sink += get_ue_golomb(&gb) + get_ue_golomb(&gb) + get_bits_long(&gb, 32);
+        av_free(buf);
+    });
+    double rbsp_ns = time_ns(iterations, 1, [&]() {
+        GetBitContext gb;
+        init_get_bits8_rbsp(&gb, escaped.data(), (unsigned)escaped.size(), ff_avc_find_escape);
+        sink += get_ue_golomb(&gb) + get_ue_golomb(&gb) + get_bits_long(&gb, 32);
+    });
+    printf("slice header from a %zu byte NAL: extract %8.1f ns, in place %6.1f ns\n",
+        escaped.size(), copy_ns, rbsp_ns);
+}
+
+void bench_sps(const char* name, const uint8_t* sps, int size, int iterations) {
+    H264SPS seq;
+    if (ff_avc_decode_sps(&seq, sps, size) < 0) {
+        fprintf(stderr, "%s: SPS does not parse\n", name);
+        exit(1);
+    }
+    printf("%-5s %dx%d, crop %d/%d/%d/%d, %d refs, timing %u/%u\n", name,
+        seq.width, seq.height, seq.crop_left, seq.crop_right, seq.crop_top, seq.crop_bottom,
+        seq.max_num_ref_frames, seq.num_units_in_tick, seq.time_scale);
+
+    volatile int sink = 0;
+    double ns = time_ns(iterations, 1, [&]() {
+        ff_avc_decode_sps(&seq, sps, size);
+        sink += seq.width;
+    });
+    printf("%-5s %7.1f ns per SPS, read in place\n", name, ns);
+}
+
+int main(int argc, char* argv[]) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 200;
+    if (iterations <= 0)
+        iterations = 200;
+
+    std::vector<int> values = make_values(1 << 16);
+    std::vector<uint8_t> buf = write_values(values);
+
+    if (!read_values(buf, values, get_ue_golomb_loop, get_se_golomb_loop) ||
+        !read_values(buf, values, get_ue_golomb, get_se_golomb)) {
+        fprintf(stderr, "Exp-Golomb readers disagree with the writer\n");
+        return 1;
+    }
+    printf("%zu codes read back identically by both readers\n", values.size() * 2);
+
+    int per_iteration = (int)values.size() * 2;
+    volatile int sink = 0;
+    double loop_ns = time_ns(iterations, per_iteration, [&]() {
+        GetBitContext gb;
+        int sum = 0;
+        init_get_bits8(&gb, buf.data(), (int)(buf.size() - padding));
+        for (size_t i = 0; i < values.size(); i++) {
+            sum += get_ue_golomb_loop(&gb);
+            sum += get_se_golomb_loop(&gb);
+        }
+        sink += sum;
+    });
+    double clz_ns = time_ns(iterations, per_iteration, [&]() {
+        GetBitContext gb;
+        int sum = 0;
+        init_get_bits8(&gb, buf.data(), (int)(buf.size() - padding));
+        for (size_t i = 0; i < values.size(); i++) {
+            sum += get_ue_golomb(&gb);
+            sum += get_se_golomb(&gb);
+        }
+        sink += sum;
+    });
+    printf("Exp-Golomb: loop %5.2f ns/code, clz %5.2f ns/code, %4.1fx\n",
+        loop_ns, clz_ns, loop_ns / clz_ns);
+
+    bench_sps("flat", flat_sps, sizeof(flat_sps), iterations * 1000);
+    bench_sps("x264", x264_sps, sizeof(x264_sps), iterations * 1000);
+
+    if (!check_rbsp_reader(20000))
+        return 1;
+    printf("RBSP reader matches extract + plain reader on 20000 payloads\n");
+    bench_slice_header(iterations * 50);
+    return 0;
+}
@@ -0,0 +1,138 @@
+#ifndef WEBDRIVERTORSO_SPSC_QUEUE_H
+#define WEBDRIVERTORSO_SPSC_QUEUE_H
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Bounded lock-free single-producer/single-consumer ring buffer.
+ *
+ * Exactly one thread may call the producer side (try_push/push) and
+ * exactly one thread the consumer side (front/try_pop/pop). The capacity
+ * is rounded up to a power of two. The blocking variants back off while
+ * the queue is full (producer) or empty (consumer) and account the time
+ * spent waiting as stall time, which together with depth() is what the
+ * pipeline reports.
+ */
+template <typename T>
+class SPSCQueue {
+public:
+    explicit SPSCQueue(size_t capacity) {
+        size_t cap = 1;
+        while (cap < capacity)
+            cap <<= 1;
+        items.resize(cap);
+        mask = cap - 1;
+    }
+
+    SPSCQueue(const SPSCQueue&) = delete;
+    SPSCQueue& operator=(const SPSCQueue&) = delete;
+
+    size_t capacity() const {
+        return mask + 1;
+    }
+
+    /* Number of queued items. Exact on either side, approximate elsewhere. */
+    size_t depth() const {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+    }
+
+    int64_t producer_stall_us() const {
+        return producer_stall.load(std::memory_order_relaxed);
+    }
+
+    int64_t consumer_stall_us() const {
+        return consumer_stall.load(std::memory_order_relaxed);
+    }
+
+    bool try_push(T& v) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) > mask)
+            return false;
+        items[t & mask] = std::move(v);
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    /* Returns the oldest item without removing it, or NULL if empty. */
+    T* front() {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+            return NULL;
+        return &items[h & mask];
+    }
+
+    bool try_pop(T& v) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+            return false;
+        v = std::move(items[h & mask]);
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    /* Blocks while full. Returns false (leaving v untouched) once stop is set. */
+    bool push(T& v, const std::atomic<bool>& stop) {
+        if (try_push(v))
+            return true;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        bool ok = false;
+        for (int spins = 0; !stop.load(std::memory_order_relaxed); spins++) {
+            if (try_push(v)) {
+                ok = true;
+                break;
+            }
+            backoff(spins);
+        }
+        producer_stall.fetch_add(elapsed_us(start), std::memory_order_relaxed);
+        return ok;
+    }
+
+    /* Blocks while empty. Returns false once stop is set. */
+    bool pop(T& v, const std::atomic<bool>& stop) {
+        if (try_pop(v))
+            return true;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        bool ok = false;
+        for (int spins = 0; !stop.load(std::memory_order_relaxed); spins++) {
+            if (try_pop(v)) {
+                ok = true;
+                break;
+            }
+            backoff(spins);
+        }
+        consumer_stall.fetch_add(elapsed_us(start), std::memory_order_relaxed);
+        return ok;
+    }
+
+private:
+    static void backoff(int spins) {
+        if (spins < 64)
+            std::this_thread::yield();
+        else
+            std::this_thread::sleep_for(std::chrono::microseconds(500));
+    }
+
+    static int64_t elapsed_us(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    }
+
+    std::vector<T> items;
+    size_t mask = 0;
+
+    /* head is written by the consumer, tail by the producer; keep them on separate cache lines */
+    char pad0[64];
+    std::atomic<size_t> head{ 0 };
+    char pad1[64];
+    std::atomic<size_t> tail{ 0 };
+    char pad2[64];
+    std::atomic<int64_t> producer_stall{ 0 };
+    std::atomic<int64_t> consumer_stall{ 0 };
+};
+
+#endif /* WEBDRIVERTORSO_SPSC_QUEUE_H */
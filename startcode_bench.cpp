@@ -0,0 +1,111 @@
+/*
+ * Start code scanners on H.264 access units: checks every SIMD version
+ * against the scalar one, escape scanners included, and measures their
+ * throughput.
+ *
+ * startcode_bench [corpus file...]
+ *
+ * With corpus files (see "bake"), the baked x264 output is scanned;
+ * without, synthetic access units with the size and start code density
+ * of 2.5 and 20 Mbit/s at 25 fps are generated.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <vector>
+#include "bench_streams.h"
+
+extern "C" {
+#include "avc.h"
+}
+
+using namespace std;
+
+/* read past end by the scalar scanner */
+const int padding = 64;
+
+/* every start code position, as avc_parse_nal_units walks them */
+std::vector<size_t> scan(AVCFindStartcodeFunc find, const uint8_t* buf, size_t size) {
+    std::vector<size_t> positions;
+    const uint8_t* end = buf + size;
+    for (const uint8_t* p = find(buf, end); p < end; p = find(p + 3, end))
+        positions.push_back(p - buf);
+    return positions;
+}
+
+/* All buffers of a few bytes from {0, 1, 2, 3} at every alignment, then
+ * random lengths, for the start code and the escape scanner. */
+bool check_small(const AVCStartcodeImpl& impl, const AVCStartcodeImpl& ref) {
+    std::vector<uint8_t> buf(128 + padding);
+    for (int iter = 0; iter < 200000; iter++) {
+        int offset = iter % 32;
+        int len = iter < 100000 ? iter % 40 : rand() % (128 - 32);
+        for (int i = 0; i < len; i++)
+            buf[offset + i] = rand() % 4;
+        /* padding must not produce matches beyond end */
+        memset(buf.data() + offset + len, 0, buf.size() - offset - len);
+        const uint8_t* p = buf.data() + offset;
+        if (ref.find(p, p + len) - p != impl.find(p, p + len) - p ||
+            ref.find_escape(p, p + len) - p != impl.find_escape(p, p + len) - p) {
+            fprintf(stderr, "%s: mismatch at length %d, alignment %d\n", impl.name, len, offset);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool bench(const Stream& s, const AVCStartcodeImpl* impls, int nb_impls, int rounds) {
+    std::vector<uint8_t> buf(s.data);
+    size_t size = buf.size();
+    buf.resize(size + padding);
+
+    printf("%s: %d frames, %.1f MB\n", s.name.c_str(), s.frames, size / 1e6);
+    std::vector<size_t> expected = scan(impls[0].find, buf.data(), size);
+    bool ok = true;
+    for (int i = 0; i < nb_impls; i++) {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        std::vector<size_t> positions;
+        for (int r = 0; r < rounds; r++)
+            positions = scan(impls[i].find, buf.data(), size);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        bool same = positions == expected;
+        ok = ok && same;
+        printf("  %-5s %8.0f MB/s  %zu start codes  %s\n", impls[i].name,
+            size * rounds / seconds / 1e6, positions.size(), same ? "ok" : "MISMATCH");
+    }
+    return ok;
+}
+
+int main(int argc, char* argv[]) {
+    const AVCStartcodeImpl* impls;
+    int nb_impls = ff_avc_startcode_impls(&impls);
+    bool ok = true;
+
+    srand(1);
+    for (int i = 1; i < nb_impls; i++) {
+        bool same = check_small(impls[i], impls[0]);
+        printf("%s against %s on short buffers: %s\n", impls[i].name, impls[0].name, same ? "ok" : "MISMATCH");
+        ok = ok && same;
+    }
+
+    std::vector<Stream> streams;
+    for (int i = 1; i < argc; i++) {
+        Stream s;
+        if (!corpus_stream(argv[i], s)) {
+            fprintf(stderr, "Could not open corpus %s\n", argv[i]);
+            return 1;
+        }
+        streams.push_back(s);
+    }
+    if (streams.empty()) {
+        streams.push_back(synthetic_stream(2500000, 60));
+        streams.push_back(synthetic_stream(20000000, 10));
+    }
+
+    for (size_t i = 0; i < streams.size(); i++)
+        ok = bench(streams[i], impls, nb_impls, 20) && ok;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,904 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <iostream>
+#include <chrono>
+#include <cassert>
+#include "log.h"
+#include "torso_channel.h"
+
+extern "C" {
+#include <libavutil/opt.h>
+#include <libavutil/mem.h>
+#include <libavutil/mathematics.h>
+}
+
+using namespace std;
+
+AacToneCache aac_cache;
+
+typedef chrono::steady_clock StageClock;
+
+static int64_t elapsed_us(StageClock::time_point start) {
+    return chrono::duration_cast<chrono::microseconds>(StageClock::now() - start).count();
+}
+
+/* Returns the time added. */
+static int64_t add_elapsed(std::atomic<int64_t>& total, StageClock::time_point start) {
+    int64_t us = elapsed_us(start);
+    total.fetch_add(us, std::memory_order_relaxed);
+    return us;
+}
+
+TorsoChannel::TorsoChannel(const ChannelConfig& config)
+    : options(config.options), stream_id(config.stream_id),
+      skip_static_frames(config.options.skip_static_frames), rng(config.seed) {
+    oscillator_init(&tone);
+}
+
+TorsoChannel::~TorsoChannel() {
+    stop_threads();
+    if (options.flat_encoder)
+        h264_flat_uninit(&flat_enc);
+    avcodec_free_context(&c_video);
+    avcodec_free_context(&c_audio);
+    av_packet_free(&pkt_video);
+    av_packet_free(&pkt_audio);
+    av_frame_free(&frame_video);
+    av_frame_free(&frame_audio);
+}
+
+void TorsoChannel::init_video_codec(const AVCodec* codec) {
+    AVCodecContext* c = c_video;
+    /* put sample parameters */
+    c->bit_rate = 2500000;
+    /* resolution must be a multiple of two */
+    c->width = options.width;
+    c->height = options.height;
+    /* frames per second */
+    c->time_base = { 1, 25 };
+    c->framerate = { 25, 1 };
+
+    const EncoderSettings& settings = options.encoder;
+    if (settings.gop_size >= 0)
+        c->gop_size = settings.gop_size;
+    if (settings.max_b_frames >= 0)
+        c->max_b_frames = settings.max_b_frames;
+    c->pix_fmt = AV_PIX_FMT_YUV420P;
+    c->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    if (options.encoder_threads)
+        c->thread_count = options.encoder_threads;
+    if (settings.thread_type)
+        c->thread_type = settings.thread_type;
+    if (settings.slices)
+        c->slices = settings.slices;
+    if (options.abr) {
+        c->rc_max_rate = c->bit_rate;
+        c->rc_buffer_size = (int)c->bit_rate;
+    }
+
+    std::string tune = settings.tune;
+    if (skip_static_frames) {
+        /* every x264 frame is a forced IDR that must come out immediately, and skip slices are CAVLC only */
+        if (tune.find("zerolatency") == std::string::npos)
+            tune += tune.empty() ? "zerolatency" : ",zerolatency";
+        av_opt_set(c->priv_data, "forced-idr", "1", 0);
+        av_opt_set(c->priv_data, "coder", "cavlc", 0);
+    }
+    if (!tune.empty())
+        av_opt_set(c->priv_data, "tune", tune.c_str(), 0);
+    if (!settings.preset.empty())
+        av_opt_set(c->priv_data, "preset", settings.preset.c_str(), 0);
+
+    int ret = avcodec_open2(c, codec, NULL);
+    if (ret < 0) {
+        char errbuf[100]{ 0 };
+        av_make_error_string(errbuf, 100, ret);
+        fprintf(stderr, "Could not open codec: %s\n", errbuf);
+        exit(1);
+    }
+
+    if (skip_static_frames) {
+        ret = h264_skip_init(&skip_ctx, c->extradata, c->extradata_size);
+        if (ret < 0) {
+            fprintf(stderr, "Encoder stream does not support skip frames, encoding every frame\n");
+            skip_static_frames = false;
+        }
+    }
+}
+
+void TorsoChannel::init_flat_video_codec() {
+    AVCodecContext* c = c_video;
+    c->codec_type = AVMEDIA_TYPE_VIDEO;
+    c->codec_id = AV_CODEC_ID_H264;
+    c->bit_rate = 2500000;
+    c->width = options.width;
+    c->height = options.height;
+    c->time_base = { 1, 25 };
+    c->framerate = { 25, 1 };
+    c->pix_fmt = AV_PIX_FMT_YUV420P;
+
+    int ret = h264_flat_init(&flat_enc, c->width, c->height, c->framerate.num / c->framerate.den);
+    if (ret < 0) {
+        char errbuf[100]{ 0 };
+        av_make_error_string(errbuf, 100, ret);
+        fprintf(stderr, "Could not init flat encoder: %s\n", errbuf);
+        exit(1);
+    }
+
+    c->extradata = (uint8_t*)av_mallocz(flat_enc.extradata_size + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (!c->extradata)
+        exit(1);
+    memcpy(c->extradata, flat_enc.extradata, flat_enc.extradata_size);
+    c->extradata_size = flat_enc.extradata_size;
+}
+
+void TorsoChannel::init_audio_codec(const AVCodec* codec) {
+    AVCodecContext* c = c_audio;
+    /* put sample parameters */
+    c->bit_rate = 320000;
+    /* check that the encoder supports s16 pcm input */
+    c->sample_fmt = AV_SAMPLE_FMT_FLTP;
+    c->sample_rate = 48000;
+    av_channel_layout_default(&c->ch_layout, 2);
+    c->channels = 2;
+    c->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    if (options.encoder_threads)
+        c->thread_count = options.encoder_threads;
+    /* open it */
+    if (avcodec_open2(c, codec, NULL) < 0) {
+        fprintf(stderr, "Could not open codec\n");
+        exit(1);
+    }
+    /* every channel has the same audio parameters, so this only sets the cache up once */
+    if (options.cache_audio)
+        aac_cache.init(c);
+}
+
+void TorsoChannel::init_frames() {
+    pkt_video = av_packet_alloc();
+    pkt_audio = av_packet_alloc();
+    if (!pkt_video)
+        exit(1);
+    if (!pkt_audio)
+        exit(1);
+
+    frame_video = av_frame_alloc();
+    frame_audio = av_frame_alloc();
+    if (!frame_video) {
+        fprintf(stderr, "Could not allocate video frame\n");
+        exit(1);
+    }
+    if (!frame_audio) {
+        fprintf(stderr, "Could not allocate audio frame\n");
+        exit(1);
+    }
+
+    int ret;
+    if (!options.flat_encoder) {
+        frame_video->format = c_video->pix_fmt;
+        frame_video->width = c_video->width;
+        frame_video->height = c_video->height;
+        ret = av_frame_get_buffer(frame_video, 0);
+        if (ret < 0) {
+            fprintf(stderr, "Could not allocate the video frame data\n");
+            exit(1);
+        }
+    }
+
+
+    frame_audio->nb_samples = c_audio->frame_size;
+    frame_audio->format = c_audio->sample_fmt;
+    frame_audio->sample_rate = c_audio->sample_rate;
+    ret = av_channel_layout_copy(&frame_audio->ch_layout, &c_audio->ch_layout);
+    if (ret < 0)
+        exit(1);
+
+    /* allocate the data buffers */
+    ret = av_frame_get_buffer(frame_audio, 0);
+    if (ret < 0) {
+        fprintf(stderr, "Could not allocate audio data buffers\n");
+        exit(1);
+    }
+}
+
+void TorsoChannel::init() {
+    const AVCodec* codec_video = options.flat_encoder ? NULL : avcodec_find_encoder(AV_CODEC_ID_H264);
+    if (!codec_video && !options.flat_encoder) {
+        fprintf(stderr, "Codec '%s' not found\n", "aac");
+        exit(1);
+    }
+    const AVCodec* codec_audio = avcodec_find_encoder(AV_CODEC_ID_AAC);
+    if (!codec_audio) {
+        fprintf(stderr, "Codec '%s' not found\n", "aac");
+        exit(1);
+    }
+
+    c_video = avcodec_alloc_context3(codec_video);
+    if (!c_video) {
+        fprintf(stderr, "Could not allocate video codec context\n");
+        exit(1);
+    }
+
+    c_audio = avcodec_alloc_context3(codec_audio);
+    if (!c_audio) {
+        fprintf(stderr, "Could not allocate audio codec context\n");
+        exit(1);
+    }
+
+    if (options.flat_encoder)
+        init_flat_video_codec();
+    else
+        init_video_codec(codec_video);
+    video_bitrate = c_video->bit_rate;
+    init_audio_codec(codec_audio);
+    init_frames();
+    change_rects(c_video->width, c_video->height);
+}
+
+RtmpStreamInfo TorsoChannel::stream_info() const {
+    RtmpStreamInfo info;
+    info.width = c_video->width;
+    info.height = c_video->height;
+    info.framerate = av_q2d(c_video->framerate);
+    info.video_bitrate = (int)video_bitrate.load();
+    info.audio_bitrate = (int)c_audio->bit_rate;
+    info.sample_rate = c_audio->sample_rate;
+    info.channels = c_audio->ch_layout.nb_channels;
+    return info;
+}
+
+std::vector<SharedMessage> TorsoChannel::headers() const {
+    std::vector<uint8_t> avcc = make_avcc(c_video->extradata, c_video->extradata_size);
+    std::vector<SharedMessage> messages;
+    messages.push_back(video_message(0, 0, 0, true, avcc.data(), avcc.size()));
+    messages.push_back(audio_message(0, 0, c_audio->extradata, c_audio->extradata_size));
+    return messages;
+}
+
+void TorsoChannel::generate_audio_frame(AVFrame* frame, float freq) {
+    int ret = av_frame_make_writable(frame);
+    if (ret < 0)
+        exit(1);
+    render_tone(frame, &tone, freq);
+}
+
+Rect TorsoChannel::generate_rect(int width, int height) {
+    assert(width >= height);
+    int minWidth = height / 10;
+    int maxWidth = height / 2;
+
+    int w = rng() % (maxWidth - minWidth) + minWidth;
+    int h = rng() % (maxWidth - minWidth) + minWidth;
+    w -= w % 2;
+    h -= h % 2;
+
+    int x = rng() % (width - w);
+    int y = rng() % (height - h);
+    x -= x % 2;
+    y -= y % 2;
+
+    Rect res;
+    res.width = w;
+    res.height = h;
+    res.x = x;
+    res.y = y;
+    return res;
+}
+
+void TorsoChannel::change_rects(int width, int height) {
+    blueRect = generate_rect(width, height);
+    redRect = generate_rect(width, height);
+}
+
+/*
+ * Repaints incrementally: only the old rects are restored to the
+ * background before the new ones are drawn, everything else already is
+ * background. av_frame_make_writable copies the picture when it has to
+ * replace a shared buffer, so only the very first frame needs a full clear.
+ */
+void TorsoChannel::generate_video_frame(AVFrame* frame) {
+    int ret = av_frame_make_writable(frame);
+    if (ret < 0)
+        exit(1);
+    if (!frame_painted) {
+        clean_frame(frame);
+        frame_painted = true;
+    }
+    else {
+        draw_rect_on_frame(frame, paintedBlueRect, get_background_color());
+        draw_rect_on_frame(frame, paintedRedRect, get_background_color());
+    }
+    draw_rect_on_frame(frame, blueRect, get_yuv_from_rgb(0, 0, 255));
+    draw_rect_on_frame(frame, redRect, get_yuv_from_rgb(255, 0, 0));
+    paintedBlueRect = blueRect;
+    paintedRedRect = redRect;
+}
+
+/* The same picture generate_video_frame draws, as input for the flat encoder. */
+void TorsoChannel::make_flat_scene(H264FlatScene* scene) {
+    const Rect* rects[] = { &blueRect, &redRect };
+    YUVColor colors[] = { get_yuv_from_rgb(0, 0, 255), get_yuv_from_rgb(255, 0, 0) };
+
+    scene->background[0] = 255;
+    scene->background[1] = 128;
+    scene->background[2] = 128;
+    scene->nb_rects = 2;
+    for (int i = 0; i < scene->nb_rects; i++) {
+        scene->rects[i].x = rects[i]->x;
+        scene->rects[i].y = rects[i]->y;
+        scene->rects[i].width = rects[i]->width;
+        scene->rects[i].height = rects[i]->height;
+        scene->rects[i].color[0] = colors[i].Y;
+        scene->rects[i].color[1] = colors[i].U;
+        scene->rects[i].color[2] = colors[i].V;
+    }
+}
+
+SharedMessage TorsoChannel::video_packet_message(AVPacket* pkt, bool& key) {
+    av_packet_rescale_ts(pkt, { c_video->time_base.num, c_video->time_base.den }, { 1,1000 });
+    if (pkt->dts < 0)
+        pkt->dts = 0;
+
+    if (!video_gather.build(pkt->data, pkt->size)) {
+        fprintf(stderr, "Could not parse video packet\n");
+        exit(1);
+    }
+    if (options.latency_probe)
+        video_gather.insert_probe(pkt->data, stream_id);
+
+    key = pkt->flags & AV_PKT_FLAG_KEY;
+    MediaMessage mediaMsg = make_video_message(1, pkt->dts, pkt->pts - pkt->dts,
+        key, video_gather.size);
+    video_gather.gather(mediaMsg.body.data() + VIDEO_TAG_HEADER_SIZE);
+    LOG_DEBUG_EVERY(1000, "Out Video %lld", pkt->dts);
+    return share_message(mediaMsg);
+}
+
+SharedMessage TorsoChannel::audio_packet_message(AVPacket* pkt) {
+    av_packet_rescale_ts(pkt, { c_audio->time_base.num, c_audio->time_base.den }, { 1,1000 });
+    if (pkt->dts < 0)
+        pkt->dts = 0;
+
+    LOG_DEBUG_EVERY(1000, "Out Audio %lld", pkt->dts);
+    return audio_message(1, pkt->dts, pkt->data, pkt->size);
+}
+
+/* Returns the number of packets the encoder emitted. */
+int TorsoChannel::encode(AVFrame* frame, AVCodecContext* c, AVPacket* pkt, PacketQueue& out,
+    LatencyHistogram& send_latency, LatencyHistogram& receive_latency) {
+    int packets = 0;
+    StageClock::time_point start = StageClock::now();
+    int ret = avcodec_send_frame(c, frame);
+    send_latency.record(elapsed_us(start));
+    if (ret < 0) {
+        fprintf(stderr, "Error sending a frame for encoding\n");
+        exit(1);
+    }
+
+    while (ret >= 0) {
+        start = StageClock::now();
+        ret = avcodec_receive_packet(c, pkt);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+            break;
+        else if (ret < 0) {
+            fprintf(stderr, "Error during encoding\n");
+            exit(1);
+        }
+        receive_latency.record(elapsed_us(start));
+        AVPacket* queued = av_packet_alloc();
+        if (!queued)
+            exit(1);
+        av_packet_move_ref(queued, pkt);
+        if (!out.push(queued, stop)) {
+            av_packet_free(&queued);
+            break;
+        }
+        packets++;
+    }
+    return packets;
+}
+
+void TorsoChannel::encode_skip_frame(AVFrame* frame) {
+    AVPacket* queued = av_packet_alloc();
+    if (!queued || av_new_packet(queued, h264_skip_max_size(&skip_ctx)) < 0)
+        exit(1);
+    int size = h264_skip_write_frame(&skip_ctx, queued->data, queued->size);
+    if (size < 0) {
+        fprintf(stderr, "Error writing skip frame\n");
+        exit(1);
+    }
+    av_shrink_packet(queued, size);
+    queued->pts = frame->pts;
+    queued->dts = frame->pts;
+    if (!video_packets.push(queued, stop))
+        av_packet_free(&queued);
+}
+
+/* A frame carrying an H264FlatScene in opaque_ref starts a scene, any other repeats it. */
+void TorsoChannel::encode_flat_frame(AVFrame* frame) {
+    bool idr = frame->opaque_ref != NULL;
+    AVPacket* queued = av_packet_alloc();
+    if (!queued || av_new_packet(queued, idr ? h264_flat_max_size(&flat_enc) : h264_skip_max_size(&flat_enc.skip)) < 0)
+        exit(1);
+    int size;
+    if (idr) {
+        size = h264_flat_write_idr(&flat_enc, (const H264FlatScene*)frame->opaque_ref->data, queued->data, queued->size);
+        queued->flags |= AV_PKT_FLAG_KEY;
+    }
+    else {
+        size = h264_flat_write_skip(&flat_enc, queued->data, queued->size);
+    }
+    if (size < 0) {
+        fprintf(stderr, "Error writing flat frame\n");
+        exit(1);
+    }
+    av_shrink_packet(queued, size);
+    queued->pts = frame->pts;
+    queued->dts = frame->pts;
+    if (!video_packets.push(queued, stop))
+        av_packet_free(&queued);
+}
+
+/*
+ * libx264 compares the rate control fields with its parameters before
+ * every frame and reconfigures x264 when they differ, so a new bitrate
+ * only has to be in the context by the next avcodec_send_frame().
+ */
+void TorsoChannel::apply_video_bitrate() {
+    int64_t bps = requested_bitrate.exchange(0, std::memory_order_relaxed);
+    if (!bps || bps == c_video->bit_rate)
+        return;
+    c_video->bit_rate = bps;
+    if (c_video->rc_max_rate) {
+        c_video->rc_max_rate = bps;
+        c_video->rc_buffer_size = (int)bps;
+    }
+    video_bitrate = bps;
+}
+
+/*
+ * With skip_static_frames, scene changes (marked as I frames by
+ * render_frame) go through x264 and everything up to the next one is
+ * synthesized.
+ */
+void TorsoChannel::encode_video_frame(AVFrame* frame) {
+    if (options.flat_encoder) {
+        encode_flat_frame(frame);
+        return;
+    }
+    if (skip_static_frames && have_idr && frame->pict_type != AV_PICTURE_TYPE_I) {
+        encode_skip_frame(frame);
+        return;
+    }
+    apply_video_bitrate();
+    if (encode(frame, c_video, pkt_video, video_packets, latency.video_send_frame, latency.video_receive_packet) > 0) {
+        h264_skip_idr(&skip_ctx);
+        have_idr = true;
+    }
+    else if (skip_static_frames) {
+        LOG_WARNING("Encoder delays output, encoding every frame");
+        skip_static_frames = false;
+    }
+}
+
+/* With cache_audio, the packets come from aac_cache and the encoder is never fed. */
+void TorsoChannel::encode_audio_frame(AVFrame* frame) {
+    if (options.cache_audio) {
+        const ToneFrame* tone_frame = (const ToneFrame*)frame->opaque_ref->data;
+        const AVPacket* cached = aac_cache.get(tone_frame->freq, tone_frame->phase);
+        if (!cached) {
+            fprintf(stderr, "Could not encode tone %d Hz\n", tone_frame->freq);
+            exit(1);
+        }
+        AVPacket* queued = av_packet_clone(cached);
+        if (!queued)
+            exit(1);
+        queued->pts = frame->pts;
+        queued->dts = frame->pts;
+        queued->duration = frame->nb_samples;
+        if (!audio_packets.push(queued, stop))
+            av_packet_free(&queued);
+    }
+    else {
+        encode(frame, c_audio, pkt_audio, audio_packets, latency.audio_send_frame, latency.audio_receive_packet);
+    }
+}
+
+AVFrame* TorsoChannel::render_frame(bool& video) {
+    /* produce in presentation order across both streams */
+    video = av_compare_ts(video_pts, c_video->time_base, audio_pts, c_audio->time_base) <= 0;
+    if (video) {
+        bool scene_change = video_pts % change_interval == 0;
+        /* a requested IDR repeats the current scene */
+        bool requested = keyframe_requested.exchange(false, std::memory_order_relaxed);
+        bool idr = scene_change || requested;
+        if (scene_change) {
+            change_rects(c_video->width, c_video->height);
+            if (!options.flat_encoder)
+                generate_video_frame(frame_video);
+            freq = rng() % 400 + 200;
+        }
+        AVFrame* frame;
+        if (options.flat_encoder) {
+            /* no pixels, only the scene description on scene changes */
+            frame = av_frame_alloc();
+            if (!frame)
+                exit(1);
+            if (idr) {
+                frame->opaque_ref = av_buffer_alloc(sizeof(H264FlatScene));
+                if (!frame->opaque_ref)
+                    exit(1);
+                make_flat_scene((H264FlatScene*)frame->opaque_ref->data);
+                frame->pict_type = AV_PICTURE_TYPE_I;
+            }
+            frame->pts = video_pts;
+        }
+        else {
+            bool force_idr = (skip_static_frames && scene_change) || requested;
+            frame_video->pict_type = force_idr ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+            frame_video->pts = video_pts;
+            frame = av_frame_clone(frame_video);
+            if (!frame)
+                exit(1);
+        }
+        video_pts++;
+        return frame;
+    }
+
+    double phase = tone.phase;
+    generate_audio_frame(frame_audio, freq);
+    frame_audio->pts = audio_pts;
+    audio_pts += c_audio->frame_size;
+    AVFrame* frame = av_frame_clone(frame_audio);
+    if (!frame)
+        exit(1);
+    if (options.cache_audio) {
+        frame->opaque_ref = av_buffer_alloc(sizeof(ToneFrame));
+        if (!frame->opaque_ref)
+            exit(1);
+        ToneFrame* tone_frame = (ToneFrame*)frame->opaque_ref->data;
+        tone_frame->freq = (int)freq;
+        tone_frame->phase = phase;
+    }
+    return frame;
+}
+
+void TorsoChannel::render_stage() {
+    while (!stop) {
+        bool video;
+        StageClock::time_point start = StageClock::now();
+        AVFrame* frame = render_frame(video);
+        latency.render.record(add_elapsed(render_us, start));
+        if (!(video ? video_frames : audio_frames).push(frame, stop)) {
+            av_frame_free(&frame);
+            break;
+        }
+    }
+}
+
+void TorsoChannel::video_encode_stage() {
+    AVFrame* frame;
+    while (video_frames.pop(frame, stop)) {
+        StageClock::time_point start = StageClock::now();
+        encode_video_frame(frame);
+        av_frame_free(&frame);
+        add_elapsed(video_encode_us, start);
+        video_frames_encoded.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void TorsoChannel::audio_encode_stage() {
+    AVFrame* frame;
+    while (audio_frames.pop(frame, stop)) {
+        StageClock::time_point start = StageClock::now();
+        encode_audio_frame(frame);
+        av_frame_free(&frame);
+        add_elapsed(audio_encode_us, start);
+        audio_frames_encoded.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void TorsoChannel::start_threads() {
+    stop = false;
+    render_thread = std::thread(&TorsoChannel::render_stage, this);
+    video_thread = std::thread(&TorsoChannel::video_encode_stage, this);
+    audio_thread = std::thread(&TorsoChannel::audio_encode_stage, this);
+}
+
+void TorsoChannel::stop_threads() {
+    stop = true;
+    if (render_thread.joinable())
+        render_thread.join();
+    if (video_thread.joinable())
+        video_thread.join();
+    if (audio_thread.joinable())
+        audio_thread.join();
+
+    AVFrame* frame;
+    while (video_frames.try_pop(frame))
+        av_frame_free(&frame);
+    while (audio_frames.try_pop(frame))
+        av_frame_free(&frame);
+    AVPacket* pkt;
+    while (video_packets.try_pop(pkt))
+        av_packet_free(&pkt);
+    while (audio_packets.try_pop(pkt))
+        av_packet_free(&pkt);
+}
+
+/*
+ * The encoders emit at most one packet per frame they are fed, so while
+ * both packet queues are below half full the pushes in encode() cannot
+ * block. x264 lookahead makes the audio queue run ahead of the video one
+ * at the start, the same as with the stage threads.
+ */
+void TorsoChannel::produce() {
+    while ((!video_packets.front() || !audio_packets.front()) &&
+        video_packets.depth() < video_packets.capacity() / 2 &&
+        audio_packets.depth() < audio_packets.capacity() / 2) {
+        bool video;
+        StageClock::time_point start = StageClock::now();
+        AVFrame* frame = render_frame(video);
+        latency.render.record(add_elapsed(render_us, start));
+        start = StageClock::now();
+        if (video)
+            encode_video_frame(frame);
+        else
+            encode_audio_frame(frame);
+        av_frame_free(&frame);
+        add_elapsed(video ? video_encode_us : audio_encode_us, start);
+        (video ? video_frames_encoded : audio_frames_encoded).fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+/*
+ * A stream with nothing queued holds the other one back, so the messages
+ * stay in dts order across both: while x264 fills its lookahead, or falls
+ * behind, the audio queued meanwhile must not go ahead of video that comes
+ * out later with earlier timestamps. The wait ends once the queue held
+ * back is half full, where produce() stops too, so a stalled encoder does
+ * not stall the other stream and the render stage behind it for good.
+ */
+int64_t TorsoChannel::next_due_ms() {
+    AVPacket** video = video_packets.front();
+    AVPacket** audio = audio_packets.front();
+    if (!video && audio_packets.depth() < audio_packets.capacity() / 2)
+        return INT64_MAX;
+    if (!audio && video_packets.depth() < video_packets.capacity() / 2)
+        return INT64_MAX;
+    int64_t video_ms = video ? av_rescale_q((*video)->dts, c_video->time_base, { 1, 1000 }) : INT64_MAX;
+    int64_t audio_ms = audio ? av_rescale_q((*audio)->dts, c_audio->time_base, { 1, 1000 }) : INT64_MAX;
+    next_is_video = video_ms <= audio_ms;
+    return min(video_ms, audio_ms);
+}
+
+SharedMessage TorsoChannel::pop_message(bool& key) {
+    StageClock::time_point start = StageClock::now();
+    AVPacket* pkt;
+    SharedMessage msg;
+    if (next_is_video) {
+        video_packets.try_pop(pkt);
+        msg = video_packet_message(pkt, key);
+    }
+    else {
+        audio_packets.try_pop(pkt);
+        msg = audio_packet_message(pkt);
+        key = false;
+    }
+    av_packet_free(&pkt);
+    latency.packetize.record(add_elapsed(packetize_us, start));
+    return msg;
+}
+
+/* nal_ref_idc 0 on the slices: no other frame predicts from this one */
+static bool is_disposable(const AVPacket* pkt) {
+    if (pkt->flags & AV_PKT_FLAG_KEY)
+        return false;
+    if (pkt->flags & AV_PKT_FLAG_DISPOSABLE)
+        return true;
+    const uint8_t* end = pkt->data + pkt->size;
+    const uint8_t* nal = ff_avc_find_startcode(pkt->data, end);
+    while (nal < end) {
+        while (nal < end && !*nal)
+            nal++;
+        if (nal + 1 < end && is_vcl_nal(nal[1]))
+            return (nal[1] & 0x60) == 0;
+        nal = ff_avc_find_startcode(nal + 1, end);
+    }
+    return false;
+}
+
+bool TorsoChannel::drop_disposable() {
+    if (!next_is_video)
+        return false;
+    AVPacket** front = video_packets.front();
+    if (!front || !is_disposable(*front))
+        return false;
+    AVPacket* pkt;
+    video_packets.try_pop(pkt);
+    av_packet_free(&pkt);
+    return true;
+}
+
+bool TorsoChannel::drop_to_keyframe() {
+    if (!next_is_video)
+        return false;
+    AVPacket** front = video_packets.front();
+    if (!front)
+        return false;
+    if ((*front)->flags & AV_PKT_FLAG_KEY) {
+        dropping_video = false;
+        return false;
+    }
+    if (!dropping_video) {
+        request_keyframe();
+        dropping_video = true;
+    }
+    AVPacket* pkt;
+    video_packets.try_pop(pkt);
+    av_packet_free(&pkt);
+    return true;
+}
+
+/*
+ * Drains the encoders without pacing into a corpus file. The render stage
+ * runs unpaced as well, so baking is as fast as the encoders are.
+ *
+ * The loop ends right before the first IDR at or after duration_ms in
+ * presentation order, and duration_ms becomes the pts of that IDR. GOPs
+ * are closed, so every frame before it in decode order is shown before
+ * it and every frame after it references nothing before; with the first
+ * frame an IDR at 0, pts and dts go on increasing into the next loop. An
+ * IDR is requested as soon as the boundary is reached, so a long GOP does
+ * not stretch the loop by more than the encoder delay.
+ */
+bool TorsoChannel::bake(CorpusWriter& writer, int64_t& duration_ms) {
+    int video_duration_ms = (int)av_rescale_q(1, c_video->time_base, { 1, 1000 });
+    int audio_duration_ms = (int)av_rescale_q(c_audio->frame_size, c_audio->time_base, { 1, 1000 });
+    NALUList& nal_list = video_gather.nal_list;
+    bool video_done = false;
+    bool audio_done = false;
+    bool keyframe_asked = false;
+    /* the pts of the IDR the loop ends before, once it came out */
+    int64_t cut_ms = INT64_MAX;
+    /* audio at or after duration_ms while the cut is not known yet */
+    std::vector<AVPacket*> held_audio;
+    std::vector<uint8_t> avcc;
+
+    auto write_audio = [&](AVPacket* pkt) {
+        if (pkt->dts >= cut_ms)
+            audio_done = true;
+        bool ok = audio_done || writer.write_packet(CORPUS_PACKET_AUDIO, pkt->dts, pkt->pts, audio_duration_ms,
+            true, pkt->data, pkt->size);
+        av_packet_free(&pkt);
+        return ok;
+    };
+
+    /* a finished stream is still drained so it never blocks the render stage */
+    bool ok = true;
+    while (ok && (!video_done || !audio_done)) {
+        AVPacket* pkt;
+        if (video_packets.try_pop(pkt)) {
+            av_packet_rescale_ts(pkt, c_video->time_base, { 1, 1000 });
+            if (pkt->dts < 0)
+                pkt->dts = 0;
+            if (!video_done && pkt->pts >= duration_ms) {
+                if (pkt->flags & AV_PKT_FLAG_KEY) {
+                    cut_ms = pkt->pts;
+                    video_done = true;
+                    for (size_t i = 0; i < held_audio.size() && ok; i++)
+                        ok = write_audio(held_audio[i]);
+                    held_audio.clear();
+                }
+                else if (!keyframe_asked) {
+                    request_keyframe();
+                    keyframe_asked = true;
+                }
+            }
+            if (!video_done) {
+                /* in place when every start code is 4 bytes; x264 writes 3-byte ones before the
+                 * second and later slices of a frame, so those go through avcc */
+                int size = ff_nal_units_create_list(&nal_list, pkt->data, pkt->size);
+                const uint8_t* data;
+                if (size >= 0 && (av_packet_make_writable(pkt) < 0 ||
+                    ff_nal_units_convert_inplace(&nal_list, pkt->data, pkt->size) < 0)) {
+                    avcc.resize(size);
+                    ff_nal_units_write_buf(&nal_list, avcc.data(), pkt->data);
+                    data = avcc.data();
+                }
+                else {
+                    /* make_writable may have replaced the buffer */
+                    data = pkt->data;
+                }
+                ok = size >= 0 && writer.write_packet(CORPUS_PACKET_VIDEO, pkt->dts, pkt->pts, video_duration_ms,
+                    pkt->flags & AV_PKT_FLAG_KEY, data, size);
+            }
+            av_packet_free(&pkt);
+        }
+        else if (audio_packets.try_pop(pkt)) {
+            av_packet_rescale_ts(pkt, c_audio->time_base, { 1, 1000 });
+            if (pkt->dts < 0)
+                pkt->dts = 0;
+            if (!audio_done && !video_done && pkt->dts >= duration_ms)
+                held_audio.push_back(pkt);
+            else if (!audio_done)
+                ok = write_audio(pkt);
+            else
+                av_packet_free(&pkt);
+        }
+        else {
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+    }
+    for (size_t i = 0; i < held_audio.size(); i++)
+        av_packet_free(&held_audio[i]);
+    duration_ms = cut_ms;
+    return ok;
+}
+
+StageTimes TorsoChannel::stage_times() const {
+    StageTimes t;
+    t.render_us = render_us.load(std::memory_order_relaxed);
+    t.video_encode_us = video_encode_us.load(std::memory_order_relaxed);
+    t.audio_encode_us = audio_encode_us.load(std::memory_order_relaxed);
+    t.packetize_us = packetize_us.load(std::memory_order_relaxed);
+    t.video_frames = video_frames_encoded.load(std::memory_order_relaxed);
+    t.audio_frames = audio_frames_encoded.load(std::memory_order_relaxed);
+    return t;
+}
+
+void TorsoChannel::add_metrics(ChannelMetrics& m) const {
+    m.render.add(latency.render);
+    m.video_send_frame.add(latency.video_send_frame);
+    m.video_receive_packet.add(latency.video_receive_packet);
+    m.audio_send_frame.add(latency.audio_send_frame);
+    m.audio_receive_packet.add(latency.audio_receive_packet);
+    m.packetize.add(latency.packetize);
+    m.video_frames += video_frames_encoded.load(std::memory_order_relaxed);
+    m.audio_frames += audio_frames_encoded.load(std::memory_order_relaxed);
+    m.video_frame_queue += video_frames.depth();
+    m.audio_frame_queue += audio_frames.depth();
+    m.video_packet_queue += video_packets.depth();
+    m.audio_packet_queue += audio_packets.depth();
+}
+
+void ChannelMetrics::write(MetricsWriter& w) const {
+    static const char* stage_help = "Latency of single calls in the pipeline stages.";
+    w.histogram("webdrivertorso_stage_seconds", stage_help, metric_label("stage", "render"), render);
+    w.histogram("webdrivertorso_stage_seconds", stage_help, metric_label("stage", "video_send_frame"), video_send_frame);
+    w.histogram("webdrivertorso_stage_seconds", stage_help, metric_label("stage", "video_receive_packet"),
+        video_receive_packet);
+    w.histogram("webdrivertorso_stage_seconds", stage_help, metric_label("stage", "audio_send_frame"), audio_send_frame);
+    w.histogram("webdrivertorso_stage_seconds", stage_help, metric_label("stage", "audio_receive_packet"),
+        audio_receive_packet);
+    w.histogram("webdrivertorso_stage_seconds", stage_help, metric_label("stage", "packetize"), packetize);
+
+    static const char* frames_help = "Frames encoded.";
+    w.counter("webdrivertorso_encoded_frames_total", frames_help, metric_label("stream", "video"), video_frames);
+    w.counter("webdrivertorso_encoded_frames_total", frames_help, metric_label("stream", "audio"), audio_frames);
+
+    static const char* queue_help = "Frames queued for the encoders and packets queued for sending.";
+    w.gauge("webdrivertorso_queue_depth", queue_help, metric_label("queue", "video_frames"), (double)video_frame_queue);
+    w.gauge("webdrivertorso_queue_depth", queue_help, metric_label("queue", "audio_frames"), (double)audio_frame_queue);
+    w.gauge("webdrivertorso_queue_depth", queue_help, metric_label("queue", "video_packets"), (double)video_packet_queue);
+    w.gauge("webdrivertorso_queue_depth", queue_help, metric_label("queue", "audio_packets"), (double)audio_packet_queue);
+}
+
+void TorsoChannel::print_pipeline_stats() {
+    std::cout << "Pipeline"
+        << " video frames " << video_frames.depth() << "/" << video_frames.capacity()
+        << " stall " << video_frames.producer_stall_us() / 1000 << "ms"
+        << ", audio frames " << audio_frames.depth() << "/" << audio_frames.capacity()
+        << " stall " << audio_frames.producer_stall_us() / 1000 << "ms"
+        << ", video packets " << video_packets.depth() << "/" << video_packets.capacity()
+        << " stall " << video_packets.producer_stall_us() / 1000 << "ms"
+        << ", audio packets " << audio_packets.depth() << "/" << audio_packets.capacity()
+        << " stall " << audio_packets.producer_stall_us() / 1000 << "ms" << endl;
+    StageTimes t = stage_times();
+    std::cout << "Busy render " << t.render_us / 1000 << "ms"
+        << ", video encode " << t.video_encode_us / 1000 << "ms for " << t.video_frames << " frames"
+        << ", audio encode " << t.audio_encode_us / 1000 << "ms for " << t.audio_frames << " frames"
+        << ", packetize " << t.packetize_us / 1000 << "ms" << endl;
+}
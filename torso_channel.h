@@ -0,0 +1,305 @@
+#ifndef WEBDRIVERTORSO_TORSO_CHANNEL_H
+#define WEBDRIVERTORSO_TORSO_CHANNEL_H
+
+#include <stdint.h>
+#include <atomic>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "spsc_queue.h"
+#include "corpus.h"
+#include "oscillator.h"
+#include "aac_cache.h"
+#include "media_message.h"
+#include "metrics.h"
+#include "render.h"
+
+extern "C" {
+#include "libavcodec/avcodec.h"
+#include "avc.h"
+#include "h264_skip.h"
+#include "h264_flat.h"
+#include "latency_sei.h"
+}
+
+/* x264's; the defaults leave each to libavcodec and x264. See encoder_tune.h to pick them for a CPU budget. */
+struct EncoderSettings {
+    std::string preset;
+    /* comma separated, skip_static_frames adds zerolatency */
+    std::string tune;
+    int thread_type = 0;        ///< FF_THREAD_FRAME or FF_THREAD_SLICE
+    int slices = 0;
+    int gop_size = -1;
+    int max_b_frames = -1;
+};
+
+/* How channels encode; the same for every channel of a process. */
+struct ChannelOptions {
+    /* only x264 encodes scene changes, the static frames in between are synthesized P_Skip frames */
+    bool skip_static_frames = false;
+    /* the scenes are written as H.264 directly, without rendering frames or running x264 */
+    bool flat_encoder = false;
+    /* the tone is not encoded, every AAC frame comes from the process-wide cache */
+    bool cache_audio = false;
+    /* every video access unit carries a latency probe SEI, see latency_sei.h */
+    bool latency_probe = false;
+    /* x264 runs with a VBV the size of a second of the bitrate, so set_video_bitrate() can move both */
+    bool abr = false;
+    /* picture size, both even */
+    int width = 1920;
+    int height = 1080;
+    /* threads per encoder, 0 keeps the libavcodec default */
+    int encoder_threads = 0;
+    EncoderSettings encoder;
+};
+
+struct ChannelConfig {
+    ChannelOptions options;
+    uint32_t seed = 0;          ///< of the scene and tone sequence
+    uint32_t stream_id = 0;     ///< in the latency probes
+};
+
+/* Time the pipeline stages of a channel were busy, since init(). */
+struct StageTimes {
+    int64_t render_us = 0;          ///< scenes and tone into frames
+    int64_t video_encode_us = 0;
+    int64_t audio_encode_us = 0;
+    int64_t packetize_us = 0;       ///< packets into messages, in pop_message()
+    uint64_t video_frames = 0;      ///< encoded
+    uint64_t audio_frames = 0;
+};
+
+/* Latency of single calls, every histogram written by the stage making them. */
+struct StageLatency {
+    LatencyHistogram render;                ///< a frame of either stream
+    LatencyHistogram video_send_frame;      ///< avcodec_send_frame
+    LatencyHistogram video_receive_packet;  ///< avcodec_receive_packet, the calls that return a packet
+    LatencyHistogram audio_send_frame;
+    LatencyHistogram audio_receive_packet;
+    LatencyHistogram packetize;             ///< AVCC conversion into a message, in pop_message()
+};
+
+/* What the metrics export shows of one or more channels, added up. */
+struct ChannelMetrics {
+    LatencySnapshot render;
+    LatencySnapshot video_send_frame;
+    LatencySnapshot video_receive_packet;
+    LatencySnapshot audio_send_frame;
+    LatencySnapshot audio_receive_packet;
+    LatencySnapshot packetize;
+    uint64_t video_frames = 0;
+    uint64_t audio_frames = 0;
+    size_t video_frame_queue = 0;
+    size_t audio_frame_queue = 0;
+    size_t video_packet_queue = 0;
+    size_t audio_packet_queue = 0;
+
+    void write(MetricsWriter& w) const;
+};
+
+/* The pre-encoded tone shared by every channel with cache_audio. */
+extern AacToneCache aac_cache;
+
+/*
+ * One test stream: the scene and tone generators, the encoders and the
+ * packet queues, everything that used to be process state.
+ *
+ * A channel runs in one of two ways. start_threads() is the staged
+ * pipeline: scene render -> video encode || audio encode, every stage on
+ * its own thread, connected by bounded SPSC queues, so a heavy x264 frame
+ * only stalls the stage it happens in until the queues in between run
+ * full. The audio queues are sized to cover the x264 lookahead delay, so
+ * render never waits on audio while the video encoder is still filling
+ * up. produce() does the same work on the calling thread instead, for
+ * a pool that runs many channels on a few workers (see channel_runner.h).
+ *
+ * Either way next_due_ms() and pop_message() take the packets out,
+ * interleaved by dts, and are called by one thread at a time.
+ */
+class TorsoChannel {
+public:
+    /* video frames per scene */
+    static const int change_interval = 25;
+
+    explicit TorsoChannel(const ChannelConfig& config);
+    ~TorsoChannel();
+
+    TorsoChannel(const TorsoChannel&) = delete;
+    TorsoChannel& operator=(const TorsoChannel&) = delete;
+
+    /* Opens the encoders and allocates the frames; exits on failure. */
+    void init();
+
+    const AVCodecContext* video_codec() const {
+        return c_video;
+    }
+    const AVCodecContext* audio_codec() const {
+        return c_audio;
+    }
+    /* what onMetaData announces, at the current video bitrate */
+    RtmpStreamInfo stream_info() const;
+    /* avcC and AudioSpecificConfig */
+    std::vector<SharedMessage> headers() const;
+
+    void start_threads();
+    /* Stops the stage threads and drops whatever is still queued. */
+    void stop_threads();
+
+    /* Renders and encodes on the calling thread until both streams have a
+     * packet queued. Only without the stage threads. */
+    void produce();
+
+    /* The dts in milliseconds of the first queued packet across both
+     * streams, INT64_MAX if there is none to send yet. While one stream
+     * has nothing queued the other waits for it, until half its queue is
+     * full. */
+    int64_t next_due_ms();
+
+    /* Takes the packet next_due_ms() is for out as a message. */
+    SharedMessage pop_message(bool& key);
+
+    /* Throws the packet next_due_ms() is for away instead if it is a
+     * video frame no other frame references (a non-reference B frame);
+     * the stream decodes on without it. Returns whether it did. */
+    bool drop_disposable();
+
+    /* Whether drop_disposable() can ever find a frame: not without B
+     * frames, as with zerolatency (and so skip_static_frames) or the flat
+     * encoder. */
+    bool has_disposable_frames() const {
+        return c_video->has_b_frames > 0;
+    }
+
+    /* For a stream without disposable frames: throws the packet
+     * next_due_ms() is for away if it is a video frame other than a
+     * keyframe, and requests an IDR the first time. The picture freezes
+     * until the IDR; once it has started, it must be called for every
+     * packet until it returns false at the keyframe, or a frame that
+     * references a dropped one goes out. Returns whether it dropped. */
+    bool drop_to_keyframe();
+
+    bool dropping_to_keyframe() const {
+        return dropping_video;
+    }
+
+    /* The next video frame rendered is encoded as an IDR. It comes out
+     * after whatever the frame queue and the encoder already hold. */
+    void request_keyframe() {
+        keyframe_requested.store(true, std::memory_order_relaxed);
+    }
+
+    /* x264 encodes at bps from the next video frame it is given on, which
+     * comes out after the lookahead. The flat encoder has no bitrate to
+     * change and ignores it. */
+    void set_video_bitrate(int64_t bps) {
+        requested_bitrate.store(bps, std::memory_order_relaxed);
+    }
+
+    /* Drains the encoders without pacing into a corpus, see run_bake().
+     * duration_ms is raised to the loop length, see the definition. */
+    bool bake(CorpusWriter& writer, int64_t& duration_ms);
+
+    StageTimes stage_times() const;
+    /* From any thread, the queue depths are approximate. */
+    void add_metrics(ChannelMetrics& m) const;
+    void print_pipeline_stats();
+
+private:
+    typedef SPSCQueue<AVFrame*> FrameQueue;
+    typedef SPSCQueue<AVPacket*> PacketQueue;
+
+    void init_video_codec(const AVCodec* codec);
+    void init_flat_video_codec();
+    void init_audio_codec(const AVCodec* codec);
+    void init_frames();
+
+    Rect generate_rect(int width, int height);
+    void change_rects(int width, int height);
+    void generate_video_frame(AVFrame* frame);
+    void generate_audio_frame(AVFrame* frame, float freq);
+    void make_flat_scene(H264FlatScene* scene);
+
+    /* The next frame in presentation order across both streams. */
+    AVFrame* render_frame(bool& video);
+    int encode(AVFrame* frame, AVCodecContext* c, AVPacket* pkt, PacketQueue& out,
+        LatencyHistogram& send_latency, LatencyHistogram& receive_latency);
+    void encode_skip_frame(AVFrame* frame);
+    void encode_flat_frame(AVFrame* frame);
+    void apply_video_bitrate();
+    void encode_video_frame(AVFrame* frame);
+    void encode_audio_frame(AVFrame* frame);
+
+    void render_stage();
+    void video_encode_stage();
+    void audio_encode_stage();
+
+    SharedMessage video_packet_message(AVPacket* pkt, bool& key);
+    SharedMessage audio_packet_message(AVPacket* pkt);
+
+    ChannelOptions options;
+    uint32_t stream_id;
+    /* cleared by the video encoder when x264 turns out not to allow skip frames */
+    std::atomic<bool> skip_static_frames;
+    /* set by the sender, taken by render */
+    std::atomic<bool> keyframe_requested{ false };
+    /* set by the sender, taken by the video encoder; 0 when nothing changes */
+    std::atomic<int64_t> requested_bitrate{ 0 };
+    /* what the video encoder runs at, for the stream metadata */
+    std::atomic<int64_t> video_bitrate{ 0 };
+
+    AVCodecContext* c_video = NULL;
+    AVCodecContext* c_audio = NULL;
+    AVPacket* pkt_video = NULL;
+    AVPacket* pkt_audio = NULL;
+    AVFrame* frame_video = NULL;
+    AVFrame* frame_audio = NULL;
+    H264SkipContext skip_ctx{};
+    H264FlatEncoder flat_enc{};
+    bool have_idr = false;
+    /* which stream next_due_ms() found first */
+    bool next_is_video = false;
+    /* sender side, drop_to_keyframe() is under way */
+    bool dropping_video = false;
+
+    /* each written by the stage it times, see StageTimes */
+    std::atomic<int64_t> render_us{ 0 };
+    std::atomic<int64_t> video_encode_us{ 0 };
+    std::atomic<int64_t> audio_encode_us{ 0 };
+    std::atomic<int64_t> packetize_us{ 0 };
+    std::atomic<uint64_t> video_frames_encoded{ 0 };
+    std::atomic<uint64_t> audio_frames_encoded{ 0 };
+    StageLatency latency;
+
+    std::atomic<bool> stop{ false };
+    std::thread render_thread;
+    std::thread video_thread;
+    std::thread audio_thread;
+
+    FrameQueue video_frames{ 4 };
+    FrameQueue audio_frames{ 16 };
+    PacketQueue video_packets{ 64 };
+    PacketQueue audio_packets{ 256 };
+
+    /*
+     * Render state, written for every frame. A pool worker runs many
+     * channels one after the other, so keep it off the cache lines of
+     * whatever the allocator put next to this channel.
+     */
+    char pad0[64];
+    std::minstd_rand rng;
+    Oscillator tone;
+    float freq = 440;
+    int64_t video_pts = 0;
+    int64_t audio_pts = 0;
+    Rect blueRect;
+    Rect redRect;
+    /* the rects currently painted in the video frame */
+    bool frame_painted = false;
+    Rect paintedBlueRect;
+    Rect paintedRedRect;
+    VideoGather video_gather;
+    char pad1[64];
+};
+
+#endif /* WEBDRIVERTORSO_TORSO_CHANNEL_H */
@@ -0,0 +1,245 @@
+/*
+ * Times the pieces of a frame and a whole channel run unpaced. It reports
+ * what it timed on the machine it runs on; compare runs on one machine,
+ * before and after a change.
+ *
+ * webdrivertorso_bench [micro] [e2e] [--frames <n>] [--skip-static | --flat-encoder] [--cache-audio]
+ *
+ * micro times the pieces of a frame one at a time: clean_frame,
+ * draw_rect_on_frame and get_yuv_from_rgb on the YUV420P frames the
+ * encoder gets, render_tone on an AAC frame, the AVCC gather list that
+ * turns an encoded packet into a message, and make_avcc on the encoder's
+ * extradata. The packetize lines run on synthetic access units, not on
+ * x264 output.
+ *
+ * e2e runs a whole channel unpaced at several resolutions: the stage
+ * threads render and encode as fast as they can and the messages go into
+ * a NullSink, for --frames video frames (500). It prints the frames per
+ * second, the busy time of every stage per video frame and the CPU time
+ * of the process per video frame. The CPU time counts every thread, the
+ * stage threads and the encoder's own, so it goes above the wall time.
+ *
+ * Without micro or e2e, both run.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <vector>
+#include "bench_streams.h"
+#include "cpu.h"
+#include "flv_sink.h"
+#include "pacer.h"
+#include "render.h"
+#include "torso_channel.h"
+
+extern "C" {
+#include <libavutil/channel_layout.h>
+}
+
+using namespace std;
+
+struct Resolution {
+    const char* name;
+    int width;
+    int height;
+};
+
+static const Resolution resolutions[] = {
+    { "360p", 640, 360 },
+    { "720p", 1280, 720 },
+    { "1080p", 1920, 1080 },
+    { "4K", 3840, 2160 },
+};
+
+template <typename F>
+double time_us(int iterations, F f) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++)
+        f(i);
+    return chrono::duration<double, micro>(chrono::steady_clock::now() - start).count() / iterations;
+}
+
+static AVFrame* alloc_video_frame(int width, int height) {
+    AVFrame* frame = av_frame_alloc();
+    if (!frame)
+        exit(1);
+    frame->format = AV_PIX_FMT_YUV420P;
+    frame->width = width;
+    frame->height = height;
+    if (av_frame_get_buffer(frame, 0) < 0) {
+        fprintf(stderr, "Could not allocate a %dx%d frame\n", width, height);
+        exit(1);
+    }
+    return frame;
+}
+
+/* the same distribution as TorsoChannel::generate_rect */
+static Rect random_rect(int width, int height) {
+    int minWidth = height / 10;
+    int maxWidth = height / 2;
+    Rect r;
+    r.width = (rand() % (maxWidth - minWidth) + minWidth) & ~1;
+    r.height = (rand() % (maxWidth - minWidth) + minWidth) & ~1;
+    r.x = (rand() % (width - r.width)) & ~1;
+    r.y = (rand() % (height - r.height)) & ~1;
+    return r;
+}
+
+static void bench_picture(const Resolution& res, int iterations) {
+    AVFrame* frame = alloc_video_frame(res.width, res.height);
+    std::vector<Rect> rects;
+    for (int i = 0; i < 2 * iterations; i++)
+        rects.push_back(random_rect(res.width, res.height));
+    YUVColor blue = get_yuv_from_rgb(0, 0, 255);
+    YUVColor red = get_yuv_from_rgb(255, 0, 0);
+
+    double clean = time_us(iterations, [&](int) { clean_frame(frame); });
+    double draw = time_us(iterations, [&](int i) {
+        draw_rect_on_frame(frame, rects[2 * i], blue);
+        draw_rect_on_frame(frame, rects[2 * i + 1], red);
+    });
+    double frame_bytes = frame->linesize[0] * frame->height + frame->linesize[1] * frame->height;
+    printf("%-6s %5dx%-5d clean_frame %8.1f us (%5.1f GB/s), draw_rect_on_frame x2 %8.1f us\n",
+        res.name, res.width, res.height, clean, frame_bytes / clean / 1000, draw);
+    av_frame_free(&frame);
+}
+
+static void bench_micro(int iterations, const AVCodecContext* c_video) {
+    srand(1);
+    for (size_t i = 0; i < sizeof(resolutions) / sizeof(resolutions[0]); i++)
+        bench_picture(resolutions[i], iterations);
+
+    /* the compiler must not hoist the conversion out of the loop */
+    volatile int sink = 0;
+    int conversions = 1000000;
+    double yuv = time_us(conversions, [&](int i) {
+        YUVColor c = get_yuv_from_rgb(i & 255, (i >> 8) & 255, (i >> 16) & 255);
+        sink = sink + c.Y + c.U + c.V;
+    });
+    printf("get_yuv_from_rgb %.1f ns\n", yuv * 1000);
+
+    AVFrame* audio = av_frame_alloc();
+    if (!audio)
+        exit(1);
+    audio->format = AV_SAMPLE_FMT_FLTP;
+    audio->nb_samples = 1024;
+    audio->sample_rate = 44100;
+    av_channel_layout_default(&audio->ch_layout, 2);
+    if (av_frame_get_buffer(audio, 0) < 0)
+        exit(1);
+    Oscillator tone;
+    oscillator_init(&tone);
+    double tone_us = time_us(10 * iterations, [&](int i) { render_tone(audio, &tone, 200 + i % 400); });
+    printf("render_tone %d samples x %d channels %.2f us\n", audio->nb_samples, audio->ch_layout.nb_channels, tone_us);
+    av_frame_free(&audio);
+
+    /* what video_packet_message does with a packet, without the rescale */
+    Stream streams[] = { synthetic_stream(2500000, 60), synthetic_stream(20000000, 10) };
+    for (size_t s = 0; s < sizeof(streams) / sizeof(streams[0]); s++) {
+        const Stream& stream = streams[s];
+        VideoGather gather;
+        uint64_t bytes = 0;
+        double packetize = time_us(stream.frames, [&](int i) {
+            size_t start = stream.frame_offsets[i];
+            size_t end = i + 1 < stream.frames ? stream.frame_offsets[i + 1] : stream.data.size();
+            if (!gather.build(stream.data.data() + start, (int)(end - start)))
+                exit(1);
+            MediaMessage msg = make_video_message(1, i * 40, 0, i % 25 == 0, gather.size);
+            gather.gather(msg.body.data() + VIDEO_TAG_HEADER_SIZE);
+            bytes += gather.size;
+        });
+        printf("packetize %s: %.2f us per frame (%.0f MB/s)\n", stream.name.c_str(), packetize,
+            bytes / (packetize * stream.frames));
+    }
+
+    std::vector<uint8_t> avcc;
+    double avcc_us = time_us(iterations, [&](int) { avcc = make_avcc(c_video->extradata, c_video->extradata_size); });
+    printf("make_avcc (av_isom_write_avcc) %d bytes of extradata: %.2f us\n", c_video->extradata_size, avcc_us);
+}
+
+static void bench_e2e(const Resolution& res, const ChannelOptions& base, uint64_t frames) {
+    ChannelConfig config;
+    config.options = base;
+    config.options.width = res.width;
+    config.options.height = res.height;
+    config.seed = 1;
+    TorsoChannel channel(config);
+    channel.init();
+
+    NullSink sink;
+    sink.start(channel.stream_info(), channel.headers());
+    SteadyClock clock;
+    PacingOptions pacing;
+    pacing.unpaced = true;
+    Pacer pacer(clock, pacing);
+
+    int64_t cpu_start = cpu_process_time_us();
+    int64_t wall_start = clock.now_us();
+    pacer.start();
+    channel.start_threads();
+    uint64_t video = 0;
+    while (video < frames) {
+        if (!pacer.wait(channel.next_due_ms(), 5000))
+            continue;
+        bool key;
+        SharedMessage msg = channel.pop_message(key);
+        video += msg->type == RTMP_VIDEO;
+        sink.publish(msg, key);
+    }
+    double wall_ms = (clock.now_us() - wall_start) / 1000.0;
+    double cpu_ms = (cpu_process_time_us() - cpu_start) / 1000.0;
+    channel.stop_threads();
+
+    StageTimes t = channel.stage_times();
+    double n = (double)video;
+    printf("%-6s %5dx%-5d %7.1f fps  per frame: render %6.2f ms, video encode %6.2f ms, audio encode %5.2f ms, "
+        "packetize %5.3f ms, CPU %6.2f ms (%.1f cores)\n",
+        res.name, res.width, res.height, n / wall_ms * 1000, t.render_us / 1000.0 / n,
+        t.video_encode_us / 1000.0 / n, t.audio_encode_us / 1000.0 / n, t.packetize_us / 1000.0 / n,
+        cpu_ms / n, cpu_ms / wall_ms);
+    fflush(stdout);
+}
+
+int main(int argc, char* argv[]) {
+    bool micro = false;
+    bool e2e = false;
+    uint64_t frames = 500;
+    ChannelOptions options;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "micro"))
+            micro = true;
+        else if (!strcmp(argv[i], "e2e"))
+            e2e = true;
+        else if (!strcmp(argv[i], "--frames") && i + 1 < argc && atoi(argv[i + 1]) > 0)
+            frames = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--skip-static"))
+            options.skip_static_frames = true;
+        else if (!strcmp(argv[i], "--flat-encoder"))
+            options.flat_encoder = true;
+        else if (!strcmp(argv[i], "--cache-audio"))
+            options.cache_audio = true;
+        else {
+            fprintf(stderr, "Usage: %s [micro] [e2e] [--frames <n>] [--skip-static | --flat-encoder] [--cache-audio]\n",
+                argv[0]);
+            return 1;
+        }
+    }
+    if (!micro && !e2e)
+        micro = e2e = true;
+
+    if (micro) {
+        /* the real extradata for make_avcc */
+        ChannelConfig config;
+        TorsoChannel channel(config);
+        channel.init();
+        bench_micro(200, channel.video_codec());
+    }
+    if (e2e) {
+        for (size_t i = 0; i < sizeof(resolutions) / sizeof(resolutions[0]); i++)
+            bench_e2e(resolutions[i], options, frames);
+    }
+    return 0;
+}